@@ -0,0 +1,78 @@
+// Throughput of the decimator kernels on a single core, in input samples per second. Exits with 2 if a kernel doesn't
+// match the scalar one.
+//
+// usage: decimate_bench [factor] [seconds]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/decimate.h"
+
+#define INPUT_SIZE (16u << 20)
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char** argv) {
+  const unsigned factor = argc > 1 ? (unsigned)atoi(argv[1]) : 4;
+  const double seconds = argc > 2 ? atof(argv[2]) : 1.0;
+
+  uint8_t* in = malloc(INPUT_SIZE);
+  uint8_t* out = malloc(INPUT_SIZE / 2);
+  uint8_t* reference = malloc(INPUT_SIZE / 2);
+  if (!in || !out || !reference)
+    return 1;
+  // something like a carrier with noise
+  srand(1);
+  for (size_t i = 0; i < INPUT_SIZE; ++i)
+    in[i] = (uint8_t)(128 + 80 * ((i / 7) % 2 ? 1 : -1) * ((i % 7) / 7.0) + rand() % 32 - 16);
+
+  struct decimator scalar;
+  if (!decimator_init(&scalar, factor, DecimatorKernel_Scalar)) {
+    fprintf(stderr, "invalid factor %u\n", factor);
+    return 1;
+  }
+  const size_t count = decimator_outputs(&scalar, INPUT_SIZE);
+  decimator_run(&scalar, in, count, reference);
+  decimator_free(&scalar);
+
+  printf("{\"bench\":\"decimate\",\"factor\":%u,\"taps\":%u,\"kernels\":[", factor, factor * 16);
+  bool first = true;
+  bool mismatch = false;
+  for (int kernel = DecimatorKernel_Scalar; kernel <= DecimatorKernel_NEON; ++kernel) {
+    struct decimator dec;
+    if (!decimator_init(&dec, factor, (enum decimator_kernel)kernel))
+      continue;
+
+    size_t runs = 0;
+    const double start = now();
+    double elapsed;
+    do {
+      decimator_run(&dec, in, count, out);
+      ++runs;
+    } while ((elapsed = now() - start) < seconds);
+
+    const bool match = 0 == memcmp(out, reference, count);
+    mismatch |= !match;
+    printf(
+      "%s{\"kernel\":\"%s\",\"samples_per_s\":%.0f,\"match\":%s}",
+      first ? "" : ",",
+      decimator_kernel_name(dec.kernel),
+      (double)runs * (double)count * factor / elapsed,
+      match ? "true" : "false"
+    );
+    first = false;
+    decimator_free(&dec);
+  }
+  printf("]}\n");
+
+  free(in);
+  free(out);
+  free(reference);
+  return mismatch ? 2 : 0;
+}
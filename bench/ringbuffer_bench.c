@@ -0,0 +1,169 @@
+// Producer/consumer throughput of the ring buffer on its own, for chunk sizes from small ALSA periods to large DMA
+// reads, with one and with several readers. The writer copies every chunk in like a source read, the readers checksum
+// what they get like a client touching the data before sending it.
+//
+// usage: ringbuffer_bench [seconds per run] [buffer MiB]
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/ringbuffer.h"
+
+static const size_t CHUNKS[] = {4096, 65536, 1u << 20, 4u << 20};
+static const size_t READERS[] = {1, 4};
+
+struct run {
+  struct atomic_ringbuffer buf;
+  size_t chunk;
+  double seconds;
+  _Atomic bool done;
+  // times the writer found the buffer full, the readers being the bottleneck
+  size_t writer_stalls;
+  const uint8_t* pattern;
+};
+
+struct reader {
+  struct run* run;
+  struct atomic_ringbuffer_reader* reader;
+  uint64_t checksum;
+  size_t bytes;
+};
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static double process_cpu(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void* writer_main(void* arg) {
+  struct run* run = arg;
+  struct atomic_ringbuffer* buf = &run->buf;
+  const double end = now() + run->seconds;
+  size_t offset = 0;
+  while (now() < end) {
+    size_t len = atomic_ringbuffer_get_write_size(buf);
+    if (len == 0) {
+      ++run->writer_stalls;
+      atomic_ringbuffer_wait_write(buf, 10);
+      continue;
+    }
+    if (len > run->chunk)
+      len = run->chunk;
+    memcpy(atomic_ringbuffer_get_write_ptr(buf), run->pattern + offset, len);
+    offset = (offset + len) % run->chunk;
+    atomic_ringbuffer_advance_written(buf, len);
+  }
+  run->done = true;
+  atomic_ringbuffer_wake(buf);
+  return NULL;
+}
+
+static void* reader_main(void* arg) {
+  struct reader* r = arg;
+  struct atomic_ringbuffer* buf = &r->run->buf;
+  while (1) {
+    // checked before looking at the size, so everything written before the writer finished gets read
+    const bool done = r->run->done;
+    size_t len = atomic_ringbuffer_get_read_size(buf, r->reader);
+    if (len < r->reader->watermark && !done) {
+      atomic_ringbuffer_wait_read(buf, r->reader, r->reader->read, 10);
+      len = atomic_ringbuffer_get_read_size(buf, r->reader);
+    }
+    if (len == 0) {
+      if (done)
+        break;
+      continue;
+    }
+    if (len > r->run->chunk)
+      len = r->run->chunk;
+    const uint64_t* p = (const uint64_t*)atomic_ringbuffer_get_read_ptr(buf, r->reader);
+    uint64_t sum = r->checksum;
+    for (size_t i = 0; i < len / sizeof(*p); ++i)
+      sum ^= p[i];
+    r->checksum = sum;
+    r->bytes += len;
+    atomic_ringbuffer_advance_read(buf, r->reader, len);
+  }
+  return NULL;
+}
+
+int main(int argc, char** argv) {
+  const double seconds = argc > 1 ? atof(argv[1]) : 1.0;
+  const size_t buf_size = (argc > 2 ? (size_t)atoi(argv[2]) : 64) << 20;
+
+  uint8_t* pattern = malloc(CHUNKS[sizeof(CHUNKS) / sizeof(*CHUNKS) - 1]);
+  if (!pattern)
+    return 1;
+  for (size_t i = 0; i < CHUNKS[sizeof(CHUNKS) / sizeof(*CHUNKS) - 1]; ++i)
+    pattern[i] = (uint8_t)(i * 31 + 7);
+
+  printf("{\"bench\":\"ringbuffer\",\"buffer_bytes\":%zu,\"runs\":[", buf_size);
+  bool first = true;
+  for (size_t c = 0; c < sizeof(CHUNKS) / sizeof(*CHUNKS); ++c) {
+    for (size_t n = 0; n < sizeof(READERS) / sizeof(*READERS); ++n) {
+      struct run run = {.chunk = CHUNKS[c], .seconds = seconds, .pattern = pattern};
+      if (!atomic_ringbuffer_init(&run.buf, buf_size)) {
+        fprintf(stderr, "can't allocate the ring buffer\n");
+        return 1;
+      }
+      run.buf.wakeup_watermark = CHUNKS[c];
+
+      struct reader readers[ATOMIC_RINGBUFFER_MAX_READERS] = {{0}};
+      pthread_t threads[ATOMIC_RINGBUFFER_MAX_READERS];
+      for (size_t r = 0; r < READERS[n]; ++r) {
+        readers[r].run = &run;
+        readers[r].reader = atomic_ringbuffer_add_reader(&run.buf, Reader_Blocking);
+      }
+
+      const double cpu_start = process_cpu();
+      const double start = now();
+      pthread_t writer;
+      pthread_create(&writer, NULL, writer_main, &run);
+      for (size_t r = 0; r < READERS[n]; ++r)
+        pthread_create(&threads[r], NULL, reader_main, &readers[r]);
+      pthread_join(writer, NULL);
+      for (size_t r = 0; r < READERS[n]; ++r)
+        pthread_join(threads[r], NULL);
+      const double elapsed = now() - start;
+      const double cpu = process_cpu() - cpu_start;
+
+      // every reader saw everything, so the first one's count is the throughput
+      const double mb = (double)readers[0].bytes / 1e6;
+      printf(
+        "%s{\"chunk\":%zu,\"readers\":%zu,\"mb_per_s\":%.1f,\"cpu_ns_per_mb\":%.0f,\"writer_stalls\":%zu,"
+        "\"reader_wakeups\":%zu,\"writer_wakeups\":%zu}",
+        first ? "" : ",",
+        CHUNKS[c],
+        READERS[n],
+        mb / elapsed,
+        mb > 0 ? cpu * 1e9 / mb : 0.0,
+        run.writer_stalls,
+        (size_t)run.buf.reader_wakeups,
+        (size_t)run.buf.writer_wakeups
+      );
+      fflush(stdout);
+      first = false;
+
+      for (size_t r = 0; r < READERS[n]; ++r)
+        atomic_ringbuffer_remove_reader(&run.buf, readers[r].reader);
+      atomic_ringbuffer_close(&run.buf);
+      atomic_ringbuffer_free(&run.buf);
+    }
+  }
+  printf("]}\n");
+
+  atomic_ringbuffer_pool_release();
+  free(pattern);
+  return 0;
+}
@@ -0,0 +1,43 @@
+#!/bin/sh
+# Run every benchmark and append their results to a JSON lines file, one line per benchmark tagged with the commit, so
+# runs from different commits can be compared with jq or a spreadsheet.
+#
+# usage: bench/run.sh <build dir> <output file>
+#
+# Exits with the status of the first benchmark that failed, after running all of them: decimate_bench when a kernel
+# doesn't match the scalar one, stream_bench on overflows or clients without data.
+
+set -e
+
+BIN="$1"
+OUT="$2"
+COMMIT=$(git -C "$(dirname "$0")" describe --always --dirty 2>/dev/null || echo unknown)
+DATE=$(date -u +%Y-%m-%dT%H:%M:%SZ)
+
+STATUS=0
+TMP=$(mktemp)
+trap 'rm -f "$TMP"' EXIT
+
+# the output goes through a file, so the exit status of the benchmark isn't lost in a pipe
+run() {
+  code=0
+  "$@" > "$TMP" || code=$?
+  while IFS= read -r line; do
+    echo "{\"commit\":\"$COMMIT\",\"date\":\"$DATE\",${line#\{}" | tee -a "$OUT"
+  done < "$TMP"
+  if [ "$code" -ne 0 ]; then
+    echo "$* failed with $code" >&2
+    [ "$STATUS" -ne 0 ] || STATUS=$code
+  fi
+}
+
+# odd factors take other paths through the SIMD kernels than even ones
+for factor in 2 3 4 5 8; do
+  run "$BIN/decimate_bench" "$factor" 1
+done
+run "$BIN/ringbuffer_bench" 1
+run "$BIN/stream_bench" "$BIN/cxadc_vhs_server" 5 1 40000000
+run "$BIN/stream_bench" "$BIN/cxadc_vhs_server" 5 4 40000000
+run "$BIN/stream_bench" "$BIN/cxadc_vhs_server" 5 1 40000000 compress=rice
+
+exit "$STATUS"
@@ -0,0 +1,282 @@
+// End to end throughput of the server: starts it on a unix socket with a synthetic cxadc source, connects clients to
+// the stream and reads for a while. Reports what the clients received, the CPU time the server and the clients spent
+// per MB of the source stream and how close the ring buffer came to overflowing, from the server's own metrics.
+//
+// usage: stream_bench <cxadc_vhs_server> [seconds] [clients] [rate] [extra stream parameters, like compress=rice]
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_CLIENTS 8
+// the synthetic card is u8 mono
+#define FRAME_SIZE 1
+
+static char g_socket_path[108];
+
+struct client {
+  const char* request;
+  _Atomic bool* stop;
+  size_t bytes;
+  bool failed;
+};
+
+// `src` as the inside of a JSON string, cut short if it doesn't fit, like the server does it. Returns `dst`.
+static const char* json_escape(char* dst, size_t dst_size, const char* src) {
+  size_t len = 0;
+  for (; *src && len + 7 <= dst_size; ++src) {
+    const unsigned char c = (unsigned char)*src;
+    if (c == '"' || c == '\\') {
+      dst[len++] = '\\';
+      dst[len++] = (char)c;
+    } else if (c < 0x20 || c == 0x7f) {
+      len += (size_t)snprintf(dst + len, dst_size - len, "\\u%04x", c);
+    } else {
+      dst[len++] = (char)c;
+    }
+  }
+  dst[len] = '\0';
+  return dst;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static double process_cpu(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// user and system time of another process, in seconds
+static double pid_cpu(pid_t pid) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+  FILE* f = fopen(path, "r");
+  if (!f)
+    return 0;
+  char line[1024];
+  const bool ok = fgets(line, sizeof(line), f) != NULL;
+  fclose(f);
+  // the command name can contain spaces, the fields after it can't
+  const char* p = ok ? strrchr(line, ')') : NULL;
+  unsigned long utime = 0, stime = 0;
+  if (!p || 2 != sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime))
+    return 0;
+  return (double)(utime + stime) / (double)sysconf(_SC_CLK_TCK);
+}
+
+static int connect_server(void) {
+  const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  strcpy(addr.sun_path, g_socket_path);
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int send_request(const char* path) {
+  const int fd = connect_server();
+  if (fd < 0)
+    return -1;
+  char request[512];
+  const int len = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: bench\r\nConnection: close\r\n\r\n", path);
+  if (write(fd, request, len) != len) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Whole response to a short request, headers included. False if there was none.
+static bool fetch(const char* path, char* out, size_t out_size) {
+  const int fd = send_request(path);
+  if (fd < 0)
+    return false;
+  size_t len = 0;
+  ssize_t count;
+  while (len < out_size - 1 && (count = read(fd, out + len, out_size - 1 - len)) > 0)
+    len += count;
+  out[len] = 0;
+  close(fd);
+  return len > 0;
+}
+
+static void* client_main(void* arg) {
+  struct client* c = arg;
+  const int fd = send_request(c->request);
+  if (fd < 0) {
+    c->failed = true;
+    return NULL;
+  }
+  const struct timeval timeout = {0, 100000};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  static const size_t BUF_SIZE = 1 << 20;
+  char* buf = malloc(BUF_SIZE);
+  // the headers aren't counted, they end the first read or so
+  bool in_headers = true;
+  char tail[4] = {0};
+  while (buf && !*c->stop) {
+    const ssize_t count = read(fd, buf, BUF_SIZE);
+    if (count == 0)
+      break;
+    if (count < 0)
+      continue;
+    ssize_t body = 0;
+    while (in_headers && body < count) {
+      memmove(tail, tail + 1, 3);
+      tail[3] = buf[body++];
+      in_headers = 0 != memcmp(tail, "\r\n\r\n", 4);
+    }
+    if (!in_headers)
+      c->bytes += count - body;
+  }
+  c->failed = in_headers;
+  free(buf);
+  close(fd);
+  return NULL;
+}
+
+// Value of a metric of the first cxadc stream.
+static size_t metric(const char* metrics, const char* name) {
+  char key[128];
+  snprintf(key, sizeof(key), "\n%s{stream=\"cxadc0\"} ", name);
+  const char* p = strstr(metrics, key);
+  size_t value = 0;
+  if (p)
+    sscanf(p + strlen(key), "%zu", &value);
+  return value;
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <cxadc_vhs_server> [seconds] [clients] [rate] [extra stream parameters]\n", argv[0]);
+    return 1;
+  }
+  const double seconds = argc > 2 ? atof(argv[2]) : 5.0;
+  size_t clients = argc > 3 ? (size_t)atoi(argv[3]) : 1;
+  if (clients < 1 || clients > MAX_CLIENTS)
+    clients = 1;
+  const unsigned rate = argc > 4 ? (unsigned)atoi(argv[4]) : 40000000;
+  const char* params = argc > 5 ? argv[5] : "";
+
+  snprintf(g_socket_path, sizeof(g_socket_path), "/tmp/cxadc_vhs_bench.%d.sock", (int)getpid());
+  unlink(g_socket_path);
+
+  char listen_arg[128];
+  snprintf(listen_arg, sizeof(listen_arg), "unix:%s", g_socket_path);
+  const pid_t server = fork();
+  if (server < 0) {
+    perror("fork failed");
+    return 1;
+  }
+  if (server == 0) {
+    freopen("/dev/null", "w", stdout);
+    freopen("/dev/null", "w", stderr);
+    execl(argv[1], argv[1], listen_arg, (char*)NULL);
+    _exit(127);
+  }
+
+  int status = 1;
+  static char response[1 << 20];
+  int fd = -1;
+  for (int i = 0; i < 100 && (fd = connect_server()) < 0; ++i)
+    usleep(20000);
+  if (fd < 0) {
+    fprintf(stderr, "server didn't come up\n");
+    goto out;
+  }
+  close(fd);
+
+  char path[256];
+  snprintf(path, sizeof(path), "/start?csynth&crate=%u&lsynth", rate);
+  if (!fetch(path, response, sizeof(response)) || strstr(response, "fail_reason")) {
+    fprintf(stderr, "start failed: %s\n", response);
+    goto out;
+  }
+
+  char request[256];
+  snprintf(request, sizeof(request), "/cxadc?0%s%s", params[0] ? "&" : "", params);
+  _Atomic bool stop = false;
+  struct client client[MAX_CLIENTS] = {{0}};
+  pthread_t threads[MAX_CLIENTS];
+
+  const double server_cpu_start = pid_cpu(server);
+  const double cpu_start = process_cpu();
+  const double start = now();
+  for (size_t i = 0; i < clients; ++i) {
+    client[i].request = request;
+    client[i].stop = &stop;
+    pthread_create(&threads[i], NULL, client_main, &client[i]);
+  }
+  usleep((useconds_t)(seconds * 1e6));
+  stop = true;
+  for (size_t i = 0; i < clients; ++i)
+    pthread_join(threads[i], NULL);
+  const double elapsed = now() - start;
+  const double cpu = process_cpu() - cpu_start;
+  const double server_cpu = pid_cpu(server) - server_cpu_start;
+
+  size_t bytes = 0;
+  bool failed = false;
+  for (size_t i = 0; i < clients; ++i) {
+    bytes += client[i].bytes;
+    failed |= client[i].failed;
+  }
+  if (failed)
+    fprintf(stderr, "a client got no response\n");
+
+  if (!fetch("/metrics", response, sizeof(response))) {
+    fprintf(stderr, "metrics failed\n");
+    goto out;
+  }
+  const size_t buf_size = metric(response, "cxadc_vhs_buffer_size_bytes");
+  const size_t high_water = metric(response, "cxadc_vhs_buffer_fill_high_water_bytes");
+  const size_t overflows = metric(response, "cxadc_vhs_overflows_total");
+  fetch("/stop", response, sizeof(response));
+
+  const double mb = (double)bytes / 1e6;
+  // the CPU time is per MB of the source, as with codecs the clients receive less, and with several clients more
+  const double source_mb = (double)rate * FRAME_SIZE * elapsed / 1e6;
+  char escaped[1024];
+  printf(
+    "{\"bench\":\"stream\",\"rate\":%u,\"clients\":%zu,\"params\":\"%s\",\"seconds\":%.2f,\"mb_per_s\":%.1f,\"source_mb_per_s\":%.1f,"
+    "\"server_cpu_ns_per_mb\":%.0f,\"client_cpu_ns_per_mb\":%.0f,\"overflows\":%zu,\"fill_high_water_pct\":%.1f,\"margin_pct\":%.1f}\n",
+    rate,
+    clients,
+    json_escape(escaped, sizeof(escaped), params),
+    elapsed,
+    mb / elapsed,
+    (double)rate * FRAME_SIZE / 1e6,
+    source_mb > 0 ? server_cpu * 1e9 / source_mb : 0.0,
+    source_mb > 0 ? cpu * 1e9 / source_mb : 0.0,
+    overflows,
+    buf_size ? high_water * 100.0 / buf_size : 0.0,
+    buf_size ? 100.0 - high_water * 100.0 / buf_size : 0.0
+  );
+  status = failed || overflows ? 2 : 0;
+
+out:
+  kill(server, SIGTERM);
+  waitpid(server, NULL, 0);
+  unlink(g_socket_path);
+  return status;
+}
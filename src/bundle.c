@@ -0,0 +1,22 @@
+#include "bundle.h"
+
+#include "le.h"
+
+void bundle_put_header(uint8_t* out, const struct bundle_frame* frame) {
+  out[0] = 'C';
+  out[1] = 'B';
+  out[2] = (uint8_t)frame->type;
+  out[3] = frame->stream;
+  put_le32(out + 4, frame->length);
+  put_le64(out + 8, frame->pos);
+}
+
+bool bundle_parse_header(const uint8_t* in, struct bundle_frame* frame) {
+  if (in[0] != 'C' || in[1] != 'B' || in[2] < Bundle_Description || in[2] > Bundle_End)
+    return false;
+  frame->type = (enum bundle_frame_type)in[2];
+  frame->stream = in[3];
+  frame->length = get_le32(in + 4);
+  frame->pos = get_le64(in + 8);
+  return frame->length <= BUNDLE_FRAME;
+}
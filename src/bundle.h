@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Frames of /bundle, which carries every stream of a capture over one connection. A frame is a BUNDLE_HEADER_SIZE byte
+// header, "CB", type, stream, then little endian payload length and stream position, followed by the payload. The
+// first frame describes the streams in the container header format, see container.h. Data frames of whole sample
+// frames of any stream follow, in the order they were sent. An end frame means the capture stopped and everything was
+// sent, without it the connection was lost.
+#define BUNDLE_HEADER_SIZE 16
+// payload of a frame at most, headers announcing more are rejected so a reader never allocates more than this
+#define BUNDLE_FRAME (1u << 20)
+
+enum bundle_frame_type {
+  Bundle_Description = 1,
+  Bundle_Data,
+  Bundle_End,
+};
+
+struct bundle_frame {
+  enum bundle_frame_type type;
+  // number of the stream in the description
+  uint8_t stream;
+  uint32_t length;
+  // data: stream byte position of the payload
+  uint64_t pos;
+};
+
+void bundle_put_header(uint8_t* out, const struct bundle_frame* frame);
+// False if it isn't a frame header, or its length is out of range.
+bool bundle_parse_header(const uint8_t* in, struct bundle_frame* frame);
@@ -0,0 +1,101 @@
+#include "container.h"
+
+#include <string.h>
+
+#include "le.h"
+
+static size_t align_up(size_t len) {
+  return (len + CONTAINER_ALIGN - 1) / CONTAINER_ALIGN * CONTAINER_ALIGN;
+}
+
+size_t container_header_size(size_t stream_count, size_t json_length) {
+  return align_up(CONTAINER_HEADER_SIZE + stream_count * CONTAINER_STREAM_SIZE + json_length);
+}
+
+void container_put_header(uint8_t* out, const struct container_stream* streams, size_t stream_count, const char* json, size_t json_length) {
+  const size_t size = container_header_size(stream_count, json_length);
+  const size_t json_offset = CONTAINER_HEADER_SIZE + stream_count * CONTAINER_STREAM_SIZE;
+  memset(out, 0, size);
+  memcpy(out, CONTAINER_MAGIC, 8);
+  put_le32(out + 8, CONTAINER_VERSION);
+  put_le32(out + 12, (uint32_t)size);
+  put_le32(out + 16, (uint32_t)stream_count);
+  put_le32(out + 20, (uint32_t)json_offset);
+  put_le32(out + 24, (uint32_t)json_length);
+  for (size_t i = 0; i < stream_count; ++i) {
+    uint8_t* p = out + CONTAINER_HEADER_SIZE + i * CONTAINER_STREAM_SIZE;
+    memcpy(p, streams[i].name, strnlen(streams[i].name, CONTAINER_NAME_SIZE));
+    put_le32(p + 16, streams[i].rate);
+    put_le32(p + 20, streams[i].frame_size);
+    put_le32(p + 24, streams[i].channels);
+  }
+  memcpy(out + json_offset, json, json_length);
+}
+
+bool container_parse_header(const uint8_t* in, struct container_header* header) {
+  if (0 != memcmp(in, CONTAINER_MAGIC, 8))
+    return false;
+  header->version = get_le32(in + 8);
+  header->size = get_le32(in + 12);
+  header->stream_count = get_le32(in + 16);
+  header->json_offset = get_le32(in + 20);
+  header->json_length = get_le32(in + 24);
+  return header->version == CONTAINER_VERSION && header->size % CONTAINER_ALIGN == 0 &&
+         CONTAINER_HEADER_SIZE + (uint64_t)header->stream_count * CONTAINER_STREAM_SIZE <= header->json_offset &&
+         (uint64_t)header->json_offset + header->json_length <= header->size;
+}
+
+void container_parse_stream(const uint8_t* in, size_t i, struct container_stream* stream) {
+  const uint8_t* p = in + CONTAINER_HEADER_SIZE + i * CONTAINER_STREAM_SIZE;
+  memcpy(stream->name, p, CONTAINER_NAME_SIZE);
+  stream->name[CONTAINER_NAME_SIZE - 1] = '\0';
+  stream->rate = get_le32(p + 16);
+  stream->frame_size = get_le32(p + 20);
+  stream->channels = get_le32(p + 24);
+}
+
+size_t container_record_size(size_t length) {
+  return align_up(CONTAINER_RECORD_HEADER + length);
+}
+
+void container_put_record(uint8_t* out, const struct container_record* record) {
+  memset(out, 0, CONTAINER_RECORD_HEADER);
+  out[0] = 'C';
+  out[1] = 'X';
+  out[2] = 'R';
+  out[3] = (uint8_t)record->type;
+  out[4] = record->stream;
+  put_le32(out + 8, record->length);
+  put_le32(out + 12, record->size);
+  put_le64(out + 16, record->pos);
+  put_le64(out + 24, (uint64_t)record->ns);
+}
+
+bool container_parse_record(const uint8_t* in, struct container_record* record) {
+  if (in[0] != 'C' || in[1] != 'X' || in[2] != 'R' || in[3] < Record_Data || in[3] > Record_End)
+    return false;
+  record->type = (enum container_record_type)in[3];
+  record->stream = in[4];
+  record->length = get_le32(in + 8);
+  record->size = get_le32(in + 12);
+  record->pos = get_le64(in + 16);
+  record->ns = (int64_t)get_le64(in + 24);
+  return CONTAINER_RECORD_HEADER + (uint64_t)record->length <= record->size;
+}
+
+void container_put_entry(uint8_t* out, const struct container_entry* entry) {
+  memset(out, 0, CONTAINER_ENTRY_SIZE);
+  put_le64(out, entry->offset);
+  put_le64(out + 8, entry->pos);
+  put_le64(out + 16, (uint64_t)entry->ns);
+  put_le32(out + 24, entry->length);
+  out[28] = entry->stream;
+}
+
+void container_parse_entry(const uint8_t* in, struct container_entry* entry) {
+  entry->offset = get_le64(in);
+  entry->pos = get_le64(in + 8);
+  entry->ns = (int64_t)get_le64(in + 16);
+  entry->length = get_le32(in + 24);
+  entry->stream = in[28];
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Capture container written by /record?container=<path>: every stream of a capture in one file, in chunks tagged with
+// their stream, position and capture time, with an index to seek by time. All numbers are little endian.
+//
+// The file starts with a header, padded to CONTAINER_ALIGN: CONTAINER_MAGIC, version, header size, stream count,
+// offset and length of a JSON description of the capture (the /start parameters and the stream formats), then a table
+// of the streams. Records follow, each with a CONTAINER_RECORD_HEADER byte header and padded to CONTAINER_ALIGN:
+// - data: whole frames of one stream, the record at most CONTAINER_CHUNK
+// - index: entries for the data records since the previous index, linking back to it, written every few seconds so a
+//   file cut off by a crash can be read up to near the end
+// A complete file ends with the index of every data record, as a chain of index records starting from nothing, and an
+// unpadded end record pointing at its last record.
+#define CONTAINER_MAGIC         "CXVHSCAP"
+#define CONTAINER_VERSION       1
+#define CONTAINER_ALIGN         4096
+#define CONTAINER_CHUNK         (1u << 20)
+#define CONTAINER_HEADER_SIZE   32
+#define CONTAINER_STREAM_SIZE   32
+#define CONTAINER_RECORD_HEADER 32
+#define CONTAINER_ENTRY_SIZE    32
+#define CONTAINER_NAME_SIZE     16
+// entries that fit in an index record
+#define CONTAINER_MAX_ENTRIES ((CONTAINER_CHUNK - CONTAINER_RECORD_HEADER) / CONTAINER_ENTRY_SIZE)
+// the first index of a chain links to this
+#define CONTAINER_NONE UINT64_MAX
+
+struct container_header {
+  uint32_t version;
+  uint32_t size;
+  uint32_t stream_count;
+  uint32_t json_offset;
+  uint32_t json_length;
+};
+
+struct container_stream {
+  char name[CONTAINER_NAME_SIZE];
+  uint32_t rate;
+  uint32_t frame_size;
+  uint32_t channels;
+};
+
+enum container_record_type {
+  Record_Data = 1,
+  Record_Index,
+  Record_End,
+};
+
+struct container_record {
+  enum container_record_type type;
+  // data: number of the stream in the table
+  uint8_t stream;
+  // payload bytes after the header
+  uint32_t length;
+  // whole record, header and padding included
+  uint32_t size;
+  // data: stream byte position of the payload; index: file offset of the previous index; end: of the last index
+  uint64_t pos;
+  // data: capture time of the first byte, CLOCK_MONOTONIC_RAW of the server
+  int64_t ns;
+};
+
+// A data record as listed in an index.
+struct container_entry {
+  uint64_t offset;
+  uint64_t pos;
+  int64_t ns;
+  uint32_t length;
+  uint8_t stream;
+};
+
+// Header size for the streams and the JSON, padded.
+size_t container_header_size(size_t stream_count, size_t json_length);
+// Writes the padded header to `out`.
+void container_put_header(uint8_t* out, const struct container_stream* streams, size_t stream_count, const char* json, size_t json_length);
+// Parse the first CONTAINER_HEADER_SIZE bytes. False if it isn't a container.
+bool container_parse_header(const uint8_t* in, struct container_header* header);
+// Parse entry `i` of the stream table, which starts right after the first CONTAINER_HEADER_SIZE bytes.
+void container_parse_stream(const uint8_t* in, size_t i, struct container_stream* stream);
+
+// Record size for a payload, padded.
+size_t container_record_size(size_t length);
+void container_put_record(uint8_t* out, const struct container_record* record);
+// False if it isn't a record header.
+bool container_parse_record(const uint8_t* in, struct container_record* record);
+
+void container_put_entry(uint8_t* out, const struct container_entry* entry);
+void container_parse_entry(const uint8_t* in, struct container_entry* entry);
@@ -0,0 +1,274 @@
+#include "decimate.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DECIMATE_X86
+#endif
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#define DECIMATE_NEON
+#endif
+
+// taps per output sample, the transition band gets narrower with more
+#define TAPS_PER_FACTOR 16
+// outputs computed from a copy when their windows wrap around the end of a ring buffer
+#define STAGING_OUTPUTS 32
+
+static inline uint8_t clamp_u8(int32_t acc) {
+  acc = (acc + (1 << 14)) >> 15;
+  return (uint8_t)(acc < 0 ? 0 : acc > 255 ? 255 : acc);
+}
+
+static void kernel_scalar(const uint8_t* in, const int16_t* coeffs, unsigned taps, unsigned factor, size_t count, uint8_t* out) {
+  for (size_t k = 0; k < count; ++k, in += factor) {
+    int32_t acc = 0;
+    for (unsigned i = 0; i < taps; ++i)
+      acc += (int32_t)in[i] * coeffs[i];
+    out[k] = clamp_u8(acc);
+  }
+}
+
+// The SIMD kernels compute 4 outputs at a time, sharing the coefficient loads and the horizontal sums.
+
+#ifdef DECIMATE_X86
+__attribute__((target("sse2"))) static inline __m128i madd_u8_sse2(const uint8_t* in, const __m128i c0, const __m128i c1, __m128i acc) {
+  const __m128i x = _mm_loadu_si128((const __m128i*)in);
+  const __m128i zero = _mm_setzero_si128();
+  acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpacklo_epi8(x, zero), c0));
+  return _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpackhi_epi8(x, zero), c1));
+}
+
+// Rounds, clamps and stores 4 outputs given as one 32 bit sum per lane.
+__attribute__((target("sse2"))) static inline void store4_sse2(__m128i sums, uint8_t* out) {
+  sums = _mm_srai_epi32(_mm_add_epi32(sums, _mm_set1_epi32(1 << 14)), 15);
+  const __m128i packed = _mm_packus_epi16(_mm_packs_epi32(sums, sums), _mm_setzero_si128());
+  const uint32_t value = (uint32_t)_mm_cvtsi128_si32(packed);
+  memcpy(out, &value, 4);
+}
+
+// Transposes and adds, so lane i is the sum of all lanes of a_i.
+__attribute__((target("sse2"))) static inline __m128i hsum4_sse2(__m128i a0, __m128i a1, __m128i a2, __m128i a3) {
+  const __m128i s01 = _mm_add_epi32(_mm_unpacklo_epi32(a0, a1), _mm_unpackhi_epi32(a0, a1));
+  const __m128i s23 = _mm_add_epi32(_mm_unpacklo_epi32(a2, a3), _mm_unpackhi_epi32(a2, a3));
+  return _mm_add_epi32(_mm_unpacklo_epi64(s01, s23), _mm_unpackhi_epi64(s01, s23));
+}
+
+__attribute__((target("sse2"))) static void kernel_sse2(const uint8_t* in, const int16_t* coeffs, unsigned taps, unsigned factor, size_t count, uint8_t* out) {
+  size_t k = 0;
+  for (; k + 4 <= count; k += 4, in += 4 * factor) {
+    __m128i acc0 = _mm_setzero_si128(), acc1 = acc0, acc2 = acc0, acc3 = acc0;
+    for (unsigned i = 0; i < taps; i += 16) {
+      const __m128i c0 = _mm_loadu_si128((const __m128i*)(coeffs + i));
+      const __m128i c1 = _mm_loadu_si128((const __m128i*)(coeffs + i + 8));
+      acc0 = madd_u8_sse2(in + i, c0, c1, acc0);
+      acc1 = madd_u8_sse2(in + factor + i, c0, c1, acc1);
+      acc2 = madd_u8_sse2(in + 2 * factor + i, c0, c1, acc2);
+      acc3 = madd_u8_sse2(in + 3 * factor + i, c0, c1, acc3);
+    }
+    store4_sse2(hsum4_sse2(acc0, acc1, acc2, acc3), out + k);
+  }
+  kernel_scalar(in, coeffs, taps, factor, count - k, out + k);
+}
+
+// 32 taps from one load. The unpacks work within the 128 bit lanes, so the low half gets taps 0-7 and 16-23, the high
+// half taps 8-15 and 24-31, and the coefficients are loaded in the same order.
+__attribute__((target("avx2"))) static inline __m256i madd_u8_avx2(const uint8_t* in, const __m256i c0, const __m256i c1, __m256i acc) {
+  const __m256i x = _mm256_loadu_si256((const __m256i*)in);
+  const __m256i zero = _mm256_setzero_si256();
+  acc = _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_unpacklo_epi8(x, zero), c0));
+  return _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_unpackhi_epi8(x, zero), c1));
+}
+
+// Taps are a multiple of 16, so for odd factors the last 16 go through the 128 bit path.
+__attribute__((target("avx2"))) static void kernel_avx2(const uint8_t* in, const int16_t* coeffs, unsigned taps, unsigned factor, size_t count, uint8_t* out) {
+  const unsigned wide_taps = taps - taps % 32;
+  size_t k = 0;
+  for (; k + 4 <= count; k += 4, in += 4 * factor) {
+    __m256i acc0 = _mm256_setzero_si256(), acc1 = acc0, acc2 = acc0, acc3 = acc0;
+    for (unsigned i = 0; i < wide_taps; i += 32) {
+      const __m256i lo = _mm256_loadu_si256((const __m256i*)(coeffs + i));
+      const __m256i hi = _mm256_loadu_si256((const __m256i*)(coeffs + i + 16));
+      const __m256i c0 = _mm256_permute2x128_si256(lo, hi, 0x20);
+      const __m256i c1 = _mm256_permute2x128_si256(lo, hi, 0x31);
+      acc0 = madd_u8_avx2(in + i, c0, c1, acc0);
+      acc1 = madd_u8_avx2(in + factor + i, c0, c1, acc1);
+      acc2 = madd_u8_avx2(in + 2 * factor + i, c0, c1, acc2);
+      acc3 = madd_u8_avx2(in + 3 * factor + i, c0, c1, acc3);
+    }
+    // fold the halves, then the same transpose as SSE2
+    __m128i s0 = _mm_add_epi32(_mm256_castsi256_si128(acc0), _mm256_extracti128_si256(acc0, 1));
+    __m128i s1 = _mm_add_epi32(_mm256_castsi256_si128(acc1), _mm256_extracti128_si256(acc1, 1));
+    __m128i s2 = _mm_add_epi32(_mm256_castsi256_si128(acc2), _mm256_extracti128_si256(acc2, 1));
+    __m128i s3 = _mm_add_epi32(_mm256_castsi256_si128(acc3), _mm256_extracti128_si256(acc3, 1));
+    if (wide_taps < taps) {
+      const __m128i c0 = _mm_loadu_si128((const __m128i*)(coeffs + wide_taps));
+      const __m128i c1 = _mm_loadu_si128((const __m128i*)(coeffs + wide_taps + 8));
+      s0 = madd_u8_sse2(in + wide_taps, c0, c1, s0);
+      s1 = madd_u8_sse2(in + factor + wide_taps, c0, c1, s1);
+      s2 = madd_u8_sse2(in + 2 * factor + wide_taps, c0, c1, s2);
+      s3 = madd_u8_sse2(in + 3 * factor + wide_taps, c0, c1, s3);
+    }
+    store4_sse2(hsum4_sse2(s0, s1, s2, s3), out + k);
+  }
+  kernel_scalar(in, coeffs, taps, factor, count - k, out + k);
+}
+#endif
+
+#ifdef DECIMATE_NEON
+static inline int32x4_t madd_u8_neon(const uint8_t* in, const int16x8_t c0, const int16x8_t c1, int32x4_t acc) {
+  const uint8x16_t x = vld1q_u8(in);
+  const int16x8_t lo = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(x)));
+  const int16x8_t hi = vreinterpretq_s16_u16(vmovl_high_u8(x));
+  acc = vmlal_s16(acc, vget_low_s16(lo), vget_low_s16(c0));
+  acc = vmlal_high_s16(acc, lo, c0);
+  acc = vmlal_s16(acc, vget_low_s16(hi), vget_low_s16(c1));
+  return vmlal_high_s16(acc, hi, c1);
+}
+
+static void kernel_neon(const uint8_t* in, const int16_t* coeffs, unsigned taps, unsigned factor, size_t count, uint8_t* out) {
+  size_t k = 0;
+  for (; k + 4 <= count; k += 4, in += 4 * factor) {
+    int32x4_t acc0 = vdupq_n_s32(0), acc1 = acc0, acc2 = acc0, acc3 = acc0;
+    for (unsigned i = 0; i < taps; i += 16) {
+      const int16x8_t c0 = vld1q_s16(coeffs + i);
+      const int16x8_t c1 = vld1q_s16(coeffs + i + 8);
+      acc0 = madd_u8_neon(in + i, c0, c1, acc0);
+      acc1 = madd_u8_neon(in + factor + i, c0, c1, acc1);
+      acc2 = madd_u8_neon(in + 2 * factor + i, c0, c1, acc2);
+      acc3 = madd_u8_neon(in + 3 * factor + i, c0, c1, acc3);
+    }
+    const int32x4_t sums = vpaddq_s32(vpaddq_s32(acc0, acc1), vpaddq_s32(acc2, acc3));
+    const int16x4_t narrow = vqrshrn_n_s32(sums, 15);
+    const uint8x8_t packed = vqmovun_s16(vcombine_s16(narrow, narrow));
+    vst1_lane_u32((uint32_t*)(out + k), vreinterpret_u32_u8(packed), 0);
+  }
+  kernel_scalar(in, coeffs, taps, factor, count - k, out + k);
+}
+#endif
+
+bool decimator_kernel_supported(enum decimator_kernel kernel) {
+  switch (kernel) {
+  case DecimatorKernel_Auto:
+  case DecimatorKernel_Scalar:
+    return true;
+#ifdef DECIMATE_X86
+  case DecimatorKernel_SSE2:
+    return __builtin_cpu_supports("sse2");
+  case DecimatorKernel_AVX2:
+    return __builtin_cpu_supports("avx2");
+#endif
+#ifdef DECIMATE_NEON
+  case DecimatorKernel_NEON:
+    return true;
+#endif
+  default:
+    return false;
+  }
+}
+
+const char* decimator_kernel_name(enum decimator_kernel kernel) {
+  const char* NAMES[] = {"auto", "scalar", "sse2", "avx2", "neon"};
+  return NAMES[(int)kernel];
+}
+
+static decimator_kernel_fn kernel_fn(enum decimator_kernel kernel) {
+  switch (kernel) {
+#ifdef DECIMATE_X86
+  case DecimatorKernel_SSE2:
+    return kernel_sse2;
+  case DecimatorKernel_AVX2:
+    return kernel_avx2;
+#endif
+#ifdef DECIMATE_NEON
+  case DecimatorKernel_NEON:
+    return kernel_neon;
+#endif
+  default:
+    return kernel_scalar;
+  }
+}
+
+// Blackman windowed sinc, cut off a bit below the new Nyquist frequency.
+static bool design_lowpass(int16_t* coeffs, unsigned taps, unsigned factor) {
+  const double fc = 0.45 / factor;
+  double* h = malloc(taps * sizeof(*h));
+  if (!h)
+    return false;
+  double sum = 0;
+  for (unsigned i = 0; i < taps; ++i) {
+    const double t = i - (taps - 1) / 2.0;
+    const double sinc = t == 0 ? 2 * fc : sin(2 * M_PI * fc * t) / (M_PI * t);
+    const double window = 0.42 - 0.5 * cos(2 * M_PI * i / (taps - 1)) + 0.08 * cos(4 * M_PI * i / (taps - 1));
+    h[i] = sinc * window;
+    sum += h[i];
+  }
+  // exact unity gain, so a constant input comes out unchanged
+  int32_t total = 0;
+  for (unsigned i = 0; i < taps; ++i) {
+    coeffs[i] = (int16_t)lround(h[i] / sum * (1 << 15));
+    total += coeffs[i];
+  }
+  coeffs[taps / 2] += (int16_t)((1 << 15) - total);
+  free(h);
+  return true;
+}
+
+bool decimator_init(struct decimator* dec, unsigned factor, enum decimator_kernel kernel) {
+  if (factor < 2 || factor > DECIMATOR_MAX_FACTOR)
+    return false;
+
+  if (kernel == DecimatorKernel_Auto) {
+    static const enum decimator_kernel PREFERRED[] = {DecimatorKernel_AVX2, DecimatorKernel_NEON, DecimatorKernel_SSE2, DecimatorKernel_Scalar};
+    for (size_t i = 0; kernel == DecimatorKernel_Auto; ++i) {
+      if (decimator_kernel_supported(PREFERRED[i]))
+        kernel = PREFERRED[i];
+    }
+  }
+  if (!decimator_kernel_supported(kernel))
+    return false;
+
+  dec->factor = factor;
+  dec->taps = TAPS_PER_FACTOR * factor;
+  dec->coeffs = malloc(dec->taps * sizeof(*dec->coeffs));
+  if (!dec->coeffs || !design_lowpass(dec->coeffs, dec->taps, factor)) {
+    free(dec->coeffs);
+    dec->coeffs = NULL;
+    return false;
+  }
+  dec->kernel = kernel;
+  dec->fn = kernel_fn(kernel);
+  return true;
+}
+
+void decimator_free(struct decimator* dec) {
+  free(dec->coeffs);
+  dec->coeffs = NULL;
+}
+
+void decimator_run_ring(const struct decimator* dec, const uint8_t* ring, size_t ring_size, size_t pos, size_t count, uint8_t* out) {
+  uint8_t staging[(STAGING_OUTPUTS - 1) * DECIMATOR_MAX_FACTOR + TAPS_PER_FACTOR * DECIMATOR_MAX_FACTOR];
+  while (count) {
+    const size_t offset = pos % ring_size;
+    size_t n = offset + dec->taps <= ring_size ? decimator_outputs(dec, ring_size - offset) : 0;
+    if (n) {
+      if (n > count)
+        n = count;
+      decimator_run(dec, ring + offset, n, out);
+    } else {
+      n = count < STAGING_OUTPUTS ? count : STAGING_OUTPUTS;
+      const size_t span = decimator_span(dec, n);
+      const size_t first = ring_size - offset < span ? ring_size - offset : span;
+      memcpy(staging, ring + offset, first);
+      memcpy(staging + first, ring, span - first);
+      decimator_run(dec, staging, n, out);
+    }
+    pos += n * dec->factor;
+    out += n;
+    count -= n;
+  }
+}
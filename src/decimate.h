@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define DECIMATOR_MAX_FACTOR 64
+
+enum decimator_kernel {
+  DecimatorKernel_Auto = 0,
+  DecimatorKernel_Scalar,
+  DecimatorKernel_SSE2,
+  DecimatorKernel_AVX2,
+  DecimatorKernel_NEON,
+};
+
+typedef void (*decimator_kernel_fn)(const uint8_t* in, const int16_t* coeffs, unsigned taps, unsigned factor, size_t count, uint8_t* out);
+
+// Low pass FIR for u8 samples that only computes every `factor`th output, the polyphase form of filter-then-drop.
+// Stateless, so one decimator can be shared by several threads.
+struct decimator {
+  unsigned factor;
+  // a multiple of 16, so the SIMD kernels need no tail handling within a window
+  unsigned taps;
+  // Q15, summing up to exactly 1 << 15
+  int16_t* coeffs;
+  enum decimator_kernel kernel;
+  decimator_kernel_fn fn;
+};
+
+bool decimator_init(struct decimator* dec, unsigned factor, enum decimator_kernel kernel);
+void decimator_free(struct decimator* dec);
+
+bool decimator_kernel_supported(enum decimator_kernel kernel);
+const char* decimator_kernel_name(enum decimator_kernel kernel);
+
+// Outputs available from `len` bytes of input.
+static inline size_t decimator_outputs(const struct decimator* dec, size_t len) {
+  return len < dec->taps ? 0 : (len - dec->taps) / dec->factor + 1;
+}
+
+// Input bytes needed for `count` outputs.
+static inline size_t decimator_span(const struct decimator* dec, size_t count) {
+  return count ? (count - 1) * dec->factor + dec->taps : 0;
+}
+
+// Output k is computed from in[k * factor] up to in[k * factor + taps - 1].
+static inline void decimator_run(const struct decimator* dec, const uint8_t* in, size_t count, uint8_t* out) {
+  dec->fn(in, dec->coeffs, dec->taps, dec->factor, count, out);
+}
+
+// Same, reading from stream position `pos` of a ring buffer. Works in place, except for the windows wrapping around.
+void decimator_run_ring(const struct decimator* dec, const uint8_t* ring, size_t ring_size, size_t pos, size_t count, uint8_t* out);
@@ -0,0 +1,191 @@
+#include "deinterleave.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DEINTERLEAVE_X86
+#endif
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#define DEINTERLEAVE_NEON
+#endif
+
+// Bytes per sample, and how many of them carry the value. Only little endian formats.
+static bool sample_layout(snd_pcm_format_t format, size_t* physical, size_t* significant, bool* is_signed) {
+  *is_signed = true;
+  switch (format) {
+  case SND_PCM_FORMAT_U8:
+    *is_signed = false;
+    // fall through
+  case SND_PCM_FORMAT_S8:
+    *physical = *significant = 1;
+    return true;
+  case SND_PCM_FORMAT_S16_LE:
+    *physical = *significant = 2;
+    return true;
+  case SND_PCM_FORMAT_S24_3LE:
+    *physical = *significant = 3;
+    return true;
+  case SND_PCM_FORMAT_S24_LE:
+    *physical = 4;
+    *significant = 3;
+    return true;
+  case SND_PCM_FORMAT_S32_LE:
+    *physical = *significant = 4;
+    return true;
+  default:
+    return false;
+  }
+}
+
+static void plan_vectorized(struct deinterleaver* di) {
+  di->vectorized = false;
+  for (size_t c = 0; c < di->out_frame; ++c) {
+    unsigned first = ~0u, last = 0;
+    for (size_t j = 0; j < 16; ++j) {
+      const size_t out = 16 * c + j;
+      const size_t in = out / di->out_frame * di->in_frame + di->map[out % di->out_frame];
+      first = in / 16 < first ? (unsigned)(in / 16) : first;
+      last = in / 16 > last ? (unsigned)(in / 16) : last;
+    }
+    if (last - first + 1 > DEINTERLEAVE_MAX_LOADS)
+      return;
+
+    di->chunks[c].first_load = first;
+    di->chunks[c].loads = last - first + 1;
+    memset(di->chunks[c].index, 0x80, sizeof(di->chunks[c].index));
+    for (size_t j = 0; j < 16; ++j) {
+      const size_t out = 16 * c + j;
+      const size_t in = out / di->out_frame * di->in_frame + di->map[out % di->out_frame];
+      di->chunks[c].index[in / 16 - first][j] = (uint8_t)(in % 16);
+      di->chunks[c].flip[j] = di->flip[out % di->out_frame];
+    }
+  }
+#ifdef DEINTERLEAVE_X86
+  di->vectorized = __builtin_cpu_supports("ssse3");
+#elif defined(DEINTERLEAVE_NEON)
+  di->vectorized = true;
+#endif
+}
+
+bool deinterleaver_init(
+  struct deinterleaver* di,
+  snd_pcm_format_t in_format,
+  unsigned in_channels,
+  const unsigned* channels,
+  unsigned channel_count,
+  snd_pcm_format_t out_format,
+  char* errstr,
+  size_t errstr_size
+) {
+  size_t in_physical, in_significant, out_physical, out_significant;
+  bool in_signed, out_signed;
+  if (!sample_layout(in_format, &in_physical, &in_significant, &in_signed)) {
+    snprintf(errstr, errstr_size, "can't deinterleave %s", snd_pcm_format_name(in_format));
+    return false;
+  }
+  if (out_format == SND_PCM_FORMAT_UNKNOWN)
+    out_format = in_format;
+  // converting keeps the most significant bytes, so only to smaller formats without padding
+  if (
+    !sample_layout(out_format, &out_physical, &out_significant, &out_signed) ||
+    (out_format != in_format && (out_physical != out_significant || out_significant > in_significant))
+  ) {
+    snprintf(errstr, errstr_size, "can't convert %s to %s", snd_pcm_format_name(in_format), snd_pcm_format_name(out_format));
+    return false;
+  }
+  if (channel_count < 1 || channel_count > DEINTERLEAVE_MAX_CHANNELS || in_channels > DEINTERLEAVE_MAX_CHANNELS) {
+    snprintf(errstr, errstr_size, "invalid channel count");
+    return false;
+  }
+
+  di->in_format = in_format;
+  di->out_format = out_format;
+  di->in_channels = in_channels;
+  di->out_channels = channel_count;
+  di->in_frame = in_physical * in_channels;
+  di->out_frame = out_physical * channel_count;
+
+  // flip the sign bit when switching between signed and unsigned
+  const size_t out_bytes = di->out_frame / channel_count;
+  for (unsigned c = 0; c < channel_count; ++c) {
+    if (channels[c] >= in_channels) {
+      snprintf(errstr, errstr_size, "no channel %u, there are %u", channels[c], in_channels);
+      return false;
+    }
+    for (size_t b = 0; b < out_bytes; ++b) {
+      const size_t i = c * out_bytes + b;
+      const size_t skip = out_format == in_format ? 0 : in_significant - out_significant;
+      di->map[i] = (uint8_t)(channels[c] * in_physical + skip + b);
+      di->flip[i] = (b == out_bytes - 1 && in_signed != out_signed) ? 0x80 : 0;
+    }
+  }
+
+  plan_vectorized(di);
+  return true;
+}
+
+static void deinterleave_scalar(const struct deinterleaver* di, const uint8_t* in, size_t frames, uint8_t* out) {
+  for (size_t f = 0; f < frames; ++f, in += di->in_frame) {
+    for (size_t i = 0; i < di->out_frame; ++i)
+      *out++ = in[di->map[i]] ^ di->flip[i];
+  }
+}
+
+#ifdef DEINTERLEAVE_X86
+__attribute__((target("ssse3"))) static void deinterleave_ssse3(const struct deinterleaver* di, const uint8_t* in, size_t groups, uint8_t* out) {
+  for (size_t g = 0; g < groups; ++g, in += DEINTERLEAVE_GROUP * di->in_frame) {
+    for (size_t c = 0; c < di->out_frame; ++c, out += 16) {
+      const uint8_t* base = in + 16 * di->chunks[c].first_load;
+      __m128i r = _mm_setzero_si128();
+      for (unsigned l = 0; l < di->chunks[c].loads; ++l) {
+        const __m128i x = _mm_loadu_si128((const __m128i*)(base + 16 * l));
+        r = _mm_or_si128(r, _mm_shuffle_epi8(x, _mm_loadu_si128((const __m128i*)di->chunks[c].index[l])));
+      }
+      r = _mm_xor_si128(r, _mm_loadu_si128((const __m128i*)di->chunks[c].flip));
+      _mm_storeu_si128((__m128i*)out, r);
+    }
+  }
+}
+#endif
+
+#ifdef DEINTERLEAVE_NEON
+static void deinterleave_neon(const struct deinterleaver* di, const uint8_t* in, size_t groups, uint8_t* out) {
+  for (size_t g = 0; g < groups; ++g, in += DEINTERLEAVE_GROUP * di->in_frame) {
+    for (size_t c = 0; c < di->out_frame; ++c, out += 16) {
+      const uint8_t* base = in + 16 * di->chunks[c].first_load;
+      uint8x16_t r = vdupq_n_u8(0);
+      for (unsigned l = 0; l < di->chunks[c].loads; ++l)
+        r = vorrq_u8(r, vqtbl1q_u8(vld1q_u8(base + 16 * l), vld1q_u8(di->chunks[c].index[l])));
+      vst1q_u8(out, veorq_u8(r, vld1q_u8(di->chunks[c].flip)));
+    }
+  }
+}
+#endif
+
+void deinterleave(const struct deinterleaver* di, const uint8_t* in, size_t frames, uint8_t* out) {
+  size_t done = 0;
+  if (di->vectorized) {
+    const size_t groups = frames / DEINTERLEAVE_GROUP;
+#ifdef DEINTERLEAVE_X86
+    deinterleave_ssse3(di, in, groups, out);
+#elif defined(DEINTERLEAVE_NEON)
+    deinterleave_neon(di, in, groups, out);
+#endif
+    done = groups * DEINTERLEAVE_GROUP;
+  }
+  deinterleave_scalar(di, in + done * di->in_frame, frames - done, out + done * di->out_frame);
+}
+
+const char* deinterleaver_kernel_name(const struct deinterleaver* di) {
+  if (!di->vectorized)
+    return "scalar";
+#ifdef DEINTERLEAVE_X86
+  return "ssse3";
+#else
+  return "neon";
+#endif
+}
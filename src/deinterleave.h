@@ -0,0 +1,55 @@
+#pragma once
+
+#include <alsa/asoundlib.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define DEINTERLEAVE_MAX_CHANNELS 16
+// largest frame, 16 channels of 32 bit samples
+#define DEINTERLEAVE_MAX_FRAME 64
+// the SIMD kernel works on groups of 16 frames, with table lookups from 16 byte loads
+#define DEINTERLEAVE_GROUP     16
+#define DEINTERLEAVE_MAX_LOADS 12
+
+// Picks channels out of interleaved frames, optionally reducing the sample size to the most significant bytes.
+struct deinterleaver {
+  snd_pcm_format_t in_format;
+  snd_pcm_format_t out_format;
+  unsigned in_channels;
+  unsigned out_channels;
+  size_t in_frame;
+  size_t out_frame;
+
+  // output byte i of a frame is input byte map[i], xor flip[i]
+  uint8_t map[DEINTERLEAVE_MAX_FRAME];
+  uint8_t flip[DEINTERLEAVE_MAX_FRAME];
+
+  // Per 16 byte output chunk of a group: table lookups into consecutive 16 byte input loads, ORed together.
+  // An index with the high bit set gives 0, like pshufb and tbl do.
+  bool vectorized;
+  struct {
+    unsigned first_load;
+    unsigned loads;
+    uint8_t index[DEINTERLEAVE_MAX_LOADS][16];
+    uint8_t flip[16];
+  } chunks[DEINTERLEAVE_MAX_FRAME];
+};
+
+bool deinterleaver_init(
+  struct deinterleaver* di,
+  snd_pcm_format_t in_format,
+  unsigned in_channels,
+  const unsigned* channels,
+  unsigned channel_count,
+  snd_pcm_format_t out_format,
+  char* errstr,
+  size_t errstr_size
+);
+
+// Both buffers hold whole frames.
+void deinterleave(const struct deinterleaver* di, const uint8_t* in, size_t frames, uint8_t* out);
+
+// Name of the kernel deinterleave() uses.
+const char* deinterleaver_kernel_name(const struct deinterleaver* di);
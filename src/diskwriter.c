@@ -0,0 +1,223 @@
+#define _GNU_SOURCE
+
+#include "diskwriter.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+// how far behind the written data we let dirty pages pile up for buffered writes
+#define WRITEBACK_WINDOW (16u << 20)
+
+static bool uring_setup(struct disk_writer* dw) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  const int ring_fd = (int)syscall(__NR_io_uring_setup, DISK_WRITER_MAX_DEPTH, &p);
+  if (ring_fd < 0)
+    return false;
+
+  dw->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  dw->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (dw->cq_size > dw->sq_size)
+      dw->sq_size = dw->cq_size;
+    dw->cq_size = dw->sq_size;
+  }
+
+  dw->sq_ptr = mmap(NULL, dw->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+  if (dw->sq_ptr == MAP_FAILED)
+    goto fail_sq;
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    dw->cq_ptr = dw->sq_ptr;
+  else
+    dw->cq_ptr = mmap(NULL, dw->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+  if (dw->cq_ptr == MAP_FAILED)
+    goto fail_cq;
+  dw->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  dw->sqes = mmap(NULL, dw->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+  if (dw->sqes == MAP_FAILED)
+    goto fail_sqes;
+
+  uint8_t* sq = dw->sq_ptr;
+  uint8_t* cq = dw->cq_ptr;
+  dw->sq_head = (unsigned*)(sq + p.sq_off.head);
+  dw->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+  dw->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+  dw->sq_array = (unsigned*)(sq + p.sq_off.array);
+  dw->cq_head = (unsigned*)(cq + p.cq_off.head);
+  dw->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+  dw->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+  dw->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+  dw->ring_fd = ring_fd;
+  return true;
+
+fail_sqes:
+  if (dw->cq_ptr != dw->sq_ptr)
+    munmap(dw->cq_ptr, dw->cq_size);
+fail_cq:
+  munmap(dw->sq_ptr, dw->sq_size);
+fail_sq:
+  close(ring_fd);
+  return false;
+}
+
+bool disk_writer_open(struct disk_writer* dw, const char* path, bool direct, char* errstr, size_t errstr_size) {
+  memset(dw, 0, sizeof(*dw));
+  dw->ring_fd = -1;
+
+  int fd = -1;
+  // not every file system supports O_DIRECT, tmpfs for example
+  if (direct)
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+  dw->direct = fd >= 0;
+  if (fd < 0)
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    snprintf(errstr, errstr_size, "cannot open %s: %s", path, strerror(errno));
+    return false;
+  }
+  dw->fd = fd;
+
+  uring_setup(dw);
+  return true;
+}
+
+bool disk_writer_set_buffered(struct disk_writer* dw) {
+  if (!dw->direct)
+    return true;
+  const int flags = fcntl(dw->fd, F_GETFL);
+  if (flags < 0 || fcntl(dw->fd, F_SETFL, flags & ~O_DIRECT) != 0)
+    return false;
+  dw->direct = false;
+  return true;
+}
+
+static void disk_writer_complete(struct disk_writer* dw, unsigned seq, int res, size_t len) {
+  if (res < 0 && !dw->error)
+    dw->error = res;
+  else if ((size_t)res != len && !dw->error)
+    dw->error = -EIO;
+  dw->done[seq % DISK_WRITER_MAX_DEPTH] = true;
+}
+
+bool disk_writer_submit(struct disk_writer* dw, const void* buf, size_t len, uint64_t offset) {
+  if (dw->error)
+    return false;
+
+  const unsigned seq = dw->next++;
+  dw->end[seq % DISK_WRITER_MAX_DEPTH] = offset + len;
+  dw->length[seq % DISK_WRITER_MAX_DEPTH] = len;
+  dw->done[seq % DISK_WRITER_MAX_DEPTH] = false;
+
+  if (dw->ring_fd < 0) {
+    const ssize_t count = pwrite(dw->fd, buf, len, (off_t)offset);
+    disk_writer_complete(dw, seq, count < 0 ? -errno : (int)count, len);
+  } else {
+    const unsigned tail = *dw->sq_tail;
+    const unsigned idx = tail & *dw->sq_mask;
+    struct io_uring_sqe* sqe = &dw->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = dw->fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = (uint32_t)len;
+    sqe->off = offset;
+    sqe->user_data = seq;
+    dw->sq_array[idx] = idx;
+    __atomic_store_n(dw->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    if (syscall(__NR_io_uring_enter, dw->ring_fd, 1, 0, 0, NULL, 0) < 0) {
+      disk_writer_complete(dw, seq, -errno, len);
+      return false;
+    }
+  }
+  dw->queue_depth = disk_writer_pending(dw);
+  return !dw->error;
+}
+
+// keep the page cache from filling up with our dirty pages when not writing directly
+static void disk_writer_writeback(struct disk_writer* dw) {
+  if (dw->direct || dw->completed - dw->writeback_started < WRITEBACK_WINDOW)
+    return;
+  sync_file_range(dw->fd, (off_t)dw->writeback_started, (off_t)(dw->completed - dw->writeback_started), SYNC_FILE_RANGE_WRITE);
+  if (dw->writeback_started > dw->dropped) {
+    const off_t len = (off_t)(dw->writeback_started - dw->dropped);
+    sync_file_range(dw->fd, (off_t)dw->dropped, len, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(dw->fd, (off_t)dw->dropped, len, POSIX_FADV_DONTNEED);
+    dw->dropped = dw->writeback_started;
+  }
+  dw->writeback_started = dw->completed;
+}
+
+uint64_t disk_writer_reap(struct disk_writer* dw, bool wait) {
+  if (dw->ring_fd >= 0) {
+    if (wait && disk_writer_pending(dw))
+      syscall(__NR_io_uring_enter, dw->ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+
+    unsigned head = *dw->cq_head;
+    while (head != __atomic_load_n(dw->cq_tail, __ATOMIC_ACQUIRE)) {
+      const struct io_uring_cqe* cqe = &dw->cqes[head & *dw->cq_mask];
+      const unsigned seq = (unsigned)cqe->user_data;
+      disk_writer_complete(dw, seq, cqe->res, dw->length[seq % DISK_WRITER_MAX_DEPTH]);
+      ++head;
+    }
+    __atomic_store_n(dw->cq_head, head, __ATOMIC_RELEASE);
+  }
+
+  while (disk_writer_pending(dw) && dw->done[dw->first % DISK_WRITER_MAX_DEPTH]) {
+    dw->completed = dw->end[dw->first % DISK_WRITER_MAX_DEPTH];
+    ++dw->first;
+  }
+  dw->bytes_written = dw->completed;
+  dw->queue_depth = disk_writer_pending(dw);
+  disk_writer_writeback(dw);
+  return dw->completed;
+}
+
+bool disk_writer_finish(struct disk_writer* dw, const void* buf, size_t len, uint64_t offset) {
+  if (dw->error)
+    return false;
+  if (len) {
+    // with O_DIRECT write a whole block, then cut the file back
+    const size_t write_len = dw->direct ? DISK_WRITER_ALIGN : len;
+    const ssize_t count = pwrite(dw->fd, buf, write_len, (off_t)offset);
+    if (count != (ssize_t)write_len) {
+      dw->error = count < 0 ? -errno : -EIO;
+      return false;
+    }
+  }
+  if (ftruncate(dw->fd, (off_t)(offset + len)) != 0) {
+    dw->error = -errno;
+    return false;
+  }
+  dw->completed = offset + len;
+  dw->bytes_written = dw->completed;
+  return true;
+}
+
+void disk_writer_close(struct disk_writer* dw) {
+  if (dw->ring_fd >= 0) {
+    munmap(dw->sqes, dw->sqes_size);
+    if (dw->cq_ptr != dw->sq_ptr)
+      munmap(dw->cq_ptr, dw->cq_size);
+    munmap(dw->sq_ptr, dw->sq_size);
+    close(dw->ring_fd);
+    dw->ring_fd = -1;
+  }
+  if (dw->fd >= 0) {
+    if (!dw->direct)
+      posix_fadvise(dw->fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(dw->fd);
+    dw->fd = -1;
+  }
+}
+
+const char* disk_writer_mode(const struct disk_writer* dw) {
+  if (dw->ring_fd >= 0)
+    return dw->direct ? "io_uring+direct" : "io_uring";
+  return dw->direct ? "sync+direct" : "sync";
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <linux/io_uring.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define DISK_WRITER_MAX_DEPTH 8
+#define DISK_WRITER_ALIGN     4096
+
+// Writes large chunks to a file, asynchronously through io_uring when possible.
+struct disk_writer {
+  int fd;
+  // opened with O_DIRECT, so offsets, lengths and buffers must be DISK_WRITER_ALIGN aligned
+  bool direct;
+
+  // raw io_uring, ring_fd is -1 if not available and writes are synchronous
+  int ring_fd;
+  void* sq_ptr;
+  size_t sq_size;
+  void* cq_ptr;
+  size_t cq_size;
+  struct io_uring_sqe* sqes;
+  size_t sqes_size;
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned* sq_mask;
+  unsigned* sq_array;
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned* cq_mask;
+  struct io_uring_cqe* cqes;
+
+  // writes in flight, in submission order
+  uint64_t end[DISK_WRITER_MAX_DEPTH];
+  size_t length[DISK_WRITER_MAX_DEPTH];
+  bool done[DISK_WRITER_MAX_DEPTH];
+  unsigned first;
+  unsigned next;
+
+  // file offset up to which every write completed
+  uint64_t completed;
+  // page cache management for buffered writes
+  uint64_t writeback_started;
+  uint64_t dropped;
+
+  // negative errno of the first failed write
+  int error;
+
+  _Atomic uint64_t bytes_written;
+  _Atomic unsigned queue_depth;
+};
+
+bool disk_writer_open(struct disk_writer* dw, const char* path, bool direct, char* errstr, size_t errstr_size);
+// Switch to buffered writes, for data that can't be written aligned.
+bool disk_writer_set_buffered(struct disk_writer* dw);
+// Queue a write. `buf` must stay valid until disk_writer_reap reports it completed. Returns false on error.
+bool disk_writer_submit(struct disk_writer* dw, const void* buf, size_t len, uint64_t offset);
+// Process completions, waiting for one if `wait` and there's anything in flight. Returns the completed offset.
+uint64_t disk_writer_reap(struct disk_writer* dw, bool wait);
+// Write the unaligned end of the file and set the final size. Everything else must be completed.
+bool disk_writer_finish(struct disk_writer* dw, const void* buf, size_t len, uint64_t offset);
+void disk_writer_close(struct disk_writer* dw);
+const char* disk_writer_mode(const struct disk_writer* dw);
+
+static inline unsigned disk_writer_pending(const struct disk_writer* dw) {
+  return dw->next - dw->first;
+}
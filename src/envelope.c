@@ -0,0 +1,156 @@
+#include "envelope.h"
+
+#include <math.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define ENVELOPE_SSE2
+#endif
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#define ENVELOPE_NEON
+#endif
+
+// 16 byte iterations before the 32 bit sum of squares lanes are widened, 4 * 255^2 per lane and iteration
+#define ENVELOPE_FLUSH 4096
+
+void envelope_reset(struct envelope* e) {
+  e->min = INT32_MAX;
+  e->max = INT32_MIN;
+  e->sum = 0;
+  e->sum_sq = 0;
+  e->count = 0;
+}
+
+void envelope_merge(struct envelope* e, const struct envelope* other) {
+  e->min = other->min < e->min ? other->min : e->min;
+  e->max = other->max > e->max ? other->max : e->max;
+  e->sum += other->sum;
+  e->sum_sq += other->sum_sq;
+  e->count += other->count;
+}
+
+static void envelope_add_u8_scalar(struct envelope* e, const uint8_t* in, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    const int32_t x = in[i];
+    e->min = x < e->min ? x : e->min;
+    e->max = x > e->max ? x : e->max;
+    e->sum += x;
+    e->sum_sq += (uint64_t)(x * x);
+  }
+  e->count += n;
+}
+
+#ifdef ENVELOPE_SSE2
+static size_t envelope_add_u8_sse2(struct envelope* e, const uint8_t* in, size_t n) {
+  const size_t vectors = n / 16;
+  const __m128i zero = _mm_setzero_si128();
+  __m128i lo = _mm_set1_epi8((char)0xff);
+  __m128i hi = zero;
+  __m128i sum = zero;
+  uint64_t sum_sq = 0;
+  for (size_t v = 0; v < vectors;) {
+    const size_t end = v + ENVELOPE_FLUSH < vectors ? v + ENVELOPE_FLUSH : vectors;
+    __m128i sq = zero;
+    for (; v < end; ++v) {
+      const __m128i x = _mm_loadu_si128((const __m128i*)(in + 16 * v));
+      lo = _mm_min_epu8(lo, x);
+      hi = _mm_max_epu8(hi, x);
+      sum = _mm_add_epi64(sum, _mm_sad_epu8(x, zero));
+      const __m128i x0 = _mm_unpacklo_epi8(x, zero);
+      const __m128i x1 = _mm_unpackhi_epi8(x, zero);
+      sq = _mm_add_epi32(sq, _mm_add_epi32(_mm_madd_epi16(x0, x0), _mm_madd_epi16(x1, x1)));
+    }
+    uint32_t lanes[4];
+    _mm_storeu_si128((__m128i*)lanes, sq);
+    sum_sq += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  }
+  if (!vectors)
+    return 0;
+
+  uint8_t min[16], max[16];
+  uint64_t sums[2];
+  _mm_storeu_si128((__m128i*)min, lo);
+  _mm_storeu_si128((__m128i*)max, hi);
+  _mm_storeu_si128((__m128i*)sums, sum);
+  for (size_t i = 0; i < 16; ++i) {
+    e->min = min[i] < e->min ? min[i] : e->min;
+    e->max = max[i] > e->max ? max[i] : e->max;
+  }
+  e->sum += (int64_t)(sums[0] + sums[1]);
+  e->sum_sq += sum_sq;
+  e->count += vectors * 16;
+  return vectors * 16;
+}
+#endif
+
+#ifdef ENVELOPE_NEON
+static size_t envelope_add_u8_neon(struct envelope* e, const uint8_t* in, size_t n) {
+  const size_t vectors = n / 16;
+  uint8x16_t lo = vdupq_n_u8(0xff);
+  uint8x16_t hi = vdupq_n_u8(0);
+  uint64x2_t sum = vdupq_n_u64(0);
+  uint64_t sum_sq = 0;
+  for (size_t v = 0; v < vectors;) {
+    const size_t end = v + ENVELOPE_FLUSH < vectors ? v + ENVELOPE_FLUSH : vectors;
+    uint32x4_t sq = vdupq_n_u32(0);
+    uint32x4_t s = vdupq_n_u32(0);
+    for (; v < end; ++v) {
+      const uint8x16_t x = vld1q_u8(in + 16 * v);
+      lo = vminq_u8(lo, x);
+      hi = vmaxq_u8(hi, x);
+      s = vpadalq_u16(s, vpaddlq_u8(x));
+      sq = vpadalq_u16(sq, vmull_u8(vget_low_u8(x), vget_low_u8(x)));
+      sq = vpadalq_u16(sq, vmull_u8(vget_high_u8(x), vget_high_u8(x)));
+    }
+    sum = vpadalq_u32(sum, s);
+    sum_sq += vaddlvq_u32(sq);
+  }
+  if (!vectors)
+    return 0;
+
+  e->min = vminvq_u8(lo) < e->min ? vminvq_u8(lo) : e->min;
+  e->max = vmaxvq_u8(hi) > e->max ? vmaxvq_u8(hi) : e->max;
+  e->sum += (int64_t)vaddvq_u64(sum);
+  e->sum_sq += sum_sq;
+  e->count += vectors * 16;
+  return vectors * 16;
+}
+#endif
+
+void envelope_add_u8(struct envelope* e, const uint8_t* in, size_t n) {
+  size_t done = 0;
+#ifdef ENVELOPE_SSE2
+  done = envelope_add_u8_sse2(e, in, n);
+#elif defined(ENVELOPE_NEON)
+  done = envelope_add_u8_neon(e, in, n);
+#endif
+  envelope_add_u8_scalar(e, in + done, n - done);
+}
+
+void envelope_add_s16(struct envelope* e, const int16_t* in, size_t n) {
+  int32_t min = e->min, max = e->max;
+  int64_t sum = 0;
+  uint64_t sum_sq = 0;
+  for (size_t i = 0; i < n; ++i) {
+    const int32_t x = in[i];
+    min = x < min ? x : min;
+    max = x > max ? x : max;
+    sum += x;
+    sum_sq += (uint64_t)((int64_t)x * x);
+  }
+  e->min = min;
+  e->max = max;
+  e->sum += sum;
+  e->sum_sq += sum_sq;
+  e->count += n;
+}
+
+double envelope_rms(const struct envelope* e) {
+  if (!e->count)
+    return 0;
+  const double mean = (double)e->sum / (double)e->count;
+  const double variance = (double)e->sum_sq / (double)e->count - mean * mean;
+  return variance > 0 ? sqrt(variance) : 0;
+}
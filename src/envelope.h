@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Min, max and sums of a block of samples, for summaries like /preview. Blocks can be added in pieces.
+struct envelope {
+  int32_t min;
+  int32_t max;
+  int64_t sum;
+  uint64_t sum_sq;
+  size_t count;
+};
+
+void envelope_reset(struct envelope* e);
+void envelope_add_u8(struct envelope* e, const uint8_t* in, size_t n);
+void envelope_add_s16(struct envelope* e, const int16_t* in, size_t n);
+// Add another block, as if its samples were added to `e`.
+void envelope_merge(struct envelope* e, const struct envelope* other);
+
+// RMS around the mean, so without the DC offset.
+double envelope_rms(const struct envelope* e);
@@ -1,176 +1,448 @@
+#define _GNU_SOURCE
+
 #include "files.h"
 
 #include <alsa/asoundlib.h>
-#include <fcntl.h>
 #include <pthread.h>
+#include <sched.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
 
 #include <ctype.h>
+#include <inttypes.h>
 #include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 
+#include "bundle.h"
+#include "container.h"
+#include "decimate.h"
+#include "deinterleave.h"
+#include "diskwriter.h"
+#include "envelope.h"
+#include "flac.h"
+#include "futex.h"
+#include "metrics.h"
+#include "resample.h"
+#include "rfstats.h"
+#include "rice.h"
+#include "ringbuffer.h"
+#include "source.h"
+#include "timeline.h"
 #include "version.h"
+#include "workpool.h"
+#include "zerocopy.h"
 
 servefile_fn file_root;
 servefile_fn file_version;
-servefile_fn file_cxadc;
-servefile_fn file_linear;
+servefile_fn file_arm;
 servefile_fn file_start;
-servefile_fn file_stop;
 servefile_fn file_stats;
+servefile_fn file_record;
+servefile_fn file_timeline;
+servefile_fn file_metrics;
+servefile_fn file_rf;
+servefile_fn file_sessions;
+servefile_fn file_gaps;
+servefile_dedicated_fn file_cxadc;
+servefile_dedicated_fn file_linear;
+servefile_dedicated_fn file_preview;
+servefile_dedicated_fn file_stop;
+servefile_dedicated_fn file_bundle;
+servefile_range_fn cxadc_range;
+servefile_range_fn linear_range;
+servefile_check_fn cxadc_check;
+servefile_check_fn linear_check;
+servefile_check_fn preview_check;
+servefile_check_fn bundle_check;
 
 struct served_file SERVED_FILES[] = {
-  {"/", "Content-Type: text/html; charset=utf-8\r\n", file_root},
-  {"/version", "Content-Type: text/plain; charset=utf-8\r\n", file_version},
-  {"/cxadc", "Content-Disposition: attachment\r\n", file_cxadc},
-  {"/linear", "Content-Disposition: attachment\r\n", file_linear},
-  {"/start", "Content-Type: text/json; charset=utf-8\r\n", file_start},
-  {"/stop", "Content-Type: text/json; charset=utf-8\r\n", file_stop},
-  {"/stats", "Content-Type: text/json; charset=utf-8\r\n", file_stats},
+  {"/", "Content-Type: text/html; charset=utf-8\r\n", file_root, NULL, NULL, NULL, false},
+  {"/version", "Content-Type: text/plain; charset=utf-8\r\n", file_version, NULL, NULL, NULL, false},
+  {"/cxadc", "Content-Disposition: attachment\r\n", NULL, file_cxadc, cxadc_range, cxadc_check, false},
+  {"/linear", "Content-Disposition: attachment\r\n", NULL, file_linear, linear_range, linear_check, false},
+  {"/bundle", "Content-Disposition: attachment\r\n", NULL, file_bundle, NULL, bundle_check, false},
+  {"/preview", "Content-Type: application/x-ndjson\r\n", NULL, file_preview, NULL, preview_check, false},
+  {"/arm", "Content-Type: text/json; charset=utf-8\r\n", file_arm, NULL, NULL, NULL, true},
+  {"/start", "Content-Type: text/json; charset=utf-8\r\n", file_start, NULL, NULL, NULL, true},
+  {"/stop", "Content-Type: text/json; charset=utf-8\r\n", NULL, file_stop, NULL, NULL, false},
+  {"/stats", "Content-Type: text/json; charset=utf-8\r\n", file_stats, NULL, NULL, NULL, false},
+  {"/record", "Content-Type: text/json; charset=utf-8\r\n", file_record, NULL, NULL, NULL, false},
+  {"/timeline", "Content-Type: text/json; charset=utf-8\r\n", file_timeline, NULL, NULL, NULL, false},
+  {"/metrics", "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n", file_metrics, NULL, NULL, NULL, false},
+  {"/rf", "Content-Type: text/json; charset=utf-8\r\n", file_rf, NULL, NULL, NULL, false},
+  {"/sessions", "Content-Type: text/json; charset=utf-8\r\n", file_sessions, NULL, NULL, NULL, false},
+  {"/gaps", "Content-Type: text/json; charset=utf-8\r\n", file_gaps, NULL, NULL, NULL, false},
   {NULL}
 };
 
-struct atomic_ringbuffer {
-  uint8_t* buf;
-  size_t buf_size;
-  _Atomic size_t written;
-  _Atomic size_t read;
+enum capture_state {
+  State_Idle = 0,
+  State_Starting,
+  State_Running,
+  State_Stopping,
+
+  State_Failed,
+  // ready to start, see /arm
+  State_Armed,
 };
 
-bool atomic_ringbuffer_init(struct atomic_ringbuffer* ctx, size_t buf_size) {
-  static const int FLAGS = MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE;
+const char* capture_state_to_str(enum capture_state state) {
+  const char* NAMES[] = {"Idle", "Starting", "Running", "Stopping", "Failed", "Armed"};
+  return NAMES[(int)state];
+}
+
+// Writes a stream to a file on the server, see /record.
+struct recorder {
+  _Atomic bool active;
+  char path[256];
+  struct disk_writer writer;
+  struct timespec start_time;
+};
 
-  void* buf = MAP_FAILED;
+// Writes every stream of a session to one indexed file, see container.h and /record.
+struct container_recorder {
+  _Atomic bool active;
+  char path[256];
+  struct disk_writer writer;
+  struct timespec start_time;
+  _Atomic size_t chunks;
+  _Atomic size_t indexes;
+};
 
-#ifdef MAP_HUGE_SHIFT
-  static const size_t ONE_GB = (1u << 30);
-  static const size_t TWO_MB = (2u << 20);
-  if (buf_size % ONE_GB == 0 && buf_size > ONE_GB)
-    buf = mmap(NULL, buf_size, PROT_READ | PROT_WRITE, FLAGS | MAP_HUGETLB | (30 << MAP_HUGE_SHIFT), -1, 0);
-  if (MAP_FAILED == buf && buf_size % TWO_MB == 0 && buf_size > TWO_MB)
-    buf = mmap(NULL, buf_size, PROT_READ | PROT_WRITE, FLAGS | MAP_HUGETLB | (21 << MAP_HUGE_SHIFT), -1, 0);
-#endif
-  if (MAP_FAILED == buf)
-    buf = mmap(NULL, buf_size, PROT_READ | PROT_WRITE, FLAGS, -1, 0);
+// Where the time goes in the capture and streaming loops, see /metrics.
+struct stream_metrics {
+  // written by the writer thread
+  struct histogram read_size;
+  struct histogram read_gap_ns;
+  // the worst stall of the writer thread, to see whether the scheduling tuning helps
+  _Atomic size_t max_read_gap_ns;
+  struct histogram source_wait_ns;
+  _Atomic size_t fill_high_water;
+  _Atomic size_t overflows;
+  // written by the clients and recorders
+  struct histogram client_write_ns;
+  struct histogram client_wait_ns;
+  // stream data compressed for clients with compress=rice, and what was sent for it
+  _Atomic size_t compress_in;
+  _Atomic size_t compress_out;
+};
 
-  if (MAP_FAILED == buf) {
-    return false;
-  }
+// gaps kept per stream, later ones are only counted
+#define GAP_LOG_CAPACITY 256
+// shorter gaps can't be told apart from the jitter of the read times
+#define GAP_MIN_NS 10000000
+
+// Data lost between the source and the ring buffer, estimated from the time that passed and the nominal rate.
+struct gap {
+  // stream position the data is missing at
+  uint64_t pos;
+  uint64_t frames;
+  // capture time of the last byte before the gap
+  int64_t ns;
+  // where the fill went in with gapfill, once the writer caught up with the source
+  uint64_t fill_pos;
+};
 
-  volatile uint8_t test = *(volatile uint8_t*)buf;
-  (void)test;
+// Written by the writer thread only, entries are complete before they are counted.
+struct gap_log {
+  _Atomic size_t count;
+  _Atomic size_t gaps;
+  _Atomic uint64_t missing_frames;
+  _Atomic uint64_t filled_bytes;
+  struct gap entries[GAP_LOG_CAPACITY];
+};
 
-  ctx->buf_size = buf_size;
-  ctx->read = 0;
-  ctx->written = 0;
-  ctx->buf = (uint8_t*)buf;
-  return true;
+struct stream_state {
+  struct source source;
+  pthread_t writer_thread;
+  // CPU the writer thread is pinned to, or -1
+  int cpu;
+  struct atomic_ringbuffer ring_buffer;
+  struct recorder recorder;
+  // capture time of the data, see /timeline
+  struct timeline timeline;
+  // data lost before it got to the ring buffer, see /gaps
+  struct gap_log gaps;
+  struct stream_metrics metrics;
+  // signal quality of the cxadc streams, see /rf
+  struct rf_stats rf;
+  // how far the analyzer got
+  size_t rf_pos;
+  // Reader trailing the writer by retain_bytes, so clients can resume after reconnecting. Only used by the writer
+  // thread while capturing.
+  struct atomic_ringbuffer_reader* retainer;
+  size_t retain_bytes;
+  // how often the retainer was dropped to make room for the writer, and the retained data lost with it
+  size_t retainer_drops;
+  struct session* session;
+};
+
+// Sessions are independent captures, each with its own streams, ring buffers and threads, see `session=` on /start.
+#define SESSION_MAX       16
+#define SESSION_NAME_SIZE 32
+
+struct session {
+  // empty for the default session
+  char name[SESSION_NAME_SIZE];
+  _Atomic enum capture_state cap_state;
+  // futex word, bumped on every change of cap_state
+  _Atomic uint32_t state_event;
+  struct stream_state cxadc[256];
+  size_t cxadc_count;
+  _Atomic size_t overflow_counter;
+  // SCHED_FIFO priority of the writer threads, 0 for the default scheduling
+  int rtprio;
+  bool memory_locked;
+  // how long preparing the capture took, see /arm
+  ssize_t arm_ns;
+  // directory for the spill files, empty if everything is kept in RAM
+  char spill_dir[256];
+  unsigned spill_seconds;
+  // how much of the streams to keep for resuming clients, see stream_retain
+  unsigned retain_seconds;
+  // fill gaps with silence, so the streams keep their length
+  bool gap_fill;
+  // what the capture was armed with, for the container header
+  char params[1024];
+  struct container_recorder container;
+  pthread_t spill_thread;
+  pthread_t rf_thread;
+
+  struct stream_state linear;
+};
+
+// Created on first use and never freed, so threads and clients can hold on to them. The default session is the first.
+static struct session* g_sessions[SESSION_MAX];
+static size_t g_session_count;
+static pthread_mutex_t g_sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+// sessions that asked for mlock, the memory stays locked until the last of them stopped
+static size_t g_memory_lock_count;
+
+void* writer_thread(void* arg);
+void* recorder_thread(void* arg);
+void* container_thread(void* arg);
+void* spill_thread(void* arg);
+void* rf_thread(void* arg);
+
+static void capture_state_notify(struct session* s) {
+  ++s->state_event;
+  futex_wake(&s->state_event);
 }
 
-void atomic_ringbuffer_free(struct atomic_ringbuffer* ctx) {
-  if (ctx->buf)
-    munmap(ctx->buf, ctx->buf_size);
-  ctx->buf = NULL;
+static void capture_state_set(struct session* s, enum capture_state state) {
+  s->cap_state = state;
+  capture_state_notify(s);
 }
 
-uint8_t* atomic_ringbuffer_get_write_ptr(struct atomic_ringbuffer* ctx) {
-  return ctx->buf + (ctx->written % ctx->buf_size);
+// Block while the capture state is `state`.
+static void capture_state_wait(struct session* s, enum capture_state state) {
+  while (1) {
+    const uint32_t event = s->state_event;
+    if (s->cap_state != state)
+      return;
+    futex_wait(&s->state_event, event, -1);
+  }
 }
 
-size_t atomic_ringbuffer_get_write_size(struct atomic_ringbuffer* ctx) {
-  size_t buf_size = ctx->buf_size;
-  size_t written = ctx->written;
-  size_t read = ctx->read;
-  size_t till_end = buf_size - (written % buf_size);
-  size_t till_read = read + buf_size - written;
-  return till_end < till_read ? till_end : till_read;
+static struct session* session_create(const char* name) {
+  struct session* s = calloc(1, sizeof(*s));
+  if (!s)
+    return NULL;
+  snprintf(s->name, sizeof(s->name), "%s", name);
+  s->linear.session = s;
+  for (size_t i = 0; i < sizeof(s->cxadc) / sizeof(*s->cxadc); ++i)
+    s->cxadc[i].session = s;
+  return s;
 }
 
-void atomic_ringbuffer_advance_written(struct atomic_ringbuffer* ctx, size_t count) {
-  ctx->written += count;
+static void gap_log_reset(struct gap_log* log) {
+  log->count = 0;
+  log->gaps = 0;
+  log->missing_frames = 0;
+  log->filled_bytes = 0;
 }
 
-uint8_t* atomic_ringbuffer_get_read_ptr(struct atomic_ringbuffer* ctx) {
-  return ctx->buf + (ctx->read % ctx->buf_size);
+static void gap_log_add(struct gap_log* log, const struct gap* gap) {
+  const size_t count = log->count;
+  if (count < GAP_LOG_CAPACITY) {
+    log->entries[count] = *gap;
+    log->count = count + 1;
+  }
+  ++log->gaps;
+  log->missing_frames += gap->frames;
 }
 
-size_t atomic_ringbuffer_get_read_size(struct atomic_ringbuffer* ctx) {
-  size_t buf_size = ctx->buf_size;
-  size_t written = ctx->written;
-  size_t read = ctx->read;
-  size_t till_end = buf_size - (read % buf_size);
-  size_t till_written = written - read;
-  return till_end < till_written ? till_end : till_written;
+// Silence for signed formats, mid-scale for unsigned ones like the cxadc samples.
+static void fill_frames(const struct source* src, uint8_t* out, size_t len) {
+  memset(out, 0, len);
+  if (snd_pcm_format_signed(src->format) != 0)
+    return;
+  const size_t sample_size = src->frame_size / src->channels;
+  for (size_t i = (size_t)snd_pcm_format_width(src->format) / 8 - 1; i < len; i += sample_size)
+    out[i] = 0x80;
 }
 
-void atomic_ringbuffer_advance_read(struct atomic_ringbuffer* ctx, size_t count) {
-  ctx->read += count;
+static bool stream_is_linear(const struct stream_state* stream) {
+  return stream == &stream->session->linear;
 }
 
-// this is only usable for stats, do not rely on being correct
-void atomic_ringbuffer_get_stats(struct atomic_ringbuffer* ctx, size_t* read, size_t* written, size_t* difference) {
-  // we read `read` first, so that we never get negative results
+// Real sample rate of the stream, from a fit of its timestamps, over the whole capture and recently. The host clock
+// is the reference, so compare streams with each other rather than with the nominal rate for the clock drift.
+static bool stream_rate(struct stream_state* stream, double* rate, double* recent_rate) {
+  const double frame_size = (double)stream->source.frame_size;
+  if (!frame_size || !timeline_rate(&stream->timeline, rate, recent_rate))
+    return false;
+  *rate /= frame_size;
+  *recent_rate /= frame_size;
+  return true;
+}
 
-  size_t _read = atomic_load(&ctx->read);
-  size_t _written = atomic_load(&ctx->written);
-  size_t _difference = _written - _read;
-  if (_difference > ctx->buf_size)
-    _difference = ctx->buf_size;
-  if (read)
-    *read = _read;
-  if (written)
-    *written = _written;
-  if (difference)
-    *difference = _difference;
+static double rate_ppm(double rate, unsigned nominal) {
+  return nominal ? (rate / nominal - 1) * 1e6 : 0;
 }
 
-enum capture_state {
-  State_Idle = 0,
-  State_Starting,
-  State_Running,
-  State_Stopping,
+// `src` as the inside of a JSON string, cut short if it doesn't fit. Returns `dst`.
+static const char* json_escape(char* dst, size_t dst_size, const char* src) {
+  size_t len = 0;
+  for (; *src && len + 7 <= dst_size; ++src) {
+    const unsigned char c = (unsigned char)*src;
+    if (c == '"' || c == '\\') {
+      dst[len++] = '\\';
+      dst[len++] = (char)c;
+    } else if (c < 0x20 || c == 0x7f) {
+      len += (size_t)snprintf(dst + len, dst_size - len, "\\u%04x", c);
+    } else {
+      dst[len++] = (char)c;
+    }
+  }
+  dst[len] = '\0';
+  return dst;
+}
 
-  State_Failed
-};
+// The session named by a `session=<name>` argument, or the default session without one. Named sessions are only
+// created if `create` is set, for /arm and /start.
+static struct session* session_find(int argc, char** argv, bool create, char* errstr, size_t errstr_size) {
+  errstr[0] = '\0';
+  char name[SESSION_NAME_SIZE] = "";
+  for (int i = 0; i < argc; ++i) {
+    if (0 != strncmp(argv[i], "session=", 8))
+      continue;
+    // it ends up in JSON and metric labels as it is
+    const char* value = argv[i] + 8;
+    const size_t len = strlen(value);
+    if (len == 0 || len >= sizeof(name) || strspn(value, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_.") != len) {
+      snprintf(errstr, errstr_size, "invalid session name");
+      return NULL;
+    }
+    memcpy(name, value, len + 1);
+  }
 
-const char* capture_state_to_str(enum capture_state state) {
-  const char* NAMES[] = {"Idle", "Starting", "Running", "Stopping", "Failed"};
-  return NAMES[(int)state];
+  pthread_mutex_lock(&g_sessions_lock);
+  if (g_session_count == 0 && (g_sessions[0] = session_create("")))
+    g_session_count = 1;
+  struct session* s = NULL;
+  for (size_t i = 0; i < g_session_count && !s; ++i) {
+    if (0 == strcmp(g_sessions[i]->name, name))
+      s = g_sessions[i];
+  }
+  if (s || !name[0]) {
+    // found, or the default session couldn't be allocated
+  } else if (!create) {
+    snprintf(errstr, errstr_size, "no session %s", name);
+  } else if (g_session_count == SESSION_MAX) {
+    snprintf(errstr, errstr_size, "too many sessions, at most %d", SESSION_MAX);
+  } else if ((s = session_create(name))) {
+    g_sessions[g_session_count++] = s;
+  }
+  if (!s && !errstr[0])
+    snprintf(errstr, errstr_size, "failed to allocate session");
+  pthread_mutex_unlock(&g_sessions_lock);
+  return s;
 }
 
-struct cxadc_state {
-  int fd;
-  pthread_t writer_thread;
-  struct atomic_ringbuffer ring_buffer;
+// session_find for the endpoints that only look at a session. Answers with the reason if there is none, unless `out`
+// is NULL for the streams.
+static struct session* session_lookup(FILE* out, int argc, char** argv) {
+  char errstr[256];
+  char escaped[1024];
+  struct session* s = session_find(argc, argv, false, errstr, sizeof(errstr) - 1);
+  if (!s && out)
+    fprintf(out, "{\"fail_reason\": \"%s\"}", json_escape(escaped, sizeof(escaped), errstr));
+  return s;
+}
 
-  // This is special and not protected by cap_state
-  _Atomic pthread_t reader_thread;
-};
+// The sessions so far, for the endpoints covering all of them. `out` needs SESSION_MAX entries.
+static size_t sessions_snapshot(struct session** out) {
+  pthread_mutex_lock(&g_sessions_lock);
+  const size_t count = g_session_count;
+  memcpy(out, g_sessions, count * sizeof(*out));
+  pthread_mutex_unlock(&g_sessions_lock);
+  return count;
+}
 
-struct {
-  _Atomic enum capture_state cap_state;
-  struct cxadc_state cxadc[256];
-  size_t cxadc_count;
-  _Atomic size_t overflow_counter;
+static bool source_same_device(const struct source* a, const struct source* b) {
+  return a->driver == b->driver && (a->driver == &SOURCE_CXADC || a->driver == &SOURCE_ALSA) && 0 == strcmp(a->name, b->name);
+}
 
-  struct {
-    snd_pcm_t* handle;
-    pthread_t writer_thread;
-    struct atomic_ringbuffer ring_buffer;
+// Whether a device of `s` is captured by another session already. Both check after setting up their sources, so of
+// two sessions arming at the same time at least one sees the other.
+static bool session_device_conflict(struct session* s, char* errstr, size_t errstr_size) {
+  struct session* sessions[SESSION_MAX];
+  const size_t count = sessions_snapshot(sessions);
+  for (size_t i = 0; i < count; ++i) {
+    struct session* other = sessions[i];
+    if (other == s || other->cap_state == State_Idle)
+      continue;
+    const struct source* used = NULL;
+    if (source_same_device(&s->linear.source, &other->linear.source))
+      used = &s->linear.source;
+    for (size_t a = 0; a < s->cxadc_count && !used; ++a) {
+      for (size_t b = 0; b < other->cxadc_count && !used; ++b) {
+        if (source_same_device(&s->cxadc[a].source, &other->cxadc[b].source))
+          used = &s->cxadc[a].source;
+      }
+    }
+    if (used) {
+      snprintf(errstr, errstr_size, "%.200s is used by session %.31s", used->name, other->name[0] ? other->name : "(default)");
+      return true;
+    }
+  }
+  return false;
+}
 
-    // This is special and not protected by cap_state
-    _Atomic pthread_t reader_thread;
-  } linear;
+static ssize_t timespec_to_nanos(const struct timespec* ts) {
+  return (ssize_t)ts->tv_nsec + (ssize_t)ts->tv_sec * 1000000000;
+}
 
-} g_state;
+static ssize_t monotonic_nanos(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return timespec_to_nanos(&ts);
+}
 
-void* cxadc_writer_thread(void* id);
-void* linear_writer_thread(void*);
+static void stream_metrics_reset(struct stream_metrics* metrics) {
+  histogram_reset(&metrics->read_size);
+  histogram_reset(&metrics->read_gap_ns);
+  metrics->max_read_gap_ns = 0;
+  histogram_reset(&metrics->source_wait_ns);
+  metrics->fill_high_water = 0;
+  metrics->overflows = 0;
+  histogram_reset(&metrics->client_write_ns);
+  histogram_reset(&metrics->client_wait_ns);
+  metrics->compress_in = 0;
+  metrics->compress_out = 0;
+}
 
-static ssize_t timespec_to_nanos(const struct timespec* ts) {
-  return (ssize_t)ts->tv_nsec + (ssize_t)ts->tv_sec * 1000000000;
+// atomic_ringbuffer_wait_read, counting the time in the stream metrics
+static bool stream_wait_read(struct stream_state* stream, struct atomic_ringbuffer_reader* reader, size_t pos, int timeout_ms) {
+  const ssize_t start_ns = monotonic_nanos();
+  const bool reached = atomic_ringbuffer_wait_read(&stream->ring_buffer, reader, pos, timeout_ms);
+  histogram_add(&stream->metrics.client_wait_ns, monotonic_nanos() - start_ns);
+  return reached;
 }
 
 static void urldecode2(char* dst, const char* src) {
@@ -201,473 +473,3169 @@ static void urldecode2(char* dst, const char* src) {
   *dst++ = '\0';
 }
 
-void file_start(int fd, int argc, char** argv) {
-  static const int MODE = SND_PCM_NONBLOCK | SND_PCM_NO_AUTO_RESAMPLE | SND_PCM_NO_AUTO_CHANNELS | SND_PCM_NO_AUTO_FORMAT | SND_PCM_NO_SOFTVOL;
+// Create a writer thread with the scheduling asked for on /start.
+static int writer_thread_create(struct stream_state* stream, pthread_t* thread_id) {
+  struct session* s = stream->session;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  if (s->rtprio) {
+    const struct sched_param param = {.sched_priority = s->rtprio};
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+    pthread_attr_setschedparam(&attr, &param);
+  }
+  if (stream->cpu >= 0) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(stream->cpu, &cpus);
+    pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+  }
+  const int err = pthread_create(thread_id, &attr, writer_thread, stream);
+  pthread_attr_destroy(&attr);
+  return err;
+}
+
+// RF statistics windows, the most the analyzer looks at in one go, and how often it catches up with the writers
+#define RF_WINDOW_MS   100
+#define RF_CHUNK       (1u << 20)
+#define RF_INTERVAL_US 10000
+
+// RAM chunks of a spilling ring buffer, and how often they are mapped and unmapped
+#define SPILL_RAM_CHUNKS  256
+#define SPILL_INTERVAL_US 5000
+
+// With retain, keep the data sent in the last retain_seconds even if every client has it already, so clients that lost
+// some of it with their connection can come back for it. Up to half the buffer, so the writer is never held back by it.
+static bool stream_retain(struct stream_state* stream) {
+  struct session* s = stream->session;
+  struct atomic_ringbuffer* buf = &stream->ring_buffer;
+  const struct source* src = &stream->source;
+  stream->retainer = NULL;
+  stream->retainer_drops = 0;
+  if (!s->retain_seconds)
+    return true;
+  const size_t frame_size = (size_t)snd_pcm_format_physical_width(src->format) / 8 * src->channels;
+  const size_t bytes = (size_t)s->retain_seconds * src->rate * frame_size;
+  stream->retain_bytes = bytes < buf->buf_size / 2 ? bytes : buf->buf_size / 2;
+  // resuming clients start at a frame boundary, so the retainer stays on one
+  stream->retain_bytes -= stream->retain_bytes % frame_size;
+  // lossy, just in case, as losing the retained data is better than losing the capture
+  stream->retainer = atomic_ringbuffer_add_reader(buf, Reader_Lossy);
+  return stream->retainer != NULL;
+}
 
-  enum capture_state expected = State_Idle;
-  if (!atomic_compare_exchange_strong(&g_state.cap_state, &expected, State_Starting)) {
-    dprintf(fd, "{\"state\": \"%s\"}", capture_state_to_str(expected));
-    return;
+static void stream_unretain(struct stream_state* stream) {
+  if (stream->retainer)
+    atomic_ringbuffer_remove_reader(&stream->ring_buffer, stream->retainer);
+  stream->retainer = NULL;
+}
+
+// Up to `ram_size` in RAM, with spilling as much more as is needed to hold spill_seconds of the stream.
+static bool stream_ringbuffer_init(struct stream_state* stream, size_t ram_size) {
+  struct session* s = stream->session;
+  struct atomic_ringbuffer* buf = &stream->ring_buffer;
+  const struct source* src = &stream->source;
+  if (!s->spill_dir[0])
+    return atomic_ringbuffer_init(buf, ram_size);
+
+  // the cxadc sources aren't open yet, so not from src->frame_size
+  const size_t frame_size = (size_t)snd_pcm_format_physical_width(src->format) / 8 * src->channels;
+  // whole frames and pages, and small enough that mapping one doesn't take long
+  size_t chunk_frames = 4096;
+  while (chunk_frames * frame_size * SPILL_RAM_CHUNKS * 2 <= ram_size)
+    chunk_frames *= 2;
+  const size_t chunk = chunk_frames * frame_size;
+  const size_t ram = (ram_size + chunk - 1) / chunk * chunk;
+  size_t total = (size_t)s->spill_seconds * src->rate * frame_size;
+  total = (total + chunk - 1) / chunk * chunk;
+  if (total <= ram)
+    return atomic_ringbuffer_init(buf, ram_size);
+  return atomic_ringbuffer_init_spill(buf, ram, total, chunk, s->spill_dir);
+}
+
+// mlockall is for the whole process, so it stays until no session wants it anymore.
+static bool memory_lock(struct session* s) {
+  pthread_mutex_lock(&g_sessions_lock);
+  const bool ok = mlockall(MCL_CURRENT | MCL_FUTURE) == 0;
+  if (ok) {
+    ++g_memory_lock_count;
+    s->memory_locked = true;
   }
+  pthread_mutex_unlock(&g_sessions_lock);
+  return ok;
+}
 
-  char errstr[256];
-  memset(errstr, 0, sizeof(errstr));
+static void memory_unlock(struct session* s) {
+  if (!s->memory_locked)
+    return;
+  pthread_mutex_lock(&g_sessions_lock);
+  if (--g_memory_lock_count == 0)
+    munlockall();
+  s->memory_locked = false;
+  pthread_mutex_unlock(&g_sessions_lock);
+}
 
-  unsigned cxadc_array[256];
-  unsigned cxadc_count = 0;
+// Parses a cpu number for pinning a writer thread, up to the first character that isn't part of it, and returns that.
+// A cpu the system doesn't have fails, instead of leaving the thread unpinned.
+static const char* parse_cpu(const char* p, int* cpu, char* errstr, size_t errstr_size) {
+  char* end;
+  const long value = strtol(p, &end, 10);
+  const long cpus = sysconf(_SC_NPROCESSORS_CONF);
+  if (end == p) {
+    snprintf(errstr, errstr_size, "expected a cpu number at %.32s", p);
+    return NULL;
+  }
+  if (value < 0 || value >= CPU_SETSIZE || (cpus > 0 && value >= cpus)) {
+    snprintf(errstr, errstr_size, "no cpu %ld, the cpus are 0 to %ld", value, (cpus > 0 ? cpus : CPU_SETSIZE) - 1);
+    return NULL;
+  }
+  *cpu = (int)value;
+  return end;
+}
 
-  char linear_name[64];
-  strcpy(linear_name, "hw:CARD=CXADCADCClockGe");
-  unsigned int linear_rate = 0;
-  unsigned int linear_channels = 0;
-  snd_pcm_format_t linear_format = SND_PCM_FORMAT_UNKNOWN;
-  snd_pcm_t* handle = NULL;
+// Everything that can be done before the capture starts: parse the parameters, allocate the ring buffers, open and
+// configure the sources, lock the memory and create the threads, which wait for the state to become Running.
+// Called in the Starting state. On failure the caller must call capture_teardown.
+static bool capture_arm(struct session* s, int argc, char** argv, char* errstr, size_t errstr_size) {
+  const ssize_t arm_start_ns = monotonic_nanos();
+  size_t cxadc_count = 0;
+  unsigned cxadc_rate = 40000000;
+  size_t wakeup = 65536;
+
+  struct source* linear = &s->linear.source;
+  source_setup(linear, &SOURCE_ALSA, "hw:CARD=CXADCADCClockGe");
+
+  s->rtprio = 0;
+  bool lock_memory = false;
+  s->spill_dir[0] = '\0';
+  s->spill_seconds = 300;
+  s->retain_seconds = 0;
+  s->gap_fill = false;
+  s->linear.cpu = -1;
+  for (size_t i = 0; i < sizeof(s->cxadc) / sizeof(*s->cxadc); ++i)
+    s->cxadc[i].cpu = -1;
 
   for (int i = 0; i < argc; ++i) {
+    const size_t max_cxadc = sizeof(s->cxadc) / sizeof(*s->cxadc);
     unsigned num;
+    char urlencoded[256];
+    char name[256];
     if (1 == sscanf(argv[i], "cxadc%u", &num)) {
-      if (cxadc_count < sizeof(cxadc_array) / sizeof(*cxadc_array)) {
-        unsigned idx = cxadc_count++;
-        cxadc_array[idx] = num;
-        g_state.cxadc[idx].fd = -1;
+      if (cxadc_count < max_cxadc) {
+        sprintf(name, "/dev/cxadc%u", num);
+        source_setup(&s->cxadc[cxadc_count++].source, &SOURCE_CXADC, name);
+      }
+      continue;
+    }
+    if (0 == strcmp(argv[i], "csynth")) {
+      if (cxadc_count < max_cxadc)
+        source_setup(&s->cxadc[cxadc_count++].source, &SOURCE_SYNTHETIC, "synthetic");
+      continue;
+    }
+    if (1 == sscanf(argv[i], "cfile=%255s", urlencoded)) {
+      if (cxadc_count < max_cxadc) {
+        urldecode2(name, urlencoded);
+        source_setup(&s->cxadc[cxadc_count++].source, &SOURCE_FILE, name);
       }
       continue;
     }
-    char urlencoded[64];
+    size_t size = 0;
+    if (1 == sscanf(argv[i], "wakeup=%zu", &size) && size >= 1) {
+      wakeup = size;
+      continue;
+    }
+    unsigned int rate = 0;
+    if (1 == sscanf(argv[i], "crate=%u", &rate) && rate >= 1000000 && rate <= 100000000) {
+      cxadc_rate = rate;
+      continue;
+    }
     if (1 == sscanf(argv[i], "lname=%63s", urlencoded)) {
-      urldecode2(linear_name, urlencoded);
+      // the name of a replayed file is its path
+      if (linear->driver == &SOURCE_ALSA)
+        urldecode2(linear->name, urlencoded);
+      continue;
+    }
+    if (0 == strcmp(argv[i], "lsynth")) {
+      linear->driver = &SOURCE_SYNTHETIC;
+      continue;
+    }
+    if (1 == sscanf(argv[i], "lfile=%255s", urlencoded)) {
+      linear->driver = &SOURCE_FILE;
+      urldecode2(linear->name, urlencoded);
       continue;
     }
     if (1 == sscanf(argv[i], "lformat=%63s", urlencoded)) {
-      linear_format = snd_pcm_format_value(urlencoded);
+      linear->format = snd_pcm_format_value(urlencoded);
       continue;
     }
-    unsigned int rate = 0;
     if (1 == sscanf(argv[i], "lrate=%u", &rate) && rate >= 22050 && rate <= 384000) {
-      linear_rate = rate;
+      linear->rate = rate;
       continue;
     }
     unsigned int channels = 0;
     if (1 == sscanf(argv[i], "lchannels=%u", &channels) && channels >= 1 && channels <= 16) {
-      linear_channels = channels;
+      linear->channels = channels;
+      continue;
+    }
+    if (0 == strcmp(argv[i], "lmmap")) {
+      linear->mmap = true;
+      continue;
+    }
+    if (1 == sscanf(argv[i], "lperiod=%zu", &size) && size >= 16) {
+      linear->period_frames = size;
+      continue;
+    }
+    if (1 == sscanf(argv[i], "lbuffer=%zu", &size) && size >= 32) {
+      linear->buffer_frames = size;
+      continue;
+    }
+    unsigned int periods = 0;
+    if (1 == sscanf(argv[i], "lperiods=%u", &periods) && periods >= 2 && periods <= 1024) {
+      linear->periods = periods;
+      continue;
+    }
+    if (0 == strncmp(argv[i], "rtprio=", 7)) {
+      char* end;
+      const long prio = strtol(argv[i] + 7, &end, 10);
+      if (end == argv[i] + 7 || *end || prio < 1 || prio > 99) {
+        snprintf(errstr, errstr_size, "rtprio needs a priority from 1 to 99, not %.32s", argv[i] + 7);
+        return false;
+      }
+      s->rtprio = (int)prio;
+      continue;
+    }
+    if (0 == strcmp(argv[i], "mlock")) {
+      lock_memory = true;
+      continue;
+    }
+    if (0 == strcmp(argv[i], "gapfill")) {
+      s->gap_fill = true;
+      continue;
+    }
+    if (1 == sscanf(argv[i], "spill=%255s", urlencoded)) {
+      urldecode2(s->spill_dir, urlencoded);
+      continue;
+    }
+    unsigned seconds = 0;
+    if (1 == sscanf(argv[i], "spilltime=%u", &seconds) && seconds >= 1) {
+      s->spill_seconds = seconds;
+      continue;
+    }
+    if (1 == sscanf(argv[i], "retain=%u", &seconds)) {
+      s->retain_seconds = seconds;
+      continue;
+    }
+    if (0 == strncmp(argv[i], "lcpu=", 5)) {
+      const char* end = parse_cpu(argv[i] + 5, &s->linear.cpu, errstr, errstr_size);
+      if (!end)
+        return false;
+      if (*end) {
+        snprintf(errstr, errstr_size, "lcpu takes a single cpu, not %.32s", argv[i] + 5);
+        return false;
+      }
+      continue;
+    }
+    // the nth cpu of the list is for the nth captured card
+    if (1 == sscanf(argv[i], "ccpu=%255s", urlencoded)) {
+      urldecode2(name, urlencoded);
+      const char* p = name;
+      for (size_t card = 0; *p; ++card) {
+        if (card == max_cxadc) {
+          snprintf(errstr, errstr_size, "ccpu lists more than %zu cpus", max_cxadc);
+          return false;
+        }
+        if (!(p = parse_cpu(p, &s->cxadc[card].cpu, errstr, errstr_size)))
+          return false;
+        if (*p == ',' && p[1])
+          ++p;
+        else if (*p) {
+          snprintf(errstr, errstr_size, "ccpu needs a comma separated list of cpus, not %.32s", name);
+          return false;
+        }
+      }
       continue;
     }
   }
 
-  g_state.overflow_counter = 0;
+  // the emulated linear sources have no device to ask, so default to what the clockgen ADC does
+  if (linear->driver != &SOURCE_ALSA) {
+    if (!linear->rate)
+      linear->rate = 46875;
+    if (!linear->channels)
+      linear->channels = 3;
+    if (linear->format == SND_PCM_FORMAT_UNKNOWN)
+      linear->format = SND_PCM_FORMAT_S24_3LE;
+    // nor a hardware buffer to map or size
+    linear->mmap = false;
+    linear->period_frames = 0;
+    linear->buffer_frames = 0;
+    linear->periods = 0;
+    // named like the synthetic cards rather than after the device it stands in for, in /stats and the headers
+    if (linear->driver == &SOURCE_SYNTHETIC)
+      snprintf(linear->name, sizeof(linear->name), "synthetic");
+  }
 
+  s->cxadc_count = cxadc_count;
   for (size_t i = 0; i < cxadc_count; ++i) {
-    if (!atomic_ringbuffer_init(&g_state.cxadc[i].ring_buffer, 1 << 30)) {
-      snprintf(errstr, sizeof(errstr) - 1, "failed to allocate ringbuffer: %s", sys_errlist[errno]);
-      goto error;
+    struct source* src = &s->cxadc[i].source;
+    src->rate = cxadc_rate;
+    src->channels = 1;
+    src->format = SND_PCM_FORMAT_U8;
+  }
+  if (session_device_conflict(s, errstr, errstr_size))
+    return false;
+
+  s->overflow_counter = 0;
+  s->params[0] = '\0';
+  size_t params_len = 0;
+  for (int i = 0; i < argc && params_len < sizeof(s->params); ++i)
+    params_len += snprintf(s->params + params_len, sizeof(s->params) - params_len, "%s%s", i ? "&" : "", argv[i]);
+
+  for (size_t i = 0; i < cxadc_count; ++i) {
+    if (!stream_ringbuffer_init(&s->cxadc[i], 1 << 30)) {
+      snprintf(errstr, errstr_size, "failed to allocate ringbuffer: %s", sys_errlist[errno]);
+      return false;
     }
+    if (!stream_retain(&s->cxadc[i])) {
+      snprintf(errstr, errstr_size, "failed to add the retaining reader");
+      return false;
+    }
+    s->cxadc[i].ring_buffer.wakeup_watermark = wakeup;
+    timeline_reset(&s->cxadc[i].timeline);
+    gap_log_reset(&s->cxadc[i].gaps);
+    stream_metrics_reset(&s->cxadc[i].metrics);
+    rf_stats_reset(&s->cxadc[i].rf, cxadc_rate / 1000 * RF_WINDOW_MS);
+    s->cxadc[i].rf_pos = 0;
   }
 
-  int err = 0;
+  if (!source_open(linear, errstr, errstr_size))
+    return false;
 
-  if ((err = snd_pcm_open(&handle, linear_name, SND_PCM_STREAM_CAPTURE, MODE)) < 0) {
-    snprintf(errstr, sizeof(errstr) - 1, "cannot open ALSA device: %s", snd_strerror(err));
-    goto error;
+  if (!stream_ringbuffer_init(&s->linear, (2 << 20) * linear->frame_size)) {
+    snprintf(errstr, errstr_size, "failed to allocate ringbuffer: %s", sys_errlist[errno]);
+    return false;
+  }
+  // the linear stream is slow, a large watermark would only add latency
+  s->linear.ring_buffer.wakeup_watermark = wakeup < s->linear.ring_buffer.ram_size / 64 ? wakeup : s->linear.ring_buffer.ram_size / 64;
+  if (!stream_retain(&s->linear)) {
+    snprintf(errstr, errstr_size, "failed to add the retaining reader");
+    return false;
   }
+  timeline_reset(&s->linear.timeline);
+  gap_log_reset(&s->linear.gaps);
+  stream_metrics_reset(&s->linear.metrics);
 
-  snd_pcm_hw_params_t* hw_params = NULL;
-  snd_pcm_hw_params_alloca(&hw_params);
+  for (size_t i = 0; i < cxadc_count; ++i) {
+    if (!source_open(&s->cxadc[i].source, errstr, errstr_size))
+      return false;
+  }
 
-  if ((err = snd_pcm_hw_params_any(handle, hw_params)) < 0) {
-    snprintf(errstr, sizeof(errstr) - 1, "cannot initialize hardware parameter structure: %s", snd_strerror(err));
-    goto error;
+  // everything is allocated by now, so this also faults in the ring buffers before the capture starts
+  if (lock_memory && !memory_lock(s)) {
+    snprintf(errstr, errstr_size, "cannot lock memory: %s", sys_errlist[errno]);
+    return false;
   }
 
-  if ((err = snd_pcm_hw_params_set_access(handle, hw_params, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0) {
-    snprintf(errstr, sizeof(errstr) - 1, "cannot set access type: %s", snd_strerror(err));
-    goto error;
+  int err = 0;
+  if (s->spill_dir[0] && (err = pthread_create(&s->spill_thread, NULL, spill_thread, s)) != 0) {
+    snprintf(errstr, errstr_size, "can't create spill thread: %s", sys_errlist[err]);
+    return false;
+  }
+  if (cxadc_count && (err = pthread_create(&s->rf_thread, NULL, rf_thread, s)) != 0) {
+    snprintf(errstr, errstr_size, "can't create rf analyzer thread: %s", sys_errlist[err]);
+    return false;
   }
 
-  if (linear_rate) {
-set_rate:
-    if ((err = snd_pcm_hw_params_set_rate(handle, hw_params, linear_rate, 0)) < 0) {
-      snprintf(errstr, sizeof(errstr) - 1, "cannot set sample rate: %s", snd_strerror(err));
-      goto error;
-    }
-  } else {
-    if (snd_pcm_hw_params_get_rate(hw_params, &linear_rate, 0) < 0) {
-      if ((err = snd_pcm_hw_params_get_rate_max(hw_params, &linear_rate, 0)) < 0) {
-        snprintf(errstr, sizeof(errstr) - 1, "cannot get sample rate: %s", snd_strerror(err));
-        goto error;
-      } else {
-        goto set_rate;
-      }
+  for (size_t i = 0; i < cxadc_count; ++i) {
+    pthread_t thread_id;
+    if ((err = writer_thread_create(&s->cxadc[i], &thread_id)) != 0) {
+      snprintf(errstr, errstr_size, "can't create cxadc writer thread: %s", sys_errlist[err]);
+      return false;
     }
+    s->cxadc[i].writer_thread = thread_id;
   }
 
-  if (linear_channels) {
-    if ((err = snd_pcm_hw_params_set_channels(handle, hw_params, linear_channels)) < 0) {
-      snprintf(errstr, sizeof(errstr) - 1, "cannot set channel count: %s", snd_strerror(err));
-      goto error;
-    }
-  } else {
-    if ((err = snd_pcm_hw_params_get_channels(hw_params, &linear_channels)) < 0) {
-      snprintf(errstr, sizeof(errstr) - 1, "cannot get channel count: %s", snd_strerror(err));
-      goto error;
-    }
+  pthread_t thread_id;
+  if ((err = writer_thread_create(&s->linear, &thread_id)) != 0) {
+    snprintf(errstr, errstr_size, "can't create linear writer thread: %s", sys_errlist[err]);
+    return false;
   }
+  s->linear.writer_thread = thread_id;
 
-  if (linear_format != SND_PCM_FORMAT_UNKNOWN) {
-    if ((err = snd_pcm_hw_params_set_format(handle, hw_params, linear_format)) < 0) {
-      snprintf(errstr, sizeof(errstr) - 1, "cannot set sample format: %s", snd_strerror(err));
-      goto error;
-    }
-  } else {
-    if ((err = snd_pcm_hw_params_get_format(hw_params, &linear_format)) < 0) {
-      snprintf(errstr, sizeof(errstr) - 1, "cannot get sample format: %s", snd_strerror(err));
-      goto error;
-    }
+  s->arm_ns = monotonic_nanos() - arm_start_ns;
+  return true;
+}
+
+// Undo a failed or abandoned capture_arm or capture start. Leaves the state Failed, for the caller to reset.
+static void capture_teardown(struct session* s) {
+  capture_state_set(s, State_Failed);
+
+  if (s->spill_thread) {
+    pthread_join(s->spill_thread, NULL);
+    s->spill_thread = 0;
+  }
+  if (s->rf_thread) {
+    pthread_join(s->rf_thread, NULL);
+    s->rf_thread = 0;
   }
 
-  ssize_t format_size;
-  if ((format_size = snd_pcm_format_size(linear_format, 1)) < 0) {
-    snprintf(errstr, sizeof(errstr) - 1, "cannot get format size: %s", snd_strerror(err));
-    goto error;
+  if (s->linear.writer_thread) {
+    pthread_join(s->linear.writer_thread, NULL);
+    s->linear.writer_thread = 0;
   }
 
-  size_t sample_size = linear_channels * format_size;
-  if (!atomic_ringbuffer_init(&g_state.linear.ring_buffer, (2 << 20) * sample_size)) {
-    snprintf(errstr, sizeof(errstr) - 1, "failed to allocate ringbuffer: %s", sys_errlist[errno]);
-    goto error;
+  for (size_t i = 0; i < s->cxadc_count; ++i) {
+    struct stream_state* cxadc = &s->cxadc[i];
+    if (cxadc->writer_thread) {
+      pthread_join(cxadc->writer_thread, NULL);
+      cxadc->writer_thread = 0;
+    }
   }
 
-  struct timespec time1;
-  clock_gettime(CLOCK_MONOTONIC_RAW, &time1);
+  source_close(&s->linear.source);
+  s->linear.retainer = NULL;
+  atomic_ringbuffer_free(&s->linear.ring_buffer);
 
-  if ((err = snd_pcm_hw_params(handle, hw_params)) < 0) {
-    snprintf(errstr, sizeof(errstr) - 1, "cannot set hw parameters: %s", snd_strerror(err));
-    goto error;
+  for (size_t i = 0; i < s->cxadc_count; ++i) {
+    struct stream_state* cxadc = &s->cxadc[i];
+    source_close(&cxadc->source);
+    cxadc->retainer = NULL;
+    atomic_ringbuffer_free(&cxadc->ring_buffer);
   }
+  s->cxadc_count = 0;
+  memory_unlock(s);
+}
 
-  snd_pcm_sw_params_t* sw_params = NULL;
-  snd_pcm_sw_params_alloca(&sw_params);
+static void capture_armed_json(FILE* out, struct session* s) {
+  const struct source* linear = &s->linear.source;
+  fprintf(
+    out,
+    "\"session\": \"%s\","
+    "\"arm_ns\": %zd,"
+    "\"linear_rate\": %u,"
+    "\"linear_channels\": %u,"
+    "\"linear_format\": \"%s\","
+    "\"linear_access\": \"%s\","
+    "\"linear_period_frames\": %zu,"
+    "\"linear_buffer_frames\": %zu,"
+    "\"linear_periods\": %u,"
+    "\"rtprio\": %d,"
+    "\"mlock\": %s,"
+    "\"spill\": %s,"
+    "\"gapfill\": %s,"
+    "\"pool_bytes\": %zu",
+    s->name,
+    s->arm_ns,
+    linear->rate,
+    linear->channels,
+    snd_pcm_format_name(linear->format),
+    linear->mmap ? "mmap" : "rw",
+    linear->period_frames,
+    linear->buffer_frames,
+    linear->periods,
+    s->rtprio,
+    s->memory_locked ? "true" : "false",
+    s->spill_dir[0] ? "true" : "false",
+    s->gap_fill ? "true" : "false",
+    atomic_ringbuffer_pool_bytes()
+  );
+}
 
-  if ((err = snd_pcm_sw_params_current(handle, sw_params)) < 0) {
-    snprintf(errstr, sizeof(errstr) - 1, "cannot query sw parameters: %s", snd_strerror(err));
-    goto error;
+void file_arm(FILE* out, int argc, char** argv) {
+  char errstr[256];
+  char escaped[1024];
+  memset(errstr, 0, sizeof(errstr));
+  struct session* s = session_find(argc, argv, true, errstr, sizeof(errstr) - 1);
+  if (!s) {
+    fprintf(out, "{\"state\": \"%s\", \"fail_reason\": \"%s\"}", capture_state_to_str(State_Failed), json_escape(escaped, sizeof(escaped), errstr));
+    return;
   }
 
-  if ((err = snd_pcm_sw_params_set_tstamp_mode(handle, sw_params, SND_PCM_TSTAMP_ENABLE)) < 0) {
-    snprintf(errstr, sizeof(errstr) - 1, "cannot set tstamp mode: %s", snd_strerror(err));
-    goto error;
+  enum capture_state expected = State_Idle;
+  if (!atomic_compare_exchange_strong(&s->cap_state, &expected, State_Starting)) {
+    fprintf(out, "{\"state\": \"%s\"}", capture_state_to_str(expected));
+    return;
   }
+  capture_state_notify(s);
 
-  if ((err = snd_pcm_sw_params_set_tstamp_type(handle, sw_params, SND_PCM_TSTAMP_TYPE_MONOTONIC_RAW)) < 0) {
-    snprintf(errstr, sizeof(errstr) - 1, "cannot set tstamp type: %s", snd_strerror(err));
-    goto error;
+  if (!capture_arm(s, argc, argv, errstr, sizeof(errstr) - 1)) {
+    capture_teardown(s);
+    fprintf(out, "{\"state\": \"%s\", \"fail_reason\": \"%s\"}", capture_state_to_str(State_Failed), json_escape(escaped, sizeof(escaped), errstr));
+    capture_state_set(s, State_Idle);
+    return;
   }
 
-  if ((err = snd_pcm_sw_params(handle, sw_params)) < 0) {
-    snprintf(errstr, sizeof(errstr) - 1, "cannot set sw parameters: %s", snd_strerror(err));
-    goto error;
+  capture_state_set(s, State_Armed);
+  fprintf(out, "{\"state\": \"%s\",", capture_state_to_str(State_Armed));
+  capture_armed_json(out, s);
+  fprintf(out, "}");
+}
+
+void file_start(FILE* out, int argc, char** argv) {
+  const ssize_t request_ns = monotonic_nanos();
+  char errstr[256];
+  char escaped[1024];
+  memset(errstr, 0, sizeof(errstr));
+  struct session* s = session_find(argc, argv, true, errstr, sizeof(errstr) - 1);
+  if (!s) {
+    fprintf(out, "{\"state\": \"%s\", \"fail_reason\": \"%s\"}", capture_state_to_str(State_Failed), json_escape(escaped, sizeof(escaped), errstr));
+    return;
   }
 
-  if ((err = snd_pcm_prepare(handle)) < 0) {
-    snprintf(errstr, sizeof(errstr) - 1, "cannot prepare audio interface for use: %s", snd_strerror(err));
-    goto error;
+  enum capture_state expected = State_Armed;
+  const bool armed = atomic_compare_exchange_strong(&s->cap_state, &expected, State_Starting);
+  if (!armed) {
+    expected = State_Idle;
+    if (!atomic_compare_exchange_strong(&s->cap_state, &expected, State_Starting)) {
+      fprintf(out, "{\"state\": \"%s\"}", capture_state_to_str(expected));
+      return;
+    }
   }
+  capture_state_notify(s);
+
+  // when armed, the parameters were given to /arm
+  if (!armed && !capture_arm(s, argc, argv, errstr, sizeof(errstr) - 1))
+    goto error;
+
+  struct source* linear = &s->linear.source;
+  const size_t cxadc_count = s->cxadc_count;
 
-  snd_pcm_start(handle);
+  struct timespec time1;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &time1);
+
+  if (!source_start(linear, errstr, sizeof(errstr) - 1))
+    goto error;
 
   struct timespec time2;
   clock_gettime(CLOCK_MONOTONIC_RAW, &time2);
 
+  // opening a cxadc device starts its DMA, so that can't be done when arming
   for (size_t i = 0; i < cxadc_count; ++i) {
-    char cxadc_name[32];
-    sprintf(cxadc_name, "/dev/cxadc%u", cxadc_array[i]);
-    const int cxadc_fd = open(cxadc_name, O_NONBLOCK);
-    if (cxadc_fd < 0) {
-      snprintf(errstr, sizeof(errstr) - 1, "cannot open cxadc: %s", sys_errlist[errno]);
+    if (!source_start(&s->cxadc[i].source, errstr, sizeof(errstr) - 1))
       goto error;
-    }
-    g_state.cxadc[i].fd = cxadc_fd;
   }
 
-  g_state.cxadc_count = cxadc_count;
-
   struct timespec time3;
   clock_gettime(CLOCK_MONOTONIC_RAW, &time3);
 
   const long linear_ns = timespec_to_nanos(&time2) - timespec_to_nanos(&time1);
   const long cxadc_ns = timespec_to_nanos(&time3) - timespec_to_nanos(&time2);
 
-  g_state.linear.handle = handle;
-
-  for (size_t i = 0; i < cxadc_count; ++i) {
-    pthread_t thread_id;
-    if ((err = pthread_create(&thread_id, NULL, cxadc_writer_thread, (void*)i) != 0)) {
-      snprintf(errstr, sizeof(errstr) - 1, "can't create cxadc writer thread: %s", sys_errlist[err]);
-      goto error;
-    }
-    g_state.cxadc[i].writer_thread = thread_id;
-  }
-
-  pthread_t thread_id;
-  if ((err = pthread_create(&thread_id, NULL, linear_writer_thread, NULL) != 0)) {
-    snprintf(errstr, sizeof(errstr) - 1, "can't create linear writer thread: %s", sys_errlist[err]);
-    goto error;
-  }
-  g_state.linear.writer_thread = thread_id;
-
-  g_state.cap_state = State_Running;
-  dprintf(
-    fd,
+  capture_state_set(s, State_Running);
+  const ssize_t start_ns = monotonic_nanos() - request_ns;
+  fprintf(
+    out,
     "{"
     "\"state\": \"%s\","
+    "\"armed\": %s,"
+    "\"start_ns\": %zd,"
     "\"linear_ns\": %ld,"
-    "\"cxadc_ns\": %ld,"
-    "\"linear_rate\": %u,"
-    "\"linear_channels\": %u,"
-    "\"linear_format\": \"%s\""
-    "}",
+    "\"cxadc_ns\": %ld,",
     capture_state_to_str(State_Running),
+    armed ? "true" : "false",
+    start_ns,
     linear_ns,
-    cxadc_ns,
-    linear_rate,
-    linear_channels,
-    snd_pcm_format_name(linear_format)
+    cxadc_ns
   );
+  capture_armed_json(out, s);
+  fprintf(out, "}");
   return;
 
 error:
-  g_state.cap_state = State_Failed;
-
-  if (g_state.linear.writer_thread) {
-    pthread_join(g_state.linear.writer_thread, NULL);
-    g_state.linear.writer_thread = 0;
-  }
+  capture_teardown(s);
+  fprintf(out, "{\"state\": \"%s\", \"fail_reason\": \"%s\"}", capture_state_to_str(State_Failed), json_escape(escaped, sizeof(escaped), errstr));
+  capture_state_set(s, State_Idle);
+}
 
-  for (size_t i = 0; i < cxadc_count; ++i) {
-    struct cxadc_state* cxadc = &g_state.cxadc[i];
-    if (cxadc->writer_thread) {
-      pthread_join(cxadc->writer_thread, NULL);
-      cxadc->writer_thread = 0;
-    }
-  }
+void* writer_thread(void* arg) {
+  struct stream_state* stream = arg;
+  struct session* s = stream->session;
+  enum capture_state state;
+  while ((state = s->cap_state) == State_Starting || state == State_Armed)
+    capture_state_wait(s, state);
 
-  if (handle)
-    snd_pcm_close(handle);
+  if (s->cap_state == State_Failed)
+    return NULL;
 
-  for (size_t i = 0; i < cxadc_count; ++i) {
-    struct cxadc_state* cxadc = &g_state.cxadc[i];
-    if (cxadc->fd != -1) {
-      close(cxadc->fd);
-      cxadc->fd = -1;
-    }
-    atomic_ringbuffer_free(&cxadc->ring_buffer);
-  }
-
-  dprintf(fd, "{\"state\": \"%s\", \"fail_reason\": \"%s\"}", capture_state_to_str(State_Failed), errstr);
-  g_state.cap_state = State_Idle;
-}
-
-void* cxadc_writer_thread(void* id) {
-  while (g_state.cap_state == State_Starting)
-    usleep(1000);
-
-  if (g_state.cap_state == State_Failed)
-    return NULL;
-
-  struct atomic_ringbuffer* buf = &g_state.cxadc[(size_t)id].ring_buffer;
-  const int fd = g_state.cxadc[(size_t)id].fd;
-
-  while (g_state.cap_state != State_Stopping) {
+  struct atomic_ringbuffer* buf = &stream->ring_buffer;
+  struct source* src = &stream->source;
+  struct stream_metrics* metrics = &stream->metrics;
+  ssize_t last_read_ns = 0;
+
+  // Capture position and time of the latest read. After the ring buffer was full or the source overran, data may be
+  // missing from `gap.pos` on. How much shows once the writer caught up with the source again: the time since the
+  // last read before, times the rate, minus what arrived.
+  uint64_t last_pos = 0;
+  int64_t last_ns = 0;
+  bool suspect = false;
+  struct gap gap = {0};
+  size_t xruns = src->xruns;
+  size_t fill_pending = 0;
+  const double bytes_per_ns = (double)src->rate * src->frame_size / 1e9;
+  // the buffer stays full for a while when it does, so this is reported once a second
+  ssize_t full_reported_ns = 0;
+  size_t full_waits = 0;
+
+  while (s->cap_state != State_Stopping) {
     void* ptr = atomic_ringbuffer_get_write_ptr(buf);
     size_t len = atomic_ringbuffer_get_write_size(buf);
-    if (len == 0) {
-      ++g_state.overflow_counter;
-      fprintf(stderr, "ringbuffer full, may be dropping samples!!! THIS IS BAD!\n");
-      usleep(1000);
+    if (fill_pending && len >= src->frame_size) {
+      len = len < fill_pending ? len - len % src->frame_size : fill_pending;
+      fill_frames(src, ptr, len);
+      atomic_ringbuffer_advance_written(buf, len);
+      stream->gaps.filled_bytes += len;
+      fill_pending -= len;
+      continue;
+    }
+    if (len < src->frame_size) {
+      if (atomic_ringbuffer_drop_lossy(buf, src->frame_size)) {
+        fprintf(stderr, "ringbuffer full, dropped lossy reader\n");
+        continue;
+      }
+      // waiting on the spill thread can lose data too, the gap check tells afterwards
+      if (!suspect && last_ns) {
+        suspect = true;
+        gap = (struct gap){buf->written, 0, last_ns, 0};
+      }
+      // not full, the spill thread just has to map more
+      if (atomic_ringbuffer_spill_behind(buf)) {
+        usleep(1000);
+        continue;
+      }
+      ++s->overflow_counter;
+      ++metrics->overflows;
+      ++full_waits;
+      if (monotonic_nanos() - full_reported_ns >= 1000000000) {
+        fprintf(stderr, "%s ringbuffer full %zu times, may be dropping samples!!! THIS IS BAD!\n", src->name, full_waits);
+        full_reported_ns = monotonic_nanos();
+        full_waits = 0;
+      }
+      atomic_ringbuffer_wait_write(buf, 1);
       continue;
     }
-    ssize_t count = read(fd, ptr, len);
+    ssize_t count = source_read(src, ptr, len);
+    if (src->xruns != xruns) {
+      xruns = src->xruns;
+      if (!suspect && last_ns) {
+        suspect = true;
+        gap = (struct gap){buf->written, 0, last_ns, 0};
+      }
+    }
     if (count == 0) {
-      usleep(1);
+      const ssize_t wait_start_ns = monotonic_nanos();
+      source_wait(src, 100);
+      histogram_add(&metrics->source_wait_ns, monotonic_nanos() - wait_start_ns);
+      ++buf->writer_wakeups;
       continue;
     }
     if (count < 0) {
-      fprintf(stderr, "read failed\n");
+      fprintf(stderr, "%s read failed: %s\n", src->driver->name, snd_strerror((int)count));
       break;
     }
 
-    atomic_ringbuffer_advance_written(buf, count);
-  }
-  close(fd);
-  return NULL;
-}
+    struct timespec ts;
+    size_t pending;
+    source_timestamp(src, &ts, &pending);
+    uint64_t pos = buf->written + count + pending;
+    const int64_t ns = timespec_to_nanos(&ts);
+
+    // the source had less than there was room for, so it's drained
+    if (suspect && (size_t)count < len) {
+      suspect = false;
+      const double missing = (double)(ns - last_ns) * bytes_per_ns - (double)(pos - last_pos);
+      if (missing > GAP_MIN_NS * bytes_per_ns) {
+        const size_t bytes = (size_t)missing - (size_t)missing % src->frame_size;
+        gap.frames = bytes / src->frame_size;
+        gap.fill_pos = buf->written + count;
+        gap_log_add(&stream->gaps, &gap);
+        fprintf(stderr, "%s lost about %" PRIu64 " frames at %" PRIu64 "\n", src->name, gap.frames, gap.pos);
+        if (s->gap_fill) {
+          fill_pending += bytes;
+          pos += bytes;
+        }
+      }
+    }
+    // the positions read while data may be missing can be off by the gap, so they're left out
+    if (!suspect) {
+      timeline_add(&stream->timeline, pos, ns);
+      last_pos = pos;
+      last_ns = ns;
+    }
 
-void* linear_writer_thread(void* arg) {
-  (void)arg;
+    const ssize_t now_ns = monotonic_nanos();
+    if (last_read_ns) {
+      const size_t gap_ns = now_ns - last_read_ns;
+      histogram_add(&metrics->read_gap_ns, gap_ns);
+      if (gap_ns > metrics->max_read_gap_ns)
+        metrics->max_read_gap_ns = gap_ns;
+    }
+    last_read_ns = now_ns;
+    histogram_add(&metrics->read_size, count);
 
-  while (g_state.cap_state == State_Starting)
-    usleep(1000);
+    atomic_ringbuffer_advance_written(buf, count);
 
-  if (g_state.cap_state == State_Failed)
-    return NULL;
+    struct atomic_ringbuffer_reader* retainer = stream->retainer;
+    if (retainer && retainer->state != ReaderState_Active) {
+      // dropped with the lossy clients, start retaining again from here
+      fprintf(stderr, "%s retaining reader dropped, the retained data is lost\n", src->name);
+      ++stream->retainer_drops;
+      atomic_ringbuffer_remove_reader(buf, retainer);
+      retainer = stream->retainer = atomic_ringbuffer_add_reader(buf, Reader_Lossy);
+    }
+    if (retainer && buf->written - retainer->read > stream->retain_bytes)
+      atomic_ringbuffer_advance_read(buf, retainer, buf->written - retainer->read - stream->retain_bytes);
 
-  struct atomic_ringbuffer* buf = &g_state.linear.ring_buffer;
-  snd_pcm_t* handle = g_state.linear.handle;
+    // only the writer thread updates it, so no need for a compare and swap
+    const size_t fill = buf->written - buf->read;
+    if (fill > metrics->fill_high_water)
+      metrics->fill_high_water = fill;
+  }
+  source_close(src);
+  return NULL;
+}
 
-  while (g_state.cap_state != State_Stopping) {
-    void* ptr = atomic_ringbuffer_get_write_ptr(buf);
-    size_t len = atomic_ringbuffer_get_write_size(buf);
-    size_t len_samples = snd_pcm_bytes_to_frames(handle, (ssize_t)len);
-    if (len_samples == 0) {
-      ++g_state.overflow_counter;
-      fprintf(stderr, "ringbuffer full, may be dropping samples!!! THIS IS BAD!\n");
-      usleep(1000);
-      continue;
+void* spill_thread(void* arg) {
+  struct session* s = arg;
+  enum capture_state state;
+  while ((state = s->cap_state) == State_Starting || state == State_Armed || state == State_Running) {
+    for (size_t i = 0; i < s->cxadc_count; ++i) {
+      if (s->cxadc[i].ring_buffer.spill)
+        atomic_ringbuffer_spill_maintain(&s->cxadc[i].ring_buffer);
     }
-    long count = snd_pcm_readi(handle, ptr, len_samples);
-    if (count == 0 || count == -EAGAIN) {
-      usleep(1);
-      continue;
+    if (s->linear.ring_buffer.spill)
+      atomic_ringbuffer_spill_maintain(&s->linear.ring_buffer);
+    usleep(SPILL_INTERVAL_US);
+  }
+  return NULL;
+}
+
+// Look at everything the writer added since the last call, unless it got too far ahead. The data is copied to `bounce`
+// (RF_CHUNK bytes) first, and only analyzed if the writer didn't get to it while copying.
+static void stream_analyze(struct stream_state* stream, uint8_t* bounce) {
+  struct atomic_ringbuffer* buf = &stream->ring_buffer;
+  const size_t written = buf->written;
+  if (written - stream->rf_pos > buf->buf_size / 4) {
+    stream->rf.skipped += written - stream->rf_pos;
+    stream->rf_pos = written;
+  }
+  while (stream->rf_pos < written) {
+    size_t len = atomic_ringbuffer_get_read_size_at(buf, stream->rf_pos);
+    if (len > RF_CHUNK)
+      len = RF_CHUNK;
+    if (!atomic_ringbuffer_peek_begin(buf, stream->rf_pos)) {
+      stream->rf.skipped += written - stream->rf_pos;
+      stream->rf_pos = written;
+      break;
     }
-    if (count < 0) {
-      fprintf(stderr, "snd_pcm_readi failed: %s\n", snd_strerror((int)count));
+    memcpy(bounce, atomic_ringbuffer_get_read_ptr_at(buf, stream->rf_pos), len);
+    if (!atomic_ringbuffer_peek_end(buf, stream->rf_pos)) {
+      stream->rf.skipped += buf->written - stream->rf_pos;
+      stream->rf_pos = buf->written;
       break;
     }
+    rf_stats_add(&stream->rf, bounce, len);
+    stream->rf_pos += len;
+  }
+}
 
-    atomic_ringbuffer_advance_written(buf, snd_pcm_frames_to_bytes(handle, count));
+// Keeps the RF statistics of the cxadc streams, reading behind the writers without holding them back.
+void* rf_thread(void* arg) {
+  struct session* s = arg;
+  enum capture_state state;
+  while ((state = s->cap_state) == State_Starting || state == State_Armed)
+    capture_state_wait(s, state);
+  uint8_t* bounce = malloc(RF_CHUNK);
+  if (!bounce) {
+    fprintf(stderr, "failed to allocate rf buffer\n");
+    return NULL;
+  }
+  while (s->cap_state == State_Running) {
+    for (size_t i = 0; i < s->cxadc_count; ++i)
+      stream_analyze(&s->cxadc[i], bounce);
+    usleep(RF_INTERVAL_US);
   }
-  snd_pcm_drop(handle);
-  snd_pcm_close(handle);
+  free(bounce);
   return NULL;
 }
 
-void file_stop(int fd, int argc, char** argv) {
-  (void)argc;
-  (void)argv;
+void file_stop(int fd, struct http_head* head, int argc, char** argv) {
+  if (!http_send_head(fd, head, -1))
+    return;
+  char errstr[256];
+  char escaped[1024];
+  struct session* s = session_find(argc, argv, false, errstr, sizeof(errstr) - 1);
+  if (!s) {
+    dprintf(fd, "{\"fail_reason\": \"%s\"}", json_escape(escaped, sizeof(escaped), errstr));
+    return;
+  }
+
+  // also give the pooled ring buffers back to the system
+  bool release = false;
+  for (int i = 0; i < argc; ++i) {
+    if (0 == strcmp(argv[i], "release"))
+      release = true;
+  }
+
+  // an armed capture is stopped without ever running
   enum capture_state expected = State_Running;
-  if (!atomic_compare_exchange_strong(&g_state.cap_state, &expected, State_Stopping)) {
+  if (
+    !atomic_compare_exchange_strong(&s->cap_state, &expected, State_Stopping) &&
+    (expected != State_Armed || !atomic_compare_exchange_strong(&s->cap_state, &expected, State_Stopping))
+  ) {
+    if (release && expected == State_Idle)
+      atomic_ringbuffer_pool_release();
     dprintf(fd, "{\"state\": \"%s\"}", capture_state_to_str(expected));
     return;
   }
+  capture_state_notify(s);
+
+  for (size_t i = 0; i < s->cxadc_count; ++i)
+    pthread_join(s->cxadc[i].writer_thread, NULL);
+
+  pthread_join(s->linear.writer_thread, NULL);
+
+  if (s->spill_thread) {
+    pthread_join(s->spill_thread, NULL);
+    s->spill_thread = 0;
+  }
+  if (s->rf_thread) {
+    pthread_join(s->rf_thread, NULL);
+    s->rf_thread = 0;
+  }
 
-  for (size_t i = 0; i < g_state.cxadc_count; ++i)
-    pthread_join(g_state.cxadc[i].writer_thread, NULL);
+  stream_unretain(&s->linear);
+  for (size_t i = 0; i < s->cxadc_count; ++i)
+    stream_unretain(&s->cxadc[i]);
 
-  pthread_join(g_state.linear.writer_thread, NULL);
+  // wake up readers sleeping below the watermark, so they can drain the rest
+  for (size_t i = 0; i < s->cxadc_count; ++i)
+    atomic_ringbuffer_wake(&s->cxadc[i].ring_buffer);
+  atomic_ringbuffer_wake(&s->linear.ring_buffer);
 
-  while (g_state.linear.reader_thread)
+  while (!atomic_ringbuffer_close(&s->linear.ring_buffer))
     usleep(100000);
 
-  for (size_t i = 0; i < g_state.cxadc_count; ++i) {
-    while (g_state.cxadc[i].reader_thread)
+  for (size_t i = 0; i < s->cxadc_count; ++i) {
+    while (!atomic_ringbuffer_close(&s->cxadc[i].ring_buffer))
       usleep(100000);
-    atomic_ringbuffer_free(&g_state.cxadc[i].ring_buffer);
-    g_state.cxadc[i].writer_thread = 0;
-    g_state.cxadc[i].reader_thread = 0;
+    atomic_ringbuffer_free(&s->cxadc[i].ring_buffer);
+    s->cxadc[i].writer_thread = 0;
   }
 
-  atomic_ringbuffer_free(&g_state.linear.ring_buffer);
-  g_state.linear.writer_thread = 0;
-  g_state.linear.reader_thread = 0;
+  atomic_ringbuffer_free(&s->linear.ring_buffer);
+  s->linear.writer_thread = 0;
+  memory_unlock(s);
+  if (release)
+    atomic_ringbuffer_pool_release();
+
+  capture_state_set(s, State_Idle);
 
-  g_state.cap_state = State_Idle;
+  dprintf(fd, "{\"state\": \"%s\", \"overflows\": %ld}", capture_state_to_str(State_Idle), s->overflow_counter);
+}
 
-  dprintf(fd, "{\"state\": \"%s\", \"overflows\": %ld}", capture_state_to_str(State_Idle), g_state.overflow_counter);
+void file_sessions(FILE* out, int argc, char** argv) {
+  (void)argc;
+  (void)argv;
+  char errstr[256];
+  session_find(0, NULL, false, errstr, sizeof(errstr) - 1);
+  struct session* sessions[SESSION_MAX];
+  const size_t count = sessions_snapshot(sessions);
+  fprintf(out, "{\"sessions\":[");
+  for (size_t i = 0; i < count; ++i) {
+    const struct session* s = sessions[i];
+    const enum capture_state state = s->cap_state;
+    const bool capturing = state == State_Armed || state == State_Running || state == State_Stopping;
+    fprintf(
+      out,
+      "%s{\"name\":\"%s\",\"state\":\"%s\",\"cxadc\":%zu,\"overflows\":%zu}",
+      i ? "," : "",
+      s->name,
+      capture_state_to_str(state),
+      capturing ? s->cxadc_count : 0,
+      s->overflow_counter
+    );
+  }
+  fprintf(out, "]}");
 }
 
-void file_root(int fd, int argc, char** argv) {
+void file_root(FILE* out, int argc, char** argv) {
   (void)argc;
   (void)argv;
-  dprintf(fd, "Hello World!\n");
+  fprintf(out, "Hello World!\n");
 }
 
-void file_version(int fd, int argc, char** argv) {
+void file_version(FILE* out, int argc, char** argv) {
   (void)argc;
   (void)argv;
-  dprintf(fd, "%s\n", CXADC_VHS_SERVER_VERSION);
+  fprintf(out, "%s\n", CXADC_VHS_SERVER_VERSION);
+}
+
+struct stream_options {
+  enum reader_policy policy;
+  bool zerocopy;
+  bool flac;
+  bool compress;
+  unsigned decimate;
+  // channels to pick out of the interleaved frames, all if none
+  unsigned channels[DEINTERLEAVE_MAX_CHANNELS];
+  unsigned channel_count;
+  // sample format to reduce to, SND_PCM_FORMAT_UNKNOWN to keep it
+  snd_pcm_format_t format;
+  // resample the linear stream to the clock of the first card
+  bool resample;
+  // resume at this stream position, only for the plain stream
+  bool resume;
+  size_t offset;
+  // sent once the client's reader is added, see stream_add_client
+  struct http_head* head;
+};
+
+// Add the reader of a streaming client and send the response head with the stream position it starts at. Returns NULL
+// if there's no free slot, the data to resume from is gone, or the offset is not at a frame, and the client gets an
+// error instead.
+static struct atomic_ringbuffer_reader* stream_add_client(struct stream_state* stream, int fd, const struct stream_options* options) {
+  struct atomic_ringbuffer* buf = &stream->ring_buffer;
+  struct atomic_ringbuffer_reader* reader = options->resume
+    ? atomic_ringbuffer_add_reader_at(buf, options->policy, options->offset, stream->source.frame_size)
+    : atomic_ringbuffer_add_reader(buf, options->policy);
+  if (reader && !http_send_head(fd, options->head, (long long)reader->read)) {
+    atomic_ringbuffer_remove_reader(buf, reader);
+    return NULL;
+  }
+  return reader;
 }
 
-void pump_ringbuffer_to_fd(int fd, struct atomic_ringbuffer* buf, _Atomic pthread_t* pt) {
-  pthread_t expected = 0;
-  if (!atomic_compare_exchange_strong(pt, &expected, pthread_self())) {
+// bytes per write of a lossy reader, which sends from a copy
+#define LOSSY_CHUNK (1u << 20)
+
+void pump_ringbuffer_to_fd(int fd, struct stream_state* stream, const struct stream_options* options) {
+  struct session* s = stream->session;
+  struct atomic_ringbuffer* buf = &stream->ring_buffer;
+  enum capture_state state;
+  while ((state = s->cap_state) != State_Running && state != State_Stopping)
+    capture_state_wait(s, state);
+
+  bool zerocopy = options->zerocopy;
+  struct atomic_ringbuffer_reader* reader = stream_add_client(stream, fd, options);
+  if (!reader)
+    return;
+
+  // A lossy reader can be dropped and written over while sending, so it sends from a copy known to be intact. It never
+  // uses zerocopy, see parse_stream_options.
+  uint8_t* bounce = NULL;
+  if (options->policy == Reader_Lossy && !(bounce = malloc(LOSSY_CHUNK))) {
+    atomic_ringbuffer_remove_reader(buf, reader);
     return;
   }
-  while (g_state.cap_state != State_Running && g_state.cap_state != State_Stopping)
-    usleep(1);
 
-  while (g_state.cap_state == State_Running || g_state.cap_state == State_Stopping) {
-    void* ptr = atomic_ringbuffer_get_read_ptr(buf);
-    size_t len = atomic_ringbuffer_get_read_size(buf);
+  // with zerocopy, `pos` is what we sent and `read` is what the kernel no longer references
+  size_t pos = reader->read;
+  struct zerocopy_sender zc;
+  if (zerocopy && !zerocopy_init(&zc, fd, pos)) {
+    fprintf(stderr, "zerocopy not supported on this socket, falling back to copying\n");
+    zerocopy = false;
+  }
+
+  while (s->cap_state == State_Running || s->cap_state == State_Stopping) {
+    if (reader->state != ReaderState_Active) {
+      fprintf(stderr, "reader too slow, dropped\n");
+      break;
+    }
+
+    if (zerocopy) {
+      const size_t released = zerocopy_reap(&zc, zerocopy_pending(&zc) == ZEROCOPY_MAX_PENDING ? 100 : 0);
+      atomic_ringbuffer_advance_read(buf, reader, released - reader->read);
+      if (zc.copied) {
+        // the kernel copies anyway, so just do it ourselves and skip the completion overhead
+        atomic_ringbuffer_advance_read(buf, reader, zerocopy_drain(&zc) - reader->read);
+        zerocopy = false;
+        continue;
+      }
+      if (zerocopy_pending(&zc) == ZEROCOPY_MAX_PENDING)
+        continue;
+    }
+
+    size_t len = atomic_ringbuffer_get_read_size_at(buf, pos);
+    if (len < reader->watermark && s->cap_state == State_Running) {
+      stream_wait_read(stream, reader, pos, 50);
+      len = atomic_ringbuffer_get_read_size_at(buf, pos);
+    }
     if (len == 0) {
-      if (g_state.cap_state == State_Stopping)
+      if (s->cap_state == State_Stopping)
         break;
-      usleep(1);
       continue;
     }
-    ssize_t count = write(fd, ptr, len);
+    void* ptr = atomic_ringbuffer_get_read_ptr_at(buf, pos);
+    if (bounce) {
+      len = len < LOSSY_CHUNK ? len : LOSSY_CHUNK;
+      memcpy(bounce, ptr, len);
+      if (!atomic_ringbuffer_reader_intact(reader)) {
+        fprintf(stderr, "reader too slow, dropped\n");
+        break;
+      }
+      ptr = bounce;
+    }
+    const ssize_t write_start_ns = monotonic_nanos();
+    ssize_t count = zerocopy ? zerocopy_send(&zc, ptr, len, pos) : write(fd, ptr, len);
+    histogram_add(&stream->metrics.client_write_ns, monotonic_nanos() - write_start_ns);
     if (count == 0) {
       usleep(1);
       continue;
     }
     if (count < 0) {
+      if (zerocopy && errno == ENOBUFS) {
+        // out of option memory for the notifications, wait for some to complete
+        zerocopy_reap(&zc, 100);
+        continue;
+      }
+      fprintf(stderr, "write failed: %s\n", sys_errlist[errno]);
+      break;
+    }
+
+    pos += count;
+    if (!zerocopy)
+      atomic_ringbuffer_advance_read(buf, reader, pos - reader->read);
+  }
+
+  if (zerocopy)
+    atomic_ringbuffer_advance_read(buf, reader, zerocopy_drain(&zc) - reader->read);
+
+  atomic_ringbuffer_remove_reader(buf, reader);
+  free(bounce);
+}
+
+// common options of the streaming endpoints
+// Blocks per encoding job. Jobs are smaller when less data is available.
+#define FLAC_JOB_BLOCKS 64
+#define FLAC_MAX_JOBS   32
+
+// Shared by the encoding clients, and stopped when the last of them is gone.
+static struct workpool g_workpool;
+static size_t g_workpool_users;
+static pthread_mutex_t g_workpool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct workpool* workpool_acquire(void) {
+  pthread_mutex_lock(&g_workpool_lock);
+  const bool ok = g_workpool_users > 0 || workpool_init(&g_workpool, 0);
+  if (ok)
+    ++g_workpool_users;
+  pthread_mutex_unlock(&g_workpool_lock);
+  return ok ? &g_workpool : NULL;
+}
+
+// The jobs of the caller must be done.
+static void workpool_release(void) {
+  pthread_mutex_lock(&g_workpool_lock);
+  if (--g_workpool_users == 0)
+    workpool_free(&g_workpool);
+  pthread_mutex_unlock(&g_workpool_lock);
+}
+
+static bool write_all(int fd, const uint8_t* buf, size_t len) {
+  while (len) {
+    const ssize_t count = write(fd, buf, len);
+    if (count < 0) {
+      if (errno == EINTR)
+        continue;
       fprintf(stderr, "write failed: %s\n", sys_errlist[errno]);
+      return false;
+    }
+    buf += count;
+    len -= count;
+  }
+  return true;
+}
+
+// write_all, counting the time in the stream metrics
+static bool stream_write_all(struct stream_state* stream, int fd, const uint8_t* buf, size_t len) {
+  const ssize_t start_ns = monotonic_nanos();
+  const bool ok = write_all(fd, buf, len);
+  histogram_add(&stream->metrics.client_write_ns, monotonic_nanos() - start_ns);
+  return ok;
+}
+
+// A job of a job pipeline, the first member of the job structs of the pumps.
+struct stream_job {
+  struct workpool_job job;
+  // input stream position, and the input bytes used up by this job
+  size_t pos;
+  size_t consumed;
+  uint8_t* out;
+  size_t out_len;
+};
+
+// Encoding pumps run their jobs on the worker pool through this: jobs are submitted in stream order and written out in
+// the same order, and the reader is only moved past the input of a job once its output was sent.
+struct job_pipeline {
+  struct workpool* pool;
+  // job_count jobs of job_size bytes each
+  uint8_t* jobs;
+  size_t job_size;
+  size_t job_count;
+  workpool_fn run;
+  // Set up `job` for the input at job->pos, of which `available` bytes are written. Returns the input bytes it uses
+  // up, or 0 to wait for more.
+  size_t (*prepare)(void* ctx, struct stream_job* job, size_t available, bool running);
+  // optional, called once the output of `job` was sent
+  void (*sent)(void* ctx, const struct stream_job* job);
+  void* ctx;
+};
+
+static struct stream_job* job_pipeline_job(const struct job_pipeline* p, size_t i) {
+  return (struct stream_job*)(p->jobs + i * p->job_size);
+}
+
+// Two jobs per worker thread, so the next ones are ready while the first ones are sent. Returns false with an error
+// logged, the pipeline must be freed either way.
+static bool job_pipeline_init(struct job_pipeline* p, size_t job_size, size_t max_jobs) {
+  p->jobs = NULL;
+  p->job_size = job_size;
+  p->job_count = 0;
+  p->pool = workpool_acquire();
+  if (!p->pool) {
+    fprintf(stderr, "can't create worker threads\n");
+    return false;
+  }
+  p->job_count = 2 * p->pool->thread_count;
+  if (p->job_count > max_jobs)
+    p->job_count = max_jobs;
+  p->jobs = calloc(p->job_count, job_size);
+  if (!p->jobs) {
+    fprintf(stderr, "failed to allocate jobs\n");
+    return false;
+  }
+  return true;
+}
+
+// The buffers of the jobs must be freed before.
+static void job_pipeline_free(struct job_pipeline* p) {
+  if (p->pool)
+    workpool_release();
+  free(p->jobs);
+  p->pool = NULL;
+  p->jobs = NULL;
+}
+
+static void job_pipeline_run(struct job_pipeline* p, int fd, struct stream_state* stream, struct atomic_ringbuffer_reader* reader) {
+  struct session* s = stream->session;
+  struct atomic_ringbuffer* buf = &stream->ring_buffer;
+
+  // `pos` is what we submitted, `read` is what was sent
+  size_t pos = reader->read;
+  size_t head = 0;
+  size_t pending = 0;
+
+  enum capture_state state;
+  while ((state = s->cap_state) == State_Running || state == State_Stopping) {
+    if (reader->state != ReaderState_Active) {
+      fprintf(stderr, "reader too slow, dropped\n");
+      break;
+    }
+
+    struct stream_job* first = job_pipeline_job(p, head);
+    if (pending && workpool_done(&first->job)) {
+      if (!atomic_ringbuffer_reader_intact(reader)) {
+        fprintf(stderr, "reader too slow, dropped\n");
+        break;
+      }
+      if (!stream_write_all(stream, fd, first->out, first->out_len))
+        break;
+      if (p->sent)
+        p->sent(p->ctx, first);
+      atomic_ringbuffer_advance_read(buf, reader, first->pos + first->consumed - reader->read);
+      head = (head + 1) % p->job_count;
+      --pending;
+      continue;
+    }
+
+    if (pending < p->job_count) {
+      struct stream_job* job = job_pipeline_job(p, (head + pending) % p->job_count);
+      job->pos = pos;
+      job->consumed = p->prepare(p->ctx, job, buf->written - pos, state == State_Running);
+      if (job->consumed) {
+        workpool_submit(p->pool, &job->job, p->run);
+        pos += job->consumed;
+        ++pending;
+        continue;
+      }
+    }
+
+    if (pending)
+      workpool_wait(&first->job, 50);
+    else if (state == State_Stopping)
       break;
+    else
+      stream_wait_read(stream, reader, pos, 50);
+  }
+
+  // the jobs reference the ring buffer and the buffers of the pump, so they must finish before it lets go
+  for (; pending; --pending, head = (head + 1) % p->job_count)
+    workpool_wait(&job_pipeline_job(p, head)->job, -1);
+}
+
+struct flac_job {
+  struct stream_job base;
+  const struct flac_encoder* enc;
+  const struct decimator* dec;
+  const struct deinterleaver* di;
+  const struct atomic_ringbuffer* buf;
+  // how many samples to encode from base.pos
+  size_t samples;
+  // input bytes per sample
+  size_t stride;
+  uint32_t first_frame;
+  int32_t* scratch;
+  // for a block wrapping around the end of the ring buffer, or the decimated input
+  uint8_t* bounce;
+  // a deinterleaved block
+  uint8_t* converted;
+};
+
+static void flac_job_run(struct workpool_job* job) {
+  struct flac_job* fj = (struct flac_job*)job;
+  const struct flac_encoder* enc = fj->enc;
+  const uint8_t* ring = fj->buf->buf;
+  const size_t ring_size = fj->buf->buf_size;
+
+  if (fj->dec)
+    decimator_run_ring(fj->dec, ring, ring_size, fj->base.pos, fj->samples, fj->bounce);
+
+  fj->base.out_len = 0;
+  uint32_t frame = fj->first_frame;
+  for (size_t offset = 0; offset < fj->samples; offset += FLAC_BLOCK_SIZE, ++frame) {
+    const size_t samples = fj->samples - offset < FLAC_BLOCK_SIZE ? fj->samples - offset : FLAC_BLOCK_SIZE;
+    const uint8_t* in;
+    if (fj->dec) {
+      in = fj->bounce + offset;
+    } else {
+      const size_t len = samples * fj->stride;
+      const size_t pos = (fj->base.pos + offset * fj->stride) % ring_size;
+      in = ring + pos;
+      if (pos + len > ring_size) {
+        memcpy(fj->bounce, in, ring_size - pos);
+        memcpy(fj->bounce + ring_size - pos, ring, len - (ring_size - pos));
+        in = fj->bounce;
+      }
+      if (fj->di) {
+        deinterleave(fj->di, in, samples, fj->converted);
+        in = fj->converted;
+      }
     }
+    fj->base.out_len += flac_encode_frame(enc, in, (unsigned)samples, frame, fj->scratch, fj->base.out + fj->base.out_len);
+  }
+}
 
-    atomic_ringbuffer_advance_read(buf, count);
+// Decimation only makes sense for the RF streams.
+static bool decimator_setup(struct decimator* dec, const struct source* src, unsigned factor) {
+  if (src->format != SND_PCM_FORMAT_U8 || src->channels != 1) {
+    fprintf(stderr, "decimation needs a single channel u8 stream\n");
+    return false;
+  }
+  if (!decimator_init(dec, factor, DecimatorKernel_Auto)) {
+    fprintf(stderr, "can't decimate by %u\n", factor);
+    return false;
   }
+  return true;
+}
+
+static bool deinterleaver_setup(struct deinterleaver* di, const struct source* src, const struct stream_options* options, char* errstr, size_t errstr_size) {
+  unsigned all[DEINTERLEAVE_MAX_CHANNELS];
+  for (unsigned c = 0; c < DEINTERLEAVE_MAX_CHANNELS; ++c)
+    all[c] = c;
+  const unsigned* channels = options->channel_count ? options->channels : all;
+  const unsigned count = options->channel_count ? options->channel_count : src->channels;
+  return deinterleaver_init(di, src->format, src->channels, channels, count, options->format, errstr, errstr_size);
+}
+
+struct flac_pipeline {
+  const struct decimator* dec;
+  // input bytes per encoded sample
+  size_t stride;
+  size_t job_samples;
+  size_t min_job_samples;
+  uint32_t frame;
+};
 
-  *pt = 0;
+static size_t flac_job_prepare(void* ctx, struct stream_job* job, size_t available, bool running) {
+  struct flac_pipeline* fp = ctx;
+  struct flac_job* fj = (struct flac_job*)job;
+  size_t samples = fp->dec ? decimator_outputs(fp->dec, available) : available / fp->stride;
+  if (samples > fp->job_samples)
+    samples = fp->job_samples;
+  if (running)
+    samples = samples < fp->min_job_samples ? 0 : samples - samples % FLAC_BLOCK_SIZE;
+  fj->samples = samples;
+  fj->first_frame = fp->frame;
+  fp->frame += (uint32_t)((samples + FLAC_BLOCK_SIZE - 1) / FLAC_BLOCK_SIZE);
+  return samples * fp->stride;
 }
 
-void file_cxadc(int fd, int argc, char** argv) {
-  if (argc != 1)
+// Encode the stream to FLAC on the worker pool, see job_pipeline.
+void pump_flac_to_fd(int fd, struct stream_state* stream, const struct stream_options* options) {
+  struct session* s = stream->session;
+
+  enum capture_state state;
+  while ((state = s->cap_state) != State_Running && state != State_Stopping)
+    capture_state_wait(s, state);
+
+  const struct source* src = &stream->source;
+  char errstr[256];
+  struct decimator dec = {0};
+  if (options->decimate > 1 && !decimator_setup(&dec, src, options->decimate))
+    return;
+  struct deinterleaver di;
+  const bool convert = options->channel_count || options->format != SND_PCM_FORMAT_UNKNOWN;
+  if (convert && !deinterleaver_setup(&di, src, options, errstr, sizeof(errstr) - 1)) {
+    fprintf(stderr, "%s\n", errstr);
+    decimator_free(&dec);
+    return;
+  }
+
+  struct flac_encoder enc;
+  const unsigned rate = src->rate / (options->decimate > 1 ? options->decimate : 1);
+  const bool enc_ok = convert ? flac_encoder_init(&enc, di.out_format, di.out_channels, rate, errstr, sizeof(errstr) - 1)
+                              : flac_encoder_init(&enc, src->format, src->channels, rate, errstr, sizeof(errstr) - 1);
+  if (!enc_ok) {
+    fprintf(stderr, "%s\n", errstr);
+    decimator_free(&dec);
     return;
-  unsigned id;
-  if (1 != sscanf(argv[0], "%u", &id) || id >= 256)
+  }
+
+  struct atomic_ringbuffer_reader* reader = stream_add_client(stream, fd, options);
+  if (!reader) {
+    decimator_free(&dec);
     return;
-  pump_ringbuffer_to_fd(fd, &g_state.cxadc[id].ring_buffer, &g_state.cxadc[id].reader_thread);
+  }
+
+  struct flac_pipeline fp = {dec.coeffs ? &dec : NULL, 0, FLAC_JOB_BLOCKS * FLAC_BLOCK_SIZE, 0, 0};
+  fp.stride = dec.coeffs ? dec.factor : convert ? di.in_frame : enc.frame_size;
+  // don't bother the pool with tiny jobs while more data is coming anyway
+  fp.min_job_samples = reader->watermark / fp.stride;
+  fp.min_job_samples -= fp.min_job_samples % FLAC_BLOCK_SIZE;
+  if (fp.min_job_samples < FLAC_BLOCK_SIZE)
+    fp.min_job_samples = FLAC_BLOCK_SIZE;
+
+  struct job_pipeline p = {.run = flac_job_run, .prepare = flac_job_prepare, .ctx = &fp};
+  bool ok = job_pipeline_init(&p, sizeof(struct flac_job), FLAC_MAX_JOBS);
+  for (size_t i = 0; ok && i < p.job_count; ++i) {
+    struct flac_job* job = (struct flac_job*)job_pipeline_job(&p, i);
+    job->enc = &enc;
+    job->dec = fp.dec;
+    job->di = convert ? &di : NULL;
+    job->buf = &stream->ring_buffer;
+    job->stride = fp.stride;
+    job->base.out = malloc(FLAC_JOB_BLOCKS * flac_encoder_max_frame_size(&enc));
+    job->scratch = malloc(flac_encoder_scratch_size(&enc) * sizeof(int32_t));
+    job->bounce = malloc(dec.coeffs ? fp.job_samples : FLAC_BLOCK_SIZE * fp.stride);
+    job->converted = convert ? malloc(FLAC_BLOCK_SIZE * enc.frame_size) : NULL;
+    ok = job->base.out && job->scratch && job->bounce && (job->converted || !convert);
+    if (!ok)
+      fprintf(stderr, "failed to allocate flac buffers\n");
+  }
+
+  uint8_t header[FLAC_HEADER_SIZE];
+  if (ok && write_all(fd, header, flac_encoder_header(&enc, header)))
+    job_pipeline_run(&p, fd, stream, reader);
+
+  atomic_ringbuffer_remove_reader(&stream->ring_buffer, reader);
+  for (size_t i = 0; p.jobs && i < p.job_count; ++i) {
+    struct flac_job* job = (struct flac_job*)job_pipeline_job(&p, i);
+    free(job->base.out);
+    free(job->scratch);
+    free(job->bounce);
+    free(job->converted);
+  }
+  job_pipeline_free(&p);
+  decimator_free(&dec);
 }
 
-void file_linear(int fd, int argc, char** argv) {
-  (void)argc;
-  (void)argv;
-  pump_ringbuffer_to_fd(fd, &g_state.linear.ring_buffer, &g_state.linear.reader_thread);
+// Stream bytes per compression job, rounded down to whole frames. Jobs are smaller when less data is available.
+#define RICE_JOB_SIZE RICE_MAX_FRAME
+#define RICE_MAX_JOBS 32
+
+struct rice_job {
+  struct stream_job base;
+  const struct atomic_ringbuffer* buf;
+  unsigned stride;
+  uint32_t sequence;
+};
+
+static void rice_job_run(struct workpool_job* job) {
+  struct rice_job* rj = (struct rice_job*)job;
+  const uint8_t* ring = rj->buf->buf;
+  const size_t ring_size = rj->buf->buf_size;
+  const size_t len = rj->base.consumed;
+  const size_t pos = rj->base.pos % ring_size;
+  const size_t first = len < ring_size - pos ? len : ring_size - pos;
+  rj->base.out_len = rice_encode_frame(ring + pos, first, ring, len - first, rj->stride, rj->sequence, rj->base.out);
 }
 
-void file_stats(int fd, int argc, char** argv) {
-  const enum capture_state state = g_state.cap_state;
-  if (state != State_Running) {
-    dprintf(fd, "{\"state\":\"%s\"}", capture_state_to_str(state));
-  } else {
-    size_t linear_read, linear_written, linear_difference;
-    atomic_ringbuffer_get_stats(&g_state.linear.ring_buffer, &linear_read, &linear_written, &linear_difference);
-    dprintf(
-      fd,
-      "{\"state\":\"%s\",\"overflows\":%zu,\"linear\":{\"read\":%zu,\"written\":%zu,\"difference\":%zu,\"difference_pct\":%zu},\"cxadc\":[",
-      capture_state_to_str(state),
-      g_state.overflow_counter,
-      linear_read,
-      linear_written,
-      linear_difference,
-      linear_difference * 100 / g_state.linear.ring_buffer.buf_size
-    );
-    for (size_t i = 0; i < g_state.cxadc_count; ++i) {
-      size_t read, written, difference;
-      atomic_ringbuffer_get_stats(&g_state.cxadc[i].ring_buffer, &read, &written, &difference);
-      if (i != 0)
-        dprintf(fd, ",");
-      dprintf(
-        fd,
-        "{\"read\":%zu,\"written\":%zu,\"difference\":%zu,\"difference_pct\":%zu}",
-        read,
-        written,
-        difference,
-        difference * 100 / g_state.cxadc[i].ring_buffer.buf_size
-      );
+struct rice_pipeline {
+  struct stream_state* stream;
+  size_t job_size;
+  size_t min_job_size;
+  uint32_t sequence;
+};
+
+static size_t rice_job_prepare(void* ctx, struct stream_job* job, size_t available, bool running) {
+  struct rice_pipeline* rp = ctx;
+  // the ring buffer holds whole frames
+  const size_t len = available < rp->job_size ? available : rp->job_size;
+  if (!len || (running && len < rp->min_job_size))
+    return 0;
+  ((struct rice_job*)job)->sequence = rp->sequence++;
+  return len;
+}
+
+static void rice_job_sent(void* ctx, const struct stream_job* job) {
+  struct rice_pipeline* rp = ctx;
+  rp->stream->metrics.compress_in += job->consumed;
+  rp->stream->metrics.compress_out += job->out_len;
+}
+
+// Compress the plain stream in independent frames on the worker pool, see job_pipeline.
+void pump_rice_to_fd(int fd, struct stream_state* stream, const struct stream_options* options) {
+  struct session* s = stream->session;
+
+  enum capture_state state;
+  while ((state = s->cap_state) != State_Running && state != State_Stopping)
+    capture_state_wait(s, state);
+
+  const size_t stride = stream->source.frame_size;
+  if (stride == 0 || stride > RICE_MAX_STRIDE) {
+    fprintf(stderr, "can't compress frames of %zu bytes\n", stride);
+    return;
+  }
+  struct atomic_ringbuffer_reader* reader = stream_add_client(stream, fd, options);
+  if (!reader)
+    return;
+
+  struct rice_pipeline rp = {stream, RICE_JOB_SIZE - RICE_JOB_SIZE % stride, 0, 0};
+  // don't bother the pool with tiny jobs while more data is coming anyway
+  rp.min_job_size = reader->watermark - reader->watermark % stride;
+  if (rp.min_job_size < stride)
+    rp.min_job_size = stride;
+
+  struct job_pipeline p = {.run = rice_job_run, .prepare = rice_job_prepare, .sent = rice_job_sent, .ctx = &rp};
+  bool ok = job_pipeline_init(&p, sizeof(struct rice_job), RICE_MAX_JOBS);
+  for (size_t i = 0; ok && i < p.job_count; ++i) {
+    struct rice_job* job = (struct rice_job*)job_pipeline_job(&p, i);
+    job->buf = &stream->ring_buffer;
+    job->stride = (unsigned)stride;
+    job->base.out = malloc(rice_max_frame_size(rp.job_size));
+    ok = job->base.out != NULL;
+    if (!ok)
+      fprintf(stderr, "failed to allocate compression buffers\n");
+  }
+  if (ok)
+    job_pipeline_run(&p, fd, stream, reader);
+
+  atomic_ringbuffer_remove_reader(&stream->ring_buffer, reader);
+  for (size_t i = 0; p.jobs && i < p.job_count; ++i)
+    free(job_pipeline_job(&p, i)->out);
+  job_pipeline_free(&p);
+}
+
+// frames per write when deinterleaving
+#define DEINTERLEAVE_CHUNK 4096
+
+void pump_deinterleaved_to_fd(int fd, struct stream_state* stream, const struct stream_options* options) {
+  struct session* s = stream->session;
+  struct atomic_ringbuffer* buf = &stream->ring_buffer;
+
+  enum capture_state state;
+  while ((state = s->cap_state) != State_Running && state != State_Stopping)
+    capture_state_wait(s, state);
+
+  char errstr[256];
+  struct deinterleaver di;
+  if (!deinterleaver_setup(&di, &stream->source, options, errstr, sizeof(errstr) - 1)) {
+    fprintf(stderr, "%s\n", errstr);
+    return;
+  }
+  uint8_t* out = malloc(DEINTERLEAVE_CHUNK * di.out_frame);
+  struct atomic_ringbuffer_reader* reader = out ? stream_add_client(stream, fd, options) : NULL;
+  if (!reader) {
+    free(out);
+    return;
+  }
+
+  while ((state = s->cap_state) == State_Running || state == State_Stopping) {
+    if (reader->state != ReaderState_Active) {
+      fprintf(stderr, "reader too slow, dropped\n");
+      break;
+    }
+
+    size_t len = atomic_ringbuffer_get_read_size(buf, reader);
+    if (len < reader->watermark && state == State_Running) {
+      stream_wait_read(stream, reader, reader->read, 50);
+      len = atomic_ringbuffer_get_read_size(buf, reader);
+    }
+    // the ring buffer holds whole frames, so they never wrap around
+    size_t frames = len / di.in_frame;
+    if (frames > DEINTERLEAVE_CHUNK)
+      frames = DEINTERLEAVE_CHUNK;
+    if (frames == 0) {
+      if (state == State_Stopping)
+        break;
+      continue;
+    }
+
+    deinterleave(&di, atomic_ringbuffer_get_read_ptr(buf, reader), frames, out);
+    if (!atomic_ringbuffer_reader_intact(reader)) {
+      fprintf(stderr, "reader too slow, dropped\n");
+      break;
     }
-    dprintf(fd, "]}");
+    if (!stream_write_all(stream, fd, out, frames * di.out_frame))
+      break;
+    atomic_ringbuffer_advance_read(buf, reader, frames * di.in_frame);
   }
-  (void)fd;
-  (void)argc;
-  (void)argv;
+
+  atomic_ringbuffer_remove_reader(buf, reader);
+  free(out);
+}
+
+// Resample the linear stream so it has the nominal rate on the first card's clock, instead of on its own, following
+// the drift between the two as estimated from their timestamps. Channels and format are picked afterwards.
+void pump_resampled_to_fd(int fd, struct stream_state* stream, const struct stream_options* options) {
+  struct session* s = stream->session;
+  struct atomic_ringbuffer* buf = &stream->ring_buffer;
+  if (!stream_is_linear(stream)) {
+    fprintf(stderr, "only the linear stream can be resampled\n");
+    return;
+  }
+
+  enum capture_state state;
+  while ((state = s->cap_state) != State_Running && state != State_Stopping)
+    capture_state_wait(s, state);
+  if (s->cxadc_count == 0) {
+    fprintf(stderr, "resampling needs a card to follow\n");
+    return;
+  }
+
+  const struct source* src = &stream->source;
+  struct stream_state* reference = &s->cxadc[0];
+  char errstr[256];
+  struct resampler r;
+  if (!resampler_init(&r, src->format, src->channels, errstr, sizeof(errstr) - 1)) {
+    fprintf(stderr, "%s\n", errstr);
+    return;
+  }
+  struct deinterleaver di;
+  const bool convert = options->channel_count || options->format != SND_PCM_FORMAT_UNKNOWN;
+  if (convert && !deinterleaver_setup(&di, src, options, errstr, sizeof(errstr) - 1)) {
+    fprintf(stderr, "%s\n", errstr);
+    resampler_free(&r);
+    return;
+  }
+  uint8_t* out = malloc(RESAMPLE_MAX_OUT * src->frame_size);
+  uint8_t* converted = convert ? malloc(RESAMPLE_MAX_OUT * di.out_frame) : NULL;
+  struct atomic_ringbuffer_reader* reader = out && (converted || !convert) ? stream_add_client(stream, fd, options) : NULL;
+  if (!reader) {
+    free(out);
+    free(converted);
+    resampler_free(&r);
+    return;
+  }
+
+  while ((state = s->cap_state) == State_Running || state == State_Stopping) {
+    if (reader->state != ReaderState_Active) {
+      fprintf(stderr, "reader too slow, dropped\n");
+      break;
+    }
+
+    size_t len = atomic_ringbuffer_get_read_size(buf, reader);
+    if (len < reader->watermark && state == State_Running) {
+      stream_wait_read(stream, reader, reader->read, 50);
+      len = atomic_ringbuffer_get_read_size(buf, reader);
+    }
+    // the ring buffer holds whole frames, so they never wrap around
+    size_t frames = len / src->frame_size;
+    if (frames > RESAMPLE_CHUNK)
+      frames = RESAMPLE_CHUNK;
+    if (frames == 0) {
+      if (state == State_Stopping)
+        break;
+      continue;
+    }
+
+    // input frames per output frame, 1 until there are estimates
+    double step = 1, rate, linear_recent, cxadc_recent;
+    if (stream_rate(stream, &rate, &linear_recent) && stream_rate(reference, &rate, &cxadc_recent))
+      step = linear_recent * reference->source.rate / ((double)src->rate * cxadc_recent);
+
+    size_t count = resampler_run(&r, atomic_ringbuffer_get_read_ptr(buf, reader), frames, step, out);
+    const uint8_t* data = out;
+    size_t size = count * src->frame_size;
+    if (convert) {
+      deinterleave(&di, out, count, converted);
+      data = converted;
+      size = count * di.out_frame;
+    }
+    if (!atomic_ringbuffer_reader_intact(reader)) {
+      fprintf(stderr, "reader too slow, dropped\n");
+      break;
+    }
+    if (!stream_write_all(stream, fd, data, size))
+      break;
+    atomic_ringbuffer_advance_read(buf, reader, frames * src->frame_size);
+  }
+
+  atomic_ringbuffer_remove_reader(buf, reader);
+  free(out);
+  free(converted);
+  resampler_free(&r);
+}
+
+// outputs per write when decimating
+#define DECIMATE_CHUNK (64u << 10)
+
+void pump_decimated_to_fd(int fd, struct stream_state* stream, const struct stream_options* options) {
+  struct session* s = stream->session;
+  struct atomic_ringbuffer* buf = &stream->ring_buffer;
+
+  enum capture_state state;
+  while ((state = s->cap_state) != State_Running && state != State_Stopping)
+    capture_state_wait(s, state);
+
+  struct decimator dec;
+  if (!decimator_setup(&dec, &stream->source, options->decimate))
+    return;
+  uint8_t* out = malloc(DECIMATE_CHUNK);
+  struct atomic_ringbuffer_reader* reader = out ? stream_add_client(stream, fd, options) : NULL;
+  if (!reader) {
+    free(out);
+    decimator_free(&dec);
+    return;
+  }
+
+  // `pos` is where the window of the next output starts, everything before it can be released
+  size_t pos = reader->read;
+  while ((state = s->cap_state) == State_Running || state == State_Stopping) {
+    if (reader->state != ReaderState_Active) {
+      fprintf(stderr, "reader too slow, dropped\n");
+      break;
+    }
+
+    if (buf->written - pos < reader->watermark && state == State_Running)
+      stream_wait_read(stream, reader, pos, 50);
+    size_t count = decimator_outputs(&dec, buf->written - pos);
+    if (count > DECIMATE_CHUNK)
+      count = DECIMATE_CHUNK;
+    if (count == 0) {
+      if (state == State_Stopping)
+        break;
+      continue;
+    }
+
+    decimator_run_ring(&dec, buf->buf, buf->buf_size, pos, count, out);
+    if (!atomic_ringbuffer_reader_intact(reader)) {
+      fprintf(stderr, "reader too slow, dropped\n");
+      break;
+    }
+    if (!stream_write_all(stream, fd, out, count))
+      break;
+    pos += count * dec.factor;
+    atomic_ringbuffer_advance_read(buf, reader, pos - reader->read);
+  }
+
+  atomic_ringbuffer_remove_reader(buf, reader);
+  free(out);
+  decimator_free(&dec);
+}
+
+static bool stream_options_transform(const struct stream_options* options) {
+  return options->flac || options->compress || options->resample || options->decimate > 1 || options->channel_count || options->format != SND_PCM_FORMAT_UNKNOWN;
+}
+
+static bool parse_stream_options(int argc, char** argv, struct stream_options* options, char* errstr, size_t errstr_size) {
+  for (int i = 0; i < argc; ++i) {
+    if (0 == strcmp(argv[i], "lossy"))
+      options->policy = Reader_Lossy;
+    if (0 == strcmp(argv[i], "zerocopy"))
+      options->zerocopy = true;
+    if (0 == strcmp(argv[i], "codec=flac"))
+      options->flac = true;
+    if (0 == strcmp(argv[i], "compress=rice"))
+      options->compress = true;
+    if (0 == strcmp(argv[i], "resample"))
+      options->resample = true;
+    sscanf(argv[i], "decimate=%u", &options->decimate);
+    if (0 == strncmp(argv[i], "channels=", 9) || 0 == strncmp(argv[i], "channel=", 8)) {
+      options->channel_count = 0;
+      // every item a channel number, no empty ones and nothing after the last
+      bool valid = true;
+      for (const char* p = strchr(argv[i], '=') + 1; valid;) {
+        char* end;
+        const unsigned long channel = strtoul(p, &end, 10);
+        valid = isdigit((unsigned char)*p) && channel < DEINTERLEAVE_MAX_CHANNELS && options->channel_count < DEINTERLEAVE_MAX_CHANNELS;
+        if (!valid)
+          break;
+        options->channels[options->channel_count++] = (unsigned)channel;
+        p = end;
+        if (!*p)
+          break;
+        // commas may arrive urlencoded
+        if (*p == ',')
+          ++p;
+        else if (0 == strncmp(p, "%2C", 3) || 0 == strncmp(p, "%2c", 3))
+          p += 3;
+        else
+          valid = false;
+      }
+      if (!valid) {
+        snprintf(errstr, errstr_size, "invalid channel list %.63s", argv[i]);
+        return false;
+      }
+    }
+    char name[64];
+    if (1 == sscanf(argv[i], "format=%63s", name)) {
+      options->format = snd_pcm_format_value(name);
+      if (options->format == SND_PCM_FORMAT_UNKNOWN) {
+        snprintf(errstr, errstr_size, "unknown format %.63s", name);
+        return false;
+      }
+    }
+    if (1 == sscanf(argv[i], "offset=%zu", &options->offset))
+      options->resume = true;
+  }
+  // a dropped lossy reader is written over right away, but the kernel keeps sending from zerocopy memory
+  if (options->zerocopy && options->policy == Reader_Lossy) {
+    snprintf(errstr, errstr_size, "lossy can't be combined with zerocopy");
+    return false;
+  }
+  // the transforms send from their own buffers, so zerocopy would be silently ignored
+  if (options->zerocopy && stream_options_transform(options)) {
+    snprintf(errstr, errstr_size, "zerocopy only works for the plain stream");
+    return false;
+  }
+  // the offsets are stream positions, which only match the bytes sent for the plain stream
+  if (options->resume && stream_options_transform(options)) {
+    snprintf(errstr, errstr_size, "offset only works for the plain stream");
+    return false;
+  }
+  return true;
+}
+
+static void pump_stream_to_fd(int fd, struct stream_state* stream, const struct stream_options* options) {
+  if (options->flac)
+    pump_flac_to_fd(fd, stream, options);
+  else if (options->compress)
+    pump_rice_to_fd(fd, stream, options);
+  else if (options->resample)
+    pump_resampled_to_fd(fd, stream, options);
+  else if (options->decimate > 1)
+    pump_decimated_to_fd(fd, stream, options);
+  else if (options->channel_count || options->format != SND_PCM_FORMAT_UNKNOWN)
+    pump_deinterleaved_to_fd(fd, stream, options);
+  else
+    pump_ringbuffer_to_fd(fd, stream, options);
+}
+
+void file_cxadc(int fd, struct http_head* head, int argc, char** argv) {
+  if (argc < 1)
+    return;
+  unsigned id;
+  if (1 != sscanf(argv[0], "%u", &id) || id >= 256)
+    return;
+  // clients can queue up before the session is started, once /arm created it
+  char errstr[256];
+  struct session* s = session_find(argc, argv, false, errstr, sizeof(errstr) - 1);
+  if (!s)
+    return;
+  struct stream_options options = {Reader_Blocking, false, false, false, 1, {0}, 0, SND_PCM_FORMAT_UNKNOWN, false, false, 0, head};
+  if (!parse_stream_options(argc - 1, argv + 1, &options, errstr, sizeof(errstr) - 1))
+    return;
+  pump_stream_to_fd(fd, &s->cxadc[id], &options);
+}
+
+void file_linear(int fd, struct http_head* head, int argc, char** argv) {
+  char errstr[256];
+  struct session* s = session_find(argc, argv, false, errstr, sizeof(errstr) - 1);
+  if (!s)
+    return;
+  struct stream_options options = {Reader_Blocking, false, false, false, 1, {0}, 0, SND_PCM_FORMAT_UNKNOWN, false, false, 0, head};
+  if (!parse_stream_options(argc, argv, &options, errstr, sizeof(errstr) - 1))
+    return;
+  pump_stream_to_fd(fd, &s->linear, &options);
+}
+
+// Whether a client can resume the plain stream at `offset`, that is the data from there on is still buffered.
+static bool stream_range(struct stream_state* stream, int argc, char** argv, unsigned long long offset) {
+  struct session* s = stream->session;
+  struct stream_options options = {Reader_Blocking, false, false, false, 1, {0}, 0, SND_PCM_FORMAT_UNKNOWN, false, false, 0, NULL};
+  char errstr[256];
+  if (!parse_stream_options(argc, argv, &options, errstr, sizeof(errstr) - 1))
+    return false;
+  const enum capture_state state = s->cap_state;
+  if ((state != State_Armed && state != State_Running && state != State_Stopping) || stream_options_transform(&options))
+    return false;
+  const struct atomic_ringbuffer* buf = &stream->ring_buffer;
+  return buf->buf && offset >= buf->read && offset <= buf->written && offset % stream->source.frame_size == 0;
+}
+
+bool cxadc_range(int argc, char** argv, unsigned long long offset) {
+  struct session* s = session_lookup(NULL, argc, argv);
+  unsigned id;
+  if (!s || argc < 1 || 1 != sscanf(argv[0], "%u", &id) || id >= s->cxadc_count)
+    return false;
+  return stream_range(&s->cxadc[id], argc - 1, argv + 1, offset);
+}
+
+bool linear_range(int argc, char** argv, unsigned long long offset) {
+  struct session* s = session_lookup(NULL, argc, argv);
+  return s && stream_range(&s->linear, argc, argv, offset);
+}
+
+bool cxadc_check(int argc, char** argv, char* errstr, size_t errstr_size) {
+  unsigned id;
+  if (argc < 1 || 1 != sscanf(argv[0], "%u", &id) || id >= 256) {
+    snprintf(errstr, errstr_size, "no card given, use /cxadc?<card>");
+    return false;
+  }
+  struct stream_options options = {Reader_Blocking, false, false, false, 1, {0}, 0, SND_PCM_FORMAT_UNKNOWN, false, false, 0, NULL};
+  if (!parse_stream_options(argc - 1, argv + 1, &options, errstr, errstr_size))
+    return false;
+  if (options.decimate == 0 || options.decimate > DECIMATOR_MAX_FACTOR) {
+    snprintf(errstr, errstr_size, "decimate needs a factor from 1 to %u", DECIMATOR_MAX_FACTOR);
+    return false;
+  }
+  // the decimator reads the u8 samples of the card, and only the FLAC encoder takes its output
+  if (options.decimate > 1 && (options.compress || options.resample || options.channel_count || options.format != SND_PCM_FORMAT_UNKNOWN)) {
+    snprintf(errstr, errstr_size, "decimate can only be combined with codec=flac");
+    return false;
+  }
+  // a stream doesn't create its session, so a typo in the name fails instead of waiting for a capture that never comes
+  if (!session_find(argc, argv, false, errstr, errstr_size))
+    return false;
+  // as for a Range header, so the client learns why instead of getting nothing once the handler runs
+  if (options.resume && !cxadc_range(argc, argv, options.offset)) {
+    snprintf(errstr, errstr_size, "offset %zu is not buffered, or not at the start of a frame", options.offset);
+    return false;
+  }
+  return true;
+}
+
+bool linear_check(int argc, char** argv, char* errstr, size_t errstr_size) {
+  struct stream_options options = {Reader_Blocking, false, false, false, 1, {0}, 0, SND_PCM_FORMAT_UNKNOWN, false, false, 0, NULL};
+  if (!parse_stream_options(argc, argv, &options, errstr, errstr_size))
+    return false;
+  if (options.decimate != 1) {
+    snprintf(errstr, errstr_size, "decimate is only for the u8 streams of /cxadc");
+    return false;
+  }
+  if (!session_find(argc, argv, false, errstr, errstr_size))
+    return false;
+  if (options.resume && !linear_range(argc, argv, options.offset)) {
+    snprintf(errstr, errstr_size, "offset %zu is not buffered, or not at the start of a frame", options.offset);
+    return false;
+  }
+  return true;
+}
+
+// limits of /preview, so a line stays small and a window well within the ring buffer
+#define PREVIEW_MAX_BINS     4096
+#define PREVIEW_MAX_BLOCK    (1u << 20)
+// in ms, the thread only notices a client that went away when it sends the next line
+#define PREVIEW_MAX_INTERVAL 60000
+
+// Add `frames` frames from `pos` on to the envelope. The cxadc data are U8 samples, wrapping around the ring buffer end
+// anywhere. The linear frames never wrap, the chosen channel is converted to S16 in `scratch` first.
+static void preview_block(struct atomic_ringbuffer* buf, const struct deinterleaver* di, int16_t* scratch, size_t pos, size_t frames, struct envelope* e) {
+  const size_t frame_size = di ? di->in_frame : 1;
+  while (frames) {
+    size_t count = (buf->buf_size - pos % buf->buf_size) / frame_size;
+    if (count > frames)
+      count = frames;
+    if (di) {
+      count = count < DEINTERLEAVE_CHUNK ? count : DEINTERLEAVE_CHUNK;
+      deinterleave(di, atomic_ringbuffer_get_read_ptr_at(buf, pos), count, (uint8_t*)scratch);
+      envelope_add_s16(e, scratch, count);
+    } else {
+      envelope_add_u8(e, atomic_ringbuffer_get_read_ptr_at(buf, pos), count);
+    }
+    pos += count * frame_size;
+    frames -= count;
+  }
+}
+
+struct preview_options {
+  bool linear;
+  unsigned cxadc;
+  unsigned bins;
+  unsigned block;
+  unsigned interval;
+  unsigned channel;
+};
+
+static bool parse_preview_options(int argc, char** argv, struct preview_options* options, char* errstr, size_t errstr_size) {
+  *options = (struct preview_options){false, 0, 128, 4096, 200, 0};
+  for (int i = 0; i < argc; ++i) {
+    if (0 == strcmp(argv[i], "stream=linear"))
+      options->linear = true;
+    else if (0 == strncmp(argv[i], "stream=", 7) && 1 != sscanf(argv[i], "stream=cxadc%u", &options->cxadc)) {
+      snprintf(errstr, errstr_size, "unknown stream %.32s, use linear or cxadc<N>", argv[i] + 7);
+      return false;
+    }
+    sscanf(argv[i], "bins=%u", &options->bins);
+    sscanf(argv[i], "block=%u", &options->block);
+    sscanf(argv[i], "interval=%u", &options->interval);
+    sscanf(argv[i], "channel=%u", &options->channel);
+  }
+  if (options->bins < 1 || options->bins > PREVIEW_MAX_BINS) {
+    snprintf(errstr, errstr_size, "bins must be from 1 to %u", PREVIEW_MAX_BINS);
+    return false;
+  }
+  if (options->block < 1 || options->block > PREVIEW_MAX_BLOCK) {
+    snprintf(errstr, errstr_size, "block must be from 1 to %u", PREVIEW_MAX_BLOCK);
+    return false;
+  }
+  if (options->interval < 10 || options->interval > PREVIEW_MAX_INTERVAL) {
+    snprintf(errstr, errstr_size, "interval must be from 10 to %u ms", PREVIEW_MAX_INTERVAL);
+    return false;
+  }
+  return true;
+}
+
+bool preview_check(int argc, char** argv, char* errstr, size_t errstr_size) {
+  struct preview_options options;
+  return parse_preview_options(argc, argv, &options, errstr, errstr_size) && session_find(argc, argv, false, errstr, errstr_size) != NULL;
+}
+
+// Min, max and RMS of the latest `bins` blocks of `block` samples, as a JSON line every `interval` ms. Reads the ring
+// buffer without being a reader of the stream, so it can't slow down the capture or anyone else. What only shows once
+// the capture runs fails with a line with the fail_reason.
+void file_preview(int fd, struct http_head* head, int argc, char** argv) {
+  struct preview_options options;
+  char errstr[256];
+  char escaped[1024];
+  if (!parse_preview_options(argc, argv, &options, errstr, sizeof(errstr) - 1) || !http_send_head(fd, head, -1))
+    return;
+  const bool linear = options.linear;
+  const unsigned bins = options.bins, block = options.block, interval = options.interval;
+  struct session* s = session_find(argc, argv, false, errstr, sizeof(errstr) - 1);
+  if (!s) {
+    dprintf(fd, "{\"fail_reason\": \"%s\"}\n", json_escape(escaped, sizeof(escaped), errstr));
+    return;
+  }
+
+  enum capture_state state;
+  while ((state = s->cap_state) != State_Running && state != State_Stopping)
+    capture_state_wait(s, state);
+  if (!linear && options.cxadc >= s->cxadc_count) {
+    dprintf(fd, "{\"fail_reason\": \"cxadc%u is not captured\"}\n", options.cxadc);
+    return;
+  }
+
+  struct stream_state* stream = linear ? &s->linear : &s->cxadc[options.cxadc];
+  struct atomic_ringbuffer* buf = &stream->ring_buffer;
+  const struct source* src = &stream->source;
+
+  struct deinterleaver di;
+  if (linear && !deinterleaver_init(&di, src->format, src->channels, &options.channel, 1, SND_PCM_FORMAT_S16_LE, errstr, sizeof(errstr) - 1)) {
+    dprintf(fd, "{\"fail_reason\": \"%s\"}\n", json_escape(escaped, sizeof(escaped), errstr));
+    return;
+  }
+  const size_t frame_size = linear ? di.in_frame : 1;
+  const size_t window = (size_t)bins * block * frame_size;
+  if (window > buf->buf_size / 4) {
+    dprintf(fd, "{\"fail_reason\": \"bins times block is more than a quarter of the ring buffer\"}\n");
+    return;
+  }
+
+  struct envelope* envelopes = malloc(bins * sizeof(*envelopes));
+  int16_t* scratch = malloc(DEINTERLEAVE_CHUNK * sizeof(*scratch));
+  const size_t line_size = 64 + (size_t)bins * 40;
+  char* line = malloc(line_size);
+  size_t last_written = 0;
+  while (envelopes && scratch && line && s->cap_state == State_Running) {
+    const size_t written = buf->written;
+    if (written < window || written == last_written) {
+      usleep(interval * 1000);
+      continue;
+    }
+    last_written = written;
+
+    const size_t pos = written - window;
+    if (!atomic_ringbuffer_peek_begin(buf, pos))
+      continue;
+    for (unsigned b = 0; b < bins; ++b) {
+      envelope_reset(&envelopes[b]);
+      preview_block(buf, linear ? &di : NULL, scratch, pos + (size_t)b * block * frame_size, block, &envelopes[b]);
+    }
+    if (!atomic_ringbuffer_peek_end(buf, pos))
+      continue;
+
+    size_t len = (size_t)snprintf(line, line_size, "{\"pos\":%zu,\"min\":[", pos / frame_size);
+    for (unsigned b = 0; b < bins; ++b)
+      len += (size_t)snprintf(line + len, line_size - len, "%s%d", b ? "," : "", envelopes[b].min);
+    len += (size_t)snprintf(line + len, line_size - len, "],\"max\":[");
+    for (unsigned b = 0; b < bins; ++b)
+      len += (size_t)snprintf(line + len, line_size - len, "%s%d", b ? "," : "", envelopes[b].max);
+    len += (size_t)snprintf(line + len, line_size - len, "],\"rms\":[");
+    for (unsigned b = 0; b < bins; ++b)
+      len += (size_t)snprintf(line + len, line_size - len, "%s%.1f", b ? "," : "", envelope_rms(&envelopes[b]));
+    len += (size_t)snprintf(line + len, line_size - len, "]}\n");
+    if (!write_all(fd, (const uint8_t*)line, len))
+      break;
+    usleep(interval * 1000);
+  }
+  free(line);
+  free(scratch);
+  free(envelopes);
+}
+
+// size of the writes when recording, large enough to keep the disk busy with few requests
+#define RECORD_CHUNK (1u << 20)
+
+void* recorder_thread(void* arg) {
+  struct stream_state* stream = arg;
+  struct session* s = stream->session;
+  struct recorder* rec = &stream->recorder;
+  struct disk_writer* dw = &rec->writer;
+  struct atomic_ringbuffer* buf = &stream->ring_buffer;
+
+  enum capture_state state;
+  while ((state = s->cap_state) != State_Running && state != State_Stopping)
+    capture_state_wait(s, state);
+
+  if (stream != &s->linear && (size_t)(stream - s->cxadc) >= s->cxadc_count) {
+    fprintf(stderr, "recording %s failed: cxadc%zu is not captured\n", rec->path, (size_t)(stream - s->cxadc));
+    disk_writer_close(dw);
+    unlink(rec->path);
+    rec->active = false;
+    return NULL;
+  }
+  struct atomic_ringbuffer_reader* reader = atomic_ringbuffer_add_reader(buf, Reader_Blocking);
+  if (!reader) {
+    fprintf(stderr, "recording %s failed: no reader slot\n", rec->path);
+    goto done;
+  }
+  const size_t chunk = RECORD_CHUNK < buf->buf_size / 4 ? RECORD_CHUNK : buf->buf_size / 4;
+  reader->watermark = chunk;
+
+  // the ring buffer is page aligned, so the data is too as long as we start on a block boundary
+  const size_t start = reader->read;
+  if (start % DISK_WRITER_ALIGN != 0)
+    disk_writer_set_buffered(dw);
+  clock_gettime(CLOCK_MONOTONIC_RAW, &rec->start_time);
+
+  // `pos` is what we submitted, `read` is what is on disk already
+  size_t pos = start;
+  while ((state = s->cap_state) == State_Running || state == State_Stopping) {
+    const bool full = disk_writer_pending(dw) == DISK_WRITER_MAX_DEPTH;
+    atomic_ringbuffer_advance_read(buf, reader, start + disk_writer_reap(dw, full) - reader->read);
+    if (dw->error)
+      break;
+    if (full)
+      continue;
+
+    size_t len = atomic_ringbuffer_get_read_size_at(buf, pos);
+    if (len < chunk && state == State_Running) {
+      stream_wait_read(stream, reader, pos, 100);
+      len = atomic_ringbuffer_get_read_size_at(buf, pos);
+    }
+    if (len > chunk)
+      len = chunk;
+    if (dw->direct)
+      len -= len % DISK_WRITER_ALIGN;
+    if (len == 0) {
+      if (state == State_Stopping)
+        break;
+      continue;
+    }
+    if (!disk_writer_submit(dw, atomic_ringbuffer_get_read_ptr_at(buf, pos), len, pos - start))
+      break;
+    pos += len;
+  }
+
+  while (disk_writer_pending(dw))
+    disk_writer_reap(dw, true);
+  // whatever is left is less than a block
+  if (!dw->error) {
+    const size_t len = s->cap_state == State_Stopping ? atomic_ringbuffer_get_read_size_at(buf, pos) : 0;
+    disk_writer_finish(dw, atomic_ringbuffer_get_read_ptr_at(buf, pos), len, pos - start);
+  }
+  if (dw->error)
+    fprintf(stderr, "recording %s failed: %s\n", rec->path, sys_errlist[-dw->error]);
+  atomic_ringbuffer_remove_reader(buf, reader);
+
+done:
+  disk_writer_close(dw);
+  rec->active = false;
+  return NULL;
+}
+
+// streams slower than a chunk in this time are written in smaller chunks, so all streams stay close in the file
+#define CONTAINER_FLUSH_NS 1000000000
+// how often the index is brought up to date, which is what a reader has to scan for after a crash
+#define CONTAINER_INDEX_NS 10000000000
+
+struct container_track {
+  struct stream_state* stream;
+  struct atomic_ringbuffer_reader* reader;
+  // whole frames that fit in a data record
+  size_t capacity;
+  // since when the data not written yet has been waiting, 0 if there is none
+  ssize_t pending_ns;
+};
+
+struct container_output {
+  struct container_recorder* rec;
+  // staging buffers of CONTAINER_CHUNK bytes, one per write in flight
+  uint8_t* slots;
+  uint64_t offset;
+  // every data record so far, for the index
+  struct container_entry* entries;
+  size_t entry_count;
+  size_t entry_capacity;
+};
+
+// Capture time of the byte at `pos`, from the latest timestamp at the estimated rate, or the nominal rate before there
+// is an estimate.
+static int64_t stream_pos_ns(struct stream_state* stream, uint64_t pos) {
+  const struct source* src = &stream->source;
+  double rate, recent_rate;
+  if (!stream_rate(stream, &rate, &recent_rate))
+    recent_rate = src->rate;
+  const double bytes_per_second = recent_rate * (double)src->frame_size;
+  int64_t ns;
+  if (timeline_ns_at(&stream->timeline, pos, bytes_per_second, &ns))
+    return ns;
+  // nothing read yet, the writer adds the timestamps
+  return monotonic_nanos();
+}
+
+// The next free staging buffer, waiting for a write to complete if they are all in flight. NULL after a write error.
+static uint8_t* container_slot(struct container_output* out) {
+  struct disk_writer* dw = &out->rec->writer;
+  disk_writer_reap(dw, false);
+  while (disk_writer_pending(dw) == DISK_WRITER_MAX_DEPTH && !dw->error)
+    disk_writer_reap(dw, true);
+  return dw->error ? NULL : out->slots + (size_t)(dw->next % DISK_WRITER_MAX_DEPTH) * CONTAINER_CHUNK;
+}
+
+static bool container_submit(struct container_output* out, const uint8_t* slot, size_t size) {
+  if (!disk_writer_submit(&out->rec->writer, slot, size, out->offset))
+    return false;
+  out->offset += size;
+  return true;
+}
+
+// The capture parameters and stream formats, for people looking at the file.
+static char* session_json(struct session* s, struct stream_state* const* streams, const uint64_t* start, size_t count, size_t* len) {
+  char* json = NULL;
+  FILE* f = open_memstream(&json, len);
+  if (!f)
+    return NULL;
+  char escaped[4096];
+  fprintf(
+    f,
+    "{\"server\":\"%s\",\"session\":\"%s\",\"params\":\"%s\",\"gapfill\":%s,\"streams\":[",
+    CXADC_VHS_SERVER_VERSION,
+    s->name,
+    json_escape(escaped, sizeof(escaped), s->params),
+    s->gap_fill ? "true" : "false"
+  );
+  for (size_t i = 0; i < count; ++i) {
+    const struct source* src = &streams[i]->source;
+    fprintf(
+      f,
+      "%s{\"source\":\"%s\",\"device\":\"%s\",\"rate\":%u,\"format\":\"%s\",\"channels\":%u,\"frame_size\":%zu,\"start_pos\":%" PRIu64 "}",
+      i ? "," : "",
+      src->driver->name,
+      json_escape(escaped, sizeof(escaped), src->name),
+      src->rate,
+      snd_pcm_format_name(src->format),
+      src->channels,
+      src->frame_size,
+      start[i]
+    );
+  }
+  fprintf(f, "]}");
+  if (fclose(f) != 0) {
+    free(json);
+    return NULL;
+  }
+  return json;
+}
+
+// Description of the streams of a session, in the container header format, so the /bundle clients can reuse it.
+// `streams` are the linear stream followed by the cards, `start` where each of them is read from.
+static uint8_t* session_header(struct session* s, struct stream_state* const* streams, const uint64_t* start, size_t count, size_t* size) {
+  size_t json_len;
+  char* json = session_json(s, streams, start, count, &json_len);
+  struct container_stream* table = calloc(count, sizeof(*table));
+  uint8_t* header = json && table ? malloc(container_header_size(count, json_len)) : NULL;
+  if (header) {
+    for (size_t i = 0; i < count; ++i) {
+      const struct source* src = &streams[i]->source;
+      if (i == 0)
+        snprintf(table[i].name, sizeof(table[i].name), "linear");
+      else
+        snprintf(table[i].name, sizeof(table[i].name), "cxadc%u", (unsigned)(i - 1));
+      table[i].rate = src->rate;
+      table[i].frame_size = (uint32_t)src->frame_size;
+      table[i].channels = src->channels;
+    }
+    container_put_header(header, table, count, json, json_len);
+    *size = container_header_size(count, json_len);
+  }
+  free(json);
+  free(table);
+  return header;
+}
+
+static bool container_write_header(struct container_output* out, struct session* s, const struct container_track* tracks, size_t count) {
+  struct stream_state** streams = calloc(count, sizeof(*streams));
+  uint64_t* start = calloc(count, sizeof(*start));
+  for (size_t i = 0; streams && start && i < count; ++i) {
+    streams[i] = tracks[i].stream;
+    start[i] = tracks[i].reader->read;
+  }
+  size_t size = 0;
+  uint8_t* header = streams && start ? session_header(s, streams, start, count, &size) : NULL;
+  uint8_t* slot = header && size <= CONTAINER_CHUNK ? container_slot(out) : NULL;
+  if (slot)
+    memcpy(slot, header, size);
+  free(streams);
+  free(start);
+  free(header);
+  return slot && container_submit(out, slot, size);
+}
+
+// A data record of the next `len` bytes of the track.
+static bool container_write_data(struct container_output* out, struct container_track* t, uint8_t id, size_t len) {
+  if (out->entry_count == out->entry_capacity) {
+    struct container_entry* entries = realloc(out->entries, 2 * out->entry_capacity * sizeof(*entries));
+    if (!entries)
+      return false;
+    out->entries = entries;
+    out->entry_capacity *= 2;
+  }
+  uint8_t* slot = container_slot(out);
+  if (!slot)
+    return false;
+
+  struct atomic_ringbuffer* buf = &t->stream->ring_buffer;
+  const uint64_t pos = t->reader->read;
+  for (size_t done = 0; done < len;) {
+    size_t count = atomic_ringbuffer_get_read_size_at(buf, pos + done);
+    if (count > len - done)
+      count = len - done;
+    memcpy(slot + CONTAINER_RECORD_HEADER + done, atomic_ringbuffer_get_read_ptr_at(buf, pos + done), count);
+    done += count;
+  }
+  const size_t size = container_record_size(len);
+  memset(slot + CONTAINER_RECORD_HEADER + len, 0, size - CONTAINER_RECORD_HEADER - len);
+  const struct container_record record = {Record_Data, id, (uint32_t)len, (uint32_t)size, pos, stream_pos_ns(t->stream, pos)};
+  container_put_record(slot, &record);
+  out->entries[out->entry_count++] = (struct container_entry){out->offset, pos, record.ns, (uint32_t)len, id};
+  // it's copied, so the ring buffer can have it back before it is on disk
+  atomic_ringbuffer_advance_read(buf, t->reader, len);
+  ++out->rec->chunks;
+  return container_submit(out, slot, size);
+}
+
+// Index records for the entries from `from` to `to`, the first one linking back to `prev`, which is updated to the last.
+static bool container_write_index(struct container_output* out, size_t from, size_t to, uint64_t* prev) {
+  while (from < to) {
+    const size_t count = to - from < CONTAINER_MAX_ENTRIES ? to - from : CONTAINER_MAX_ENTRIES;
+    uint8_t* slot = container_slot(out);
+    if (!slot)
+      return false;
+    const size_t len = count * CONTAINER_ENTRY_SIZE;
+    const size_t size = container_record_size(len);
+    memset(slot, 0, size);
+    const struct container_record record = {Record_Index, 0, (uint32_t)len, (uint32_t)size, *prev, 0};
+    container_put_record(slot, &record);
+    for (size_t i = 0; i < count; ++i)
+      container_put_entry(slot + CONTAINER_RECORD_HEADER + i * CONTAINER_ENTRY_SIZE, &out->entries[from + i]);
+    *prev = out->offset;
+    if (!container_submit(out, slot, size))
+      return false;
+    from += count;
+    ++out->rec->indexes;
+  }
+  return true;
+}
+
+void* container_thread(void* arg) {
+  struct session* s = arg;
+  struct container_recorder* rec = &s->container;
+  struct disk_writer* dw = &rec->writer;
+
+  enum capture_state state;
+  while ((state = s->cap_state) != State_Running && state != State_Stopping)
+    capture_state_wait(s, state);
+
+  // the linear stream first, then the cards
+  const size_t count = 1 + s->cxadc_count;
+  struct container_track* tracks = calloc(count, sizeof(*tracks));
+  struct container_output out = {rec, aligned_alloc(CONTAINER_ALIGN, (size_t)DISK_WRITER_MAX_DEPTH * CONTAINER_CHUNK), 0, NULL, 0, 4096};
+  out.entries = malloc(out.entry_capacity * sizeof(*out.entries));
+  bool ok = tracks && out.slots && out.entries;
+  if (!ok)
+    fprintf(stderr, "recording %s failed: out of memory\n", rec->path);
+  if (ok && count > 256) {
+    fprintf(stderr, "recording %s failed: too many streams\n", rec->path);
+    ok = false;
+  }
+
+  size_t added = 0;
+  for (; ok && added < count; ++added) {
+    struct container_track* t = &tracks[added];
+    t->stream = added == 0 ? &s->linear : &s->cxadc[added - 1];
+    t->reader = atomic_ringbuffer_add_reader(&t->stream->ring_buffer, Reader_Blocking);
+    if (!t->reader) {
+      fprintf(stderr, "recording %s failed: no reader slot\n", rec->path);
+      ok = false;
+      break;
+    }
+    const size_t frame_size = t->stream->source.frame_size;
+    t->capacity = (CONTAINER_CHUNK - CONTAINER_RECORD_HEADER) / frame_size * frame_size;
+    t->reader->watermark = t->capacity;
+  }
+  clock_gettime(CLOCK_MONOTONIC_RAW, &rec->start_time);
+  ok = ok && container_write_header(&out, s, tracks, count);
+
+  uint64_t index_prev = CONTAINER_NONE;
+  size_t indexed = 0;
+  ssize_t index_ns = monotonic_nanos();
+  while (ok) {
+    const bool stopping = s->cap_state != State_Running;
+    const ssize_t now_ns = monotonic_nanos();
+    // one chunk of every stream with enough data per pass, so the streams are interleaved in time
+    bool wrote = false;
+    for (size_t i = 0; ok && i < count; ++i) {
+      struct container_track* t = &tracks[i];
+      const size_t frame_size = t->stream->source.frame_size;
+      size_t len = t->stream->ring_buffer.written - t->reader->read;
+      len -= len % frame_size;
+      if (len == 0) {
+        t->pending_ns = 0;
+        continue;
+      }
+      if (!t->pending_ns)
+        t->pending_ns = now_ns;
+      if (len < t->capacity && !stopping && now_ns - t->pending_ns < CONTAINER_FLUSH_NS)
+        continue;
+      if (len > t->capacity)
+        len = t->capacity;
+      ok = container_write_data(&out, t, (uint8_t)i, len);
+      t->pending_ns = now_ns;
+      wrote = true;
+    }
+    if (ok && (out.entry_count - indexed >= CONTAINER_MAX_ENTRIES || now_ns - index_ns >= CONTAINER_INDEX_NS)) {
+      ok = container_write_index(&out, indexed, out.entry_count, &index_prev);
+      indexed = out.entry_count;
+      index_ns = now_ns;
+    }
+    if (wrote)
+      continue;
+    if (stopping)
+      break;
+    // the last card fills up first, the slower streams are picked up on the timeout
+    struct container_track* t = &tracks[count - 1];
+    stream_wait_read(t->stream, t->reader, t->reader->read, 100);
+  }
+
+  // the complete index, and the end record pointing at it
+  if (ok) {
+    uint64_t last = CONTAINER_NONE;
+    ok = container_write_index(&out, 0, out.entry_count, &last);
+    while (disk_writer_pending(dw))
+      disk_writer_reap(dw, true);
+    if (ok && !dw->error) {
+      memset(out.slots, 0, CONTAINER_ALIGN);
+      const struct container_record end = {Record_End, 0, 0, CONTAINER_RECORD_HEADER, last, 0};
+      container_put_record(out.slots, &end);
+      disk_writer_finish(dw, out.slots, CONTAINER_RECORD_HEADER, out.offset);
+    }
+  }
+  while (disk_writer_pending(dw))
+    disk_writer_reap(dw, true);
+  if (dw->error)
+    fprintf(stderr, "recording %s failed: %s\n", rec->path, sys_errlist[-dw->error]);
+
+  for (size_t i = 0; i < added; ++i)
+    atomic_ringbuffer_remove_reader(&tracks[i].stream->ring_buffer, tracks[i].reader);
+  free(tracks);
+  free(out.slots);
+  free(out.entries);
+  disk_writer_close(dw);
+  rec->active = false;
+  return NULL;
+}
+
+static bool recorder_thread_create(void* (*fn)(void*), void* arg, char* errstr, size_t errstr_size) {
+  pthread_t thread_id;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  const int err = pthread_create(&thread_id, &attr, fn, arg);
+  pthread_attr_destroy(&attr);
+  if (err != 0)
+    snprintf(errstr, errstr_size, "can't create recorder thread: %s", sys_errlist[err]);
+  return err == 0;
+}
+
+void file_record(FILE* out, int argc, char** argv) {
+  char errstr[256];
+  char escaped[1024];
+  memset(errstr, 0, sizeof(errstr));
+  // recorders can wait for the session to start, like streaming clients
+  struct session* s = session_find(argc, argv, false, errstr, sizeof(errstr) - 1);
+  if (!s) {
+    fprintf(out, "{\"state\": \"%s\", \"recorders\": 0, \"fail_reason\": \"%s\"}", capture_state_to_str(State_Failed), json_escape(escaped, sizeof(escaped), errstr));
+    return;
+  }
+  const enum capture_state state = s->cap_state;
+  if (state == State_Stopping) {
+    fprintf(out, "{\"state\": \"%s\"}", capture_state_to_str(state));
+    return;
+  }
+
+  size_t recorders = 0;
+
+  for (int i = 0; i < argc; ++i) {
+    unsigned num;
+    char urlencoded[256];
+    struct stream_state* stream = NULL;
+    if (1 == sscanf(argv[i], "container=%255s", urlencoded)) {
+      struct container_recorder* rec = &s->container;
+      bool expected = false;
+      if (!atomic_compare_exchange_strong(&rec->active, &expected, true)) {
+        snprintf(errstr, sizeof(errstr) - 1, "already recording to %.200s", rec->path);
+        goto error;
+      }
+      urldecode2(rec->path, urlencoded);
+      rec->chunks = 0;
+      rec->indexes = 0;
+      if (!disk_writer_open(&rec->writer, rec->path, true, errstr, sizeof(errstr) - 1)) {
+        rec->active = false;
+        goto error;
+      }
+      if (!recorder_thread_create(container_thread, s, errstr, sizeof(errstr) - 1)) {
+        disk_writer_close(&rec->writer);
+        rec->active = false;
+        goto error;
+      }
+      ++recorders;
+      continue;
+    }
+    if (2 == sscanf(argv[i], "cxadc%u=%255s", &num, urlencoded) && num < 256) {
+      // before /arm or /start the cards aren't known yet, the recorder checks once the capture runs
+      if ((state == State_Armed || state == State_Running) && num >= s->cxadc_count) {
+        snprintf(errstr, sizeof(errstr) - 1, "cxadc%u is not captured", num);
+        goto error;
+      }
+      stream = &s->cxadc[num];
+    } else if (1 == sscanf(argv[i], "linear=%255s", urlencoded))
+      stream = &s->linear;
+    if (!stream)
+      continue;
+
+    struct recorder* rec = &stream->recorder;
+    bool expected = false;
+    if (!atomic_compare_exchange_strong(&rec->active, &expected, true)) {
+      snprintf(errstr, sizeof(errstr) - 1, "already recording to %.200s", rec->path);
+      goto error;
+    }
+    urldecode2(rec->path, urlencoded);
+    if (!disk_writer_open(&rec->writer, rec->path, true, errstr, sizeof(errstr) - 1)) {
+      rec->active = false;
+      goto error;
+    }
+
+    if (!recorder_thread_create(recorder_thread, stream, errstr, sizeof(errstr) - 1)) {
+      disk_writer_close(&rec->writer);
+      rec->active = false;
+      goto error;
+    }
+    ++recorders;
+  }
+
+  fprintf(out, "{\"state\": \"%s\", \"recorders\": %zu}", capture_state_to_str(state), recorders);
+  return;
+
+error:
+  fprintf(out, "{\"state\": \"%s\", \"recorders\": %zu, \"fail_reason\": \"%s\"}", capture_state_to_str(state), recorders, json_escape(escaped, sizeof(escaped), errstr));
+}
+
+// how much to send with one writev, in frames of up to BUNDLE_FRAME
+#define BUNDLE_BATCH   (4u << 20)
+#define BUNDLE_MAX_IOV 64
+
+static bool writev_all(int fd, struct iovec* iov, int count) {
+  while (count) {
+    const ssize_t written = writev(fd, iov, count);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "write failed: %s\n", sys_errlist[errno]);
+      return false;
+    }
+    size_t left = (size_t)written;
+    while (count && left >= iov->iov_len) {
+      left -= iov->iov_len;
+      ++iov;
+      --count;
+    }
+    if (count) {
+      iov->iov_base = (uint8_t*)iov->iov_base + left;
+      iov->iov_len -= left;
+    }
+  }
+  return true;
+}
+
+// Every stream of the session over one connection, see bundle.h. Each batch takes frames from the stream whose ring
+// buffer is the fullest for its size, until the batch is full, so a fast stream can't push a slow one into overflowing.
+void pump_bundle_to_fd(int fd, struct session* s, enum reader_policy policy) {
+  enum capture_state state;
+  while ((state = s->cap_state) != State_Running && state != State_Stopping)
+    capture_state_wait(s, state);
+
+  // the linear stream first, then the cards, like in the container
+  const size_t count = 1 + s->cxadc_count;
+  if (count > 256)
+    return;
+  struct stream_state** streams = calloc(count, sizeof(*streams));
+  struct atomic_ringbuffer_reader** readers = calloc(count, sizeof(*readers));
+  uint64_t* start = calloc(count, sizeof(*start));
+  size_t* queued = calloc(count, sizeof(*queued));
+  size_t added = 0;
+  // the stream with the most bytes per second, to wait on
+  size_t fastest = 0;
+  for (; streams && readers && start && queued && added < count; ++added) {
+    streams[added] = added == 0 ? &s->linear : &s->cxadc[added - 1];
+    readers[added] = atomic_ringbuffer_add_reader(&streams[added]->ring_buffer, policy);
+    if (!readers[added])
+      break;
+    start[added] = readers[added]->read;
+    const struct source* src = &streams[added]->source;
+    const struct source* best = &streams[fastest]->source;
+    if ((uint64_t)src->rate * src->frame_size > (uint64_t)best->rate * best->frame_size)
+      fastest = added;
+  }
+
+  size_t header_size = 0;
+  uint8_t* header = added == count ? session_header(s, streams, start, count, &header_size) : NULL;
+  uint8_t frame_headers[BUNDLE_MAX_IOV / 2][BUNDLE_HEADER_SIZE];
+  // lossy readers send from a copy known to be intact, like pump_ringbuffer_to_fd
+  uint8_t* bounce = policy == Reader_Lossy ? malloc(BUNDLE_BATCH) : NULL;
+  bool ok = header != NULL && header_size <= BUNDLE_FRAME && (bounce || policy != Reader_Lossy);
+  if (ok) {
+    const struct bundle_frame description = {Bundle_Description, 0, (uint32_t)header_size, 0};
+    bundle_put_header(frame_headers[0], &description);
+    struct iovec iov[2] = {{frame_headers[0], BUNDLE_HEADER_SIZE}, {header, header_size}};
+    ok = writev_all(fd, iov, 2);
+  }
+  free(header);
+
+  while (ok && ((state = s->cap_state) == State_Running || state == State_Stopping)) {
+    bool ready = false;
+    for (size_t i = 0; i < count; ++i) {
+      if (readers[i]->state != ReaderState_Active) {
+        fprintf(stderr, "reader too slow, dropped\n");
+        ok = false;
+      }
+      ready |= streams[i]->ring_buffer.written - readers[i]->read >= readers[i]->watermark;
+    }
+    if (!ok)
+      break;
+    if (!ready && state == State_Running)
+      stream_wait_read(streams[fastest], readers[fastest], readers[fastest]->read, 50);
+
+    struct iovec iov[BUNDLE_MAX_IOV];
+    int iov_count = 0;
+    size_t frames = 0, batch = 0;
+    memset(queued, 0, count * sizeof(*queued));
+    // a header and up to two parts for a frame wrapping around the end of the ring buffer
+    while (batch < BUNDLE_BATCH && iov_count + 3 <= BUNDLE_MAX_IOV) {
+      size_t best = count;
+      double best_fill = 0;
+      for (size_t i = 0; i < count; ++i) {
+        const struct atomic_ringbuffer* buf = &streams[i]->ring_buffer;
+        const size_t left = buf->written - readers[i]->read - queued[i];
+        const double fill = (double)left / (double)buf->buf_size;
+        if (left >= streams[i]->source.frame_size && fill > best_fill) {
+          best = i;
+          best_fill = fill;
+        }
+      }
+      if (best == count)
+        break;
+
+      struct atomic_ringbuffer* buf = &streams[best]->ring_buffer;
+      const size_t frame_size = streams[best]->source.frame_size;
+      const size_t pos = readers[best]->read + queued[best];
+      size_t len = buf->written - pos;
+      if (len > BUNDLE_FRAME)
+        len = BUNDLE_FRAME;
+      if (len > BUNDLE_BATCH - batch)
+        len = BUNDLE_BATCH - batch;
+      len -= len % frame_size;
+      if (len == 0)
+        break;
+
+      const struct bundle_frame frame = {Bundle_Data, (uint8_t)best, (uint32_t)len, pos};
+      bundle_put_header(frame_headers[frames], &frame);
+      iov[iov_count++] = (struct iovec){frame_headers[frames++], BUNDLE_HEADER_SIZE};
+      const size_t first = atomic_ringbuffer_get_read_size_at(buf, pos) < len ? atomic_ringbuffer_get_read_size_at(buf, pos) : len;
+      if (bounce) {
+        memcpy(bounce + batch, atomic_ringbuffer_get_read_ptr_at(buf, pos), first);
+        memcpy(bounce + batch + first, atomic_ringbuffer_get_read_ptr_at(buf, pos + first), len - first);
+        iov[iov_count++] = (struct iovec){bounce + batch, len};
+      } else {
+        iov[iov_count++] = (struct iovec){atomic_ringbuffer_get_read_ptr_at(buf, pos), first};
+        if (first < len)
+          iov[iov_count++] = (struct iovec){atomic_ringbuffer_get_read_ptr_at(buf, pos + first), len - first};
+      }
+      queued[best] += len;
+      batch += len;
+    }
+
+    if (iov_count == 0) {
+      if (state == State_Stopping) {
+        const struct bundle_frame end = {Bundle_End, 0, 0, 0};
+        bundle_put_header(frame_headers[0], &end);
+        write_all(fd, frame_headers[0], BUNDLE_HEADER_SIZE);
+        break;
+      }
+      continue;
+    }
+    for (size_t i = 0; bounce && i < count; ++i) {
+      if (queued[i] && !atomic_ringbuffer_reader_intact(readers[i])) {
+        fprintf(stderr, "reader too slow, dropped\n");
+        ok = false;
+      }
+    }
+    if (!ok)
+      break;
+    const ssize_t write_start_ns = monotonic_nanos();
+    ok = writev_all(fd, iov, iov_count);
+    histogram_add(&streams[fastest]->metrics.client_write_ns, monotonic_nanos() - write_start_ns);
+    for (size_t i = 0; ok && i < count; ++i)
+      atomic_ringbuffer_advance_read(&streams[i]->ring_buffer, readers[i], queued[i]);
+  }
+
+  for (size_t i = 0; i < added; ++i)
+    atomic_ringbuffer_remove_reader(&streams[i]->ring_buffer, readers[i]);
+  free(bounce);
+  free(streams);
+  free(readers);
+  free(start);
+  free(queued);
+}
+
+bool bundle_check(int argc, char** argv, char* errstr, size_t errstr_size) {
+  return session_find(argc, argv, false, errstr, errstr_size) != NULL;
+}
+
+void file_bundle(int fd, struct http_head* head, int argc, char** argv) {
+  // like for the single streams, clients can connect before the session is started
+  char errstr[256];
+  struct session* s = session_find(argc, argv, false, errstr, sizeof(errstr) - 1);
+  if (!s)
+    return;
+  enum reader_policy policy = Reader_Blocking;
+  for (int i = 0; i < argc; ++i) {
+    if (0 == strcmp(argv[i], "lossy"))
+      policy = Reader_Lossy;
+  }
+  if (http_send_head(fd, head, -1))
+    pump_bundle_to_fd(fd, s, policy);
+}
+
+// the latest window and the clipping so far, as a member of the stream's object
+static void stream_rf_summary(FILE* out, struct rf_stats* rf) {
+  const size_t window = rf->step_size ? rf->step_size * RF_STEPS : 1;
+  fprintf(
+    out,
+    ",\"rf\":{\"dc_offset\":%.2f,\"peak_to_peak\":%d,\"rms\":%.2f,\"window_clip_pct\":%.4f,\"clipped_low\":%" PRIu64 ",\"clipped_high\":%" PRIu64 "}",
+    rf->windows ? rf->window_mean - 128 : 0,
+    rf->window_max - rf->window_min,
+    rf->window_rms,
+    rf->window_clipped * 100.0 / window,
+    rf->histogram[0],
+    rf->histogram[255]
+  );
+}
+
+static void stream_stats(FILE* out, struct stream_state* stream) {
+  size_t read, written, difference;
+  atomic_ringbuffer_get_stats(&stream->ring_buffer, &read, &written, &difference);
+
+  struct timespec cpu_time = {0, 0};
+  clockid_t clock_id;
+  if (0 == pthread_getcpuclockid(stream->writer_thread, &clock_id))
+    clock_gettime(clock_id, &cpu_time);
+
+  fprintf(
+    out,
+    "{\"read\":%zu,\"written\":%zu,\"difference\":%zu,\"difference_pct\":%zu,\"writer_cpu_ns\":%zd,\"writer_wakeups\":%zu,\"reader_wakeups\":%zu,"
+    "\"readers\":%zu,\"dropped_readers\":%zu,\"retainer_drops\":%zu,\"max_read_gap_ns\":%zu",
+    read,
+    written,
+    difference,
+    difference * 100 / stream->ring_buffer.buf_size,
+    timespec_to_nanos(&cpu_time),
+    stream->ring_buffer.writer_wakeups,
+    stream->ring_buffer.reader_wakeups,
+    atomic_ringbuffer_reader_count(&stream->ring_buffer),
+    stream->ring_buffer.dropped_readers,
+    stream->retainer_drops,
+    stream->metrics.max_read_gap_ns
+  );
+
+  // the wakeups of each reader tell which client is woken up too often
+  fprintf(out, ",\"active_readers\":[");
+  bool first = true;
+  for (size_t i = 0; i < ATOMIC_RINGBUFFER_MAX_READERS; ++i) {
+    const struct atomic_ringbuffer_reader* reader = &stream->ring_buffer.readers[i];
+    const size_t pos = reader->read;
+    if (reader->state != ReaderState_Active)
+      continue;
+    fprintf(
+      out,
+      "%s{\"slot\":%zu,\"policy\":\"%s\",\"behind\":%zu,\"wakeups\":%zu}",
+      first ? "" : ",",
+      i,
+      reader->policy == Reader_Lossy ? "lossy" : "blocking",
+      pos < written ? written - pos : 0,
+      (size_t)reader->wakeups
+    );
+    first = false;
+  }
+  fprintf(out, "]");
+
+  double rate, recent_rate;
+  if (stream_rate(stream, &rate, &recent_rate))
+    fprintf(out, ",\"rate_hz\":%.3f,\"ppm\":%.3f,\"recent_ppm\":%.3f", rate, rate_ppm(rate, stream->source.rate), rate_ppm(recent_rate, stream->source.rate));
+
+  fprintf(out, ",\"gaps\":%zu,\"missing_frames\":%" PRIu64, (size_t)stream->gaps.gaps, (uint64_t)stream->gaps.missing_frames);
+  if (stream_is_linear(stream))
+    fprintf(out, ",\"xruns\":%zu", (size_t)stream->source.xruns);
+  else
+    stream_rf_summary(out, &stream->rf);
+
+  const struct atomic_ringbuffer_spill* spill = stream->ring_buffer.spill;
+  if (spill) {
+    fprintf(
+      out,
+      ",\"spill\":{\"ram_bytes\":%zu,\"spill_bytes\":%zu,\"spill_high_water_bytes\":%zu,\"spilled_bytes\":%zu}",
+      spill->ram_in_use * spill->chunk_size,
+      spill->spill_in_use * spill->chunk_size,
+      spill->spill_high_water * spill->chunk_size,
+      spill->spilled_chunks * spill->chunk_size
+    );
+  }
+
+  struct recorder* rec = &stream->recorder;
+  if (rec->active) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+    const ssize_t elapsed_ns = timespec_to_nanos(&now) - timespec_to_nanos(&rec->start_time);
+    const size_t bytes_written = rec->writer.bytes_written;
+    char path[1024];
+    fprintf(
+      out,
+      ",\"record\":{\"path\":\"%s\",\"mode\":\"%s\",\"bytes_written\":%zu,\"queue_depth\":%u,\"mb_per_s\":%.1f}",
+      json_escape(path, sizeof(path), rec->path),
+      disk_writer_mode(&rec->writer),
+      bytes_written,
+      rec->writer.queue_depth,
+      elapsed_ns > 0 ? bytes_written * 1000.0 / elapsed_ns : 0.0
+    );
+  }
+  fprintf(out, "}");
+}
+
+void file_stats(FILE* out, int argc, char** argv) {
+  struct session* s = session_lookup(out, argc, argv);
+  if (!s)
+    return;
+  const enum capture_state state = s->cap_state;
+  if (state != State_Running) {
+    fprintf(out, "{\"state\":\"%s\",\"pool_bytes\":%zu}", capture_state_to_str(state), atomic_ringbuffer_pool_bytes());
+  } else {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    fprintf(
+      out,
+      "{\"state\":\"%s\",\"overflows\":%zu,\"cpu\":{\"user_us\":%ld,\"system_us\":%ld},\"linear\":",
+      capture_state_to_str(state),
+      s->overflow_counter,
+      (long)usage.ru_utime.tv_sec * 1000000 + usage.ru_utime.tv_usec,
+      (long)usage.ru_stime.tv_sec * 1000000 + usage.ru_stime.tv_usec
+    );
+    stream_stats(out, &s->linear);
+    fprintf(out, ",\"cxadc\":[");
+    for (size_t i = 0; i < s->cxadc_count; ++i) {
+      if (i != 0)
+        fprintf(out, ",");
+      stream_stats(out, &s->cxadc[i]);
+    }
+    fprintf(out, "]");
+    struct container_recorder* rec = &s->container;
+    if (rec->active) {
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+      const ssize_t elapsed_ns = timespec_to_nanos(&now) - timespec_to_nanos(&rec->start_time);
+      const size_t bytes_written = rec->writer.bytes_written;
+      char path[1024];
+      fprintf(
+        out,
+        ",\"container\":{\"path\":\"%s\",\"mode\":\"%s\",\"bytes_written\":%zu,\"chunks\":%zu,\"indexes\":%zu,\"queue_depth\":%u,\"mb_per_s\":%.1f}",
+        json_escape(path, sizeof(path), rec->path),
+        disk_writer_mode(&rec->writer),
+        bytes_written,
+        (size_t)rec->chunks,
+        (size_t)rec->indexes,
+        rec->writer.queue_depth,
+        elapsed_ns > 0 ? bytes_written * 1000.0 / elapsed_ns : 0.0
+      );
+    }
+    fprintf(out, "}");
+  }
+}
+
+static bool stream_start_ns(struct stream_state* stream, struct timeline_entry* entries, int64_t* start_ns) {
+  uint64_t stride;
+  const size_t count = timeline_snapshot(&stream->timeline, entries, &stride);
+  return timeline_start_ns(entries, count, (double)stream->source.rate * stream->source.frame_size, start_ns);
+}
+
+// `reference_ns` is the start of the linear stream if known, `common_ns` the latest start of all streams.
+// `reference_ratio` is the linear stream's estimated rate over its nominal rate, if known.
+static void stream_timeline(
+  FILE* out,
+  const char* name,
+  struct stream_state* stream,
+  struct timeline_entry* entries,
+  const int64_t* reference_ns,
+  int64_t common_ns,
+  const double* reference_ratio
+) {
+  const struct source* src = &stream->source;
+  uint64_t stride;
+  const size_t count = timeline_snapshot(&stream->timeline, entries, &stride);
+
+  fprintf(out, "{\"name\":\"%s\",\"rate\":%u,\"frame_size\":%zu,\"stride\":%" PRIu64, name, src->rate, src->frame_size, stride);
+  int64_t start_ns;
+  if (timeline_start_ns(entries, count, (double)src->rate * src->frame_size, &start_ns)) {
+    fprintf(out, ",\"start_ns\":%" PRId64 ",\"skip_frames\":%.0f", start_ns, (double)(common_ns - start_ns) * src->rate / 1e9);
+    if (reference_ns)
+      fprintf(out, ",\"offset_ns\":%" PRId64, start_ns - *reference_ns);
+  }
+  double rate, recent_rate;
+  if (stream_rate(stream, &rate, &recent_rate)) {
+    fprintf(
+      out,
+      ",\"rate_hz\":%.3f,\"ppm\":%.3f,\"recent_rate_hz\":%.3f,\"recent_ppm\":%.3f",
+      rate,
+      rate_ppm(rate, src->rate),
+      recent_rate,
+      rate_ppm(recent_rate, src->rate)
+    );
+    if (reference_ratio)
+      fprintf(out, ",\"drift_ppm\":%.3f", (rate / src->rate / *reference_ratio - 1) * 1e6);
+  }
+
+  // a few KiB per write instead of one write per entry
+  char chunk[4096];
+  size_t len = 0;
+  fprintf(out, ",\"entries\":[");
+  for (size_t i = 0; i < count; ++i) {
+    len += snprintf(chunk + len, sizeof(chunk) - len, "%s[%" PRIu64 ",%" PRId64 "]", i ? "," : "", entries[i].pos, entries[i].ns);
+    if (len > sizeof(chunk) - 64 || i + 1 == count) {
+      fwrite(chunk, 1, len, out);
+      len = 0;
+    }
+  }
+  fprintf(out, "]}");
+}
+
+void file_timeline(FILE* out, int argc, char** argv) {
+  struct session* s = session_lookup(out, argc, argv);
+  if (!s)
+    return;
+  const enum capture_state state = s->cap_state;
+  if (state == State_Starting || state == State_Failed) {
+    fprintf(out, "{\"state\":\"%s\"}", capture_state_to_str(state));
+    return;
+  }
+  struct timeline_entry* entries = malloc((TIMELINE_CAPACITY + 1) * sizeof(*entries));
+  if (!entries)
+    return;
+
+  // everything before the latest start is missing from some stream, so that's where they can all be aligned
+  int64_t reference_ns = 0, common_ns = INT64_MIN, start_ns;
+  const bool have_reference = stream_start_ns(&s->linear, entries, &reference_ns);
+  if (have_reference)
+    common_ns = reference_ns;
+  for (size_t i = 0; i < s->cxadc_count; ++i) {
+    if (stream_start_ns(&s->cxadc[i], entries, &start_ns) && start_ns > common_ns)
+      common_ns = start_ns;
+  }
+
+  double rate, recent_rate, reference_ratio = 0;
+  const bool have_ratio = stream_rate(&s->linear, &rate, &recent_rate) && s->linear.source.rate;
+  if (have_ratio)
+    reference_ratio = rate / s->linear.source.rate;
+
+  fprintf(out, "{\"state\":\"%s\",\"reference\":\"linear\",\"streams\":[", capture_state_to_str(state));
+  stream_timeline(out, "linear", &s->linear, entries, have_reference ? &reference_ns : NULL, common_ns, have_ratio ? &reference_ratio : NULL);
+  for (size_t i = 0; i < s->cxadc_count; ++i) {
+    char name[32];
+    snprintf(name, sizeof(name), "cxadc%zu", i);
+    fprintf(out, ",");
+    stream_timeline(out, name, &s->cxadc[i], entries, have_reference ? &reference_ns : NULL, common_ns, have_ratio ? &reference_ratio : NULL);
+  }
+  fprintf(out, "]}");
+  free(entries);
+}
+
+static void stream_gaps(FILE* out, const char* name, struct stream_state* stream) {
+  const struct source* src = &stream->source;
+  struct gap_log* log = &stream->gaps;
+  fprintf(
+    out,
+    "{\"name\":\"%s\",\"rate\":%u,\"frame_size\":%zu,\"gaps\":%zu,\"missing_frames\":%" PRIu64 ",\"filled_bytes\":%" PRIu64 ",\"entries\":[",
+    name,
+    src->rate,
+    src->frame_size,
+    (size_t)log->gaps,
+    (uint64_t)log->missing_frames,
+    (uint64_t)log->filled_bytes
+  );
+  const size_t count = log->count;
+  for (size_t i = 0; i < count; ++i) {
+    const struct gap* gap = &log->entries[i];
+    fprintf(
+      out,
+      "%s{\"pos\":%" PRIu64 ",\"frames\":%" PRIu64 ",\"ns\":%" PRId64 ",\"fill_pos\":%" PRIu64 "}",
+      i ? "," : "",
+      gap->pos,
+      gap->frames,
+      gap->ns,
+      gap->fill_pos
+    );
+  }
+  fprintf(out, "]}");
+}
+
+void file_gaps(FILE* out, int argc, char** argv) {
+  struct session* s = session_lookup(out, argc, argv);
+  if (!s)
+    return;
+  const enum capture_state state = s->cap_state;
+  if (state == State_Starting || state == State_Failed) {
+    fprintf(out, "{\"state\":\"%s\"}", capture_state_to_str(state));
+    return;
+  }
+  fprintf(out, "{\"state\":\"%s\",\"gapfill\":%s,\"streams\":[", capture_state_to_str(state), s->gap_fill ? "true" : "false");
+  stream_gaps(out, "linear", &s->linear);
+  for (size_t i = 0; i < s->cxadc_count; ++i) {
+    char name[32];
+    snprintf(name, sizeof(name), "cxadc%zu", i);
+    fprintf(out, ",");
+    stream_gaps(out, name, &s->cxadc[i]);
+  }
+  fprintf(out, "]}");
+}
+
+static const struct {
+  const char* name;
+  const char* help;
+  size_t offset;
+  double scale;
+} STREAM_HISTOGRAMS[] = {
+  {"cxadc_vhs_read_size_bytes", "Bytes returned by each read from the source.", offsetof(struct stream_metrics, read_size), 1},
+  {"cxadc_vhs_read_gap_seconds", "Time between successful reads from the source.", offsetof(struct stream_metrics, read_gap_ns), 1e-9},
+  {"cxadc_vhs_source_wait_seconds", "Time the writer thread waited for the source to have data.", offsetof(struct stream_metrics, source_wait_ns), 1e-9},
+  {"cxadc_vhs_client_write_seconds", "Duration of each write to a streaming client.", offsetof(struct stream_metrics, client_write_ns), 1e-9},
+  {"cxadc_vhs_client_wait_seconds", "Time streaming clients and recorders waited for data.", offsetof(struct stream_metrics, client_wait_ns), 1e-9},
+};
+
+static const char* stream_label(const struct stream_state* stream, char* label, size_t label_size) {
+  const struct session* s = stream->session;
+  // the default session keeps the labels from before there were sessions
+  const size_t len = s->name[0] ? (size_t)snprintf(label, label_size, "session=\"%s\",", s->name) : 0;
+  if (stream_is_linear(stream))
+    snprintf(label + len, label_size - len, "stream=\"linear\"");
+  else
+    snprintf(label + len, label_size - len, "stream=\"cxadc%zu\"", (size_t)(stream - s->cxadc));
+  return label;
+}
+
+void file_rf(FILE* out, int argc, char** argv) {
+  struct session* s = session_lookup(out, argc, argv);
+  if (!s)
+    return;
+  const enum capture_state state = s->cap_state;
+  if (state != State_Running && state != State_Stopping && state != State_Idle) {
+    fprintf(out, "{\"state\":\"%s\"}", capture_state_to_str(state));
+    return;
+  }
+  fprintf(out, "{\"state\":\"%s\",\"window_ms\":%d,\"cxadc\":[", capture_state_to_str(state), RF_WINDOW_MS);
+  for (size_t i = 0; i < s->cxadc_count; ++i) {
+    struct rf_stats* rf = &s->cxadc[i].rf;
+    fprintf(
+      out,
+      "%s{\"analyzed\":%" PRIu64 ",\"skipped\":%" PRIu64 ",\"windows\":%" PRIu64 ",\"min\":%d,\"max\":%d,\"mean\":%.2f",
+      i ? "," : "",
+      rf->analyzed,
+      rf->skipped,
+      rf->windows,
+      rf->window_min,
+      rf->window_max,
+      rf->window_mean
+    );
+    stream_rf_summary(out, rf);
+    char chunk[4096];
+    size_t len = (size_t)snprintf(chunk, sizeof(chunk), ",\"histogram\":[");
+    for (size_t v = 0; v < 256; ++v) {
+      len += (size_t)snprintf(chunk + len, sizeof(chunk) - len, "%s%" PRIu64, v ? "," : "", rf->histogram[v]);
+      if (len > sizeof(chunk) - 32) {
+        fwrite(chunk, 1, len, out);
+        len = 0;
+      }
+    }
+    len += (size_t)snprintf(chunk + len, sizeof(chunk) - len, "]}");
+    fwrite(chunk, 1, len, out);
+  }
+  fprintf(out, "]}");
+}
+
+void file_metrics(FILE* out, int argc, char** argv) {
+  (void)argc;
+  (void)argv;
+  // all sessions, and at least the default one
+  char errstr[256];
+  session_find(0, NULL, false, errstr, sizeof(errstr) - 1);
+  struct session* sessions[SESSION_MAX];
+  const size_t session_count = sessions_snapshot(sessions);
+  struct stream_state** streams = malloc(session_count * (1 + sizeof(sessions[0]->cxadc) / sizeof(*sessions[0]->cxadc)) * sizeof(*streams));
+  if (!streams)
+    return;
+  size_t stream_count = 0;
+  for (size_t i = 0; i < session_count; ++i) {
+    struct session* s = sessions[i];
+    const enum capture_state state = s->cap_state;
+    // the streams are only being set up while starting, and nothing was captured before the first start
+    if (state == State_Starting || state == State_Failed || !s->linear.source.driver)
+      continue;
+    streams[stream_count++] = &s->linear;
+    for (size_t c = 0; c < s->cxadc_count; ++c)
+      streams[stream_count++] = &s->cxadc[c];
+  }
+
+
+  metrics_family(out, "cxadc_vhs_capture_state", "gauge", "Capture state, 0 idle, 1 starting, 2 running, 3 stopping, 4 failed, 5 armed.");
+  for (size_t i = 0; i < session_count; ++i) {
+    if (sessions[i]->name[0])
+      fprintf(out, "cxadc_vhs_capture_state{session=\"%s\"} %d\n", sessions[i]->name, (int)sessions[i]->cap_state);
+    else
+      fprintf(out, "cxadc_vhs_capture_state %d\n", (int)sessions[i]->cap_state);
+  }
+  metrics_family(out, "cxadc_vhs_overflows_total", "counter", "Times the writer thread found the ring buffer full, per stream.");
+  char label[96];
+  for (size_t i = 0; i < stream_count; ++i)
+    fprintf(out, "cxadc_vhs_overflows_total{%s} %zu\n", stream_label(streams[i], label, sizeof(label)), streams[i]->metrics.overflows);
+  metrics_family(out, "cxadc_vhs_gaps_total", "counter", "Times data was lost before it got to the ring buffer, see /gaps.");
+  for (size_t i = 0; i < stream_count; ++i)
+    fprintf(out, "cxadc_vhs_gaps_total{%s} %zu\n", stream_label(streams[i], label, sizeof(label)), (size_t)streams[i]->gaps.gaps);
+  metrics_family(out, "cxadc_vhs_missing_frames_total", "counter", "Frames estimated lost in those gaps.");
+  for (size_t i = 0; i < stream_count; ++i)
+    fprintf(out, "cxadc_vhs_missing_frames_total{%s} %" PRIu64 "\n", stream_label(streams[i], label, sizeof(label)), (uint64_t)streams[i]->gaps.missing_frames);
+  metrics_family(out, "cxadc_vhs_xruns_total", "counter", "Overruns of the ALSA device's own buffer, each losing data before it got to the ring buffer.");
+  for (size_t i = 0; i < stream_count; ++i) {
+    if (stream_is_linear(streams[i]))
+      fprintf(out, "cxadc_vhs_xruns_total{%s} %zu\n", stream_label(streams[i], label, sizeof(label)), (size_t)streams[i]->source.xruns);
+  }
+
+  for (size_t h = 0; h < sizeof(STREAM_HISTOGRAMS) / sizeof(*STREAM_HISTOGRAMS); ++h) {
+    metrics_family(out, STREAM_HISTOGRAMS[h].name, "histogram", STREAM_HISTOGRAMS[h].help);
+    for (size_t i = 0; i < stream_count; ++i) {
+      const struct histogram* hist = (const struct histogram*)((const uint8_t*)&streams[i]->metrics + STREAM_HISTOGRAMS[h].offset);
+      metrics_histogram(out, STREAM_HISTOGRAMS[h].name, stream_label(streams[i], label, sizeof(label)), hist, STREAM_HISTOGRAMS[h].scale);
+    }
+  }
+
+  metrics_family(out, "cxadc_vhs_written_bytes_total", "counter", "Bytes captured from the source.");
+  for (size_t i = 0; i < stream_count; ++i)
+    fprintf(out, "cxadc_vhs_written_bytes_total{%s} %zu\n", stream_label(streams[i], label, sizeof(label)), streams[i]->ring_buffer.written);
+  metrics_family(out, "cxadc_vhs_buffer_size_bytes", "gauge", "Size of the ring buffer.");
+  for (size_t i = 0; i < stream_count; ++i)
+    fprintf(out, "cxadc_vhs_buffer_size_bytes{%s} %zu\n", stream_label(streams[i], label, sizeof(label)), streams[i]->ring_buffer.buf_size);
+  metrics_family(out, "cxadc_vhs_buffer_fill_bytes", "gauge", "Data in the ring buffer not yet consumed by the slowest reader.");
+  for (size_t i = 0; i < stream_count; ++i) {
+    const struct atomic_ringbuffer* buf = &streams[i]->ring_buffer;
+    fprintf(out, "cxadc_vhs_buffer_fill_bytes{%s} %zu\n", stream_label(streams[i], label, sizeof(label)), buf->written - buf->read);
+  }
+  metrics_family(out, "cxadc_vhs_buffer_fill_high_water_bytes", "gauge", "Highest ring buffer fill seen by the writer thread.");
+  for (size_t i = 0; i < stream_count; ++i)
+    fprintf(out, "cxadc_vhs_buffer_fill_high_water_bytes{%s} %zu\n", stream_label(streams[i], label, sizeof(label)), streams[i]->metrics.fill_high_water);
+  metrics_family(out, "cxadc_vhs_sample_rate_hz", "gauge", "Sample rate estimated from the capture timestamps over the whole capture, on the host clock.");
+  for (size_t i = 0; i < stream_count; ++i) {
+    double rate, recent_rate;
+    if (stream_rate(streams[i], &rate, &recent_rate))
+      fprintf(out, "cxadc_vhs_sample_rate_hz{%s} %.3f\n", stream_label(streams[i], label, sizeof(label)), rate);
+  }
+  metrics_family(out, "cxadc_vhs_clock_offset_ppm", "gauge", "Sample rate over about the last minute relative to the nominal rate, in ppm on the host clock.");
+  for (size_t i = 0; i < stream_count; ++i) {
+    double rate, recent_rate;
+    if (stream_rate(streams[i], &rate, &recent_rate))
+      fprintf(out, "cxadc_vhs_clock_offset_ppm{%s} %.3f\n", stream_label(streams[i], label, sizeof(label)), rate_ppm(recent_rate, streams[i]->source.rate));
+  }
+  metrics_family(out, "cxadc_vhs_read_gap_max_seconds", "gauge", "Longest time between two reads from the source, the worst stall of the writer thread.");
+  for (size_t i = 0; i < stream_count; ++i)
+    fprintf(out, "cxadc_vhs_read_gap_max_seconds{%s} %.9f\n", stream_label(streams[i], label, sizeof(label)), streams[i]->metrics.max_read_gap_ns * 1e-9);
+  metrics_family(out, "cxadc_vhs_readers", "gauge", "Streaming clients and recorders reading the stream.");
+  for (size_t i = 0; i < stream_count; ++i)
+    fprintf(out, "cxadc_vhs_readers{%s} %zu\n", stream_label(streams[i], label, sizeof(label)), atomic_ringbuffer_reader_count(&streams[i]->ring_buffer));
+  metrics_family(out, "cxadc_vhs_dropped_readers_total", "counter", "Lossy readers dropped for falling behind.");
+  for (size_t i = 0; i < stream_count; ++i)
+    fprintf(out, "cxadc_vhs_dropped_readers_total{%s} %zu\n", stream_label(streams[i], label, sizeof(label)), streams[i]->ring_buffer.dropped_readers);
+  metrics_family(out, "cxadc_vhs_rf_dc_offset", "gauge", "Mean of the latest RF statistics window, minus the 128 midpoint.");
+  for (size_t i = 0; i < stream_count; ++i) {
+    if (!stream_is_linear(streams[i]))
+      fprintf(out, "cxadc_vhs_rf_dc_offset{%s} %.2f\n", stream_label(streams[i], label, sizeof(label)), streams[i]->rf.window_mean - 128);
+  }
+  metrics_family(out, "cxadc_vhs_rf_peak_to_peak", "gauge", "Peak to peak value of the latest RF statistics window.");
+  for (size_t i = 0; i < stream_count; ++i) {
+    if (!stream_is_linear(streams[i]))
+      fprintf(out, "cxadc_vhs_rf_peak_to_peak{%s} %d\n", stream_label(streams[i], label, sizeof(label)), streams[i]->rf.window_max - streams[i]->rf.window_min);
+  }
+  metrics_family(out, "cxadc_vhs_rf_clipped_samples_total", "counter", "Samples at 0 or 255.");
+  for (size_t i = 0; i < stream_count; ++i) {
+    if (stream_is_linear(streams[i]))
+      continue;
+    stream_label(streams[i], label, sizeof(label));
+    fprintf(out, "cxadc_vhs_rf_clipped_samples_total{%s,edge=\"low\"} %" PRIu64 "\n", label, streams[i]->rf.histogram[0]);
+    fprintf(out, "cxadc_vhs_rf_clipped_samples_total{%s,edge=\"high\"} %" PRIu64 "\n", label, streams[i]->rf.histogram[255]);
+  }
+  metrics_family(out, "cxadc_vhs_compress_input_bytes_total", "counter", "Stream data sent to clients with compress=rice.");
+  for (size_t i = 0; i < stream_count; ++i)
+    fprintf(out, "cxadc_vhs_compress_input_bytes_total{%s} %zu\n", stream_label(streams[i], label, sizeof(label)), streams[i]->metrics.compress_in);
+  metrics_family(out, "cxadc_vhs_compress_output_bytes_total", "counter", "Compressed data sent for it, frame headers included.");
+  for (size_t i = 0; i < stream_count; ++i)
+    fprintf(out, "cxadc_vhs_compress_output_bytes_total{%s} %zu\n", stream_label(streams[i], label, sizeof(label)), streams[i]->metrics.compress_out);
+  metrics_family(out, "cxadc_vhs_spill_bytes", "gauge", "Part of the ring buffer backed by the spill file.");
+  for (size_t i = 0; i < stream_count; ++i) {
+    const struct atomic_ringbuffer_spill* spill = streams[i]->ring_buffer.spill;
+    if (spill)
+      fprintf(out, "cxadc_vhs_spill_bytes{%s} %zu\n", stream_label(streams[i], label, sizeof(label)), spill->spill_in_use * spill->chunk_size);
+  }
+  metrics_family(out, "cxadc_vhs_spilled_bytes_total", "counter", "Data written to the spill file because the RAM part of the ring buffer was full.");
+  for (size_t i = 0; i < stream_count; ++i) {
+    const struct atomic_ringbuffer_spill* spill = streams[i]->ring_buffer.spill;
+    if (spill)
+      fprintf(out, "cxadc_vhs_spilled_bytes_total{%s} %zu\n", stream_label(streams[i], label, sizeof(label)), spill->spilled_chunks * spill->chunk_size);
+  }
+
+  free(streams);
 }
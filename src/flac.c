@@ -0,0 +1,409 @@
+#include "flac.h"
+
+#include <pthread.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_FIXED_ORDER     4
+#define MAX_PARTITION_ORDER 8
+// the highest Rice parameter of the 4 and 5 bit parameter codings, the next value is the escape code
+#define MAX_RICE_PARAM4 14
+#define MAX_RICE_PARAM5 30
+
+static uint8_t CRC8_TABLE[256];
+static uint16_t CRC16_TABLE[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void) {
+  for (unsigned i = 0; i < 256; ++i) {
+    unsigned crc8 = i;
+    unsigned crc16 = i << 8;
+    for (int j = 0; j < 8; ++j) {
+      crc8 = (crc8 & 0x80) ? (crc8 << 1) ^ 0x07 : crc8 << 1;
+      crc16 = (crc16 & 0x8000) ? (crc16 << 1) ^ 0x8005 : crc16 << 1;
+    }
+    CRC8_TABLE[i] = (uint8_t)crc8;
+    CRC16_TABLE[i] = (uint16_t)crc16;
+  }
+}
+
+static uint8_t crc8(const uint8_t* data, size_t len) {
+  uint8_t crc = 0;
+  for (size_t i = 0; i < len; ++i)
+    crc = CRC8_TABLE[crc ^ data[i]];
+  return crc;
+}
+
+static uint16_t crc16(const uint8_t* data, size_t len) {
+  uint16_t crc = 0;
+  for (size_t i = 0; i < len; ++i)
+    crc = (uint16_t)((crc << 8) ^ CRC16_TABLE[(crc >> 8) ^ data[i]]);
+  return crc;
+}
+
+struct bitwriter {
+  uint8_t* out;
+  size_t pos;
+  uint64_t acc;
+  unsigned bits;
+};
+
+// n <= 32
+static inline void put_bits(struct bitwriter* bw, unsigned n, uint32_t value) {
+  if (n == 0)
+    return;
+  bw->acc = (bw->acc << n) | (value & (uint32_t)(0xFFFFFFFFu >> (32 - n)));
+  bw->bits += n;
+  while (bw->bits >= 8) {
+    bw->bits -= 8;
+    bw->out[bw->pos++] = (uint8_t)(bw->acc >> bw->bits);
+  }
+}
+
+static void put_zeros(struct bitwriter* bw, uint32_t n) {
+  for (; n > 32; n -= 32)
+    put_bits(bw, 32, 0);
+  put_bits(bw, n, 0);
+}
+
+static void align_byte(struct bitwriter* bw) {
+  if (bw->bits)
+    put_bits(bw, 8 - bw->bits, 0);
+}
+
+static inline uint32_t zigzag(int32_t v) {
+  return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+static inline void put_rice(struct bitwriter* bw, unsigned k, int32_t v) {
+  const uint32_t u = zigzag(v);
+  const uint32_t q = u >> k;
+  if ((uint64_t)q + 1 + k <= 32) {
+    put_bits(bw, q + 1 + k, (1u << k) | (u & ((1u << k) - 1)));
+  } else {
+    put_zeros(bw, q);
+    put_bits(bw, 1, 1);
+    put_bits(bw, k, u);
+  }
+}
+
+bool flac_encoder_init(struct flac_encoder* enc, snd_pcm_format_t format, unsigned channels, unsigned rate, char* errstr, size_t errstr_size) {
+  pthread_once(&crc_once, crc_init);
+
+  switch (format) {
+  case SND_PCM_FORMAT_U8:
+  case SND_PCM_FORMAT_S8:
+    enc->bits = 8;
+    break;
+  case SND_PCM_FORMAT_S16_LE:
+    enc->bits = 16;
+    break;
+  case SND_PCM_FORMAT_S24_3LE:
+  case SND_PCM_FORMAT_S24_LE:
+    enc->bits = 24;
+    break;
+  default:
+    snprintf(errstr, errstr_size, "flac does not support %s", snd_pcm_format_name(format));
+    return false;
+  }
+  if (channels < 1 || channels > FLAC_MAX_CHANNELS) {
+    snprintf(errstr, errstr_size, "flac does not support %u channels", channels);
+    return false;
+  }
+  enc->format = format;
+  enc->channels = channels;
+  enc->rate = rate;
+  enc->frame_size = (size_t)snd_pcm_format_physical_width(format) / 8 * channels;
+  return true;
+}
+
+// the lengths in a VORBIS_COMMENT block are little endian, unlike everything else
+static void put_le32(struct bitwriter* bw, uint32_t value) {
+  for (int i = 0; i < 4; ++i)
+    put_bits(bw, 8, value >> (8 * i));
+}
+
+static void put_string(struct bitwriter* bw, const char* text) {
+  const size_t len = strlen(text);
+  put_le32(bw, (uint32_t)len);
+  for (size_t i = 0; i < len; ++i)
+    put_bits(bw, 8, (uint8_t)text[i]);
+}
+
+size_t flac_encoder_header(const struct flac_encoder* enc, uint8_t* out) {
+  // STREAMINFO only has 20 bits for the rate, so store RF captures in kHz like ffmpeg -ar 40000 does. That drops the
+  // fraction of a kHz, so the exact rate goes into a VORBIS_COMMENT block. The frames take the rate from STREAMINFO,
+  // so the lower limit of their own rate field doesn't matter.
+  const bool scaled = enc->rate > (1u << 20) - 1;
+  const unsigned rate = scaled ? enc->rate / FLAC_RATE_DIVISOR : enc->rate;
+
+  struct bitwriter bw = {out, 0, 0, 0};
+  put_bits(&bw, 32, 0x664C6143); // fLaC
+  put_bits(&bw, 1, !scaled);     // last metadata block
+  put_bits(&bw, 7, 0);           // STREAMINFO
+  put_bits(&bw, 24, 34);
+  put_bits(&bw, 16, FLAC_BLOCK_SIZE);
+  put_bits(&bw, 16, FLAC_BLOCK_SIZE);
+  put_bits(&bw, 24, 0);
+  put_bits(&bw, 24, 0);
+  put_bits(&bw, 20, rate);
+  put_bits(&bw, 3, enc->channels - 1);
+  put_bits(&bw, 5, enc->bits - 1);
+  put_bits(&bw, 4, 0); // 36 bits total samples, unknown
+  put_bits(&bw, 32, 0);
+  for (int i = 0; i < 4; ++i)
+    put_bits(&bw, 32, 0); // MD5, unknown
+
+  if (scaled) {
+    char comments[2][64];
+    snprintf(comments[0], sizeof(comments[0]), "CXADC_VHS_RATE_HZ=%u", enc->rate);
+    snprintf(comments[1], sizeof(comments[1]), "CXADC_VHS_RATE_DIVISOR=%u", FLAC_RATE_DIVISOR);
+    static const char VENDOR[] = "cxadc-vhs-server";
+    put_bits(&bw, 1, 1); // last metadata block
+    put_bits(&bw, 7, 4); // VORBIS_COMMENT
+    put_bits(&bw, 24, (uint32_t)(4 + strlen(VENDOR) + 4 + 4 + strlen(comments[0]) + 4 + strlen(comments[1])));
+    put_string(&bw, VENDOR);
+    put_le32(&bw, 2);
+    put_string(&bw, comments[0]);
+    put_string(&bw, comments[1]);
+  }
+  return bw.pos;
+}
+
+size_t flac_encoder_max_frame_size(const struct flac_encoder* enc) {
+  // header, verbatim subframes and footer
+  return 16 + enc->channels * (1 + (size_t)FLAC_BLOCK_SIZE * enc->bits / 8) + 2;
+}
+
+size_t flac_encoder_scratch_size(const struct flac_encoder* enc) {
+  (void)enc;
+  return 2 * FLAC_BLOCK_SIZE;
+}
+
+static void read_channel(const struct flac_encoder* enc, const uint8_t* in, unsigned channel, unsigned samples, int32_t* out) {
+  const size_t stride = enc->frame_size;
+  switch (enc->format) {
+  case SND_PCM_FORMAT_U8:
+    in += channel;
+    for (unsigned i = 0; i < samples; ++i, in += stride)
+      out[i] = (int32_t)in[0] - 128;
+    break;
+  case SND_PCM_FORMAT_S8:
+    in += channel;
+    for (unsigned i = 0; i < samples; ++i, in += stride)
+      out[i] = (int8_t)in[0];
+    break;
+  case SND_PCM_FORMAT_S16_LE:
+    in += channel * 2;
+    for (unsigned i = 0; i < samples; ++i, in += stride)
+      out[i] = (int16_t)(in[0] | (in[1] << 8));
+    break;
+  case SND_PCM_FORMAT_S24_3LE:
+    in += channel * 3;
+    for (unsigned i = 0; i < samples; ++i, in += stride)
+      out[i] = (int32_t)((uint32_t)in[0] << 8 | (uint32_t)in[1] << 16 | (uint32_t)in[2] << 24) >> 8;
+    break;
+  case SND_PCM_FORMAT_S24_LE:
+    in += channel * 4;
+    for (unsigned i = 0; i < samples; ++i, in += stride)
+      out[i] = (int32_t)((uint32_t)in[0] << 8 | (uint32_t)in[1] << 16 | (uint32_t)in[2] << 24) >> 8;
+    break;
+  default:
+    memset(out, 0, samples * sizeof(*out));
+    break;
+  }
+}
+
+// Pick the fixed predictor order with the smallest residual.
+static unsigned best_fixed_order(const int32_t* x, unsigned n) {
+  uint64_t sum[MAX_FIXED_ORDER + 1] = {0};
+  for (unsigned i = MAX_FIXED_ORDER; i < n; ++i) {
+    const int64_t e0 = x[i];
+    const int64_t e1 = e0 - x[i - 1];
+    const int64_t e2 = e1 - ((int64_t)x[i - 1] - x[i - 2]);
+    const int64_t e3 = e2 - ((int64_t)x[i - 1] - 2 * (int64_t)x[i - 2] + x[i - 3]);
+    const int64_t e4 = e3 - ((int64_t)x[i - 1] - 3 * (int64_t)x[i - 2] + 3 * (int64_t)x[i - 3] - x[i - 4]);
+    sum[0] += (uint64_t)(e0 < 0 ? -e0 : e0);
+    sum[1] += (uint64_t)(e1 < 0 ? -e1 : e1);
+    sum[2] += (uint64_t)(e2 < 0 ? -e2 : e2);
+    sum[3] += (uint64_t)(e3 < 0 ? -e3 : e3);
+    sum[4] += (uint64_t)(e4 < 0 ? -e4 : e4);
+  }
+  unsigned order = 0;
+  for (unsigned o = 1; o <= MAX_FIXED_ORDER; ++o) {
+    if (sum[o] < sum[order])
+      order = o;
+  }
+  return order;
+}
+
+static void fixed_residual(const int32_t* x, unsigned n, unsigned order, int32_t* r) {
+  switch (order) {
+  case 0:
+    for (unsigned i = 0; i < n; ++i)
+      r[i] = x[i];
+    break;
+  case 1:
+    for (unsigned i = 1; i < n; ++i)
+      r[i] = x[i] - x[i - 1];
+    break;
+  case 2:
+    for (unsigned i = 2; i < n; ++i)
+      r[i] = x[i] - 2 * x[i - 1] + x[i - 2];
+    break;
+  case 3:
+    for (unsigned i = 3; i < n; ++i)
+      r[i] = x[i] - 3 * x[i - 1] + 3 * x[i - 2] - x[i - 3];
+    break;
+  case 4:
+    for (unsigned i = 4; i < n; ++i)
+      r[i] = x[i] - 4 * x[i - 1] + 6 * x[i - 2] - 4 * x[i - 3] + x[i - 4];
+    break;
+  }
+}
+
+// Best Rice parameter and its cost in bits for `count` values whose zigzag sum is `sum`.
+static unsigned rice_param(uint64_t sum, unsigned count, uint64_t* bits) {
+  unsigned k = 0;
+  while (k < MAX_RICE_PARAM5 && ((uint64_t)count << (k + 1)) < sum)
+    ++k;
+  uint64_t best = (uint64_t)count * (k + 1) + (sum >> k);
+  if (k > 0) {
+    const uint64_t lower = (uint64_t)count * k + (sum >> (k - 1));
+    if (lower < best) {
+      best = lower;
+      --k;
+    }
+  }
+  *bits = best;
+  return k;
+}
+
+struct rice_plan {
+  unsigned order;
+  unsigned params[1 << MAX_PARTITION_ORDER];
+  bool wide;
+  uint64_t bits;
+};
+
+static void plan_residual(const int32_t* r, unsigned n, unsigned predictor_order, struct rice_plan* plan) {
+  unsigned max_order = 0;
+  while (max_order < MAX_PARTITION_ORDER && n % (2u << max_order) == 0 && (n >> (max_order + 1)) > predictor_order)
+    ++max_order;
+
+  uint64_t sums[1 << MAX_PARTITION_ORDER];
+  const unsigned partitions = 1u << max_order;
+  const unsigned partition_size = n >> max_order;
+  for (unsigned p = 0; p < partitions; ++p) {
+    uint64_t sum = 0;
+    for (unsigned i = p == 0 ? predictor_order : p * partition_size; i < (p + 1) * partition_size; ++i)
+      sum += zigzag(r[i]);
+    sums[p] = sum;
+  }
+
+  plan->bits = UINT64_MAX;
+  for (int order = (int)max_order; order >= 0; --order) {
+    const unsigned count = 1u << order;
+    const unsigned size = n >> order;
+    unsigned params[1 << MAX_PARTITION_ORDER];
+    uint64_t bits = 0;
+    bool wide = false;
+    for (unsigned p = 0; p < count; ++p) {
+      uint64_t partition_bits;
+      params[p] = rice_param(sums[p], p == 0 ? size - predictor_order : size, &partition_bits);
+      bits += partition_bits;
+      wide |= params[p] > MAX_RICE_PARAM4;
+    }
+    bits += (uint64_t)count * (wide ? 5 : 4);
+    if (bits < plan->bits) {
+      plan->bits = bits;
+      plan->order = (unsigned)order;
+      plan->wide = wide;
+      memcpy(plan->params, params, count * sizeof(*params));
+    }
+    // merge pairs for the next lower order
+    for (unsigned p = 0; p < count / 2; ++p)
+      sums[p] = sums[2 * p] + sums[2 * p + 1];
+  }
+}
+
+static void write_subframe(struct bitwriter* bw, const int32_t* x, unsigned n, unsigned bits, int32_t* r) {
+  bool constant = true;
+  for (unsigned i = 1; i < n && constant; ++i)
+    constant = x[i] == x[0];
+  if (constant) {
+    put_bits(bw, 8, 0x00);
+    put_bits(bw, bits, (uint32_t)x[0]);
+    return;
+  }
+
+  const uint64_t verbatim_bits = (uint64_t)n * bits;
+  if (n > MAX_FIXED_ORDER) {
+    const unsigned order = best_fixed_order(x, n);
+    fixed_residual(x, n, order, r);
+    struct rice_plan plan;
+    plan_residual(r, n, order, &plan);
+
+    if (2 + 4 + order * bits + plan.bits < verbatim_bits) {
+      put_bits(bw, 8, (0x08 | order) << 1);
+      for (unsigned i = 0; i < order; ++i)
+        put_bits(bw, bits, (uint32_t)x[i]);
+      put_bits(bw, 2, plan.wide ? 1 : 0);
+      put_bits(bw, 4, plan.order);
+      const unsigned size = n >> plan.order;
+      for (unsigned p = 0; p < (1u << plan.order); ++p) {
+        const unsigned k = plan.params[p];
+        put_bits(bw, plan.wide ? 5 : 4, k);
+        for (unsigned i = p == 0 ? order : p * size; i < (p + 1) * size; ++i)
+          put_rice(bw, k, r[i]);
+      }
+      return;
+    }
+  }
+
+  put_bits(bw, 8, 0x01 << 1);
+  for (unsigned i = 0; i < n; ++i)
+    put_bits(bw, bits, (uint32_t)x[i]);
+}
+
+static void put_utf8(struct bitwriter* bw, uint32_t value) {
+  if (value < 0x80) {
+    put_bits(bw, 8, value);
+    return;
+  }
+  unsigned bytes = 2;
+  while (bytes < 6 && value >= (1u << (5 * bytes + 1)))
+    ++bytes;
+  const unsigned shift = 6 * (bytes - 1);
+  put_bits(bw, 8, ((0xFF00u >> bytes) & 0xFF) | (value >> shift));
+  for (int i = (int)bytes - 2; i >= 0; --i)
+    put_bits(bw, 8, 0x80 | ((value >> (6 * i)) & 0x3F));
+}
+
+size_t flac_encode_frame(const struct flac_encoder* enc, const uint8_t* in, unsigned samples, uint32_t frame_number, int32_t* scratch, uint8_t* out) {
+  static const unsigned SAMPLE_SIZE_CODES[] = {[8] = 1, [16] = 4, [24] = 6};
+
+  struct bitwriter bw = {out, 0, 0, 0};
+  put_bits(&bw, 16, 0xFFF8);           // sync, fixed block size
+  put_bits(&bw, 4, 7);                 // block size - 1 in 16 bits after the frame number
+  put_bits(&bw, 4, 0);                 // rate from STREAMINFO
+  put_bits(&bw, 4, enc->channels - 1); // independent channels
+  put_bits(&bw, 3, SAMPLE_SIZE_CODES[enc->bits]);
+  put_bits(&bw, 1, 0);
+  put_utf8(&bw, frame_number & 0x7FFFFFFF);
+  put_bits(&bw, 16, samples - 1);
+  put_bits(&bw, 8, crc8(out, bw.pos));
+
+  int32_t* x = scratch;
+  int32_t* r = scratch + FLAC_BLOCK_SIZE;
+  for (unsigned c = 0; c < enc->channels; ++c) {
+    read_channel(enc, in, c, samples, x);
+    write_subframe(&bw, x, samples, enc->bits, r);
+  }
+
+  align_byte(&bw);
+  put_bits(&bw, 16, crc16(out, bw.pos));
+  return bw.pos;
+}
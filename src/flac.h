@@ -0,0 +1,39 @@
+#pragma once
+
+#include <alsa/asoundlib.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Samples per channel in every frame but the last one.
+#define FLAC_BLOCK_SIZE   4096
+#define FLAC_MAX_CHANNELS 8
+// the header is at most this long
+#define FLAC_HEADER_SIZE  160
+// rates too high for STREAMINFO are stored divided by this, the exact rate is in a comment
+#define FLAC_RATE_DIVISOR 1000
+
+// A minimal FLAC encoder: fixed predictors and partitioned Rice coding, about what `flac -0` does.
+// Frames are independent, so they can be encoded on any thread in any order, as long as they are output in order.
+struct flac_encoder {
+  snd_pcm_format_t format;
+  unsigned channels;
+  unsigned rate;
+  unsigned bits;
+  size_t frame_size;
+};
+
+bool flac_encoder_init(struct flac_encoder* enc, snd_pcm_format_t format, unsigned channels, unsigned rate, char* errstr, size_t errstr_size);
+
+// Stream marker and STREAMINFO, plus a VORBIS_COMMENT block with the exact rate if STREAMINFO can't hold it. Sizes,
+// sample count and MD5 are left unknown. Returns the size, at most FLAC_HEADER_SIZE.
+size_t flac_encoder_header(const struct flac_encoder* enc, uint8_t* out);
+
+// Upper bound of the encoded size of a frame.
+size_t flac_encoder_max_frame_size(const struct flac_encoder* enc);
+// Number of int32_t the encoder needs as scratch space.
+size_t flac_encoder_scratch_size(const struct flac_encoder* enc);
+
+// Encode at most FLAC_BLOCK_SIZE samples of interleaved input. Returns the encoded size.
+size_t flac_encode_frame(const struct flac_encoder* enc, const uint8_t* in, unsigned samples, uint32_t frame_number, int32_t* scratch, uint8_t* out);
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+
+// Sleep while *addr == expected, at most timeout_ms (negative means forever). Spurious wakeups are possible.
+static inline void futex_wait(_Atomic uint32_t* addr, uint32_t expected, int timeout_ms) {
+  struct timespec ts = {timeout_ms / 1000, (long)(timeout_ms % 1000) * 1000000};
+  syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, expected, timeout_ms < 0 ? NULL : &ts, NULL, 0);
+}
+
+static inline void futex_wake(_Atomic uint32_t* addr) {
+  syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
@@ -1,79 +1,423 @@
+#define _GNU_SOURCE
+
 #include "http.h"
 
 #include "files.h"
 
-#include <alloca.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 
-void http_serve(int fd, const char* method, char* uri) {
-  if (0 != strcmp(method, "GET")) {
-    dprintf(fd, "HTTP/1.0 405 Method Not Allowed\r\n\r\n");
-    return;
+// threads serving the event loop, the streams get their own on top of these
+#define HTTP_WORKERS 4
+// how long a worker waits for a slow client to take a buffered response
+#define HTTP_SEND_TIMEOUT_MS 5000
+// an uri of 127 characters can't have more
+#define HTTP_MAX_ARGS 64
+
+struct http_request {
+  char method[8];
+  char uri[128];
+  int version_minor;
+  bool keep_alive;
+  const struct served_file* file;
+  // from a "Range: bytes=<offset>-" header, -1 without
+  long long range_offset;
+  char range_arg[32];
+  int argc;
+  char* argv[HTTP_MAX_ARGS + 1];
+};
+
+struct http_conn {
+  int fd;
+  size_t len;
+  char buf[0x1000];
+};
+
+struct http_worker {
+  int epoll_fd;
+  int server_fd;
+};
+
+static bool http_parse(const char* buf, struct http_request* req) {
+  memset(req, 0, sizeof(*req));
+  int version_major;
+  if (4 != sscanf(buf, "%7s %127s HTTP/%d.%d\r\n", req->method, req->uri, &version_major, &req->version_minor) || version_major != 1)
+    return false;
+
+  // HTTP/1.1 keeps the connection by default, 1.0 only when asked to
+  req->keep_alive = req->version_minor >= 1;
+  req->range_offset = -1;
+  for (const char* line = strstr(buf, "\r\n"); line && line[2] != '\r'; line = strstr(line + 2, "\r\n")) {
+    // only open-ended ranges make sense for the streams
+    long long offset;
+    char dash;
+    if (0 == strncasecmp(line + 2, "range:", 6) && 2 == sscanf(line + 8, " bytes=%lld%c", &offset, &dash) && dash == '-' && offset >= 0)
+      req->range_offset = offset;
+    if (0 != strncasecmp(line + 2, "connection:", 11))
+      continue;
+    const char* value = line + 13;
+    while (*value == ' ' || *value == '\t')
+      ++value;
+    if (0 == strncasecmp(value, "close", 5))
+      req->keep_alive = false;
+    else if (0 == strncasecmp(value, "keep-alive", 10))
+      req->keep_alive = true;
   }
 
-  char** argv = NULL;
-  int argc = 0;
-  char* args_begin = strchr(uri, '?');
-  if (args_begin != NULL) {
-    *args_begin++ = 0;
-    argc = 1;
-    for (const char* p = args_begin; *p; ++p)
-      if (*p == '&')
-        argc += 1;
-    argv = (char**)alloca(sizeof(char*) * argc);
-    char** args_it = argv;
-    *args_it++ = args_begin;
-    for (char* p = args_begin; *p; ++p) {
-      if (*p == '&') {
-        *p = 0;
-        *args_it++ = p + 1;
-      }
+  const size_t path_len = strcspn(req->uri, "?");
+  for (const struct served_file* file = SERVED_FILES; file->path; ++file) {
+    if (strlen(file->path) == path_len && 0 == strncmp(file->path, req->uri, path_len)) {
+      req->file = file;
+      break;
     }
   }
+  return true;
+}
 
-  for (const struct served_file* file = SERVED_FILES; file->path; ++file) {
-    if (0 != strcmp(file->path, uri))
+// Split the query string into arguments. The pointers go into `uri`, so this must be done after the request is in place.
+static void http_split_args(struct http_request* req) {
+  char* args_begin = strchr(req->uri, '?');
+  req->argc = 0;
+  if (args_begin == NULL)
+    return;
+  *args_begin++ = 0;
+  req->argv[req->argc++] = args_begin;
+  for (char* p = args_begin; *p && req->argc < HTTP_MAX_ARGS; ++p) {
+    if (*p == '&') {
+      *p = 0;
+      req->argv[req->argc++] = p + 1;
+    }
+  }
+}
+
+static bool http_send(int fd, struct iovec* iov, int iovcnt) {
+  while (iovcnt) {
+    ssize_t count = writev(fd, iov, iovcnt);
+    if (count < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        return false;
+      struct pollfd pfd = {fd, POLLOUT, 0};
+      if (poll(&pfd, 1, HTTP_SEND_TIMEOUT_MS) <= 0)
+        return false;
       continue;
+    }
+    while (iovcnt && (size_t)count >= iov->iov_len) {
+      count -= iov->iov_len;
+      ++iov;
+      --iovcnt;
+    }
+    if (iovcnt) {
+      iov->iov_base = (char*)iov->iov_base + count;
+      iov->iov_len -= count;
+    }
+  }
+  return true;
+}
+
+static bool http_send_status(int fd, const struct http_request* req, const char* status, bool keep_alive) {
+  char header[256];
+  struct iovec iov = {header, 0};
+  iov.iov_len = snprintf(
+    header,
+    sizeof(header),
+    "HTTP/1.%d %s\r\nContent-Length: 0\r\nConnection: %s\r\n\r\n",
+    req ? req->version_minor : 0,
+    status,
+    keep_alive ? "keep-alive" : "close"
+  );
+  return http_send(fd, &iov, 1);
+}
+
+// A status with a short plain text body, for errors the client should see.
+static bool http_send_error(int fd, const struct http_request* req, const char* status, const char* reason) {
+  char header[256];
+  struct iovec iov[3] = {{header, 0}, {(void*)reason, strlen(reason)}, {"\n", 1}};
+  iov[0].iov_len = snprintf(
+    header,
+    sizeof(header),
+    "HTTP/1.%d %s\r\nContent-Type: text/plain; charset=utf-8\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+    req->version_minor,
+    status,
+    iov[1].iov_len + 1
+  );
+  return http_send(fd, iov, 3);
+}
+
+bool http_send_head(int fd, struct http_head* head, long long stream_offset) {
+  char header[512];
+  struct iovec iov = {header, 0};
+  if (stream_offset >= 0 && head->range_offset >= 0) {
+    // A range needs an end, which the streams don't have, so it goes up to the largest position there can be. The
+    // body is sent until the stream ends, without a length.
+    iov.iov_len = snprintf(
+      header,
+      sizeof(header),
+      "HTTP/1.%d 206 Partial Content\r\n%sContent-Range: bytes %lld-%lld/*\r\nX-Stream-Offset: %lld\r\nConnection: close\r\n\r\n",
+      head->version_minor,
+      head->headers,
+      stream_offset,
+      LLONG_MAX - 1,
+      stream_offset
+    );
+  } else if (stream_offset >= 0) {
+    iov.iov_len = snprintf(header, sizeof(header), "HTTP/1.%d 200 OK\r\n%sX-Stream-Offset: %lld\r\nConnection: close\r\n\r\n", head->version_minor, head->headers, stream_offset);
+  } else {
+    iov.iov_len = snprintf(header, sizeof(header), "HTTP/1.%d 200 OK\r\n%sConnection: close\r\n\r\n", head->version_minor, head->headers);
+  }
+  head->sent = true;
+  return http_send(fd, &iov, 1);
+}
+
+// Run the handler into memory, then send the headers and the whole body with one writev.
+static bool http_serve_buffered(int fd, struct http_request* req) {
+  http_split_args(req);
+  char* body = NULL;
+  size_t size = 0;
+  FILE* out = open_memstream(&body, &size);
+  if (!out)
+    goto error;
+  req->file->fn(out, req->argc, req->argv);
+  if (fclose(out) != 0)
+    goto error;
+
+  char header[512];
+  struct iovec iov[2] = {{header, 0}, {body, size}};
+  iov[0].iov_len = snprintf(
+    header,
+    sizeof(header),
+    "HTTP/1.%d 200 OK\r\n%sContent-Length: %zu\r\nConnection: %s\r\n\r\n",
+    req->version_minor,
+    req->file->headers ? req->file->headers : "",
+    size,
+    req->keep_alive ? "keep-alive" : "close"
+  );
+  const bool ok = http_send(fd, iov, 2) && req->keep_alive;
+  free(body);
+  return ok;
+
+error:
+  perror("buffering response failed");
+  free(body);
+  http_send_status(fd, req, "500 Internal Server Error", false);
+  return false;
+}
 
-    dprintf(fd, "HTTP/1.0 200 OK\r\n%s\r\n", file->headers ? file->headers : "");
-    file->fn(fd, argc, argv);
+struct http_dedicated {
+  int fd;
+  struct http_request req;
+};
+
+static void* http_dedicated_thread(void* arg) {
+  struct http_dedicated* d = arg;
+  struct http_request* req = &d->req;
+  if (req->file->fn) {
+    req->keep_alive = false;
+    http_serve_buffered(d->fd, req);
+    goto done;
+  }
+  http_split_args(req);
+  struct http_head head = {req->version_minor, req->file->headers ? req->file->headers : "", -1, false};
+  char errstr[256];
+  if (req->file->check && !req->file->check(req->argc, req->argv, errstr, sizeof(errstr))) {
+    http_send_error(d->fd, req, "400 Bad Request", errstr);
+    goto done;
+  }
+  if (req->range_offset >= 0 && req->file->range) {
+    if (!req->file->range(req->argc, req->argv, (unsigned long long)req->range_offset)) {
+      http_send_status(d->fd, req, "416 Range Not Satisfiable", false);
+      goto done;
+    }
+    head.range_offset = req->range_offset;
+    snprintf(req->range_arg, sizeof(req->range_arg), "offset=%lld", req->range_offset);
+    req->argv[req->argc++] = req->range_arg;
+  }
+  req->file->dedicated(d->fd, &head, req->argc, req->argv);
+  if (!head.sent)
+    http_send_error(d->fd, req, "503 Service Unavailable", "nothing to send, see the server log");
+
+done:
+  close(d->fd);
+  free(d);
+  return NULL;
+}
+
+// Hand the connection over to a thread of its own. Takes ownership of `fd`.
+static void http_serve_dedicated(int fd, const struct http_request* req) {
+  struct http_dedicated* d = malloc(sizeof(*d));
+  if (!d) {
+    close(fd);
+    return;
+  }
+  d->fd = fd;
+  d->req = *req;
+
+  // the handlers expect blocking writes
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+
+  pthread_t thread_id;
+  int err = 0;
+  if ((err = pthread_create(&thread_id, NULL, http_dedicated_thread, d)) != 0) {
+    fprintf(stderr, "can't create http thread: %d\n", err);
+    close(fd);
+    free(d);
     return;
   }
+  if ((err = pthread_detach(thread_id)) != 0)
+    fprintf(stderr, "can't detach http thread: %d\n", err);
+}
 
-  dprintf(fd, "HTTP/1.0 404 Not Found\r\n\r\n");
+static void http_conn_close(struct http_worker* w, struct http_conn* conn) {
+  epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+  close(conn->fd);
+  free(conn);
 }
 
-void* http_thread(void* arg) {
-  const int client_fd = (int)(intptr_t)arg;
-
-  do {
-    char buf[0x1000];
-    ssize_t len = 0;
-    do {
-      int cur = read(client_fd, buf + len, sizeof(buf) - len - 1);
-      len += cur;
-      if (cur <= 0 || len == sizeof(buf) - 1) {
-        len = 0;
+// Serve every complete request buffered, then wait for more. Only one worker at a time handles a connection.
+static void http_conn_ready(struct http_worker* w, struct http_conn* conn) {
+  while (1) {
+    char* end = strstr(conn->buf, "\r\n\r\n");
+    if (!end) {
+      if (conn->len == sizeof(conn->buf) - 1) {
+        http_send_status(conn->fd, NULL, "431 Request Header Fields Too Large", false);
+        break;
+      }
+      const ssize_t count = read(conn->fd, conn->buf + conn->len, sizeof(conn->buf) - 1 - conn->len);
+      if (count < 0 && errno == EINTR)
+        continue;
+      if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        struct epoll_event ev = {EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, {.ptr = conn}};
+        if (0 == epoll_ctl(w->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev))
+          return;
         break;
       }
-      buf[len] = 0;
-    } while (NULL == strstr(buf, "\r\n\r\n"));
+      if (count <= 0)
+        break;
+      conn->len += count;
+      conn->buf[conn->len] = 0;
+      continue;
+    }
 
-    if (!len)
+    struct http_request req;
+    if (!http_parse(conn->buf, &req)) {
+      http_send_status(conn->fd, NULL, "400 Bad Request", false);
+      break;
+    }
+    if (0 != strcmp(req.method, "GET")) {
+      if (!http_send_status(conn->fd, &req, "405 Method Not Allowed", req.keep_alive) || !req.keep_alive)
+        break;
+    } else if (!req.file) {
+      if (!http_send_status(conn->fd, &req, "404 Not Found", req.keep_alive) || !req.keep_alive)
+        break;
+    } else if (req.file->dedicated || req.file->slow) {
+      epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+      http_serve_dedicated(conn->fd, &req);
+      free(conn);
+      return;
+    } else if (!http_serve_buffered(conn->fd, &req)) {
       break;
+    }
 
-    char method[8];
-    int version1, version2;
-    char uri[128];
-    if (4 != sscanf(buf, "%7s %127s HTTP/%d.%d\r\n", method, uri, &version1, &version2)) {
-      dprintf(client_fd, "HTTP/1.0 400 Bad Request\r\n\r\n");
+    // keep whatever the client sent after this request
+    const size_t request_len = end + 4 - conn->buf;
+    memmove(conn->buf, conn->buf + request_len, conn->len - request_len + 1);
+    conn->len -= request_len;
+  }
+  http_conn_close(w, conn);
+}
+
+static void http_accept(struct http_worker* w) {
+  while (1) {
+    const int fd = accept4(w->server_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        perror("accept failed");
       break;
     }
+    struct http_conn* conn = malloc(sizeof(*conn));
+    if (!conn) {
+      close(fd);
+      continue;
+    }
+    conn->fd = fd;
+    conn->len = 0;
+    conn->buf[0] = 0;
+    struct epoll_event ev = {EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, {.ptr = conn}};
+    if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+      perror("epoll_ctl failed");
+      close(fd);
+      free(conn);
+    }
+  }
+  // the listener is one shot too, so only one worker accepts at a time
+  struct epoll_event ev = {EPOLLIN | EPOLLONESHOT, {.ptr = NULL}};
+  epoll_ctl(w->epoll_fd, EPOLL_CTL_MOD, w->server_fd, &ev);
+}
 
-    http_serve(client_fd, method, uri);
-  } while (0);
-  close(client_fd);
+static void* http_worker_thread(void* arg) {
+  struct http_worker* w = arg;
+  while (1) {
+    // one event at a time, so a slow request doesn't hold up others another worker could take
+    struct epoll_event event;
+    const int count = epoll_wait(w->epoll_fd, &event, 1, -1);
+    if (count < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("epoll_wait failed");
+      break;
+    }
+    if (count == 0)
+      continue;
+    if (event.data.ptr == NULL)
+      http_accept(w);
+    else
+      http_conn_ready(w, event.data.ptr);
+  }
   return NULL;
 }
+
+bool http_run(int server_fd) {
+  static struct http_worker workers[HTTP_WORKERS];
+
+  fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL) | O_NONBLOCK);
+  const int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd < 0) {
+    perror("epoll_create1 failed");
+    return false;
+  }
+  struct epoll_event ev = {EPOLLIN | EPOLLONESHOT, {.ptr = NULL}};
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &ev) != 0) {
+    perror("epoll_ctl failed");
+    return false;
+  }
+
+  for (size_t i = 0; i < HTTP_WORKERS; ++i)
+    workers[i] = (struct http_worker){epoll_fd, server_fd};
+  // the main thread is the first worker
+  for (size_t i = 1; i < HTTP_WORKERS; ++i) {
+    pthread_t thread_id;
+    int err = 0;
+    if ((err = pthread_create(&thread_id, NULL, http_worker_thread, &workers[i])) != 0) {
+      fprintf(stderr, "can't create http worker thread: %d\n", err);
+      return false;
+    }
+    pthread_detach(thread_id);
+  }
+  http_worker_thread(&workers[0]);
+  return false;
+}
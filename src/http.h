@@ -1,11 +1,48 @@
 #pragma once
 
-typedef void(servefile_fn)(int fd, int argc, char** argv);
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
 
-void* http_thread(void* arg);
+// The status line and headers of a dedicated response. The handler sends them with http_send_head once it knows what
+// to answer, if it returns without, the client gets a 503.
+struct http_head {
+  int version_minor;
+  const char* headers;
+  // from a "Range: bytes=<offset>-" header the range hook agreed to, -1 without
+  long long range_offset;
+  bool sent;
+};
+
+typedef void(servefile_fn)(FILE* out, int argc, char** argv);
+typedef void(servefile_dedicated_fn)(int fd, struct http_head* head, int argc, char** argv);
+// Whether a dedicated handler can serve the request from byte `offset` on, for a Range header.
+typedef bool(servefile_range_fn)(int argc, char** argv, unsigned long long offset);
+// Whether a dedicated handler can serve the request at all. Otherwise fills in why.
+typedef bool(servefile_check_fn)(int argc, char** argv, char* errstr, size_t errstr_size);
+
+// Accept and serve connections on a listening socket. Only returns on fatal errors.
+bool http_run(int server_fd);
+
+// Send the head of a dedicated response. A stream passes the stream position its body starts at as `stream_offset`,
+// which goes into an X-Stream-Offset header, and makes a Range request a 206. Otherwise -1.
+bool http_send_head(int fd, struct http_head* head, long long stream_offset);
 
 struct served_file {
   const char* path;
   const char* headers;
+  // Writes the body to memory, it is sent with a Content-Length and the connection can keep-alive.
   servefile_fn* fn;
+  // Instead of `fn`, runs on a thread of its own and writes straight to the socket, which is closed afterwards. For the
+  // streams and anything else that can block for long.
+  servefile_dedicated_fn* dedicated;
+  // With this, a "Range: bytes=<offset>-" request gets the handler called with an extra "offset=<offset>" argument, and
+  // a 206 from http_send_head, or a 416 if the offset can't be served. Without, the Range header is ignored.
+  servefile_range_fn* range;
+  // For a dedicated handler, called before the response starts, a request it fails gets a 400 with the reason.
+  servefile_check_fn* check;
+  // With `fn`, run it on a thread of its own like a dedicated handler, for the control endpoints that can take a second
+  // or more, like /arm setting up the ring buffers. The body is still sent with a Content-Length, then the connection
+  // is closed.
+  bool slow;
 };
@@ -1,5 +1,4 @@
 #include <arpa/inet.h>
-#include <pthread.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <unistd.h>
@@ -106,32 +105,9 @@ int main(int argc, char* argv[]) {
   }
 
   printf("server listening on %s\n", argv[1]);
-  while (1) {
-    // client info
-    struct sockaddr_in client_addr;
-    socklen_t client_addr_len = sizeof(client_addr);
-
-    // accept client connection
-    const int client_fd = accept(server_fd, (struct sockaddr*)&client_addr, &client_addr_len);
-
-    if (client_fd < 0) {
-      perror("accept failed");
-      continue;
-    }
-
-    // create a new thread to handle client request
-    pthread_t thread_id;
-    int err = 0;
-    if ((err = pthread_create(&thread_id, NULL, http_thread, (void*)(intptr_t)client_fd)) != 0) {
-      fprintf(stderr, "can't create http thread: %d\n", err);
-      continue;
-    }
-    if ((err = pthread_detach(thread_id)) != 0) {
-      fprintf(stderr, "can't detach http thread: %d\n", err);
-      continue;
-    }
-  }
+  fflush(stdout);
+  http_run(server_fd);
 
   close(server_fd);
-  return 0;
+  return EXIT_FAILURE;
 }
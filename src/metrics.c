@@ -0,0 +1,25 @@
+#include "metrics.h"
+
+#include <stdio.h>
+
+void histogram_reset(struct histogram* h) {
+  for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i)
+    h->buckets[i] = 0;
+  h->sum = 0;
+}
+
+void metrics_family(FILE* out, const char* name, const char* type, const char* help) {
+  fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void metrics_histogram(FILE* out, const char* name, const char* labels, const struct histogram* h, double scale) {
+  uint64_t count = 0;
+  for (size_t i = 0; i < HISTOGRAM_BUCKETS - 1; ++i) {
+    count += h->buckets[i];
+    fprintf(out, "%s_bucket{%s,le=\"%.12g\"} %llu\n", name, labels, (double)(1ull << i) * scale, (unsigned long long)count);
+  }
+  count += h->buckets[HISTOGRAM_BUCKETS - 1];
+  fprintf(out, "%s_bucket{%s,le=\"+Inf\"} %llu\n", name, labels, (unsigned long long)count);
+  fprintf(out, "%s_sum{%s} %.12g\n", name, labels, (double)h->sum * scale);
+  fprintf(out, "%s_count{%s} %llu\n", name, labels, (unsigned long long)count);
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Bucket i counts the values up to and including 2^i that are not in a smaller bucket, the last one everything else. The
+// bounds are inclusive like Prometheus `le`, so a 4096 byte read counts as le="4096".
+#define HISTOGRAM_BUCKETS 40
+
+// Histogram with power of two buckets. Adding is a couple of relaxed atomic increments, so it can be used from any thread.
+struct histogram {
+  _Atomic uint64_t buckets[HISTOGRAM_BUCKETS];
+  _Atomic uint64_t sum;
+};
+
+static inline void histogram_add(struct histogram* h, uint64_t value) {
+  // the bit length of value - 1, so exact powers of two stay in their own bucket
+  unsigned bucket = value > 1 ? 64 - (unsigned)__builtin_clzll(value - 1) : 0;
+  if (bucket >= HISTOGRAM_BUCKETS)
+    bucket = HISTOGRAM_BUCKETS - 1;
+  atomic_fetch_add_explicit(&h->buckets[bucket], 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&h->sum, value, memory_order_relaxed);
+}
+
+void histogram_reset(struct histogram* h);
+
+// Writers for the Prometheus text exposition format.
+
+// The HELP and TYPE lines, once before all samples of a metric.
+void metrics_family(FILE* out, const char* name, const char* type, const char* help);
+// The samples of a histogram. `labels` are without braces, `scale` converts the values to the metric's unit.
+void metrics_histogram(FILE* out, const char* name, const char* labels, const struct histogram* h, double scale);
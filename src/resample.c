@@ -0,0 +1,125 @@
+#include "resample.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HISTORY 3
+
+bool resampler_init(struct resampler* r, snd_pcm_format_t format, unsigned channels, char* errstr, size_t errstr_size) {
+  memset(r, 0, sizeof(*r));
+  r->format = format;
+  r->channels = channels;
+  r->is_signed = true;
+  // only little endian formats, like the deinterleaver
+  switch (format) {
+  case SND_PCM_FORMAT_U8:
+    r->is_signed = false;
+    // fall through
+  case SND_PCM_FORMAT_S8:
+    r->physical = r->significant = 1;
+    break;
+  case SND_PCM_FORMAT_S16_LE:
+    r->physical = r->significant = 2;
+    break;
+  case SND_PCM_FORMAT_S24_3LE:
+    r->physical = r->significant = 3;
+    break;
+  case SND_PCM_FORMAT_S24_LE:
+    r->physical = 4;
+    r->significant = 3;
+    break;
+  case SND_PCM_FORMAT_S32_LE:
+    r->physical = r->significant = 4;
+    break;
+  default:
+    snprintf(errstr, errstr_size, "can't resample %s", snd_pcm_format_name(format));
+    return false;
+  }
+  if (channels == 0 || channels > RESAMPLE_MAX_CHANNELS) {
+    snprintf(errstr, errstr_size, "can't resample %u channels", channels);
+    return false;
+  }
+  r->frame_size = r->physical * channels;
+  r->work = malloc((HISTORY + RESAMPLE_CHUNK) * channels * sizeof(*r->work));
+  if (!r->work) {
+    snprintf(errstr, errstr_size, "failed to allocate resampler buffer");
+    return false;
+  }
+  return true;
+}
+
+void resampler_free(struct resampler* r) {
+  free(r->work);
+  r->work = NULL;
+}
+
+static inline int32_t decode(const struct resampler* r, const uint8_t* in) {
+  uint32_t v = 0;
+  for (size_t b = 0; b < r->significant; ++b)
+    v |= (uint32_t)in[b] << (8 * b);
+  const unsigned shift = 32 - 8 * (unsigned)r->significant;
+  if (!r->is_signed)
+    v ^= 0x80u << (8 * (r->significant - 1));
+  return (int32_t)(v << shift) >> shift;
+}
+
+static inline void encode(const struct resampler* r, double value, uint8_t* out) {
+  const double max = (double)((1ull << (8 * r->significant - 1)) - 1);
+  value = round(value);
+  if (value > max)
+    value = max;
+  if (value < -max - 1)
+    value = -max - 1;
+  uint32_t v = (uint32_t)(int32_t)value;
+  if (!r->is_signed)
+    v ^= 0x80u << (8 * (r->significant - 1));
+  // S24_LE keeps the sign in the padding byte
+  for (size_t b = 0; b < r->physical; ++b)
+    out[b] = (uint8_t)(v >> (8 * b));
+}
+
+size_t resampler_run(struct resampler* r, const uint8_t* in, size_t frames, double step, uint8_t* out) {
+  const unsigned channels = r->channels;
+  if (frames > RESAMPLE_CHUNK)
+    frames = RESAMPLE_CHUNK;
+  if (frames == 0)
+    return 0;
+  if (step < 1 - RESAMPLE_MAX_SKEW)
+    step = 1 - RESAMPLE_MAX_SKEW;
+  if (step > 1 + RESAMPLE_MAX_SKEW)
+    step = 1 + RESAMPLE_MAX_SKEW;
+
+  int32_t* work = r->work;
+  for (size_t i = 0; i < frames * channels; ++i)
+    work[HISTORY * channels + i] = decode(r, in + i * r->physical);
+  // the stream starts with its first frame, as if it had been there all along
+  if (!r->primed) {
+    for (size_t h = 0; h < HISTORY; ++h)
+      memcpy(work + h * channels, work + HISTORY * channels, channels * sizeof(*work));
+    r->pos = HISTORY;
+    r->primed = true;
+  }
+
+  // Catmull-Rom through the frames around each output position
+  size_t count = 0;
+  const size_t end = HISTORY + frames;
+  double pos = r->pos;
+  while ((size_t)pos + 2 < end) {
+    const size_t i = (size_t)pos;
+    const double t = pos - (double)i;
+    const int32_t* x = work + (i - 1) * channels;
+    for (unsigned c = 0; c < channels; ++c) {
+      const double x0 = x[c], x1 = x[channels + c], x2 = x[2 * channels + c], x3 = x[3 * channels + c];
+      const double y = x1 + 0.5 * t * (x2 - x0 + t * (2 * x0 - 5 * x1 + 4 * x2 - x3 + t * (3 * (x1 - x2) + x3 - x0)));
+      encode(r, y, out + count * r->frame_size + c * r->physical);
+    }
+    ++count;
+    pos += step;
+  }
+
+  memmove(work, work + frames * channels, HISTORY * channels * sizeof(*work));
+  r->pos = pos - (double)frames;
+  return count;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <alsa/asoundlib.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define RESAMPLE_MAX_CHANNELS 16
+// input frames per call, and the most the step may differ from 1, so a bad estimate can't do much harm
+#define RESAMPLE_CHUNK    4096
+#define RESAMPLE_MAX_SKEW 0.01
+// upper bound of the output frames per call
+#define RESAMPLE_MAX_OUT  (RESAMPLE_CHUNK + RESAMPLE_CHUNK / 64 + 4)
+
+// Fractional resampler for interleaved frames by cubic interpolation, for correcting clock drift of a few ppm up to a
+// percent rather than changing rates. The output has the input's format. Keeps the last frames between calls, so a
+// stream can be fed in chunks of any size, with a step that may change between them.
+struct resampler {
+  snd_pcm_format_t format;
+  unsigned channels;
+  size_t physical;
+  size_t significant;
+  bool is_signed;
+  size_t frame_size;
+
+  // position of the next output frame in `work`, which starts with the last 3 frames of the previous call
+  double pos;
+  bool primed;
+  int32_t* work;
+};
+
+bool resampler_init(struct resampler* r, snd_pcm_format_t format, unsigned channels, char* errstr, size_t errstr_size);
+void resampler_free(struct resampler* r);
+
+// Resample up to RESAMPLE_CHUNK frames, taking `step` input frames per output frame. Returns the output frame count.
+size_t resampler_run(struct resampler* r, const uint8_t* in, size_t frames, double step, uint8_t* out);
@@ -0,0 +1,99 @@
+#include "rfstats.h"
+
+#include <string.h>
+
+void rf_stats_reset(struct rf_stats* rf, size_t window_size) {
+  for (size_t i = 0; i < 256; ++i)
+    rf->histogram[i] = 0;
+  rf->analyzed = 0;
+  rf->skipped = 0;
+  rf->window_min = 0;
+  rf->window_max = 0;
+  rf->window_mean = 0;
+  rf->window_rms = 0;
+  rf->window_clipped = 0;
+  rf->windows = 0;
+  rf->step_size = window_size / RF_STEPS;
+  for (size_t i = 0; i < RF_STEPS; ++i) {
+    envelope_reset(&rf->steps[i]);
+    rf->step_clipped[i] = 0;
+  }
+  rf->step = 0;
+  rf->steps_done = 0;
+}
+
+void rf_histogram_u8(uint64_t hist[256], const uint8_t* in, size_t n) {
+  // Consecutive increments of the same bin wait for each other, which is common with RF, so spread the samples over
+  // four tables. A scatter like this doesn't vectorize, but loading 8 samples at once still saves most of the loads.
+  uint32_t tables[4][256];
+  memset(tables, 0, sizeof(tables));
+  size_t i = 0;
+  while (i < n) {
+    // flush before the 32 bit counts can overflow
+    const size_t end = n - i > (1u << 30) ? i + (1u << 30) : n;
+    for (; i + 8 <= end; i += 8) {
+      uint64_t x;
+      memcpy(&x, in + i, sizeof(x));
+      ++tables[0][x & 0xff];
+      ++tables[1][(x >> 8) & 0xff];
+      ++tables[2][(x >> 16) & 0xff];
+      ++tables[3][(x >> 24) & 0xff];
+      ++tables[0][(x >> 32) & 0xff];
+      ++tables[1][(x >> 40) & 0xff];
+      ++tables[2][(x >> 48) & 0xff];
+      ++tables[3][x >> 56];
+    }
+    for (; i < end; ++i)
+      ++tables[0][in[i]];
+    for (size_t v = 0; v < 256; ++v) {
+      hist[v] += (uint64_t)tables[0][v] + tables[1][v] + tables[2][v] + tables[3][v];
+      tables[0][v] = tables[1][v] = tables[2][v] = tables[3][v] = 0;
+    }
+  }
+}
+
+static void rf_window_add(struct rf_stats* rf, const uint8_t* in, size_t n) {
+  uint64_t hist[256];
+  memset(hist, 0, sizeof(hist));
+  rf_histogram_u8(hist, in, n);
+  for (size_t v = 0; v < 256; ++v) {
+    if (hist[v])
+      atomic_fetch_add_explicit(&rf->histogram[v], hist[v], memory_order_relaxed);
+  }
+  rf->step_clipped[rf->step] += hist[0] + hist[255];
+  envelope_add_u8(&rf->steps[rf->step], in, n);
+  rf->analyzed += n;
+
+  if (rf->steps[rf->step].count < rf->step_size)
+    return;
+  rf->step = (rf->step + 1) % RF_STEPS;
+  if (++rf->steps_done >= RF_STEPS) {
+    struct envelope window;
+    envelope_reset(&window);
+    uint64_t clipped = 0;
+    for (size_t i = 0; i < RF_STEPS; ++i) {
+      envelope_merge(&window, &rf->steps[i]);
+      clipped += rf->step_clipped[i];
+    }
+    rf->window_min = window.min;
+    rf->window_max = window.max;
+    rf->window_mean = (double)window.sum / (double)window.count;
+    rf->window_rms = envelope_rms(&window);
+    rf->window_clipped = clipped;
+    ++rf->windows;
+  }
+  // the oldest step makes room for the next
+  envelope_reset(&rf->steps[rf->step]);
+  rf->step_clipped[rf->step] = 0;
+}
+
+void rf_stats_add(struct rf_stats* rf, const uint8_t* in, size_t n) {
+  while (n) {
+    size_t len = rf->step_size - rf->steps[rf->step].count;
+    if (len > n)
+      len = n;
+    rf_window_add(rf, in, len);
+    in += len;
+    n -= len;
+  }
+}
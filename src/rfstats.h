@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "envelope.h"
+
+// steps a window slides by, the window fields are updated every 1/RF_STEPS of a window
+#define RF_STEPS 10
+
+// Signal quality of a U8 RF stream, for spotting bad gain settings while capturing. The value histogram and clip
+// counts cover the whole capture, the rest the latest complete window. Single writer, readers may see a window's
+// fields from two different windows.
+struct rf_stats {
+  _Atomic uint64_t histogram[256];
+  _Atomic uint64_t analyzed;
+  // data the analyzer fell too far behind to look at
+  _Atomic uint64_t skipped;
+
+  _Atomic int32_t window_min;
+  _Atomic int32_t window_max;
+  _Atomic double window_mean;
+  _Atomic double window_rms;
+  // samples at 0 or 255 in the window
+  _Atomic uint64_t window_clipped;
+  _Atomic uint64_t windows;
+
+  // The analyzer's own state. A window is made of the latest RF_STEPS steps, `step` is the one being filled.
+  size_t step_size;
+  struct envelope steps[RF_STEPS];
+  uint64_t step_clipped[RF_STEPS];
+  size_t step;
+  // complete steps so far, the first window is published once there are RF_STEPS
+  size_t steps_done;
+};
+
+// `window_size` is rounded down to a multiple of RF_STEPS.
+void rf_stats_reset(struct rf_stats* rf, size_t window_size);
+// Account the next `n` samples of the stream.
+void rf_stats_add(struct rf_stats* rf, const uint8_t* in, size_t n);
+
+// Count the values into `hist`, which is added to.
+void rf_histogram_u8(uint64_t hist[256], const uint8_t* in, size_t n);
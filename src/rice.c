@@ -0,0 +1,248 @@
+#include "rice.h"
+
+#include <string.h>
+
+#include "le.h"
+
+// Parameter of a block stored as plain bytes.
+#define RICE_PARAM_RAW 8
+#define RICE_PARAM_BITS 4
+// Fixed predictors like FLAC's: 0 predicts the midpoint, 1 the previous value, 2 extends the line through the previous two.
+#define RICE_ORDERS     3
+#define RICE_ORDER_BITS 2
+// Quotients from this on are written as this many zeros and the value in 8 bits.
+#define RICE_ESCAPE 16
+
+struct bit_writer {
+  uint8_t* out;
+  size_t len;
+  uint64_t acc;
+  unsigned bits;
+};
+
+// at most 24 bits at a time
+static inline void put_bits(struct bit_writer* bw, uint32_t value, unsigned count) {
+  bw->acc = (bw->acc << count) | value;
+  bw->bits += count;
+  if (bw->bits >= 32) {
+    bw->bits -= 32;
+    const uint32_t word = (uint32_t)(bw->acc >> bw->bits);
+    bw->out[bw->len++] = (uint8_t)(word >> 24);
+    bw->out[bw->len++] = (uint8_t)(word >> 16);
+    bw->out[bw->len++] = (uint8_t)(word >> 8);
+    bw->out[bw->len++] = (uint8_t)word;
+  }
+}
+
+static void flush_bits(struct bit_writer* bw) {
+  if (bw->bits % 8)
+    put_bits(bw, 0, 8 - bw->bits % 8);
+  for (; bw->bits; bw->bits -= 8)
+    bw->out[bw->len++] = (uint8_t)(bw->acc >> (bw->bits - 8));
+}
+
+static inline uint8_t zigzag(uint8_t delta) {
+  return (uint8_t)((delta << 1) ^ (uint8_t)((int8_t)delta >> 7));
+}
+
+static inline uint8_t unzigzag(uint8_t value) {
+  return (uint8_t)((value >> 1) ^ (uint8_t)-(value & 1));
+}
+
+size_t rice_max_frame_size(size_t raw_len) {
+  // predictor and parameter per block, stored bytes otherwise, and the last word of the bit writer
+  return RICE_HEADER_SIZE + raw_len + (raw_len / RICE_BLOCK + 1) * (RICE_ORDER_BITS + RICE_PARAM_BITS) / 8 + 8;
+}
+
+static inline uint8_t predict(unsigned order, uint8_t p1, uint8_t p2) {
+  return order == 0 ? 0x80 : order == 1 ? p1 : (uint8_t)(2 * p1 - p2);
+}
+
+// Residuals of the block starting at `start` for every predictor, with the values before the frame taken as 0x80. The
+// fast path has the block and its predictors in one part.
+static void block_residuals(const uint8_t* in, size_t len, const uint8_t* in2, size_t start, size_t n, unsigned stride, uint8_t v[RICE_ORDERS][RICE_BLOCK]) {
+  const size_t back = 2 * (size_t)stride;
+  if (start >= back && (start + n <= len || start - back >= len)) {
+    const uint8_t* x = start + n <= len ? in + start : in2 + (start - len);
+    const uint8_t* p1 = x - stride;
+    const uint8_t* p2 = x - back;
+    for (size_t i = 0; i < n; ++i) {
+      v[0][i] = zigzag((uint8_t)(x[i] - 0x80));
+      v[1][i] = zigzag((uint8_t)(x[i] - p1[i]));
+      v[2][i] = zigzag((uint8_t)(x[i] - 2 * p1[i] + p2[i]));
+    }
+    return;
+  }
+  for (size_t i = 0; i < n; ++i) {
+    const size_t at = start + i;
+    uint8_t x[3];
+    for (size_t h = 0; h < 3; ++h) {
+      const size_t a = at - h * stride;
+      x[h] = at < h * stride ? 0x80 : a < len ? in[a] : in2[a - len];
+    }
+    for (unsigned order = 0; order < RICE_ORDERS; ++order)
+      v[order][i] = zigzag((uint8_t)(x[0] - predict(order, x[1], x[2])));
+  }
+}
+
+static unsigned block_order(uint8_t v[RICE_ORDERS][RICE_BLOCK], size_t n) {
+  unsigned best = 0;
+  size_t best_sum = SIZE_MAX;
+  for (unsigned order = 0; order < RICE_ORDERS; ++order) {
+    size_t sum = 0;
+    for (size_t i = 0; i < n; ++i)
+      sum += v[order][i];
+    if (sum < best_sum) {
+      best_sum = sum;
+      best = order;
+    }
+  }
+  return best;
+}
+
+static unsigned block_param(const uint8_t* v, size_t n) {
+  // the quotients add up to about sum >> k, good enough to pick the parameter
+  size_t sum = 0;
+  for (size_t i = 0; i < n; ++i)
+    sum += v[i];
+  unsigned k = 0;
+  size_t best = n + sum;
+  for (unsigned p = 1; p < RICE_PARAM_RAW; ++p) {
+    const size_t cost = n * (p + 1) + (sum >> p);
+    if (cost < best) {
+      best = cost;
+      k = p;
+    }
+  }
+
+  size_t bits = 0;
+  for (size_t i = 0; i < n; ++i) {
+    const unsigned q = v[i] >> k;
+    bits += q < RICE_ESCAPE ? q + 1 + k : RICE_ESCAPE + 8;
+  }
+  return bits < 8 * n ? k : RICE_PARAM_RAW;
+}
+
+size_t rice_encode_frame(const uint8_t* in, size_t len, const uint8_t* in2, size_t len2, unsigned stride, uint32_t sequence, uint8_t* out) {
+  const size_t total = len + len2;
+  struct bit_writer bw = {out + RICE_HEADER_SIZE, 0, 0, 0};
+  uint8_t residuals[RICE_ORDERS][RICE_BLOCK];
+  for (size_t start = 0; start < total; start += RICE_BLOCK) {
+    const size_t n = total - start < RICE_BLOCK ? total - start : RICE_BLOCK;
+    block_residuals(in, len, in2, start, n, stride, residuals);
+    const unsigned order = block_order(residuals, n);
+    const uint8_t* v = residuals[order];
+    const unsigned k = block_param(v, n);
+    put_bits(&bw, order << RICE_PARAM_BITS | k, RICE_ORDER_BITS + RICE_PARAM_BITS);
+    if (k == RICE_PARAM_RAW) {
+      for (size_t i = 0; i < n; ++i)
+        put_bits(&bw, v[i], 8);
+      continue;
+    }
+    const uint32_t mask = (1u << k) - 1;
+    for (size_t i = 0; i < n; ++i) {
+      const unsigned q = v[i] >> k;
+      if (q < RICE_ESCAPE)
+        put_bits(&bw, (1u << k) | (v[i] & mask), q + 1 + k);
+      else
+        put_bits(&bw, v[i], RICE_ESCAPE + 8);
+    }
+  }
+  flush_bits(&bw);
+
+  size_t packed = bw.len;
+  if (packed >= total) {
+    memcpy(out + RICE_HEADER_SIZE, in, len);
+    memcpy(out + RICE_HEADER_SIZE + len, in2, len2);
+    packed = total;
+  }
+
+  out[0] = 'C';
+  out[1] = 'R';
+  out[2] = RICE_VERSION;
+  out[3] = (uint8_t)stride;
+  put_le32(out + 4, sequence);
+  put_le32(out + 8, (uint32_t)total);
+  put_le32(out + 12, (uint32_t)packed);
+  return RICE_HEADER_SIZE + packed;
+}
+
+bool rice_parse_header(const uint8_t* in, struct rice_frame* frame) {
+  if (in[0] != 'C' || in[1] != 'R' || in[2] != RICE_VERSION || in[3] == 0)
+    return false;
+  frame->stride = in[3];
+  frame->sequence = get_le32(in + 4);
+  frame->raw_len = get_le32(in + 8);
+  frame->packed_len = get_le32(in + 12);
+  return frame->raw_len <= RICE_MAX_FRAME && frame->packed_len <= frame->raw_len;
+}
+
+struct bit_reader {
+  const uint8_t* in;
+  size_t len;
+  size_t pos;
+  // `bits` valid bits, most significant first
+  uint64_t acc;
+  unsigned bits;
+};
+
+static inline void refill(struct bit_reader* br) {
+  while (br->bits <= 56) {
+    const uint8_t byte = br->pos < br->len ? br->in[br->pos] : 0;
+    ++br->pos;
+    br->acc |= (uint64_t)byte << (56 - br->bits);
+    br->bits += 8;
+  }
+}
+
+static inline uint32_t take_bits(struct bit_reader* br, unsigned count) {
+  const uint32_t value = count ? (uint32_t)(br->acc >> (64 - count)) : 0;
+  br->acc <<= count;
+  br->bits -= count;
+  return value;
+}
+
+bool rice_decode_frame(const struct rice_frame* frame, const uint8_t* in, uint8_t* out) {
+  const size_t total = frame->raw_len;
+  const unsigned stride = frame->stride;
+  if (frame->packed_len == frame->raw_len) {
+    memcpy(out, in, total);
+    return true;
+  }
+
+  struct bit_reader br = {in, frame->packed_len, 0, 0, 0};
+  for (size_t start = 0; start < total; start += RICE_BLOCK) {
+    const size_t n = total - start < RICE_BLOCK ? total - start : RICE_BLOCK;
+    refill(&br);
+    const unsigned order = take_bits(&br, RICE_ORDER_BITS);
+    const unsigned k = take_bits(&br, RICE_PARAM_BITS);
+    if (order >= RICE_ORDERS || k > RICE_PARAM_RAW)
+      return false;
+    for (size_t i = start; i < start + n; ++i) {
+      refill(&br);
+      unsigned value;
+      if (k == RICE_PARAM_RAW) {
+        value = take_bits(&br, 8);
+      } else {
+        const unsigned q = br.acc ? (unsigned)__builtin_clzll(br.acc) : 64;
+        if (q >= RICE_ESCAPE) {
+          take_bits(&br, RICE_ESCAPE);
+          value = take_bits(&br, 8);
+        } else {
+          take_bits(&br, q + 1);
+          value = q << k | take_bits(&br, k);
+          if (value > 255)
+            return false;
+        }
+      }
+      const uint8_t p1 = i < stride ? 0x80 : out[i - stride];
+      const uint8_t p2 = i < 2 * (size_t)stride ? 0x80 : out[i - 2 * stride];
+      out[i] = (uint8_t)(predict(order, p1, p2) + unzigzag((uint8_t)value));
+    }
+    // past the end, it only reads zeros
+    if (br.pos > br.len + 8)
+      return false;
+  }
+  // everything used must have been in the frame
+  return 8 * br.pos - br.bits <= 8 * br.len;
+}
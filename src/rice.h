@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Frame header: "CR", version, stride, then little endian sequence number, raw length and packed length.
+#define RICE_HEADER_SIZE 16
+#define RICE_VERSION     1
+// residuals sharing a Rice parameter
+#define RICE_BLOCK 256
+#define RICE_MAX_STRIDE 255
+// largest raw length of a frame, headers announcing more are rejected so a decoder never allocates more than this
+#define RICE_MAX_FRAME (1u << 20)
+
+// A fast lossless codec for sample streams: every byte is predicted from the bytes 1 and 2 times `stride` before it,
+// so the same byte of the same channel for interleaved frames, and the differences are Rice coded. Predictor and Rice
+// parameter are picked per block. Frames are independent, so they can be encoded on any thread in any order and
+// decoded from any frame on. A frame that doesn't get smaller is stored as it is.
+struct rice_frame {
+  unsigned stride;
+  uint32_t sequence;
+  uint32_t raw_len;
+  uint32_t packed_len;
+};
+
+// Upper bound of an encoded frame, header included.
+size_t rice_max_frame_size(size_t raw_len);
+
+// Encode `len` bytes, which may be split in two parts for data wrapping around the end of a ring buffer. Returns the
+// size written to `out`.
+size_t rice_encode_frame(const uint8_t* in, size_t len, const uint8_t* in2, size_t len2, unsigned stride, uint32_t sequence, uint8_t* out);
+
+// Parse a header. False if it isn't one, or its lengths are out of range.
+bool rice_parse_header(const uint8_t* in, struct rice_frame* frame);
+// Decode the packed_len bytes following the header into raw_len bytes. False on corrupt data.
+bool rice_decode_frame(const struct rice_frame* frame, const uint8_t* in, uint8_t* out);
@@ -0,0 +1,551 @@
+#define _GNU_SOURCE
+
+#include "ringbuffer.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "futex.h"
+
+// Buffers given back by atomic_ringbuffer_free, still mapped and faulted in, so the next capture doesn't wait for that.
+static struct {
+  pthread_mutex_t lock;
+  struct {
+    void* buf;
+    size_t size;
+  } entries[ATOMIC_RINGBUFFER_POOL_SIZE];
+  size_t count;
+} g_pool = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static void* pool_take(size_t size) {
+  void* buf = MAP_FAILED;
+  pthread_mutex_lock(&g_pool.lock);
+  for (size_t i = 0; i < g_pool.count; ++i) {
+    if (g_pool.entries[i].size == size) {
+      buf = g_pool.entries[i].buf;
+      g_pool.entries[i] = g_pool.entries[--g_pool.count];
+      break;
+    }
+  }
+  pthread_mutex_unlock(&g_pool.lock);
+  return buf;
+}
+
+static void pool_give(void* buf, size_t size) {
+  pthread_mutex_lock(&g_pool.lock);
+  if (g_pool.count < ATOMIC_RINGBUFFER_POOL_SIZE) {
+    g_pool.entries[g_pool.count].buf = buf;
+    g_pool.entries[g_pool.count].size = size;
+    ++g_pool.count;
+    buf = NULL;
+  }
+  pthread_mutex_unlock(&g_pool.lock);
+  if (buf)
+    munmap(buf, size);
+}
+
+void atomic_ringbuffer_pool_release(void) {
+  pthread_mutex_lock(&g_pool.lock);
+  for (size_t i = 0; i < g_pool.count; ++i)
+    munmap(g_pool.entries[i].buf, g_pool.entries[i].size);
+  g_pool.count = 0;
+  pthread_mutex_unlock(&g_pool.lock);
+}
+
+size_t atomic_ringbuffer_pool_bytes(void) {
+  size_t bytes = 0;
+  pthread_mutex_lock(&g_pool.lock);
+  for (size_t i = 0; i < g_pool.count; ++i)
+    bytes += g_pool.entries[i].size;
+  pthread_mutex_unlock(&g_pool.lock);
+  return bytes;
+}
+
+bool atomic_ringbuffer_init(struct atomic_ringbuffer* ctx, size_t buf_size) {
+  static const int FLAGS = MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE;
+
+  void* buf = pool_take(buf_size);
+  if (MAP_FAILED != buf)
+    goto mapped;
+
+#ifdef MAP_HUGE_SHIFT
+  static const size_t ONE_GB = (1u << 30);
+  static const size_t TWO_MB = (2u << 20);
+  if (buf_size % ONE_GB == 0 && buf_size > ONE_GB)
+    buf = mmap(NULL, buf_size, PROT_READ | PROT_WRITE, FLAGS | MAP_HUGETLB | (30 << MAP_HUGE_SHIFT), -1, 0);
+  if (MAP_FAILED == buf && buf_size % TWO_MB == 0 && buf_size > TWO_MB)
+    buf = mmap(NULL, buf_size, PROT_READ | PROT_WRITE, FLAGS | MAP_HUGETLB | (21 << MAP_HUGE_SHIFT), -1, 0);
+#endif
+  if (MAP_FAILED == buf)
+    buf = mmap(NULL, buf_size, PROT_READ | PROT_WRITE, FLAGS, -1, 0);
+
+  if (MAP_FAILED == buf) {
+    return false;
+  }
+
+mapped:;
+  volatile uint8_t test = *(volatile uint8_t*)buf;
+  (void)test;
+
+  ctx->buf_size = buf_size;
+  ctx->ram_size = buf_size;
+  ctx->spill = NULL;
+  ctx->read = 0;
+  ctx->written = 0;
+  pthread_mutex_init(&ctx->readers_lock, NULL);
+  memset(ctx->readers, 0, sizeof(ctx->readers));
+  ctx->closed = false;
+  ctx->wakeup_watermark = 1;
+  ctx->read_event = 0;
+  ctx->writer_waiting = 0;
+  ctx->reader_wakeups = 0;
+  ctx->writer_wakeups = 0;
+  ctx->dropped_readers = 0;
+  ctx->buf = (uint8_t*)buf;
+  return true;
+}
+
+enum spill_tier {
+  SpillTier_None = 0,
+  SpillTier_RAM,
+  SpillTier_File,
+};
+
+// chunks mapped ahead of the writer
+#define SPILL_AHEAD_CHUNKS 4
+
+static bool spill_map_chunk(struct atomic_ringbuffer* ctx, size_t chunk, enum spill_tier tier) {
+  struct atomic_ringbuffer_spill* spill = ctx->spill;
+  const size_t size = spill->chunk_size;
+  uint8_t* addr = ctx->buf + chunk * size;
+  const off_t offset = (off_t)(chunk * size);
+
+  void* result = MAP_FAILED;
+  switch (tier) {
+  case SpillTier_None:
+    result = mmap(addr, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+    break;
+  case SpillTier_RAM:
+    result = mmap(addr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE | MAP_FIXED, -1, 0);
+    break;
+  case SpillTier_File:
+    result = mmap(addr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE | MAP_FIXED, spill->fd, offset);
+    // with mlockall(MCL_FUTURE) this would be locked too, but the point is that it can be paged out
+    if (result != MAP_FAILED)
+      munlock(addr, size);
+    break;
+  }
+  if (result == MAP_FAILED)
+    return false;
+
+  switch (spill->tiers[chunk]) {
+  case SpillTier_RAM:
+    --spill->ram_in_use;
+    break;
+  case SpillTier_File:
+    --spill->spill_in_use;
+    // nobody needs it anymore, don't keep it in the page cache
+    posix_fadvise(spill->fd, offset, size, POSIX_FADV_DONTNEED);
+    break;
+  }
+  switch (tier) {
+  case SpillTier_RAM:
+    ++spill->ram_in_use;
+    break;
+  case SpillTier_File:
+    ++spill->spilled_chunks;
+    if (++spill->spill_in_use > spill->spill_high_water)
+      spill->spill_high_water = spill->spill_in_use;
+    break;
+  case SpillTier_None:
+    break;
+  }
+  spill->tiers[chunk] = (uint8_t)tier;
+  return true;
+}
+
+bool atomic_ringbuffer_init_spill(struct atomic_ringbuffer* ctx, size_t ram_size, size_t buf_size, size_t chunk_size, const char* dir) {
+  struct atomic_ringbuffer_spill* spill = calloc(1, sizeof(*spill));
+  uint8_t* tiers = calloc(buf_size / chunk_size, 1);
+  void* buf = MAP_FAILED;
+  int fd = -1;
+  if (!spill || !tiers)
+    goto error;
+
+  if ((fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600)) < 0)
+    goto error;
+  // reserve the space, so running out of it is noticed now and not in the middle of the capture
+  if (fallocate(fd, 0, 0, (off_t)buf_size) != 0 && (errno != EOPNOTSUPP || ftruncate(fd, (off_t)buf_size) != 0))
+    goto error;
+  // only reserve the address space, the chunks are mapped as the writer gets to them
+  buf = mmap(NULL, buf_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (MAP_FAILED == buf)
+    goto error;
+
+  spill->fd = fd;
+  pthread_rwlock_init(&spill->peek_lock, NULL);
+  spill->chunk_size = chunk_size;
+  spill->ram_chunks = ram_size / chunk_size;
+  spill->tiers = tiers;
+
+  ctx->buf_size = buf_size;
+  ctx->ram_size = ram_size;
+  ctx->spill = spill;
+  ctx->read = 0;
+  ctx->written = 0;
+  pthread_mutex_init(&ctx->readers_lock, NULL);
+  memset(ctx->readers, 0, sizeof(ctx->readers));
+  ctx->closed = false;
+  ctx->wakeup_watermark = 1;
+  ctx->read_event = 0;
+  ctx->writer_waiting = 0;
+  ctx->reader_wakeups = 0;
+  ctx->writer_wakeups = 0;
+  ctx->dropped_readers = 0;
+  ctx->buf = (uint8_t*)buf;
+
+  atomic_ringbuffer_spill_maintain(ctx);
+  if (spill->backed == 0) {
+    atomic_ringbuffer_free(ctx);
+    return false;
+  }
+  return true;
+
+error:;
+  const int err = errno;
+  if (MAP_FAILED != buf)
+    munmap(buf, buf_size);
+  if (fd >= 0)
+    close(fd);
+  free(tiers);
+  free(spill);
+  errno = err;
+  return false;
+}
+
+void atomic_ringbuffer_spill_maintain(struct atomic_ringbuffer* ctx) {
+  struct atomic_ringbuffer_spill* spill = ctx->spill;
+  const size_t chunk_size = spill->chunk_size;
+  const size_t chunks = ctx->buf_size / chunk_size;
+
+  // releasing can wait while someone peeks
+  const size_t read = ctx->read;
+  if (pthread_rwlock_trywrlock(&spill->peek_lock) == 0) {
+    for (; spill->released + chunk_size <= read; spill->released += chunk_size)
+      spill_map_chunk(ctx, spill->released / chunk_size % chunks, SpillTier_None);
+    pthread_rwlock_unlock(&spill->peek_lock);
+  }
+
+  // start writing back spilled chunks as soon as they are complete, so dirty pages don't pile up
+  const size_t written = ctx->written;
+  if (spill->flushed < spill->released)
+    spill->flushed = spill->released;
+  for (; spill->flushed + chunk_size <= written; spill->flushed += chunk_size) {
+    const size_t chunk = spill->flushed / chunk_size % chunks;
+    if (spill->tiers[chunk] == SpillTier_File)
+      sync_file_range(spill->fd, (off_t)(chunk * chunk_size), (off_t)chunk_size, SYNC_FILE_RANGE_WRITE);
+  }
+
+  // a chunk can only be mapped again once the data from a buffer size ago is released
+  while (spill->backed < written + SPILL_AHEAD_CHUNKS * chunk_size && spill->backed + chunk_size <= spill->released + ctx->buf_size) {
+    const enum spill_tier tier = spill->ram_in_use < spill->ram_chunks ? SpillTier_RAM : SpillTier_File;
+    if (!spill_map_chunk(ctx, spill->backed / chunk_size % chunks, tier))
+      break;
+    spill->backed += chunk_size;
+  }
+}
+
+void atomic_ringbuffer_free(struct atomic_ringbuffer* ctx) {
+  if (!ctx->buf)
+    return;
+  if (ctx->spill) {
+    // most of it is PROT_NONE or the file, nothing worth keeping
+    munmap(ctx->buf, ctx->buf_size);
+    close(ctx->spill->fd);
+    pthread_rwlock_destroy(&ctx->spill->peek_lock);
+    free(ctx->spill->tiers);
+    free(ctx->spill);
+    ctx->spill = NULL;
+  } else {
+    pool_give(ctx->buf, ctx->buf_size);
+  }
+  pthread_mutex_destroy(&ctx->readers_lock);
+  ctx->buf = NULL;
+}
+
+uint8_t* atomic_ringbuffer_get_write_ptr(struct atomic_ringbuffer* ctx) {
+  return ctx->buf + (ctx->written % ctx->buf_size);
+}
+
+size_t atomic_ringbuffer_get_write_size(struct atomic_ringbuffer* ctx) {
+  size_t buf_size = ctx->buf_size;
+  size_t written = ctx->written;
+  size_t read = ctx->read;
+  size_t till_end = buf_size - (written % buf_size);
+  size_t till_read = read + buf_size - written;
+  size_t size = till_end < till_read ? till_end : till_read;
+  if (ctx->spill) {
+    const size_t till_backed = ctx->spill->backed - written;
+    size = size < till_backed ? size : till_backed;
+  }
+  return size;
+}
+
+bool atomic_ringbuffer_spill_behind(struct atomic_ringbuffer* ctx) {
+  return ctx->spill && ctx->spill->backed == ctx->written && ctx->written - ctx->read < ctx->buf_size;
+}
+
+void atomic_ringbuffer_advance_written(struct atomic_ringbuffer* ctx, size_t count) {
+  const size_t written = ctx->written += count;
+  for (size_t i = 0; i < ATOMIC_RINGBUFFER_MAX_READERS; ++i) {
+    struct atomic_ringbuffer_reader* reader = &ctx->readers[i];
+    if (reader->waiting && written - reader->wait_pos >= reader->watermark && atomic_exchange(&reader->waiting, 0)) {
+      ++reader->event;
+      futex_wake(&reader->event);
+    }
+  }
+}
+
+// must be called with readers_lock held
+static struct atomic_ringbuffer_reader* atomic_ringbuffer_slowest_reader(struct atomic_ringbuffer* ctx) {
+  struct atomic_ringbuffer_reader* slowest = NULL;
+  for (size_t i = 0; i < ATOMIC_RINGBUFFER_MAX_READERS; ++i) {
+    struct atomic_ringbuffer_reader* reader = &ctx->readers[i];
+    if (reader->state == ReaderState_Active && (!slowest || reader->read < slowest->read))
+      slowest = reader;
+  }
+  return slowest;
+}
+
+// must be called with readers_lock held
+static void atomic_ringbuffer_update_read(struct atomic_ringbuffer* ctx) {
+  // without readers, keep the data for the next one
+  struct atomic_ringbuffer_reader* slowest = atomic_ringbuffer_slowest_reader(ctx);
+  if (slowest && slowest->read > ctx->read)
+    ctx->read = slowest->read;
+}
+
+static void atomic_ringbuffer_wake_writer(struct atomic_ringbuffer* ctx) {
+  if (ctx->writer_waiting && atomic_exchange(&ctx->writer_waiting, 0)) {
+    ++ctx->read_event;
+    futex_wake(&ctx->read_event);
+  }
+}
+
+bool atomic_ringbuffer_drop_lossy(struct atomic_ringbuffer* ctx, size_t needed) {
+  bool dropped = false;
+  pthread_mutex_lock(&ctx->readers_lock);
+  struct atomic_ringbuffer_reader* slowest;
+  // only as many as it takes, the next one may be far enough behind the writer already
+  while ((slowest = atomic_ringbuffer_slowest_reader(ctx)) && slowest->policy == Reader_Lossy && ctx->written - slowest->read > ctx->buf_size - needed) {
+    // The reader may still be looking at what we're about to overwrite, atomic_ringbuffer_reader_intact tells it.
+    slowest->state = ReaderState_Dropped;
+    ++slowest->event;
+    futex_wake(&slowest->event);
+    ++ctx->dropped_readers;
+    dropped = true;
+  }
+  atomic_ringbuffer_update_read(ctx);
+  pthread_mutex_unlock(&ctx->readers_lock);
+  // the readers must be able to see they were dropped before anything gets overwritten
+  atomic_thread_fence(memory_order_seq_cst);
+  return dropped;
+}
+
+bool atomic_ringbuffer_reader_intact(struct atomic_ringbuffer_reader* reader) {
+  // the data was looked at before the state, like the second sequence check of a seqlock
+  atomic_thread_fence(memory_order_acquire);
+  return reader->state == ReaderState_Active;
+}
+
+// must be called with readers_lock held
+static struct atomic_ringbuffer_reader* atomic_ringbuffer_add_reader_locked(struct atomic_ringbuffer* ctx, enum reader_policy policy, size_t pos) {
+  struct atomic_ringbuffer_reader* result = NULL;
+  for (size_t i = 0; !ctx->closed && ctx->buf && i < ATOMIC_RINGBUFFER_MAX_READERS; ++i) {
+    struct atomic_ringbuffer_reader* reader = &ctx->readers[i];
+    if (reader->state != ReaderState_Free)
+      continue;
+    reader->policy = policy;
+    reader->read = pos;
+    reader->watermark = ctx->wakeup_watermark;
+    reader->waiting = 0;
+    reader->wakeups = 0;
+    reader->state = ReaderState_Active;
+    result = reader;
+    break;
+  }
+  return result;
+}
+
+struct atomic_ringbuffer_reader* atomic_ringbuffer_add_reader(struct atomic_ringbuffer* ctx, enum reader_policy policy) {
+  pthread_mutex_lock(&ctx->readers_lock);
+  struct atomic_ringbuffer_reader* result = atomic_ringbuffer_add_reader_locked(ctx, policy, ctx->read);
+  pthread_mutex_unlock(&ctx->readers_lock);
+  return result;
+}
+
+struct atomic_ringbuffer_reader* atomic_ringbuffer_add_reader_at(struct atomic_ringbuffer* ctx, enum reader_policy policy, size_t pos, size_t frame_size) {
+  if (pos % frame_size != 0)
+    return NULL;
+  struct atomic_ringbuffer_reader* result = NULL;
+  pthread_mutex_lock(&ctx->readers_lock);
+  // the data from ctx->read on is guaranteed to stay until the new reader moves on
+  if (pos >= ctx->read && pos <= ctx->written)
+    result = atomic_ringbuffer_add_reader_locked(ctx, policy, pos);
+  pthread_mutex_unlock(&ctx->readers_lock);
+  return result;
+}
+
+void atomic_ringbuffer_remove_reader(struct atomic_ringbuffer* ctx, struct atomic_ringbuffer_reader* reader) {
+  pthread_mutex_lock(&ctx->readers_lock);
+  reader->state = ReaderState_Free;
+  atomic_ringbuffer_update_read(ctx);
+  pthread_mutex_unlock(&ctx->readers_lock);
+  atomic_ringbuffer_wake_writer(ctx);
+}
+
+bool atomic_ringbuffer_close(struct atomic_ringbuffer* ctx) {
+  pthread_mutex_lock(&ctx->readers_lock);
+  ctx->closed = atomic_ringbuffer_reader_count(ctx) == 0;
+  // a peeker checks `closed` after counting itself, so either it sees the flag or we see it
+  if (ctx->closed && ctx->peekers)
+    ctx->closed = false;
+  const bool closed = ctx->closed;
+  pthread_mutex_unlock(&ctx->readers_lock);
+  return closed;
+}
+
+size_t atomic_ringbuffer_reader_count(struct atomic_ringbuffer* ctx) {
+  size_t count = 0;
+  for (size_t i = 0; i < ATOMIC_RINGBUFFER_MAX_READERS; ++i)
+    if (ctx->readers[i].state != ReaderState_Free)
+      ++count;
+  return count;
+}
+
+uint8_t* atomic_ringbuffer_get_read_ptr(struct atomic_ringbuffer* ctx, struct atomic_ringbuffer_reader* reader) {
+  return atomic_ringbuffer_get_read_ptr_at(ctx, reader->read);
+}
+
+size_t atomic_ringbuffer_get_read_size(struct atomic_ringbuffer* ctx, struct atomic_ringbuffer_reader* reader) {
+  return atomic_ringbuffer_get_read_size_at(ctx, reader->read);
+}
+
+void atomic_ringbuffer_advance_read(struct atomic_ringbuffer* ctx, struct atomic_ringbuffer_reader* reader, size_t count) {
+  if (count == 0)
+    return;
+  const size_t old = atomic_fetch_add(&reader->read, count);
+  // only the slowest reader can move the shared position
+  if (old <= ctx->read) {
+    pthread_mutex_lock(&ctx->readers_lock);
+    atomic_ringbuffer_update_read(ctx);
+    pthread_mutex_unlock(&ctx->readers_lock);
+    atomic_ringbuffer_wake_writer(ctx);
+  }
+}
+
+uint8_t* atomic_ringbuffer_get_read_ptr_at(struct atomic_ringbuffer* ctx, size_t pos) {
+  return ctx->buf + (pos % ctx->buf_size);
+}
+
+size_t atomic_ringbuffer_get_read_size_at(struct atomic_ringbuffer* ctx, size_t pos) {
+  size_t buf_size = ctx->buf_size;
+  size_t written = ctx->written;
+  size_t till_end = buf_size - (pos % buf_size);
+  size_t till_written = written - pos;
+  return till_end < till_written ? till_end : till_written;
+}
+
+bool atomic_ringbuffer_peek_begin(struct atomic_ringbuffer* ctx, size_t pos) {
+  ++ctx->peekers;
+  if (ctx->closed) {
+    --ctx->peekers;
+    return false;
+  }
+  if (ctx->spill) {
+    pthread_rwlock_rdlock(&ctx->spill->peek_lock);
+    // released chunks are unmapped
+    if (pos < ctx->spill->released) {
+      pthread_rwlock_unlock(&ctx->spill->peek_lock);
+      --ctx->peekers;
+      return false;
+    }
+    return true;
+  }
+  if (ctx->written - pos > ctx->buf_size / 2) {
+    --ctx->peekers;
+    return false;
+  }
+  return true;
+}
+
+bool atomic_ringbuffer_peek_end(struct atomic_ringbuffer* ctx, size_t pos) {
+  // nothing not yet released is written over with spilling
+  bool intact = true;
+  if (ctx->spill)
+    pthread_rwlock_unlock(&ctx->spill->peek_lock);
+  else
+    intact = ctx->written - pos <= ctx->buf_size / 2;
+  --ctx->peekers;
+  return intact;
+}
+
+bool atomic_ringbuffer_wait_read(struct atomic_ringbuffer* ctx, struct atomic_ringbuffer_reader* reader, size_t pos, int timeout_ms) {
+  // the flag must be visible before we check, so that the writer either sees it or we see its data
+  reader->wait_pos = pos;
+  reader->waiting = 1;
+  const uint32_t event = reader->event;
+  if (ctx->written - pos >= reader->watermark || reader->state != ReaderState_Active) {
+    reader->waiting = 0;
+    return true;
+  }
+  futex_wait(&reader->event, event, timeout_ms);
+  reader->waiting = 0;
+  ++reader->wakeups;
+  ++ctx->reader_wakeups;
+  return ctx->written - pos >= reader->watermark;
+}
+
+bool atomic_ringbuffer_wait_write(struct atomic_ringbuffer* ctx, int timeout_ms) {
+  ctx->writer_waiting = 1;
+  const uint32_t event = ctx->read_event;
+  if (ctx->written - ctx->read < ctx->buf_size) {
+    ctx->writer_waiting = 0;
+    return true;
+  }
+  futex_wait(&ctx->read_event, event, timeout_ms);
+  ctx->writer_waiting = 0;
+  ++ctx->writer_wakeups;
+  return ctx->written - ctx->read < ctx->buf_size;
+}
+
+void atomic_ringbuffer_wake(struct atomic_ringbuffer* ctx) {
+  for (size_t i = 0; i < ATOMIC_RINGBUFFER_MAX_READERS; ++i) {
+    ++ctx->readers[i].event;
+    futex_wake(&ctx->readers[i].event);
+  }
+  ++ctx->read_event;
+  futex_wake(&ctx->read_event);
+}
+
+void atomic_ringbuffer_get_stats(struct atomic_ringbuffer* ctx, size_t* read, size_t* written, size_t* difference) {
+  // we read `read` first, so that we never get negative results
+
+  size_t _read = atomic_load(&ctx->read);
+  size_t _written = atomic_load(&ctx->written);
+  size_t _difference = _written - _read;
+  if (_difference > ctx->buf_size)
+    _difference = ctx->buf_size;
+  if (read)
+    *read = _read;
+  if (written)
+    *written = _written;
+  if (difference)
+    *difference = _difference;
+}
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <pthread.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define ATOMIC_RINGBUFFER_MAX_READERS 8
+// freed buffers kept for reuse
+#define ATOMIC_RINGBUFFER_POOL_SIZE 16
+
+enum reader_policy {
+  // the writer waits for this reader, overflowing if it's too slow
+  Reader_Blocking = 0,
+  // the reader is dropped when it would make the writer overflow
+  Reader_Lossy,
+};
+
+enum reader_state {
+  ReaderState_Free = 0,
+  ReaderState_Active,
+  ReaderState_Dropped,
+};
+
+struct atomic_ringbuffer_reader {
+  _Atomic enum reader_state state;
+  enum reader_policy policy;
+  _Atomic size_t read;
+  // wake up only once this much data is available, defaults to wakeup_watermark of the buffer
+  size_t watermark;
+
+  // futex word, bumped when the writer reached the watermark this reader is waiting for
+  _Atomic uint32_t event;
+  _Atomic uint32_t waiting;
+  _Atomic size_t wait_pos;
+  // times this reader woke up from waiting for data
+  _Atomic size_t wakeups;
+};
+
+// Second tier of a ring buffer. The buffer is split into chunks, each backed by anonymous memory while there's RAM budget
+// left, or by the spill file beyond that. Readers see one contiguous buffer either way.
+struct atomic_ringbuffer_spill {
+  int fd;
+  size_t chunk_size;
+  size_t ram_chunks;
+  // which tier backs each chunk of the buffer
+  uint8_t* tiers;
+  // Positions below `released` are unmapped, from there up to `backed` mapped.
+  size_t released;
+  _Atomic size_t backed;
+  // spill chunks below this position were handed to writeback
+  size_t flushed;
+  _Atomic size_t ram_in_use;
+  _Atomic size_t spill_in_use;
+  _Atomic size_t spill_high_water;
+  _Atomic size_t spilled_chunks;
+  // held for reading by peekers, chunks are only released when it can be taken for writing
+  pthread_rwlock_t peek_lock;
+};
+
+struct atomic_ringbuffer {
+  uint8_t* buf;
+  size_t buf_size;
+  // the part of buf_size that is kept in RAM
+  size_t ram_size;
+  struct atomic_ringbuffer_spill* spill;
+  _Atomic size_t written;
+  // The slowest reader, everything before this can be overwritten. Only ever increases.
+  _Atomic size_t read;
+
+  // Protects adding, removing and dropping readers, and recalculating `read`.
+  pthread_mutex_t readers_lock;
+  struct atomic_ringbuffer_reader readers[ATOMIC_RINGBUFFER_MAX_READERS];
+  // no new readers or peekers are accepted once closed
+  _Atomic bool closed;
+  // threads between atomic_ringbuffer_peek_begin and atomic_ringbuffer_peek_end
+  _Atomic size_t peekers;
+
+  // Default watermark of new readers.
+  size_t wakeup_watermark;
+
+  // futex word, bumped when the writer may have some space again
+  _Atomic uint32_t read_event;
+  _Atomic uint32_t writer_waiting;
+
+  // reader wakeups summed over every reader, including the ones gone already
+  _Atomic size_t reader_wakeups;
+  // wakeups of the writer, counted here by the writer whatever it waited for
+  _Atomic size_t writer_wakeups;
+  _Atomic size_t dropped_readers;
+};
+
+bool atomic_ringbuffer_init(struct atomic_ringbuffer* ctx, size_t buf_size);
+// A buffer of `buf_size`, of which at most `ram_size` is in RAM and the rest in a temporary file created in `dir`.
+// Both sizes must be multiples of `chunk_size`, which must be a multiple of the page size.
+// atomic_ringbuffer_spill_maintain must be called regularly to keep memory mapped ahead of the writer.
+bool atomic_ringbuffer_init_spill(struct atomic_ringbuffer* ctx, size_t ram_size, size_t buf_size, size_t chunk_size, const char* dir);
+// RAM buffers are kept in a pool and reused by the next atomic_ringbuffer_init of the same size.
+void atomic_ringbuffer_free(struct atomic_ringbuffer* ctx);
+// Unmap the pooled buffers.
+void atomic_ringbuffer_pool_release(void);
+size_t atomic_ringbuffer_pool_bytes(void);
+
+uint8_t* atomic_ringbuffer_get_write_ptr(struct atomic_ringbuffer* ctx);
+size_t atomic_ringbuffer_get_write_size(struct atomic_ringbuffer* ctx);
+void atomic_ringbuffer_advance_written(struct atomic_ringbuffer* ctx, size_t count);
+// Whether the writer is short on space only because atomic_ringbuffer_spill_maintain didn't map the next chunk yet.
+bool atomic_ringbuffer_spill_behind(struct atomic_ringbuffer* ctx);
+// Map chunks ahead of the writer and unmap the chunks all readers are done with. Not to be called from the writer,
+// mapping memory can take a while.
+void atomic_ringbuffer_spill_maintain(struct atomic_ringbuffer* ctx);
+// Drop the lossy readers holding back the writer, the slowest first until there are `needed` bytes of room. Returns
+// whether any was dropped. Their data is written over right away, even while they are still looking at it.
+bool atomic_ringbuffer_drop_lossy(struct atomic_ringbuffer* ctx, size_t needed);
+// Whether the data a reader looked at since its last advance is intact, as the reader wasn't dropped. A lossy reader
+// copies or processes the data first and checks this before using the result, so it never passes on torn data.
+bool atomic_ringbuffer_reader_intact(struct atomic_ringbuffer_reader* reader);
+
+// Register a new reader starting at the oldest data still in the buffer. Returns NULL if there's no free slot, or closed.
+struct atomic_ringbuffer_reader* atomic_ringbuffer_add_reader(struct atomic_ringbuffer* ctx, enum reader_policy policy);
+// Same, starting at `pos`. Returns NULL if the data there is no longer, or not yet, in the buffer, or `pos` is in the
+// middle of a frame.
+struct atomic_ringbuffer_reader* atomic_ringbuffer_add_reader_at(struct atomic_ringbuffer* ctx, enum reader_policy policy, size_t pos, size_t frame_size);
+void atomic_ringbuffer_remove_reader(struct atomic_ringbuffer* ctx, struct atomic_ringbuffer_reader* reader);
+// Stop accepting readers and peekers. Fails if there are still readers registered, or peekers looking.
+bool atomic_ringbuffer_close(struct atomic_ringbuffer* ctx);
+size_t atomic_ringbuffer_reader_count(struct atomic_ringbuffer* ctx);
+
+uint8_t* atomic_ringbuffer_get_read_ptr(struct atomic_ringbuffer* ctx, struct atomic_ringbuffer_reader* reader);
+size_t atomic_ringbuffer_get_read_size(struct atomic_ringbuffer* ctx, struct atomic_ringbuffer_reader* reader);
+void atomic_ringbuffer_advance_read(struct atomic_ringbuffer* ctx, struct atomic_ringbuffer_reader* reader, size_t count);
+
+// Same as above, but for a position between read and written. Used by readers that release data later than reading it.
+uint8_t* atomic_ringbuffer_get_read_ptr_at(struct atomic_ringbuffer* ctx, size_t pos);
+size_t atomic_ringbuffer_get_read_size_at(struct atomic_ringbuffer* ctx, size_t pos);
+
+// Look at the data from `pos` on without registering as a reader, so the writer is never held back. Returns false if
+// the data at `pos` is gone already. The writer may overwrite it while looking, atomic_ringbuffer_peek_end returns
+// whether the data is still intact, going by a safety margin of half the buffer behind the writer. Also fails once the
+// buffer is closed, and closing waits for atomic_ringbuffer_peek_end, so the buffer isn't freed while looking.
+bool atomic_ringbuffer_peek_begin(struct atomic_ringbuffer* ctx, size_t pos);
+bool atomic_ringbuffer_peek_end(struct atomic_ringbuffer* ctx, size_t pos);
+
+// Block until at least the reader's watermark bytes are readable after `pos`, or timeout. Returns whether the watermark was reached.
+bool atomic_ringbuffer_wait_read(struct atomic_ringbuffer* ctx, struct atomic_ringbuffer_reader* reader, size_t pos, int timeout_ms);
+// Block until there's some space to write, or timeout. Returns whether there's space.
+bool atomic_ringbuffer_wait_write(struct atomic_ringbuffer* ctx, int timeout_ms);
+// Wake up everyone waiting, for example on state changes.
+void atomic_ringbuffer_wake(struct atomic_ringbuffer* ctx);
+
+// this is only usable for stats, do not rely on being correct
+void atomic_ringbuffer_get_stats(struct atomic_ringbuffer* ctx, size_t* read, size_t* written, size_t* difference);
@@ -0,0 +1,548 @@
+#include "source.h"
+
+#include <fcntl.h>
+#include <poll.h>
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+void source_setup(struct source* src, const struct source_driver* driver, const char* name) {
+  memset(src, 0, sizeof(*src));
+  src->driver = driver;
+  src->format = SND_PCM_FORMAT_UNKNOWN;
+  src->fd = -1;
+  snprintf(src->name, sizeof(src->name), "%s", name);
+}
+
+bool source_open(struct source* src, char* errstr, size_t errstr_size) {
+  return src->driver->open(src, errstr, errstr_size);
+}
+
+bool source_start(struct source* src, char* errstr, size_t errstr_size) {
+  return src->driver->start(src, errstr, errstr_size);
+}
+
+ssize_t source_read(struct source* src, void* buf, size_t len) {
+  return src->driver->read(src, buf, len);
+}
+
+void source_timestamp(struct source* src, struct timespec* ts, size_t* pending) {
+  if (src->driver->timestamp && src->driver->timestamp(src, ts, pending))
+    return;
+  clock_gettime(CLOCK_MONOTONIC_RAW, ts);
+  *pending = 0;
+}
+
+void source_wait(struct source* src, int timeout_ms) {
+  src->driver->wait(src, timeout_ms);
+}
+
+void source_close(struct source* src) {
+  if (src->driver)
+    src->driver->close(src);
+}
+
+// cxadc
+
+static bool cxadc_open(struct source* src, char* errstr, size_t errstr_size) {
+  (void)errstr;
+  (void)errstr_size;
+  src->channels = 1;
+  src->format = SND_PCM_FORMAT_U8;
+  src->frame_size = 1;
+  return true;
+}
+
+static bool cxadc_start(struct source* src, char* errstr, size_t errstr_size) {
+  const int fd = open(src->name, O_NONBLOCK);
+  if (fd < 0) {
+    snprintf(errstr, errstr_size, "cannot open cxadc: %s", sys_errlist[errno]);
+    return false;
+  }
+  src->fd = fd;
+  return true;
+}
+
+static ssize_t cxadc_read(struct source* src, void* buf, size_t len) {
+  ssize_t count = read(src->fd, buf, len);
+  if (count < 0)
+    return errno == EAGAIN ? 0 : -errno;
+  return count;
+}
+
+static void fd_wait(struct source* src, int timeout_ms) {
+  struct pollfd pfd = {src->fd, POLLIN, 0};
+  poll(&pfd, 1, timeout_ms);
+}
+
+static void fd_close(struct source* src) {
+  if (src->fd != -1) {
+    close(src->fd);
+    src->fd = -1;
+  }
+}
+
+const struct source_driver SOURCE_CXADC = {
+  "cxadc",
+  cxadc_open,
+  cxadc_start,
+  cxadc_read,
+  NULL,
+  fd_wait,
+  fd_close,
+};
+
+// ALSA
+
+static bool alsa_open(struct source* src, char* errstr, size_t errstr_size) {
+  static const int MODE = SND_PCM_NONBLOCK | SND_PCM_NO_AUTO_RESAMPLE | SND_PCM_NO_AUTO_CHANNELS | SND_PCM_NO_AUTO_FORMAT | SND_PCM_NO_SOFTVOL;
+
+  int err = 0;
+  snd_pcm_t* handle = NULL;
+
+  if ((err = snd_pcm_open(&handle, src->name, SND_PCM_STREAM_CAPTURE, MODE)) < 0) {
+    snprintf(errstr, errstr_size, "cannot open ALSA device: %s", snd_strerror(err));
+    return false;
+  }
+
+  src->handle = handle;
+
+  snd_pcm_hw_params_t* hw_params = NULL;
+  snd_pcm_hw_params_alloca(&hw_params);
+
+  if ((err = snd_pcm_hw_params_any(handle, hw_params)) < 0) {
+    snprintf(errstr, errstr_size, "cannot initialize hardware parameter structure: %s", snd_strerror(err));
+    return false;
+  }
+
+  if ((err = snd_pcm_hw_params_set_access(handle, hw_params, src->mmap ? SND_PCM_ACCESS_MMAP_INTERLEAVED : SND_PCM_ACCESS_RW_INTERLEAVED)) < 0) {
+    snprintf(errstr, errstr_size, "cannot set access type %s: %s", src->mmap ? "mmap" : "rw", snd_strerror(err));
+    return false;
+  }
+
+  if (src->rate) {
+set_rate:
+    if ((err = snd_pcm_hw_params_set_rate(handle, hw_params, src->rate, 0)) < 0) {
+      snprintf(errstr, errstr_size, "cannot set sample rate: %s", snd_strerror(err));
+      return false;
+    }
+  } else {
+    if (snd_pcm_hw_params_get_rate(hw_params, &src->rate, 0) < 0) {
+      if ((err = snd_pcm_hw_params_get_rate_max(hw_params, &src->rate, 0)) < 0) {
+        snprintf(errstr, errstr_size, "cannot get sample rate: %s", snd_strerror(err));
+        return false;
+      } else {
+        goto set_rate;
+      }
+    }
+  }
+
+  if (src->channels) {
+    if ((err = snd_pcm_hw_params_set_channels(handle, hw_params, src->channels)) < 0) {
+      snprintf(errstr, errstr_size, "cannot set channel count: %s", snd_strerror(err));
+      return false;
+    }
+  } else {
+    if ((err = snd_pcm_hw_params_get_channels(hw_params, &src->channels)) < 0) {
+      snprintf(errstr, errstr_size, "cannot get channel count: %s", snd_strerror(err));
+      return false;
+    }
+  }
+
+  if (src->format != SND_PCM_FORMAT_UNKNOWN) {
+    if ((err = snd_pcm_hw_params_set_format(handle, hw_params, src->format)) < 0) {
+      snprintf(errstr, errstr_size, "cannot set sample format: %s", snd_strerror(err));
+      return false;
+    }
+  } else {
+    if ((err = snd_pcm_hw_params_get_format(hw_params, &src->format)) < 0) {
+      snprintf(errstr, errstr_size, "cannot get sample format: %s", snd_strerror(err));
+      return false;
+    }
+  }
+
+  ssize_t format_size;
+  if ((format_size = snd_pcm_format_size(src->format, 1)) < 0) {
+    snprintf(errstr, errstr_size, "cannot get format size: %s", snd_strerror((int)format_size));
+    return false;
+  }
+  src->frame_size = src->channels * format_size;
+
+  if (src->period_frames) {
+    snd_pcm_uframes_t frames = src->period_frames;
+    if ((err = snd_pcm_hw_params_set_period_size_near(handle, hw_params, &frames, 0)) < 0) {
+      snprintf(errstr, errstr_size, "cannot set period size: %s", snd_strerror(err));
+      return false;
+    }
+  }
+
+  if (src->periods) {
+    unsigned periods = src->periods;
+    if ((err = snd_pcm_hw_params_set_periods_near(handle, hw_params, &periods, 0)) < 0) {
+      snprintf(errstr, errstr_size, "cannot set period count: %s", snd_strerror(err));
+      return false;
+    }
+  }
+
+  if (src->buffer_frames) {
+    snd_pcm_uframes_t frames = src->buffer_frames;
+    if ((err = snd_pcm_hw_params_set_buffer_size_near(handle, hw_params, &frames)) < 0) {
+      snprintf(errstr, errstr_size, "cannot set buffer size: %s", snd_strerror(err));
+      return false;
+    }
+  }
+
+  if ((err = snd_pcm_hw_params(handle, hw_params)) < 0) {
+    snprintf(errstr, errstr_size, "cannot set hw parameters: %s", snd_strerror(err));
+    return false;
+  }
+
+  snd_pcm_uframes_t period_frames = 0, buffer_frames = 0;
+  if ((err = snd_pcm_hw_params_get_period_size(hw_params, &period_frames, 0)) < 0 || (err = snd_pcm_hw_params_get_buffer_size(hw_params, &buffer_frames)) < 0) {
+    snprintf(errstr, errstr_size, "cannot get buffer size: %s", snd_strerror(err));
+    return false;
+  }
+  src->period_frames = period_frames;
+  src->buffer_frames = buffer_frames;
+  src->periods = period_frames ? (unsigned)(buffer_frames / period_frames) : 0;
+
+  snd_pcm_sw_params_t* sw_params = NULL;
+  snd_pcm_sw_params_alloca(&sw_params);
+
+  if ((err = snd_pcm_sw_params_current(handle, sw_params)) < 0) {
+    snprintf(errstr, errstr_size, "cannot query sw parameters: %s", snd_strerror(err));
+    return false;
+  }
+
+  if ((err = snd_pcm_sw_params_set_tstamp_mode(handle, sw_params, SND_PCM_TSTAMP_ENABLE)) < 0) {
+    snprintf(errstr, errstr_size, "cannot set tstamp mode: %s", snd_strerror(err));
+    return false;
+  }
+
+  if ((err = snd_pcm_sw_params_set_tstamp_type(handle, sw_params, SND_PCM_TSTAMP_TYPE_MONOTONIC_RAW)) < 0) {
+    snprintf(errstr, errstr_size, "cannot set tstamp type: %s", snd_strerror(err));
+    return false;
+  }
+
+  if ((err = snd_pcm_sw_params(handle, sw_params)) < 0) {
+    snprintf(errstr, errstr_size, "cannot set sw parameters: %s", snd_strerror(err));
+    return false;
+  }
+
+  if ((err = snd_pcm_prepare(handle)) < 0) {
+    snprintf(errstr, errstr_size, "cannot prepare audio interface for use: %s", snd_strerror(err));
+    return false;
+  }
+
+  return true;
+}
+
+static bool alsa_start(struct source* src, char* errstr, size_t errstr_size) {
+  int err = 0;
+  if ((err = snd_pcm_start(src->handle)) < 0) {
+    snprintf(errstr, errstr_size, "cannot start audio interface: %s", snd_strerror(err));
+    return false;
+  }
+  return true;
+}
+
+// Copy up to `len_frames` captured frames out of the hardware buffer, in up to two parts when they wrap around its end.
+static snd_pcm_sframes_t alsa_mmap_read(struct source* src, uint8_t* buf, snd_pcm_uframes_t len_frames) {
+  const snd_pcm_sframes_t avail = snd_pcm_avail_update(src->handle);
+  if (avail < 0)
+    return avail;
+  if ((snd_pcm_uframes_t)avail < len_frames)
+    len_frames = avail;
+
+  snd_pcm_uframes_t done = 0;
+  while (done < len_frames) {
+    const snd_pcm_channel_area_t* areas;
+    snd_pcm_uframes_t offset;
+    snd_pcm_uframes_t frames = len_frames - done;
+    int err;
+    if ((err = snd_pcm_mmap_begin(src->handle, &areas, &offset, &frames)) < 0)
+      return done ? (snd_pcm_sframes_t)done : err;
+    if (frames == 0)
+      break;
+    // interleaved, so all channels are in the first area with one frame after the other
+    const uint8_t* from = (const uint8_t*)areas[0].addr + areas[0].first / 8 + offset * (areas[0].step / 8);
+    memcpy(buf + done * src->frame_size, from, frames * src->frame_size);
+    const snd_pcm_sframes_t committed = snd_pcm_mmap_commit(src->handle, offset, frames);
+    if (committed < 0)
+      return committed;
+    done += committed;
+    if ((snd_pcm_uframes_t)committed != frames)
+      break;
+  }
+  return (snd_pcm_sframes_t)done;
+}
+
+// The device's buffer overran, or the system was suspended. Prepare and start it again, the data in between is lost.
+static ssize_t alsa_recover(struct source* src, int err) {
+  ++src->xruns;
+  fprintf(stderr, "%s overrun, restarting capture\n", src->name);
+  if ((err = snd_pcm_recover(src->handle, err, 1)) < 0)
+    return err;
+  if ((err = snd_pcm_start(src->handle)) < 0)
+    return err;
+  return 0;
+}
+
+static ssize_t alsa_read(struct source* src, void* buf, size_t len) {
+  snd_pcm_uframes_t len_frames = len / src->frame_size;
+  if (len_frames == 0)
+    return 0;
+  snd_pcm_sframes_t count = src->mmap ? alsa_mmap_read(src, buf, len_frames) : snd_pcm_readi(src->handle, buf, len_frames);
+  if (count == -EAGAIN)
+    return 0;
+  if (count == -EPIPE || count == -ESTRPIPE)
+    return alsa_recover(src, (int)count);
+  if (count < 0)
+    return count;
+  return (ssize_t)(count * src->frame_size);
+}
+
+// The driver's timestamp of the latest period, and the frames captured since then but not read yet.
+static bool alsa_timestamp(struct source* src, struct timespec* ts, size_t* pending) {
+  snd_pcm_uframes_t avail;
+  snd_htimestamp_t htstamp;
+  if (snd_pcm_htimestamp(src->handle, &avail, &htstamp) < 0 || (htstamp.tv_sec == 0 && htstamp.tv_nsec == 0))
+    return false;
+  *ts = htstamp;
+  *pending = avail * src->frame_size;
+  return true;
+}
+
+static void alsa_wait(struct source* src, int timeout_ms) {
+  // errors like overruns will be reported by the next read
+  snd_pcm_wait(src->handle, timeout_ms);
+}
+
+static void alsa_close(struct source* src) {
+  if (src->handle) {
+    snd_pcm_drop(src->handle);
+    snd_pcm_close(src->handle);
+    src->handle = NULL;
+  }
+}
+
+const struct source_driver SOURCE_ALSA = {
+  "alsa",
+  alsa_open,
+  alsa_start,
+  alsa_read,
+  alsa_timestamp,
+  alsa_wait,
+  alsa_close,
+};
+
+// emulated sources, producing data at the configured rate
+
+static bool emulated_open(struct source* src, char* errstr, size_t errstr_size) {
+  ssize_t format_size;
+  if (src->rate == 0 || src->channels == 0 || (format_size = snd_pcm_format_size(src->format, 1)) <= 0) {
+    snprintf(errstr, errstr_size, "%s source needs rate, channels and format", src->driver->name);
+    return false;
+  }
+  src->frame_size = src->channels * format_size;
+  return true;
+}
+
+static bool emulated_start(struct source* src, char* errstr, size_t errstr_size) {
+  (void)errstr;
+  (void)errstr_size;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &src->start_time);
+  src->bytes_produced = 0;
+  return true;
+}
+
+// how many bytes the source should have produced by now, limited to `len`
+// how long the emulated sources hold data that wasn't read
+#define EMULATED_BACKLOG_MS 1000
+
+static size_t emulated_due(struct source* src, size_t len) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+  uint64_t sec = now.tv_sec - src->start_time.tv_sec;
+  long nsec = now.tv_nsec - src->start_time.tv_nsec;
+  if (nsec < 0) {
+    sec -= 1;
+    nsec += 1000000000;
+  }
+  const uint64_t due_frames = sec * src->rate + (uint64_t)nsec * src->rate / 1000000000;
+  uint64_t due = due_frames * src->frame_size - src->bytes_produced;
+  // like a device's buffer, what wasn't read in time is overwritten
+  const uint64_t backlog = (uint64_t)src->rate * src->frame_size * EMULATED_BACKLOG_MS / 1000;
+  if (due > backlog) {
+    const uint64_t lost = (due - backlog) - (due - backlog) % src->frame_size;
+    src->bytes_produced += lost;
+    due -= lost;
+    ++src->xruns;
+  }
+  // don't bother with less than a millisecond worth of data, wait instead
+  if (due < len && due < (src->rate / 1000 + 1) * src->frame_size)
+    return 0;
+  const size_t count = due < len ? (size_t)due : len;
+  return count - count % src->frame_size;
+}
+
+// the data is produced on schedule, so its capture time is exact
+static bool emulated_timestamp(struct source* src, struct timespec* ts, size_t* pending) {
+  const uint64_t frames = src->bytes_produced / src->frame_size;
+  const uint64_t nsec = src->start_time.tv_nsec + frames % src->rate * 1000000000 / src->rate;
+  ts->tv_sec = src->start_time.tv_sec + (time_t)(frames / src->rate + nsec / 1000000000);
+  ts->tv_nsec = (long)(nsec % 1000000000);
+  *pending = 0;
+  return true;
+}
+
+// sleep until about a millisecond worth of data is due
+static void emulated_wait(struct source* src, int timeout_ms) {
+  const uint64_t chunk = src->rate / 1000 + 1;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+  const uint64_t elapsed_ns = (uint64_t)(now.tv_sec - src->start_time.tv_sec) * 1000000000 + now.tv_nsec - src->start_time.tv_nsec;
+  const uint64_t due_frames = src->bytes_produced / src->frame_size + chunk;
+  const uint64_t due_ns = due_frames / src->rate * 1000000000 + due_frames % src->rate * 1000000000 / src->rate;
+  if (due_ns <= elapsed_ns)
+    return;
+  uint64_t sleep_ns = due_ns - elapsed_ns;
+  if (sleep_ns > (uint64_t)timeout_ms * 1000000)
+    sleep_ns = (uint64_t)timeout_ms * 1000000;
+  const struct timespec ts = {(time_t)(sleep_ns / 1000000000), (long)(sleep_ns % 1000000000)};
+  nanosleep(&ts, NULL);
+}
+
+static bool synthetic_open(struct source* src, char* errstr, size_t errstr_size) {
+  static const size_t PATTERN_FRAMES = 4096;
+
+  if (!emulated_open(src, errstr, errstr_size))
+    return false;
+
+  src->pattern_size = PATTERN_FRAMES * src->frame_size;
+  src->pattern = malloc(src->pattern_size);
+  if (!src->pattern) {
+    snprintf(errstr, errstr_size, "failed to allocate pattern: %s", sys_errlist[errno]);
+    return false;
+  }
+
+  // a few tones with a bit of noise per channel, periodic over the pattern so it can loop seamlessly
+  const size_t sample_size = src->frame_size / src->channels;
+  const int width = snd_pcm_format_width(src->format);
+  const bool is_signed = snd_pcm_format_signed(src->format) == 1;
+  const double full_scale = (double)((1u << (width - 1)) - 1);
+  uint32_t lfsr = 0xACE1u;
+  uint8_t* p = src->pattern;
+  for (size_t i = 0; i < PATTERN_FRAMES; ++i) {
+    for (unsigned c = 0; c < src->channels; ++c) {
+      const double phase = 2 * M_PI * (double)i / PATTERN_FRAMES;
+      lfsr = lfsr * 1103515245u + 12345u;
+      const double noise = ((double)(lfsr >> 16) / 65536.0 - 0.5) * 0.02;
+      const double v = 0.6 * sin(phase * (37 + 16 * c)) + 0.25 * sin(phase * (401 + 64 * c)) + noise;
+      int32_t s = (int32_t)(v * full_scale);
+      if (!is_signed)
+        s += (int32_t)(1u << (width - 1));
+      for (size_t b = 0; b < sample_size; ++b)
+        *p++ = (uint8_t)((uint32_t)s >> (8 * b));
+    }
+  }
+  return true;
+}
+
+static ssize_t synthetic_read(struct source* src, void* buf, size_t len) {
+  size_t count = emulated_due(src, len);
+  uint8_t* out = buf;
+  size_t left = count;
+  while (left) {
+    const size_t offset = src->bytes_produced % src->pattern_size;
+    size_t chunk = src->pattern_size - offset;
+    if (chunk > left)
+      chunk = left;
+    memcpy(out, src->pattern + offset, chunk);
+    out += chunk;
+    left -= chunk;
+    src->bytes_produced += chunk;
+  }
+  return (ssize_t)count;
+}
+
+static void synthetic_close(struct source* src) {
+  free(src->pattern);
+  src->pattern = NULL;
+}
+
+const struct source_driver SOURCE_SYNTHETIC = {
+  "synthetic",
+  synthetic_open,
+  emulated_start,
+  synthetic_read,
+  emulated_timestamp,
+  emulated_wait,
+  synthetic_close,
+};
+
+static bool file_open(struct source* src, char* errstr, size_t errstr_size) {
+  if (!emulated_open(src, errstr, errstr_size))
+    return false;
+
+  src->partial = malloc(src->frame_size);
+  src->partial_size = 0;
+  if (!src->partial) {
+    snprintf(errstr, errstr_size, "failed to allocate frame: %s", sys_errlist[errno]);
+    return false;
+  }
+  const int fd = open(src->name, O_RDONLY | O_NONBLOCK);
+  if (fd < 0) {
+    snprintf(errstr, errstr_size, "cannot open %s: %s", src->name, sys_errlist[errno]);
+    return false;
+  }
+  src->fd = fd;
+  return true;
+}
+
+// Regular files loop forever, FIFOs end the capture on EOF. Only whole frames are returned, a frame cut off by the end
+// of the file is dropped, one split across FIFO reads is kept until the rest arrives.
+static ssize_t file_read(struct source* src, void* buf, size_t len) {
+  const size_t due = emulated_due(src, len);
+  if (due == 0)
+    return 0;
+  uint8_t* out = buf;
+  memcpy(out, src->partial, src->partial_size);
+  ssize_t count = read(src->fd, out + src->partial_size, due - src->partial_size);
+  if (count == 0) {
+    src->partial_size = 0;
+    if (lseek(src->fd, 0, SEEK_SET) != 0)
+      return -ENODATA;
+    count = read(src->fd, out, due);
+  }
+  if (count < 0)
+    return errno == EAGAIN ? 0 : -errno;
+  if (count == 0)
+    return -ENODATA;
+  const size_t total = src->partial_size + (size_t)count;
+  src->partial_size = total % src->frame_size;
+  memcpy(src->partial, out + total - src->partial_size, src->partial_size);
+  src->bytes_produced += total - src->partial_size;
+  return (ssize_t)(total - src->partial_size);
+}
+
+static void file_close(struct source* src) {
+  fd_close(src);
+  free(src->partial);
+  src->partial = NULL;
+  src->partial_size = 0;
+}
+
+const struct source_driver SOURCE_FILE = {
+  "file",
+  file_open,
+  emulated_start,
+  file_read,
+  emulated_timestamp,
+  emulated_wait,
+  file_close,
+};
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <alsa/asoundlib.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+struct source;
+
+struct source_driver {
+  const char* name;
+
+  // Configure the source, but do not start capturing yet. Fills in rate, channels, format and frame_size.
+  bool (*open)(struct source* src, char* errstr, size_t errstr_size);
+
+  // Start capturing. This should be as quick as possible, as it is timed for synchronization.
+  bool (*start)(struct source* src, char* errstr, size_t errstr_size);
+
+  // Read at most `len` bytes. Returns the byte count, 0 if nothing is available yet, or a negative errno.
+  ssize_t (*read)(struct source* src, void* buf, size_t len);
+
+  // When the last byte read so far was captured, on CLOCK_MONOTONIC_RAW, and how many bytes were captured since.
+  // Optional, without it the data is assumed to be read as soon as it arrives.
+  bool (*timestamp)(struct source* src, struct timespec* ts, size_t* pending);
+
+  // Block until there is likely something to read, or timeout.
+  void (*wait)(struct source* src, int timeout_ms);
+
+  void (*close)(struct source* src);
+};
+
+struct source {
+  const struct source_driver* driver;
+  char name[256];
+
+  // Rate in frames per second. For real devices this is the nominal rate.
+  unsigned rate;
+  unsigned channels;
+  snd_pcm_format_t format;
+  size_t frame_size;
+
+  // ALSA only: read straight out of the mapped hardware buffer instead of through snd_pcm_readi, and the buffering to
+  // ask for, 0 for the device's default. Replaced by what the device picked when opened.
+  bool mmap;
+  size_t period_frames;
+  size_t buffer_frames;
+  unsigned periods;
+  // the device's own buffer overran, losing what didn't fit, see the gap log
+  _Atomic size_t xruns;
+
+  int fd;
+  snd_pcm_t* handle;
+
+  // pacing of the emulated sources
+  struct timespec start_time;
+  uint64_t bytes_produced;
+  uint8_t* pattern;
+  size_t pattern_size;
+  // file replay: the start of a frame that a read stopped in the middle of
+  uint8_t* partial;
+  size_t partial_size;
+};
+
+extern const struct source_driver SOURCE_CXADC;
+extern const struct source_driver SOURCE_ALSA;
+extern const struct source_driver SOURCE_SYNTHETIC;
+extern const struct source_driver SOURCE_FILE;
+
+void source_setup(struct source* src, const struct source_driver* driver, const char* name);
+
+bool source_open(struct source* src, char* errstr, size_t errstr_size);
+bool source_start(struct source* src, char* errstr, size_t errstr_size);
+ssize_t source_read(struct source* src, void* buf, size_t len);
+void source_timestamp(struct source* src, struct timespec* ts, size_t* pending);
+void source_wait(struct source* src, int timeout_ms);
+void source_close(struct source* src);
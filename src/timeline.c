@@ -0,0 +1,138 @@
+#include "timeline.h"
+
+#include <math.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <string.h>
+
+static void write_begin(struct timeline* tl) {
+  ++tl->seq;
+  atomic_thread_fence(memory_order_release);
+}
+
+static void write_end(struct timeline* tl) {
+  ++tl->seq;
+}
+
+void timeline_reset(struct timeline* tl) {
+  write_begin(tl);
+  tl->count = 0;
+  tl->stride = 1;
+  tl->calls = 0;
+  tl->last.pos = 0;
+  tl->last.ns = 0;
+  tl->has_edge = false;
+  memset(&tl->all, 0, sizeof(tl->all));
+  memset(&tl->recent, 0, sizeof(tl->recent));
+  write_end(tl);
+}
+
+static void fit_add(struct timeline_fit* fit, double decay, double t, double p) {
+  fit->weight = fit->weight * decay + 1;
+  const double dt = t - fit->mean_t;
+  fit->mean_t += dt / fit->weight;
+  fit->mean_p += (p - fit->mean_p) / fit->weight;
+  fit->var_t = fit->var_t * decay + dt * (t - fit->mean_t);
+  fit->cov_tp = fit->cov_tp * decay + dt * (p - fit->mean_p);
+}
+
+void timeline_add(struct timeline* tl, uint64_t pos, int64_t ns) {
+  write_begin(tl);
+  if (tl->calls == 0)
+    tl->first = (struct timeline_entry){pos, ns};
+  const double t = (double)(ns - tl->first.ns) * 1e-9;
+  const double p = (double)(pos - tl->first.pos);
+  const double since_last = tl->calls ? (double)(ns - tl->last.ns) * 1e-9 : 0;
+  fit_add(&tl->all, 1, t, p);
+  fit_add(&tl->recent, exp(-since_last / TIMELINE_RECENT_SECONDS), t, p);
+  const struct timeline_entry entry = {pos, ns};
+  if (ns - tl->first.ns >= 1000000000 && tl->recent.var_t > 0) {
+    const double bytes_per_ns = tl->recent.cov_tp / tl->recent.var_t * 1e-9;
+    const int64_t expected = tl->has_edge ? tl->edge.ns + (int64_t)((double)(pos - tl->edge.pos) / bytes_per_ns) : ns;
+    if (!tl->has_edge || ns <= expected)
+      tl->edge = entry;
+    else if (ns - tl->edge.ns > TIMELINE_EDGE_NS)
+      tl->edge = (struct timeline_entry){pos, expected};
+    tl->has_edge = true;
+  }
+  tl->last.pos = pos;
+  tl->last.ns = ns;
+  if (tl->calls++ % tl->stride == 0) {
+    if (tl->count == TIMELINE_CAPACITY) {
+      for (size_t i = 0; i < TIMELINE_CAPACITY / 2; ++i)
+        tl->entries[i] = tl->entries[2 * i];
+      tl->count = TIMELINE_CAPACITY / 2;
+      tl->stride *= 2;
+    }
+    tl->entries[tl->count++] = tl->last;
+  }
+  write_end(tl);
+}
+
+// The readers retry while a write is in progress. They yield between tries, so a writer thread preempted on the same
+// CPU gets to finish.
+size_t timeline_snapshot(struct timeline* tl, struct timeline_entry* out, uint64_t* stride) {
+  for (;; sched_yield()) {
+    const uint32_t seq = tl->seq;
+    if (seq & 1)
+      continue;
+    atomic_thread_fence(memory_order_acquire);
+    size_t count = tl->count;
+    if (count <= TIMELINE_CAPACITY) {
+      memcpy(out, tl->entries, count * sizeof(*out));
+      *stride = tl->stride;
+      if (count && tl->last.pos != out[count - 1].pos)
+        out[count++] = tl->last;
+    }
+    atomic_thread_fence(memory_order_acquire);
+    if (seq == tl->seq && count <= TIMELINE_CAPACITY + 1)
+      return count;
+  }
+}
+
+bool timeline_start_ns(const struct timeline_entry* entries, size_t count, double bytes_per_second, int64_t* start_ns) {
+  if (count == 0 || bytes_per_second <= 0)
+    return false;
+  double start = 0;
+  for (size_t i = 0; i < count; ++i) {
+    const double t = (double)entries[i].ns - (double)entries[i].pos * 1e9 / bytes_per_second;
+    if (i == 0 || t < start)
+      start = t;
+  }
+  *start_ns = (int64_t)start;
+  return true;
+}
+
+bool timeline_rate(struct timeline* tl, double* bytes_per_second, double* recent_bytes_per_second) {
+  for (;; sched_yield()) {
+    const uint32_t seq = tl->seq;
+    if (seq & 1)
+      continue;
+    atomic_thread_fence(memory_order_acquire);
+    const bool ok = tl->calls > 2 && tl->last.ns - tl->first.ns >= 1000000000 && tl->all.var_t > 0 && tl->recent.var_t > 0;
+    if (ok) {
+      *bytes_per_second = tl->all.cov_tp / tl->all.var_t;
+      *recent_bytes_per_second = tl->recent.cov_tp / tl->recent.var_t;
+    }
+    atomic_thread_fence(memory_order_acquire);
+    if (seq == tl->seq)
+      return ok;
+  }
+}
+
+bool timeline_ns_at(struct timeline* tl, uint64_t pos, double bytes_per_second, int64_t* ns) {
+  for (;; sched_yield()) {
+    const uint32_t seq = tl->seq;
+    if (seq & 1)
+      continue;
+    atomic_thread_fence(memory_order_acquire);
+    const bool ok = tl->calls > 0 && bytes_per_second > 0;
+    const struct timeline_entry last = tl->has_edge ? tl->edge : tl->last;
+    atomic_thread_fence(memory_order_acquire);
+    if (seq != tl->seq)
+      continue;
+    if (ok)
+      *ns = last.ns - (int64_t)(((double)last.pos - (double)pos) * 1e9 / bytes_per_second);
+    return ok;
+  }
+}
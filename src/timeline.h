@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TIMELINE_CAPACITY 1024
+// time constant of the recent rate estimate
+#define TIMELINE_RECENT_SECONDS 60.0
+// how long the least delayed timestamp is carried along the recent rate before starting over from the latest one
+#define TIMELINE_EDGE_NS 10000000000
+
+// Stream byte position and the CLOCK_MONOTONIC_RAW time it was captured at.
+struct timeline_entry {
+  uint64_t pos;
+  int64_t ns;
+};
+
+// Running least squares fit of byte position over time, in seconds and bytes from the first timestamp. Updated in
+// Welford's form, which stays accurate over captures of many hours. With a decay the older timestamps weigh less.
+struct timeline_fit {
+  double weight;
+  double mean_t;
+  double mean_p;
+  double var_t;
+  double cov_tp;
+};
+
+// Index of capture timestamps covering a whole capture in fixed memory. When full, every other entry is dropped
+// and only every `stride`th timestamp is kept from then on. Single writer, readers get a consistent copy.
+struct timeline {
+  // seqlock, odd while the writer is changing things
+  _Atomic uint32_t seq;
+  size_t count;
+  uint64_t stride;
+  uint64_t calls;
+  struct timeline_entry entries[TIMELINE_CAPACITY];
+  // the latest timestamp, even if it is not kept
+  struct timeline_entry last;
+  // the data rate over the whole capture and over about the last TIMELINE_RECENT_SECONDS, fit to every timestamp
+  struct timeline_entry first;
+  struct timeline_fit all;
+  struct timeline_fit recent;
+  // Lower envelope of the recent timestamps, moved along at the recent rate. Reads are only ever late, so this is the
+  // best guess of when a byte was captured. Kept once there is a rate.
+  bool has_edge;
+  struct timeline_entry edge;
+};
+
+void timeline_reset(struct timeline* tl);
+void timeline_add(struct timeline* tl, uint64_t pos, int64_t ns);
+// Copies the entries, plus the latest timestamp if it was not kept. `out` needs TIMELINE_CAPACITY + 1 entries.
+size_t timeline_snapshot(struct timeline* tl, struct timeline_entry* out, uint64_t* stride);
+
+// Estimated capture time of byte 0 given the nominal data rate. Timestamps are only ever late, so this is the lower envelope.
+bool timeline_start_ns(const struct timeline_entry* entries, size_t count, double bytes_per_second, int64_t* start_ns);
+
+// Real data rate in bytes per second, over the whole capture and recently. False until there's a second of timestamps.
+bool timeline_rate(struct timeline* tl, double* bytes_per_second, double* recent_bytes_per_second);
+
+// Capture time of the byte at `pos`, going from the lower envelope, or before there is one the latest timestamp, at
+// `bytes_per_second`. False if there is no timestamp yet.
+bool timeline_ns_at(struct timeline* tl, uint64_t pos, double bytes_per_second, int64_t* ns);
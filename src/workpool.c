@@ -0,0 +1,96 @@
+#include "workpool.h"
+
+#include <unistd.h>
+
+#include <stdatomic.h>
+
+#include "futex.h"
+
+static void* workpool_thread(void* arg) {
+  struct workpool* pool = arg;
+  pthread_mutex_lock(&pool->lock);
+  while (1) {
+    while (!pool->head && !pool->stopping)
+      pthread_cond_wait(&pool->cond, &pool->lock);
+    struct workpool_job* job = pool->head;
+    if (!job)
+      break;
+    pool->head = job->next;
+    if (!pool->head)
+      pool->tail = NULL;
+    pthread_mutex_unlock(&pool->lock);
+
+    job->fn(job);
+    ++pool->jobs_done;
+    job->done = 1;
+    futex_wake(&job->done);
+
+    pthread_mutex_lock(&pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+bool workpool_init(struct workpool* pool, size_t threads) {
+  if (threads == 0) {
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cpus > 0 ? (size_t)cpus : 1;
+  }
+  if (threads > WORKPOOL_MAX_THREADS)
+    threads = WORKPOOL_MAX_THREADS;
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->cond, NULL);
+  pool->head = NULL;
+  pool->tail = NULL;
+  pool->stopping = false;
+  pool->jobs_done = 0;
+  pool->thread_count = 0;
+
+  for (size_t i = 0; i < threads; ++i) {
+    if (pthread_create(&pool->threads[i], NULL, workpool_thread, pool) != 0)
+      break;
+    ++pool->thread_count;
+  }
+  if (pool->thread_count == 0) {
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+    return false;
+  }
+  return true;
+}
+
+void workpool_free(struct workpool* pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = true;
+  pthread_cond_broadcast(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (size_t i = 0; i < pool->thread_count; ++i)
+    pthread_join(pool->threads[i], NULL);
+  pool->thread_count = 0;
+
+  pthread_cond_destroy(&pool->cond);
+  pthread_mutex_destroy(&pool->lock);
+}
+
+void workpool_submit(struct workpool* pool, struct workpool_job* job, workpool_fn fn) {
+  job->fn = fn;
+  job->next = NULL;
+  job->done = 0;
+
+  pthread_mutex_lock(&pool->lock);
+  if (pool->tail)
+    pool->tail->next = job;
+  else
+    pool->head = job;
+  pool->tail = job;
+  pthread_cond_signal(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+bool workpool_wait(struct workpool_job* job, int timeout_ms) {
+  if (!job->done)
+    futex_wait(&job->done, 0, timeout_ms);
+  return job->done != 0;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <pthread.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define WORKPOOL_MAX_THREADS 64
+
+struct workpool_job;
+typedef void (*workpool_fn)(struct workpool_job* job);
+
+// Embed this in the job's own struct, the pool does not allocate anything.
+struct workpool_job {
+  workpool_fn fn;
+  struct workpool_job* next;
+  // futex word, set to 1 once fn returned
+  _Atomic uint32_t done;
+};
+
+// A fixed set of threads running jobs in the order they were submitted. Jobs may finish out of order.
+struct workpool {
+  pthread_t threads[WORKPOOL_MAX_THREADS];
+  size_t thread_count;
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct workpool_job* head;
+  struct workpool_job* tail;
+  bool stopping;
+
+  _Atomic size_t jobs_done;
+};
+
+// 0 threads means one per online CPU.
+bool workpool_init(struct workpool* pool, size_t threads);
+// Finishes the queued jobs, then joins the threads.
+void workpool_free(struct workpool* pool);
+
+void workpool_submit(struct workpool* pool, struct workpool_job* job, workpool_fn fn);
+// Wait until the job is done, or timeout. Returns whether it is done.
+bool workpool_wait(struct workpool_job* job, int timeout_ms);
+
+static inline bool workpool_done(struct workpool_job* job) {
+  return job->done != 0;
+}
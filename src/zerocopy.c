@@ -0,0 +1,82 @@
+#include "zerocopy.h"
+
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include <errno.h>
+#include <string.h>
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+bool zerocopy_init(struct zerocopy_sender* zc, int fd, size_t pos) {
+  memset(zc, 0, sizeof(*zc));
+  zc->fd = fd;
+  zc->released = pos;
+  int one = 1;
+  return 0 == setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one));
+}
+
+ssize_t zerocopy_send(struct zerocopy_sender* zc, const void* buf, size_t len, size_t pos) {
+  const ssize_t count = send(zc->fd, buf, len, MSG_ZEROCOPY);
+  if (count > 0) {
+    const uint32_t idx = zc->next_seq++ % ZEROCOPY_MAX_PENDING;
+    zc->end[idx] = pos + count;
+    zc->done[idx] = false;
+  }
+  return count;
+}
+
+static void zerocopy_complete(struct zerocopy_sender* zc, uint32_t lo, uint32_t hi) {
+  for (uint32_t seq = lo; seq != hi + 1; ++seq)
+    if (seq - zc->first_seq < zerocopy_pending(zc))
+      zc->done[seq % ZEROCOPY_MAX_PENDING] = true;
+}
+
+size_t zerocopy_reap(struct zerocopy_sender* zc, int timeout_ms) {
+  if (timeout_ms != 0 && zerocopy_pending(zc)) {
+    // completions are signalled as errors, which poll always reports
+    struct pollfd pfd = {zc->fd, 0, 0};
+    poll(&pfd, 1, timeout_ms);
+  }
+
+  while (1) {
+    char control[128];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(zc->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+      break;
+
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) && !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+        continue;
+      const struct sock_extended_err* serr = (const struct sock_extended_err*)CMSG_DATA(cmsg);
+      if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+        continue;
+      zerocopy_complete(zc, serr->ee_info, serr->ee_data);
+      if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+        zc->copied = true;
+    }
+  }
+
+  while (zerocopy_pending(zc) && zc->done[zc->first_seq % ZEROCOPY_MAX_PENDING]) {
+    zc->released = zc->end[zc->first_seq % ZEROCOPY_MAX_PENDING];
+    ++zc->first_seq;
+  }
+  return zc->released;
+}
+
+size_t zerocopy_drain(struct zerocopy_sender* zc) {
+  while (zerocopy_pending(zc))
+    zerocopy_reap(zc, 100);
+  return zc->released;
+}
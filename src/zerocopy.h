@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define ZEROCOPY_MAX_PENDING 256
+
+// Tracks MSG_ZEROCOPY sends on a socket, so the caller knows when the kernel stopped referencing the sent memory.
+struct zerocopy_sender {
+  int fd;
+  // the kernel numbers every zerocopy send from 0
+  uint32_t next_seq;
+  uint32_t first_seq;
+  // stream position after each pending send, indexed by seq % ZEROCOPY_MAX_PENDING
+  size_t end[ZEROCOPY_MAX_PENDING];
+  bool done[ZEROCOPY_MAX_PENDING];
+  // stream position up to which the memory is released
+  size_t released;
+  // the kernel told us it copied the data anyway, so zerocopy is pointless on this socket
+  bool copied;
+};
+
+// Returns false if the socket does not support zerocopy.
+bool zerocopy_init(struct zerocopy_sender* zc, int fd, size_t pos);
+// Send data found at stream position `pos`. Same return as send().
+ssize_t zerocopy_send(struct zerocopy_sender* zc, const void* buf, size_t len, size_t pos);
+// Process completions, waiting at most timeout_ms for one if there are sends pending. Returns the released position.
+size_t zerocopy_reap(struct zerocopy_sender* zc, int timeout_ms);
+// Wait until everything is released, for as long as it takes: until then the kernel may still send from the memory,
+// like a blocking write that didn't return yet. Returns the released position, which is then the end of the last send.
+size_t zerocopy_drain(struct zerocopy_sender* zc);
+
+static inline uint32_t zerocopy_pending(const struct zerocopy_sender* zc) {
+  return zc->next_seq - zc->first_seq;
+}
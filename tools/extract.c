@@ -0,0 +1,286 @@
+// Read a container written by /record?container=<path>.
+//
+// usage: cxadc_vhs_extract <file>                        describe the capture and its streams, as JSON
+//        cxadc_vhs_extract <file> <stream> [from [to]]   write a stream to stdout, from and to a time in seconds
+//
+// `stream` is a name from the description, like cxadc0 or linear. Times count from the start of the capture and are
+// looked up in the index by capture time, so the same times cut every stream at the same moment. A file cut off by a
+// crash is read as far as it goes. Reports missing data on stderr and exits with 1, after writing everything it could.
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../src/container.h"
+
+struct index {
+  struct container_entry* entries;
+  size_t count;
+  size_t capacity;
+  // found through the end record, rather than put together from what a crash left
+  bool complete;
+};
+
+static bool read_at(int fd, void* buf, size_t len, uint64_t offset) {
+  return pread(fd, buf, len, (off_t)offset) == (ssize_t)len;
+}
+
+static bool index_add(struct index* index, const struct container_entry* entry) {
+  if (index->count == index->capacity) {
+    const size_t capacity = index->capacity ? 2 * index->capacity : 4096;
+    struct container_entry* entries = realloc(index->entries, capacity * sizeof(*entries));
+    if (!entries)
+      return false;
+    index->entries = entries;
+    index->capacity = capacity;
+  }
+  index->entries[index->count++] = *entry;
+  return true;
+}
+
+static bool read_record(int fd, uint64_t offset, uint64_t file_size, struct container_record* record) {
+  uint8_t header[CONTAINER_RECORD_HEADER];
+  return offset + CONTAINER_RECORD_HEADER <= file_size && read_at(fd, header, sizeof(header), offset) &&
+         container_parse_record(header, record) && offset + record->size <= file_size;
+}
+
+// The entries of the chain of index records ending at `offset`.
+static bool load_chain(int fd, uint64_t offset, uint64_t file_size, struct index* index) {
+  uint8_t* payload = malloc(CONTAINER_CHUNK);
+  bool ok = payload != NULL;
+  while (ok && offset != CONTAINER_NONE) {
+    struct container_record record;
+    ok = read_record(fd, offset, file_size, &record) && record.type == Record_Index && record.length <= CONTAINER_CHUNK &&
+         read_at(fd, payload, record.length, offset + CONTAINER_RECORD_HEADER);
+    for (size_t i = 0; ok && i < record.length / CONTAINER_ENTRY_SIZE; ++i) {
+      struct container_entry entry;
+      container_parse_entry(payload + i * CONTAINER_ENTRY_SIZE, &entry);
+      // extract reads a record into a buffer of CONTAINER_CHUNK
+      ok = entry.length <= CONTAINER_CHUNK - CONTAINER_RECORD_HEADER && index_add(index, &entry);
+    }
+    // the chain only goes back, anything else is garbage
+    ok = ok && (record.pos == CONTAINER_NONE || record.pos < offset);
+    offset = record.pos;
+  }
+  free(payload);
+  return ok;
+}
+
+// Data records from `offset` on, as far as they are intact.
+static bool scan_records(int fd, uint64_t offset, uint64_t file_size, uint32_t stream_count, struct index* index) {
+  struct container_record record;
+  while (read_record(fd, offset, file_size, &record) && record.type != Record_End) {
+    if (record.type == Record_Data) {
+      if (record.stream >= stream_count || record.length > CONTAINER_CHUNK - CONTAINER_RECORD_HEADER)
+        break;
+      const struct container_entry entry = {offset, record.pos, record.ns, record.length, record.stream};
+      if (!index_add(index, &entry))
+        return false;
+    }
+    offset += record.size;
+  }
+  return true;
+}
+
+static int by_offset(const void* a, const void* b) {
+  const uint64_t x = ((const struct container_entry*)a)->offset;
+  const uint64_t y = ((const struct container_entry*)b)->offset;
+  return x < y ? -1 : x > y;
+}
+
+// Every data record, in file order. Follows the end record if there is one, otherwise the latest index that made it
+// to disk, and scans the records written after it.
+static bool load_index(int fd, uint64_t header_size, uint64_t file_size, uint32_t stream_count, struct index* index) {
+  struct container_record record;
+  if (file_size >= header_size + CONTAINER_RECORD_HEADER && read_record(fd, file_size - CONTAINER_RECORD_HEADER, file_size, &record) && record.type == Record_End) {
+    index->complete = load_chain(fd, record.pos, file_size, index);
+    if (!index->complete)
+      index->count = 0;
+  }
+
+  uint64_t scan_from = header_size;
+  for (uint64_t offset = (file_size - 1) / CONTAINER_ALIGN * CONTAINER_ALIGN; !index->complete && file_size > header_size && offset >= header_size; offset -= CONTAINER_ALIGN) {
+    if (!read_record(fd, offset, file_size, &record) || record.type != Record_Index)
+      continue;
+    if (load_chain(fd, offset, file_size, index)) {
+      scan_from = offset + record.size;
+      break;
+    }
+    index->count = 0;
+  }
+  if (!index->complete && !scan_records(fd, scan_from, file_size, stream_count, index))
+    return false;
+  // the chain goes from the latest index record back, so its blocks come in reverse
+  qsort(index->entries, index->count, sizeof(*index->entries), by_offset);
+  return true;
+}
+
+// The byte position of the stream at `ns`, going from the last of its records that started by then.
+static uint64_t position_at(const struct container_entry* entries, size_t count, const struct container_stream* stream, int64_t ns) {
+  size_t lo = 0, hi = count;
+  while (lo < hi) {
+    const size_t mid = lo + (hi - lo) / 2;
+    if (entries[mid].ns <= ns)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo == 0)
+    return entries[0].pos;
+  const struct container_entry* e = &entries[lo - 1];
+  double offset = (double)(ns - e->ns) * stream->rate * stream->frame_size / 1e9;
+  if (offset > e->length)
+    offset = e->length;
+  const uint64_t bytes = (uint64_t)offset;
+  return e->pos + bytes - bytes % stream->frame_size;
+}
+
+static int describe(const uint8_t* header, const struct container_header* h, const struct container_stream* streams, const struct index* index) {
+  printf("{\"complete\":%s,\"capture\":%.*s,\"streams\":[", index->complete ? "true" : "false", (int)h->json_length, (const char*)header + h->json_offset);
+  for (uint32_t i = 0; i < h->stream_count; ++i) {
+    size_t chunks = 0;
+    uint64_t bytes = 0;
+    int64_t start_ns = 0;
+    for (size_t e = 0; e < index->count; ++e) {
+      if (index->entries[e].stream != i)
+        continue;
+      if (chunks++ == 0)
+        start_ns = index->entries[e].ns;
+      bytes += index->entries[e].length;
+    }
+    const double frames = streams[i].frame_size ? (double)bytes / streams[i].frame_size : 0;
+    printf(
+      "%s{\"name\":\"%s\",\"rate\":%" PRIu32 ",\"frame_size\":%" PRIu32 ",\"channels\":%" PRIu32 ",\"chunks\":%zu,\"bytes\":%" PRIu64
+      ",\"start_ns\":%" PRId64 ",\"seconds\":%.3f}",
+      i ? "," : "",
+      streams[i].name,
+      streams[i].rate,
+      streams[i].frame_size,
+      streams[i].channels,
+      chunks,
+      bytes,
+      start_ns,
+      streams[i].rate ? frames / streams[i].rate : 0.0
+    );
+  }
+  printf("]}\n");
+  return 0;
+}
+
+static int extract(int fd, const struct container_stream* stream, uint8_t id, const struct index* index, const double* from, const double* to) {
+  // the capture starts with the earliest record of any stream
+  int64_t start_ns = index->count ? index->entries[0].ns : 0;
+  size_t count = 0;
+  for (size_t e = 0; e < index->count; ++e) {
+    if (index->entries[e].ns < start_ns)
+      start_ns = index->entries[e].ns;
+    if (index->entries[e].stream == id)
+      index->entries[count++] = index->entries[e];
+  }
+  if (count == 0) {
+    fprintf(stderr, "%s has no data\n", stream->name);
+    return 1;
+  }
+  const struct container_entry* entries = index->entries;
+  const uint64_t begin = from ? position_at(entries, count, stream, start_ns + (int64_t)(*from * 1e9)) : entries[0].pos;
+  const uint64_t end = to ? position_at(entries, count, stream, start_ns + (int64_t)(*to * 1e9)) : entries[count - 1].pos + entries[count - 1].length;
+
+  uint8_t* buf = malloc(CONTAINER_CHUNK);
+  if (!buf) {
+    fprintf(stderr, "can't allocate %u bytes\n", CONTAINER_CHUNK);
+    return 1;
+  }
+  int status = 0;
+  uint64_t expected = entries[0].pos;
+  for (size_t e = 0; e < count && entries[e].pos < end; ++e) {
+    const struct container_entry* entry = &entries[e];
+    if (entry->pos != expected) {
+      fprintf(stderr, "bytes %" PRIu64 " to %" PRIu64 " are missing\n", expected, entry->pos - 1);
+      status = 1;
+    }
+    expected = entry->pos + entry->length;
+    if (expected <= begin)
+      continue;
+    const uint64_t skip = begin > entry->pos ? begin - entry->pos : 0;
+    const uint64_t len = (end < expected ? end : expected) - entry->pos - skip;
+    if (!read_at(fd, buf, entry->length, entry->offset + CONTAINER_RECORD_HEADER)) {
+      fprintf(stderr, "can't read the record at %" PRIu64 "\n", entry->offset);
+      status = 1;
+      break;
+    }
+    if (fwrite(buf + skip, 1, len, stdout) != len) {
+      perror("write failed");
+      status = 1;
+      break;
+    }
+  }
+  free(buf);
+  return status;
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <file> [<stream> [from [to]]]\n", argv[0]);
+    return 1;
+  }
+  const int fd = open(argv[1], O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    perror(argv[1]);
+    return 1;
+  }
+
+  uint8_t fixed[CONTAINER_HEADER_SIZE];
+  struct container_header h;
+  if (!read_at(fd, fixed, sizeof(fixed), 0) || !container_parse_header(fixed, &h)) {
+    fprintf(stderr, "%s is not a capture container\n", argv[1]);
+    return 1;
+  }
+  uint8_t* header = malloc(h.size);
+  struct container_stream* streams = calloc(h.stream_count ? h.stream_count : 1, sizeof(*streams));
+  if (!header || !streams || !read_at(fd, header, h.size, 0)) {
+    fprintf(stderr, "can't read the header\n");
+    return 1;
+  }
+  for (uint32_t i = 0; i < h.stream_count; ++i)
+    container_parse_stream(header, i, &streams[i]);
+
+  struct index index = {NULL, 0, 0, false};
+  if (!load_index(fd, h.size, (uint64_t)st.st_size, h.stream_count, &index)) {
+    fprintf(stderr, "can't allocate the index\n");
+    return 1;
+  }
+  if (!index.complete)
+    fprintf(stderr, "%s is incomplete, read %zu records\n", argv[1], index.count);
+
+  int status;
+  if (argc == 2) {
+    status = describe(header, &h, streams, &index);
+  } else {
+    uint32_t id = 0;
+    while (id < h.stream_count && 0 != strcmp(streams[id].name, argv[2]))
+      ++id;
+    if (id == h.stream_count || !streams[id].frame_size) {
+      fprintf(stderr, "no stream %s\n", argv[2]);
+      return 1;
+    }
+    const double from = argc > 3 ? atof(argv[3]) : 0;
+    const double to = argc > 4 ? atof(argv[4]) : 0;
+    if (argc > 4 && from > to) {
+      fprintf(stderr, "from %s is after to %s\n", argv[3], argv[4]);
+      return 1;
+    }
+    status = extract(fd, &streams[id], (uint8_t)id, &index, argc > 3 ? &from : NULL, argc > 4 ? &to : NULL);
+  }
+  free(index.entries);
+  free(streams);
+  free(header);
+  close(fd);
+  return status;
+}
@@ -0,0 +1,130 @@
+// Split a stream fetched from /bundle into one file per capture stream, reading stdin.
+//
+// usage: curl -s http://host:8080/bundle | cxadc_vhs_unbundle capture
+//
+// Writes capture-linear.s24, capture-cxadc0.u8 and so on, the extension going by the sample size. Reports missing data
+// and a stream that ended before the capture stopped on stderr and exits with 1, after writing everything it got.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/bundle.h"
+#include "../src/container.h"
+
+static bool read_all(uint8_t* buf, size_t len) {
+  return fread(buf, 1, len, stdin) == len;
+}
+
+static const char* extension(const struct container_stream* stream) {
+  switch (stream->channels ? stream->frame_size / stream->channels : 0) {
+    case 1:
+      return "u8";
+    case 2:
+      return "s16";
+    case 3:
+      return "s24";
+    case 4:
+      return "s32";
+    default:
+      return "raw";
+  }
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <output prefix>\n", argv[0]);
+    return 1;
+  }
+
+  uint8_t header[BUNDLE_HEADER_SIZE];
+  struct bundle_frame frame;
+  uint8_t* description = NULL;
+  struct container_header h;
+  if (!read_all(header, sizeof(header)) || !bundle_parse_header(header, &frame) || frame.type != Bundle_Description ||
+      frame.length < CONTAINER_HEADER_SIZE || !(description = malloc(frame.length)) || !read_all(description, frame.length) ||
+      !container_parse_header(description, &h) || h.size > frame.length) {
+    fprintf(stderr, "not a bundle\n");
+    return 1;
+  }
+
+  struct container_stream* streams = calloc(h.stream_count ? h.stream_count : 1, sizeof(*streams));
+  FILE** files = calloc(h.stream_count ? h.stream_count : 1, sizeof(*files));
+  // next expected position of every stream, the first frame tells where it starts
+  uint64_t* expected = calloc(h.stream_count ? h.stream_count : 1, sizeof(*expected));
+  bool* seen = calloc(h.stream_count ? h.stream_count : 1, sizeof(*seen));
+  if (!streams || !files || !expected || !seen) {
+    fprintf(stderr, "can't allocate the streams\n");
+    return 1;
+  }
+  for (uint32_t i = 0; i < h.stream_count; ++i) {
+    container_parse_stream(description, i, &streams[i]);
+    char path[4096];
+    snprintf(path, sizeof(path), "%s-%s.%s", argv[1], streams[i].name, extension(&streams[i]));
+    files[i] = fopen(path, "wb");
+    if (!files[i]) {
+      perror(path);
+      return 1;
+    }
+  }
+  free(description);
+
+  uint8_t* buf = NULL;
+  size_t capacity = 0;
+  bool complete = false, missing = false;
+  while (1) {
+    if (!read_all(header, sizeof(header))) {
+      fprintf(stderr, "the bundle ended before the capture stopped\n");
+      break;
+    }
+    if (!bundle_parse_header(header, &frame) || (frame.type == Bundle_Data && frame.stream >= h.stream_count)) {
+      fprintf(stderr, "not a frame header\n");
+      break;
+    }
+    if (frame.type == Bundle_End) {
+      complete = true;
+      break;
+    }
+    if (frame.length > capacity) {
+      free(buf);
+      capacity = frame.length;
+      buf = malloc(capacity);
+      if (!buf) {
+        fprintf(stderr, "can't allocate %zu bytes\n", capacity);
+        return 1;
+      }
+    }
+    if (!read_all(buf, frame.length)) {
+      fprintf(stderr, "the bundle ended before the capture stopped\n");
+      break;
+    }
+    if (frame.type != Bundle_Data)
+      continue;
+
+    const uint8_t s = frame.stream;
+    if (seen[s] && frame.pos != expected[s]) {
+      fprintf(stderr, "%s: bytes %llu to %llu are missing\n", streams[s].name, (unsigned long long)expected[s], (unsigned long long)frame.pos - 1);
+      missing = true;
+    }
+    seen[s] = true;
+    expected[s] = frame.pos + frame.length;
+    if (fwrite(buf, 1, frame.length, files[s]) != frame.length) {
+      perror("write failed");
+      break;
+    }
+  }
+  int status = complete && !missing ? 0 : 1;
+
+  for (uint32_t i = 0; i < h.stream_count; ++i) {
+    if (fclose(files[i]) != 0) {
+      perror("write failed");
+      status = 1;
+    }
+  }
+  free(buf);
+  free(streams);
+  free(files);
+  free(expected);
+  free(seen);
+  return status;
+}
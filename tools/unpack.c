@@ -0,0 +1,84 @@
+// Decompress a stream fetched with compress=rice, from stdin to stdout.
+//
+// usage: curl -s 'http://host:8080/cxadc?0&compress=rice' | cxadc_vhs_unpack > cxadc0.u8
+//
+// Reports missing frames and corrupt data on stderr and exits with 1, after writing everything it could decode.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/rice.h"
+
+static bool read_all(uint8_t* buf, size_t len) {
+  return fread(buf, 1, len, stdin) == len;
+}
+
+int main(int argc, char** argv) {
+  const bool verbose = argc > 1 && 0 == strcmp(argv[1], "-v");
+
+  uint8_t header[RICE_HEADER_SIZE];
+  uint8_t* in = NULL;
+  uint8_t* out = NULL;
+  size_t capacity = 0;
+  uint64_t frames = 0, raw = 0, packed = 0;
+  uint32_t expected = 0;
+  int status = 0;
+
+  while (read_all(header, sizeof(header))) {
+    struct rice_frame frame;
+    if (!rice_parse_header(header, &frame)) {
+      fprintf(stderr, "not a frame header after %llu frames\n", (unsigned long long)frames);
+      status = 1;
+      break;
+    }
+    if (frame.sequence != expected) {
+      fprintf(stderr, "frames %u to %u are missing\n", expected, frame.sequence - 1);
+      status = 1;
+    }
+    expected = frame.sequence + 1;
+
+    if (frame.raw_len > capacity) {
+      free(in);
+      free(out);
+      capacity = frame.raw_len;
+      in = malloc(capacity);
+      out = malloc(capacity);
+      if (!in || !out) {
+        fprintf(stderr, "can't allocate %zu bytes\n", capacity);
+        return 1;
+      }
+    }
+    if (!read_all(in, frame.packed_len)) {
+      fprintf(stderr, "frame %u is cut off\n", frame.sequence);
+      status = 1;
+      break;
+    }
+    if (!rice_decode_frame(&frame, in, out)) {
+      fprintf(stderr, "frame %u is corrupt\n", frame.sequence);
+      status = 1;
+      break;
+    }
+    if (fwrite(out, 1, frame.raw_len, stdout) != frame.raw_len) {
+      perror("write failed");
+      status = 1;
+      break;
+    }
+    ++frames;
+    raw += frame.raw_len;
+    packed += RICE_HEADER_SIZE + frame.packed_len;
+  }
+
+  if (verbose)
+    fprintf(
+      stderr,
+      "%llu frames, %llu bytes from %llu, ratio %.3f\n",
+      (unsigned long long)frames,
+      (unsigned long long)raw,
+      (unsigned long long)packed,
+      raw ? (double)packed / (double)raw : 0.0
+    );
+  free(in);
+  free(out);
+  return status;
+}